@@ -0,0 +1,811 @@
+// Implementation for 'apply.h', written by Connor Li (z5425430)
+// There is 1 'interface' function:
+//      - In_Apply_TCBI()
+//
+// The receiver's side of stage 4. Each record is applied by:
+//      1. copying the old target into a temporary file in the same
+//         directory (so the rename at the end is atomic). Where the
+//         filesystem can (btrfs, XFS), the copy is a reflink that shares
+//         the old file's extents, so only the blocks written in step 2
+//         ever take new space or I/O. Elsewhere it is copy_file_range,
+//         which at least stays in the kernel, or else a plain copy.
+//      2. pwrite-ing every update (and every rolling copy) into it,
+//      3. truncating/extending it to the new size and setting its mode,
+//      4. fsync-ing it and renaming it over the target.
+// With --in-place the updates are written straight into the target.
+// Everything is done relative to the target's directory, which is opened
+// a component at a time without following symlinks, so a record can't be
+// written anywhere outside the current directory.
+// A compressed record's dictionary is read from the target (or its copy)
+// before anything is written into it. A chunked record lists where its
+// chunks end after its size, and its updates and copies are by chunk.
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+#include <errno.h>
+#include <limits.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/random.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include "apply.h"
+#include "helpers.h"
+#include "format.h"
+#include "compress.h"
+#include "cdc.h"
+#include "footer.h"
+#include "rbuoy.h"
+#include "stats.h"
+
+#define COPY_BUFFER_SIZE (64 * 1024)
+#define PERMISSIONS "rwxrwxrwx"
+#define NUM_PERMISSIONS 9
+#define DICT_MAX_BLOCKS (COMPRESS_DICT_MAX_SIZE / BLOCK_SIZE_MIN)
+#define TEMP_TEMPLATE ".rbuoy.XXXXXX"
+#define TEMP_RANDOM_CHARS 6
+#define TEMP_CHARS \
+    "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789"
+
+// From <linux/fs.h>, which can't be included alongside rbuoy.h as it has
+// a BLOCK_SIZE of its own
+#ifndef FICLONE
+#define FICLONE _IOW(0x94, 9, int)
+#endif
+
+// The temporary file currently being built (in the directory `dir_fd`),
+// removed if we exit early
+static int apply_temp_dir = -1;
+static char apply_temp_name[sizeof(TEMP_TEMPLATE)];
+
+//////////////////////////////////////////////////////////////////////
+//                        FUNCTION PROTOTYPES
+//////////////////////////////////////////////////////////////////////
+
+void apply_record(FILE *tcbi, struct Index_Format format);
+
+void apply_directory(
+    FILE *tcbi, int dir_fd, char *pathname, char *name, mode_t mode,
+    uint64_t size, struct Index_Format format
+);
+
+int apply_open_parent(char *pathname, char **name);
+
+int apply_open_target(
+    int dir_fd, char *pathname, char *name, uint64_t size, int *old_fd,
+    bool in_place
+);
+
+int apply_create_temp(int dir_fd);
+
+void apply_finish_target(int fd, int dir_fd, char *name, bool in_place);
+
+void apply_read_chunks(
+    FILE *tcbi, uint64_t size, struct Index_Format format,
+    struct Chunk_List *chunks
+);
+
+void apply_updates(
+    FILE *tcbi, int fd, uint64_t size, const struct Chunk_List *chunks,
+    struct Index_Format format
+);
+
+void apply_runs(
+    FILE *tcbi, int fd, uint64_t size, struct Index_Format format
+);
+
+void apply_copies(
+    FILE *tcbi, int fd, int old_fd, uint64_t size,
+    const struct Chunk_List *chunks, struct Index_Format format
+);
+
+size_t apply_read_dict_blocks(
+    FILE *tcbi, uint64_t size, struct Index_Format format,
+    size_t blocks[DICT_MAX_BLOCKS]
+);
+
+size_t apply_read_dict(
+    int fd, size_t blocks[], size_t num_blocks, uint64_t size, uint8_t dict[]
+);
+
+void apply_cleanup(void);
+
+mode_t mode_from_chars(char mode_chars[MODE_SIZE], char *pathname);
+
+bool path_escapes_cwd(char *pathname);
+
+void fd_copy_all(int src, int dest, uint64_t max_bytes);
+
+uint64_t fd_copy_in_kernel(int src, int dest, uint64_t max_bytes);
+
+void pwrite_handler(int fd, void *buffer, size_t n, uint64_t offset);
+
+//////////////////////////////////////////////////////////////////////
+//                        INTERFACE FUNCTIONS
+//////////////////////////////////////////////////////////////////////
+
+// Apply each record in turn. Nothing about a record is kept once it has
+// been applied, so memory stays constant however large the TCBI is.
+void In_Apply_TCBI(FILE *tcbi) {
+    uint64_t num_records;
+    struct Index_Format format = Format_Read_Header(
+        tcbi, INDEX_TCBI, &num_records
+    );
+    if (format.runs && format.cdc) {
+        fprintf(stderr, "Error: a chunked TCBI can't have runs\n");
+        exit(1);
+    }
+    rbuoy_options.block_size = format.block_size;
+
+    atexit(apply_cleanup);
+
+    for (uint64_t record_n = 0; record_n < num_records; record_n++) {
+        apply_record(tcbi, format);
+    }
+
+    if (format.footer) Footer_Skip(tcbi);
+    check_eof(tcbi);
+}
+
+//////////////////////////////////////////////////////////////////////
+//                           LOCAL HELPERS
+//////////////////////////////////////////////////////////////////////
+
+// Function to apply a single record, from its pathname to its last update
+void apply_record(FILE *tcbi, struct Index_Format format) {
+    uint64_t started = Stats_Start();
+    size_t pathname_length = Format_Read_Uint(
+        tcbi, format, PATHNAME_LEN_SIZE
+    );
+    if (pathname_length >= PATH_MAX) {
+        fprintf(stderr, "Error: pathname too long\n");
+        exit(1);
+    }
+    char pathname[PATH_MAX];
+    fread_handler(pathname, sizeof(char), pathname_length, tcbi);
+    pathname[pathname_length] = '\0';
+
+    if (pathname_length == 0 || path_escapes_cwd(pathname)) {
+        fprintf(stderr, "Error: invalid pathname '%s'\n", pathname);
+        exit(1);
+    }
+    char *name;
+    int dir_fd = apply_open_parent(pathname, &name);
+
+    char mode_chars[MODE_SIZE];
+    fread_handler(mode_chars, sizeof(char), MODE_SIZE, tcbi);
+    mode_t mode = mode_from_chars(mode_chars, pathname);
+
+    uint64_t size = Format_Read_Uint(tcbi, format, FILE_SIZE_SIZE);
+
+    struct Chunk_List chunks;
+    memset(&chunks, 0, sizeof(struct Chunk_List));
+    if (format.cdc) apply_read_chunks(tcbi, size, format, &chunks);
+    struct Chunk_List *block_chunks = format.cdc ? &chunks : NULL;
+
+    size_t dict_blocks[DICT_MAX_BLOCKS];
+    size_t num_dict_blocks = 0;
+    if (format.compressed) {
+        num_dict_blocks = apply_read_dict_blocks(
+            tcbi, size, format, dict_blocks
+        );
+    }
+
+    if (S_ISDIR(mode)) {
+        if (!format.compressed) {
+            apply_directory(tcbi, dir_fd, pathname, name, mode, size, format);
+            close(dir_fd);
+            Stats_File(pathname, started);
+            return;
+        }
+
+        FILE *payload = Frame_Reader_Open(tcbi, format, NULL, 0);
+        apply_directory(payload, dir_fd, pathname, name, mode, size, format);
+        Frame_Reader_Close(payload);
+        close(dir_fd);
+        Stats_File(pathname, started);
+        return;
+    }
+
+    // Rolling (and chunked) copies read from the old file, so they can't
+    // be patched in over the top of it.
+    bool in_place = rbuoy_options.in_place && !format.rolling && !format.cdc;
+
+    int old_fd = -1;
+    int fd = apply_open_target(
+        dir_fd, pathname, name, size, &old_fd, in_place
+    );
+
+    // Grow the file up front so every pwrite lands inside it, and cut off
+    // anything past the new end.
+    if (ftruncate(fd, size) != 0) {
+        perror("Truncate Failed");
+        exit(1);
+    }
+
+    // Everything after the dictionary of a compressed record is in frames
+    FILE *payload = tcbi;
+    if (format.compressed) {
+        uint8_t dict[COMPRESS_DICT_MAX_SIZE];
+        size_t dict_size = apply_read_dict(
+            fd, dict_blocks, num_dict_blocks, size, dict
+        );
+        payload = Frame_Reader_Open(tcbi, format, dict, dict_size);
+    }
+
+    if (format.runs) {
+        apply_runs(payload, fd, size, format);
+    } else {
+        apply_updates(payload, fd, size, block_chunks, format);
+    }
+    if (format.rolling || format.cdc) {
+        apply_copies(payload, fd, old_fd, size, block_chunks, format);
+    }
+
+    if (format.compressed) Frame_Reader_Close(payload);
+    Chunk_List_Free(&chunks);
+
+    if (fchmod(fd, mode & 07777) != 0) {
+        perror("Chmod Failed");
+        exit(1);
+    }
+
+    if (old_fd >= 0) close(old_fd);
+    apply_finish_target(fd, dir_fd, name, in_place);
+    close(dir_fd);
+    Stats_File(pathname, started);
+}
+
+// Function to create (or update the mode of) a directory record, `name`
+// in the directory `dir_fd`
+void apply_directory(
+    FILE *tcbi, int dir_fd, char *pathname, char *name, mode_t mode,
+    uint64_t size, struct Index_Format format
+) {
+    size_t num_updates = Format_Read_Uint(tcbi, format, BLOCK_INDEX_SIZE);
+    size_t num_copies = (format.rolling || format.cdc) ?
+        Format_Read_Uint(tcbi, format, BLOCK_INDEX_SIZE) : 0;
+    if (size != 0 || num_updates != 0 || num_copies != 0) {
+        fprintf(stderr, "Error: directory '%s' has contents\n", pathname);
+        exit(1);
+    }
+
+    if (mkdirat(dir_fd, name, mode & 07777) != 0 && errno != EEXIST) {
+        perror("Mkdir Failed");
+        exit(1);
+    }
+
+    // Opened rather than chmod-ed by name, so a symlink isn't followed
+    int fd = openat(dir_fd, name, O_RDONLY | O_DIRECTORY | O_NOFOLLOW);
+    if (fd < 0) {
+        fprintf(stderr, "Error: '%s' is not a directory\n", pathname);
+        exit(1);
+    }
+    if (fchmod(fd, mode & 07777) != 0) {
+        perror("Chmod Failed");
+        exit(1);
+    }
+    close(fd);
+}
+
+// Function to open the directory holding `pathname` a component at a
+// time from the current directory, never following a symlink, as the
+// pathname alone can't say whether one of its directories is a link to
+// somewhere else. Trailing slashes are dropped, and `name` is set to the
+// last component, to be used relative to the directory.
+int apply_open_parent(char *pathname, char **name) {
+    size_t length = strlen(pathname);
+    while (length > 1 && pathname[length - 1] == '/') {
+        pathname[--length] = '\0';
+    }
+
+    char *slash = strrchr(pathname, '/');
+    *name = (slash == NULL) ? pathname : slash + 1;
+
+    int dir_fd = open(".", O_RDONLY | O_DIRECTORY);
+    if (dir_fd < 0) {
+        perror("Error");
+        exit(1);
+    }
+
+    char *component = pathname;
+    while (component < *name) {
+        size_t component_length = strcspn(component, "/");
+
+        if (component_length > 0 &&
+            !(component_length == 1 && component[0] == '.')) {
+            component[component_length] = '\0';
+            int next_fd = openat(
+                dir_fd, component, O_RDONLY | O_DIRECTORY | O_NOFOLLOW
+            );
+            component[component_length] = '/';
+
+            if (next_fd < 0 && (errno == ELOOP || errno == ENOTDIR)) {
+                fprintf(
+                    stderr, "Error: '%s' has a symlink or file in its path\n",
+                    pathname
+                );
+                exit(1);
+            } else if (next_fd < 0) {
+                perror("Error");
+                exit(1);
+            }
+            close(dir_fd);
+            dir_fd = next_fd;
+        }
+
+        component += component_length + 1;
+    }
+
+    return dir_fd;
+}
+
+// Function to open the file updates are written into, `name` in the
+// directory `dir_fd`. In place, that is the target itself. Otherwise it's
+// a new temporary file holding a copy of the target (as much of it as
+// fits in the new `size`), and `old_fd` is left open on the target for
+// copies.
+int apply_open_target(
+    int dir_fd, char *pathname, char *name, uint64_t size, int *old_fd,
+    bool in_place
+) {
+    struct stat old_stat;
+    uint64_t started = Stats_Start();
+    bool exists = fstatat(
+        dir_fd, name, &old_stat, AT_SYMLINK_NOFOLLOW
+    ) == 0;
+    Stats_Stop(STATS_TIMER_STAT, started);
+    Stats_Add(STATS_STAT_CALLS, 1);
+    if (exists && !S_ISREG(old_stat.st_mode)) {
+        fprintf(stderr, "Error: '%s' is not a regular file\n", pathname);
+        exit(1);
+    }
+
+    if (in_place) {
+        started = Stats_Start();
+        int fd = openat(dir_fd, name, O_RDWR | O_CREAT | O_NOFOLLOW, 0600);
+        Stats_Stop(STATS_TIMER_OPEN, started);
+        Stats_Add(STATS_OPEN_CALLS, 1);
+        if (fd < 0) {
+            perror("Error");
+            exit(1);
+        }
+        return fd;
+    }
+
+    // Temporary file lives in the same directory so rename is atomic
+    started = Stats_Start();
+    int fd = apply_create_temp(dir_fd);
+    Stats_Stop(STATS_TIMER_OPEN, started);
+    Stats_Add(STATS_OPEN_CALLS, 1);
+
+    if (exists) {
+        started = Stats_Start();
+        *old_fd = openat(dir_fd, name, O_RDONLY | O_NOFOLLOW);
+        Stats_Stop(STATS_TIMER_OPEN, started);
+        Stats_Add(STATS_OPEN_CALLS, 1);
+        if (*old_fd < 0) {
+            perror("Error");
+            exit(1);
+        }
+        uint64_t old_size = old_stat.st_size;
+        fd_copy_all(*old_fd, fd, (old_size < size) ? old_size : size);
+    }
+
+    return fd;
+}
+
+// Function to create a new temporary file in the directory `dir_fd`, as
+// mkstemp does in the current one, and remember it for apply_cleanup
+int apply_create_temp(int dir_fd) {
+    while (true) {
+        uint8_t random_bytes[TEMP_RANDOM_CHARS];
+        ssize_t num_random = getrandom(random_bytes, TEMP_RANDOM_CHARS, 0);
+        if (num_random != TEMP_RANDOM_CHARS) {
+            perror("Error");
+            exit(1);
+        }
+
+        strcpy(apply_temp_name, TEMP_TEMPLATE);
+        char *suffix = apply_temp_name + strlen(TEMP_TEMPLATE) -
+            TEMP_RANDOM_CHARS;
+        for (int i = 0; i < TEMP_RANDOM_CHARS; i++) {
+            suffix[i] = TEMP_CHARS[random_bytes[i] % (sizeof(TEMP_CHARS) - 1)];
+        }
+
+        int fd = openat(
+            dir_fd, apply_temp_name, O_RDWR | O_CREAT | O_EXCL | O_NOFOLLOW,
+            0600
+        );
+        if (fd >= 0) {
+            apply_temp_dir = dir_fd;
+            return fd;
+        }
+        if (errno != EEXIST) {
+            perror("Error");
+            exit(1);
+        }
+    }
+}
+
+// Function to read where each chunk of a chunked record ends. The chunks
+// must cover the whole file, and none can be empty.
+void apply_read_chunks(
+    FILE *tcbi, uint64_t size, struct Index_Format format,
+    struct Chunk_List *chunks
+) {
+    size_t num_chunks = Format_Read_Uint(tcbi, format, NUM_BLOCKS_SIZE);
+    if (num_chunks > size) {
+        fprintf(stderr, "Error: invalid chunks\n");
+        exit(1);
+    }
+
+    uint64_t end = 0;
+    for (size_t chunk_n = 0; chunk_n < num_chunks; chunk_n++) {
+        uint64_t length = Format_Read_Uint(tcbi, format, UPDATE_LEN_SIZE);
+        if (length == 0 || length > size - end) {
+            fprintf(stderr, "Error: invalid chunks\n");
+            exit(1);
+        }
+        end += length;
+        Chunk_List_Add(chunks, end, 0);
+    }
+
+    if (end != size) {
+        fprintf(stderr, "Error: invalid chunks\n");
+        exit(1);
+    }
+}
+
+// Function to read which blocks a compressed record's dictionary is made
+// of. They must be in order, and inside the file. Chunked records never
+// have any.
+size_t apply_read_dict_blocks(
+    FILE *tcbi, uint64_t size, struct Index_Format format,
+    size_t blocks[DICT_MAX_BLOCKS]
+) {
+    size_t num_blocks = number_of_blocks_in_file(size);
+    size_t max_dict_blocks = format.cdc ? 0 :
+        (COMPRESS_DICT_MAX_SIZE + format.block_size - 1) / format.block_size;
+    size_t num_dict_blocks = Format_Read_Uint(tcbi, format, BLOCK_INDEX_SIZE);
+    if (num_dict_blocks > max_dict_blocks) {
+        fprintf(stderr, "Error: dictionary is too big\n");
+        exit(1);
+    }
+
+    size_t next_block = 0;
+    for (size_t dict_n = 0; dict_n < num_dict_blocks; dict_n++) {
+        size_t gap = Format_Read_Uint(tcbi, format, BLOCK_INDEX_SIZE);
+        if (gap >= num_blocks - next_block) {
+            fprintf(stderr, "Error: invalid dictionary block\n");
+            exit(1);
+        }
+        blocks[dict_n] = next_block + gap;
+        next_block = blocks[dict_n] + 1;
+    }
+
+    return num_dict_blocks;
+}
+
+// Function to read a compressed record's dictionary from the blocks the
+// receiver already has, up to COMPRESS_DICT_MAX_SIZE of them. Returns its
+// size.
+size_t apply_read_dict(
+    int fd, size_t blocks[], size_t num_blocks, uint64_t size, uint8_t dict[]
+) {
+    size_t dict_size = 0;
+
+    for (size_t dict_n = 0; dict_n < num_blocks; dict_n++) {
+        uint64_t offset = Block_Offset(NULL, blocks[dict_n]);
+        size_t length = Block_Length(NULL, blocks[dict_n], size);
+        if (length > COMPRESS_DICT_MAX_SIZE - dict_size) {
+            length = COMPRESS_DICT_MAX_SIZE - dict_size;
+        }
+        if (pread(fd, dict + dict_size, length, offset) != (ssize_t) length) {
+            fprintf(stderr, "Error: dictionary block %zu is missing\n", blocks[dict_n]);
+            exit(1);
+        }
+        dict_size += length;
+    }
+
+    return dict_size;
+}
+
+// Function to make the new contents durable and, if they were built in a
+// temporary file, atomically swap them in for `name` in `dir_fd`.
+void apply_finish_target(int fd, int dir_fd, char *name, bool in_place) {
+    if (fsync(fd) != 0 || close(fd) != 0) {
+        perror("Sync Failed");
+        exit(1);
+    }
+
+    if (in_place) return;
+
+    if (renameat(dir_fd, apply_temp_name, dir_fd, name) != 0) {
+        perror("Rename Failed");
+        exit(1);
+    }
+    apply_temp_dir = -1;
+
+    // So the rename is itself durable. Some filesystems can't fsync a
+    // directory, which isn't worth failing for.
+    fsync(dir_fd);
+}
+
+// Function to stream every update of a record into `fd`, a buffer at a
+// time. The blocks are `chunks`, if the record has content-defined ones.
+void apply_updates(
+    FILE *tcbi, int fd, uint64_t size, const struct Chunk_List *chunks,
+    struct Index_Format format
+) {
+    size_t num_blocks = (chunks != NULL) ?
+        chunks->num_chunks : number_of_blocks_in_file(size);
+    size_t num_updates = Format_Read_Uint(tcbi, format, BLOCK_INDEX_SIZE);
+
+    char *buffer = NULL;
+    if (num_updates > 0) buffer = malloc(COPY_BUFFER_SIZE);
+    if (num_updates > 0 && buffer == NULL) {
+        perror("Error");
+        exit(1);
+    }
+
+    for (size_t update_n = 0; update_n < num_updates; update_n++) {
+        size_t block_index = Format_Read_Uint(
+            tcbi, format, BLOCK_INDEX_SIZE
+        );
+        size_t update_length = Format_Read_Uint(
+            tcbi, format, UPDATE_LEN_SIZE
+        );
+
+        if (block_index >= num_blocks ||
+            update_length != Block_Length(chunks, block_index, size)) {
+            fprintf(stderr, "Error: invalid update for block %zu\n", block_index);
+            exit(1);
+        }
+
+        uint64_t offset = Block_Offset(chunks, block_index);
+        while (update_length > 0) {
+            size_t n = (update_length < COPY_BUFFER_SIZE) ?
+                update_length : COPY_BUFFER_SIZE;
+            fread_handler(buffer, sizeof(char), n, tcbi);
+            pwrite_handler(fd, buffer, n, offset);
+            offset += n;
+            update_length -= n;
+        }
+    }
+
+    free(buffer);
+}
+
+// Function to stream every run of changed blocks of a record into `fd`,
+// a buffer at a time. A run covers whole blocks, so it ends either on a
+// block boundary or at the end of the file.
+void apply_runs(
+    FILE *tcbi, int fd, uint64_t size, struct Index_Format format
+) {
+    size_t num_blocks = number_of_blocks_in_file(size);
+    size_t num_runs = Format_Read_Uint(tcbi, format, BLOCK_INDEX_SIZE);
+
+    char *buffer = NULL;
+    if (num_runs > 0) buffer = malloc(COPY_BUFFER_SIZE);
+    if (num_runs > 0 && buffer == NULL) {
+        perror("Error");
+        exit(1);
+    }
+
+    for (size_t run_n = 0; run_n < num_runs; run_n++) {
+        size_t first_block = Format_Read_Uint(
+            tcbi, format, BLOCK_INDEX_SIZE
+        );
+        uint64_t length = Format_Read_Uint(tcbi, format, UPDATE_LEN_SIZE);
+
+        uint64_t offset = Block_Offset(NULL, first_block);
+        if (
+            first_block >= num_blocks || length == 0 ||
+            length > size - offset ||
+            (length % rbuoy_options.block_size != 0 && offset + length != size)
+        ) {
+            fprintf(stderr, "Error: invalid run from block %zu\n", first_block);
+            exit(1);
+        }
+
+        while (length > 0) {
+            size_t n = (length < COPY_BUFFER_SIZE) ? length : COPY_BUFFER_SIZE;
+            fread_handler(buffer, sizeof(char), n, tcbi);
+            pwrite_handler(fd, buffer, n, offset);
+            offset += n;
+            length -= n;
+        }
+    }
+
+    free(buffer);
+}
+
+// Function to apply the copies of a rolling (or chunked) record, each
+// moving a block from elsewhere in the old file to the block's own offset.
+void apply_copies(
+    FILE *tcbi, int fd, int old_fd, uint64_t size,
+    const struct Chunk_List *chunks, struct Index_Format format
+) {
+    size_t num_blocks = (chunks != NULL) ?
+        chunks->num_chunks : number_of_blocks_in_file(size);
+    size_t num_copies = Format_Read_Uint(tcbi, format, BLOCK_INDEX_SIZE);
+
+    char *buffer = NULL;
+    if (num_copies > 0) buffer = malloc(COPY_BUFFER_SIZE);
+    if (num_copies > 0 && buffer == NULL) {
+        perror("Error");
+        exit(1);
+    }
+
+    for (size_t copy_n = 0; copy_n < num_copies; copy_n++) {
+        size_t block_index = Format_Read_Uint(
+            tcbi, format, BLOCK_INDEX_SIZE
+        );
+        uint64_t offset = Format_Read_Uint(tcbi, format, BLOCK_OFFSET_SIZE);
+
+        if (block_index >= num_blocks || old_fd < 0) {
+            fprintf(stderr, "Error: invalid copy for block %zu\n", block_index);
+            exit(1);
+        }
+
+        size_t length = Block_Length(chunks, block_index, size);
+        uint64_t dest_offset = Block_Offset(chunks, block_index);
+        while (length > 0) {
+            size_t n = (length < COPY_BUFFER_SIZE) ? length : COPY_BUFFER_SIZE;
+            if (pread(old_fd, buffer, n, offset) != (ssize_t) n) {
+                fprintf(stderr, "Error: copy for block %zu is past the end\n", block_index);
+                exit(1);
+            }
+            pwrite_handler(fd, buffer, n, dest_offset);
+            offset += n;
+            dest_offset += n;
+            length -= n;
+        }
+    }
+
+    free(buffer);
+}
+
+// Function to remove a half-built temporary file when exiting on an error,
+// which leaves the target exactly as it was.
+void apply_cleanup(void) {
+    if (apply_temp_dir >= 0) {
+        unlinkat(apply_temp_dir, apply_temp_name, 0);
+    }
+}
+
+// Function to turn a mode field such as "-rw-r--r--" into mode bits
+mode_t mode_from_chars(char mode_chars[MODE_SIZE], char *pathname) {
+    mode_t mode;
+    switch (mode_chars[0]) {
+        case '-': mode = S_IFREG; break;
+        case 'd': mode = S_IFDIR; break;
+        default: {
+            fprintf(stderr, "Error: '%s' has an invalid type\n", pathname);
+            exit(1);
+        }
+    }
+
+    for (int i = 0; i < NUM_PERMISSIONS; i++) {
+        char c = mode_chars[i + 1];
+        if (c == PERMISSIONS[i]) {
+            mode |= 1 << (NUM_PERMISSIONS - 1 - i);
+        } else if (c != '-') {
+            fprintf(stderr, "Error: '%s' has invalid permissions\n", pathname);
+            exit(1);
+        }
+    }
+
+    return mode;
+}
+
+// Function to check if a relative pathname ever steps above the current
+// directory, e.g. "fizz/../../aaa/short.txt". Absolute paths also escape.
+bool path_escapes_cwd(char *pathname) {
+    if (pathname[0] == '/') return true;
+
+    int depth = 0;
+    char *component = pathname;
+    while (*component != '\0') {
+        size_t length = strcspn(component, "/");
+
+        if (length == 2 && strncmp(component, "..", 2) == 0) {
+            depth--;
+            if (depth < 0) return true;
+        } else if (length > 0 && !(length == 1 && component[0] == '.')) {
+            depth++;
+        }
+
+        component += length;
+        if (*component == '/') component++;
+    }
+
+    return false;
+}
+
+// Function to copy at least `max_bytes` from the start of one file to the
+// start of an empty one. A reflink shares all of `src`'s extents (anything
+// past `max_bytes` is left to be truncated off), which costs the same
+// however big the file is. Failing that, the copy is done in the kernel,
+// and whatever it can't do goes through a fixed size buffer.
+void fd_copy_all(int src, int dest, uint64_t max_bytes) {
+    if (max_bytes == 0 || ioctl(dest, FICLONE, src) == 0) return;
+
+    uint64_t copied = fd_copy_in_kernel(src, dest, max_bytes);
+    if (copied == max_bytes) return;
+
+    char *buffer = malloc(COPY_BUFFER_SIZE);
+    if (buffer == NULL) {
+        perror("Error");
+        exit(1);
+    }
+
+    while (copied < max_bytes) {
+        size_t length = (max_bytes - copied < COPY_BUFFER_SIZE) ?
+            max_bytes - copied : COPY_BUFFER_SIZE;
+        ssize_t n = pread(src, buffer, length, copied);
+        if (n < 0 && errno == EINTR) continue;
+        if (n < 0) {
+            perror("Read Failed");
+            exit(1);
+        }
+        if (n == 0) break;
+
+        pwrite_handler(dest, buffer, n, copied);
+        copied += n;
+    }
+
+    free(buffer);
+}
+
+// Function to copy as much as copy_file_range will of the first
+// `max_bytes` of one file to the same place in another, returning how
+// much that was. It can't copy between some filesystems (or at all, on
+// old kernels), so can stop short anywhere, even at 0.
+uint64_t fd_copy_in_kernel(int src, int dest, uint64_t max_bytes) {
+    loff_t in_offset = 0;
+    loff_t out_offset = 0;
+    uint64_t copied = 0;
+    while (copied < max_bytes) {
+        uint64_t started = Stats_Start();
+        ssize_t n = copy_file_range(
+            src, &in_offset, dest, &out_offset, max_bytes - copied, 0
+        );
+        Stats_Stop(STATS_TIMER_WRITE, started);
+        Stats_Add(STATS_WRITE_CALLS, 1);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) break;
+
+        copied += n;
+        Stats_Add(STATS_BYTES_WRITTEN, n);
+    }
+
+    return copied;
+}
+
+// Simple function that calls pwrite until everything is written, but
+// errors out on fail
+void pwrite_handler(int fd, void *buffer, size_t n, uint64_t offset) {
+    char *bytes = buffer;
+    while (n > 0) {
+        uint64_t started = Stats_Start();
+        ssize_t written = pwrite(fd, bytes, n, offset);
+        Stats_Stop(STATS_TIMER_WRITE, started);
+        Stats_Add(STATS_WRITE_CALLS, 1);
+        if (written < 0) {
+            if (errno == EINTR) continue;
+            perror("Write Failed");
+            exit(1);
+        }
+        bytes += written;
+        offset += written;
+        n -= written;
+        Stats_Add(STATS_BYTES_WRITTEN, written);
+    }
+}
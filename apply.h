@@ -0,0 +1,19 @@
+// Header file for apply.c written by Connor Li (z5425430)
+// For implementation details go to apply.c.
+
+#ifndef APPLY_H_
+#define APPLY_H_
+
+#include <stdio.h>
+
+/// @brief Apply every record of a TCBI (or TCRI) file to the filesystem.
+///
+/// Records are streamed one at a time, so memory use doesn't depend on the
+/// size of the files. Unless `rbuoy_options.in_place` is set, each file is
+/// rebuilt in a temporary file next to it, which is then renamed over the
+/// target, so a crash never leaves a half-written target behind.
+///
+/// @param tcbi The TCBI file to apply, positioned at its start.
+void In_Apply_TCBI(FILE *tcbi);
+
+#endif
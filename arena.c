@@ -0,0 +1,122 @@
+// Implementation for 'arena.h', written by Connor Li (z5425430)
+// A bump allocator. Memory comes from a list of chunks, newest first; an
+// allocation that doesn't fit in the newest chunk starts a bigger one.
+// Resetting throws the chunks away and keeps a single chunk as big as
+// all of them were, so a run of similar records settles into one chunk
+// and never calls malloc again. A chunk left over from a huge record is
+// given back rather than kept around for the rest of the run.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include "arena.h"
+
+#define ARENA_ALIGN 16
+#define ARENA_MIN_CHUNK (64 * 1024)
+#define ARENA_KEEP_MAX (16 * 1024 * 1024)
+
+struct Arena_Chunk {
+    struct Arena_Chunk *next;
+    size_t size;
+    size_t used;
+    _Alignas(ARENA_ALIGN) unsigned char data[];
+};
+
+//////////////////////////////////////////////////////////////////////
+//                        FUNCTION PROTOTYPES
+//////////////////////////////////////////////////////////////////////
+
+void arena_add_chunk(struct Arena *arena, size_t size);
+
+void arena_free_chunks(struct Arena *arena);
+
+//////////////////////////////////////////////////////////////////////
+//                        INTERFACE FUNCTIONS
+//////////////////////////////////////////////////////////////////////
+
+void Arena_Init(struct Arena *arena) {
+    arena->chunks = NULL;
+    arena->capacity = 0;
+}
+
+void *Arena_Alloc(struct Arena *arena, size_t size) {
+    if (size > SIZE_MAX - ARENA_ALIGN) {
+        fprintf(stderr, "Error: out of memory\n");
+        exit(1);
+    }
+    size = (size + ARENA_ALIGN - 1) & ~(size_t) (ARENA_ALIGN - 1);
+
+    struct Arena_Chunk *chunk = arena->chunks;
+    if (chunk == NULL || chunk->size - chunk->used < size) {
+        size_t chunk_size = arena->capacity < ARENA_MIN_CHUNK ?
+            ARENA_MIN_CHUNK : arena->capacity;
+        if (chunk_size < size) chunk_size = size;
+        arena_add_chunk(arena, chunk_size);
+        chunk = arena->chunks;
+    }
+
+    void *memory = chunk->data + chunk->used;
+    chunk->used += size;
+
+    return memory;
+}
+
+void *Arena_Alloc_Array(struct Arena *arena, size_t count, size_t size) {
+    if (size != 0 && count > SIZE_MAX / size) {
+        fprintf(stderr, "Error: out of memory\n");
+        exit(1);
+    }
+
+    return Arena_Alloc(arena, count * size);
+}
+
+void Arena_Reset(struct Arena *arena) {
+    if (arena->chunks == NULL) return;
+
+    if (arena->chunks->next == NULL && arena->capacity <= ARENA_KEEP_MAX) {
+        arena->chunks->used = 0;
+        return;
+    }
+
+    size_t capacity = arena->capacity;
+    arena_free_chunks(arena);
+    if (capacity <= ARENA_KEEP_MAX) arena_add_chunk(arena, capacity);
+}
+
+void Arena_Free(struct Arena *arena) {
+    arena_free_chunks(arena);
+}
+
+//////////////////////////////////////////////////////////////////////
+//                           LOCAL HELPERS
+//////////////////////////////////////////////////////////////////////
+
+// Function to start a new chunk of `size` bytes at the front of the list
+void arena_add_chunk(struct Arena *arena, size_t size) {
+    if (size > SIZE_MAX - sizeof(struct Arena_Chunk)) {
+        fprintf(stderr, "Error: out of memory\n");
+        exit(1);
+    }
+
+    struct Arena_Chunk *chunk = malloc(sizeof(struct Arena_Chunk) + size);
+    if (chunk == NULL) {
+        perror("Error");
+        exit(1);
+    }
+
+    chunk->next = arena->chunks;
+    chunk->size = size;
+    chunk->used = 0;
+    arena->chunks = chunk;
+    arena->capacity += size;
+}
+
+// Function to free every chunk
+void arena_free_chunks(struct Arena *arena) {
+    while (arena->chunks != NULL) {
+        struct Arena_Chunk *next = arena->chunks->next;
+        free(arena->chunks);
+        arena->chunks = next;
+    }
+    arena->capacity = 0;
+}
@@ -0,0 +1,41 @@
+// Header file for arena.c written by Connor Li (z5425430)
+// For implementation details go to arena.c.
+
+#ifndef ARENA_H_
+#define ARENA_H_
+
+#include <stddef.h>
+
+struct Arena_Chunk;
+
+/// @brief A bump allocator for memory that lives as long as one record.
+///        Everything allocated from it is freed at once by Arena_Reset.
+struct Arena {
+    struct Arena_Chunk *chunks;
+    size_t capacity;
+};
+
+/// @brief Start an empty arena. Nothing is allocated until it is used.
+/// @param arena The arena.
+void Arena_Init(struct Arena *arena);
+
+/// @brief Allocate memory that stays valid until the next Arena_Reset.
+/// @param arena The arena.
+/// @param size The number of bytes wanted.
+/// @return Memory aligned for any type. Errors out if there is none left.
+void *Arena_Alloc(struct Arena *arena, size_t size);
+
+/// @brief Like Arena_Alloc, but for `count` items of `size` bytes each,
+///        erroring out if that overflows.
+void *Arena_Alloc_Array(struct Arena *arena, size_t count, size_t size);
+
+/// @brief Free everything allocated since the last reset, keeping one
+///        chunk big enough to hold it all for next time.
+/// @param arena The arena.
+void Arena_Reset(struct Arena *arena);
+
+/// @brief Free the arena's memory.
+/// @param arena The arena.
+void Arena_Free(struct Arena *arena);
+
+#endif
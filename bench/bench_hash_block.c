@@ -0,0 +1,103 @@
+// Benchmark for block_hash.c, written by Connor Li (z5425430)
+// Hashes the same buffer with every FNV-1a kernel this CPU supports, and
+// with XXH64, and reports the throughput of each in GB/s (best of a few
+// runs). Every FNV kernel is checked against the scalar one.
+//
+// Usage: ./bench_hash_block [size in MiB] [runs]
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "../rbuoy.h"
+#include "../block_hash.h"
+
+#define DEFAULT_SIZE_MIB 64
+#define DEFAULT_RUNS 5
+
+struct Kernel {
+    char *name;
+    enum FNV_Kernel kernel;
+};
+
+double seconds_now(void) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec + now.tv_nsec / 1e9;
+}
+
+// Function to fill a buffer with pseudo-random bytes
+void fill_random(unsigned char data[], size_t size) {
+    uint64_t state = 0x9e3779b97f4a7c15ull;
+    for (size_t i = 0; i < size; i++) {
+        state ^= state << 13;
+        state ^= state >> 7;
+        state ^= state << 17;
+        data[i] = state;
+    }
+}
+
+int main(int argc, char *argv[]) {
+    uint64_t size_mib = (argc > 1) ? strtoull(argv[1], NULL, 10) : DEFAULT_SIZE_MIB;
+    int runs = (argc > 2) ? atoi(argv[2]) : DEFAULT_RUNS;
+    size_t num_blocks = size_mib * 1024 * 1024 / BLOCK_SIZE;
+    size_t size = num_blocks * BLOCK_SIZE;
+
+    unsigned char *data = malloc(size);
+    uint64_t *hashes = malloc(sizeof(uint64_t) * num_blocks);
+    uint64_t *expected = malloc(sizeof(uint64_t) * num_blocks);
+    if (data == NULL || hashes == NULL || expected == NULL) {
+        perror("Error");
+        return 1;
+    }
+    fill_random(data, size);
+
+    struct Kernel kernels[] = {
+        {"scalar", FNV_KERNEL_SCALAR},
+        {"lanes", FNV_KERNEL_LANES},
+        {"avx2", FNV_KERNEL_AVX2},
+        {"avx512", FNV_KERNEL_AVX512},
+        {"auto", FNV_KERNEL_AUTO},
+    };
+    size_t num_kernels = sizeof(kernels) / sizeof(kernels[0]);
+
+    printf("hashing %lu MiB (%zu blocks), best of %d runs\n", size_mib, num_blocks, runs);
+    for (size_t kernel_n = 0; kernel_n < num_kernels; kernel_n++) {
+        if (!FNV_Kernel_Supported(kernels[kernel_n].kernel)) {
+            printf("fnv1a/%-7s unsupported\n", kernels[kernel_n].name);
+            continue;
+        }
+
+        double best = 0;
+        for (int run = 0; run < runs; run++) {
+            double start = seconds_now();
+            FNV_Hash_Blocks(data, num_blocks, hashes, kernels[kernel_n].kernel);
+            double elapsed = seconds_now() - start;
+            if (run == 0 || elapsed < best) best = elapsed;
+        }
+
+        if (kernel_n == 0) {
+            memcpy(expected, hashes, sizeof(uint64_t) * num_blocks);
+        } else if (memcmp(expected, hashes, sizeof(uint64_t) * num_blocks) != 0) {
+            fprintf(stderr, "Error: %s hashes differ from scalar\n", kernels[kernel_n].name);
+            return 1;
+        }
+
+        printf("fnv1a/%-7s %8.3f s %8.3f GB/s\n", kernels[kernel_n].name, best, size / best / 1e9);
+    }
+
+    double best = 0;
+    for (int run = 0; run < runs; run++) {
+        double start = seconds_now();
+        Block_Hash_Many(data, size, hashes, BLOCK_HASH_XXH64);
+        double elapsed = seconds_now() - start;
+        if (run == 0 || elapsed < best) best = elapsed;
+    }
+    printf("%-13s %8.3f s %8.3f GB/s\n", "xxh64", best, size / best / 1e9);
+
+    free(data);
+    free(hashes);
+    free(expected);
+
+    return 0;
+}
@@ -0,0 +1,103 @@
+// Benchmark for hash_io.c, written by Connor Li (z5425430)
+// Hashes the same file through every backend of file_get_hashes and
+// reports the throughput of each in GB/s (best of a few runs, warm cache).
+//
+// Usage: ./bench_hash_io [size in MiB] [runs]
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include "../rbuoy.h"
+#include "../helpers.h"
+#include "../hash_io.h"
+
+#define DEFAULT_SIZE_MIB 256
+#define DEFAULT_RUNS 3
+
+struct Backend {
+    char *name;
+    enum Hash_Backend backend;
+};
+
+double seconds_now(void) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec + now.tv_nsec / 1e9;
+}
+
+// Function to write `size` bytes of pseudo-random data to a new temp file
+FILE *make_input(char *pathname, uint64_t size) {
+    int fd = mkstemp(pathname);
+    FILE *f = (fd < 0) ? NULL : fdopen(fd, "w+b");
+    if (f == NULL) {
+        perror("Error");
+        exit(1);
+    }
+
+    uint64_t state = 0x9e3779b97f4a7c15ull;
+    uint64_t chunk[1024];
+    for (uint64_t written = 0; written < size; written += sizeof(chunk)) {
+        for (size_t i = 0; i < 1024; i++) {
+            state ^= state << 13;
+            state ^= state >> 7;
+            state ^= state << 17;
+            chunk[i] = state;
+        }
+        size_t n = (size - written < sizeof(chunk)) ? size - written : sizeof(chunk);
+        fwrite(chunk, 1, n, f);
+    }
+    fflush(f);
+
+    return f;
+}
+
+int main(int argc, char *argv[]) {
+    uint64_t size_mib = (argc > 1) ? strtoull(argv[1], NULL, 10) : DEFAULT_SIZE_MIB;
+    int runs = (argc > 2) ? atoi(argv[2]) : DEFAULT_RUNS;
+    uint64_t size = size_mib * 1024 * 1024;
+
+    char pathname[] = "/tmp/rbuoy_bench_hash_io.XXXXXX";
+    FILE *input = make_input(pathname, size);
+
+    size_t num_blocks = number_of_blocks_in_file(size);
+    uint64_t *hashes = malloc(sizeof(uint64_t) * num_blocks);
+    uint64_t *expected = malloc(sizeof(uint64_t) * num_blocks);
+
+    struct Backend backends[] = {
+        {"stdio", HASH_BACKEND_STDIO},
+        {"mmap", HASH_BACKEND_MMAP},
+        {"stream", HASH_BACKEND_STREAM},
+    };
+    size_t num_backends = sizeof(backends) / sizeof(backends[0]);
+
+    printf("hashing %lu MiB (%zu blocks), best of %d runs\n", size_mib, num_blocks, runs);
+    for (size_t backend_n = 0; backend_n < num_backends; backend_n++) {
+        rbuoy_options.hash_backend = backends[backend_n].backend;
+
+        double best = 0;
+        for (int run = 0; run < runs; run++) {
+            double start = seconds_now();
+            file_get_hashes(input, hashes, NULL, num_blocks);
+            double elapsed = seconds_now() - start;
+            if (run == 0 || elapsed < best) best = elapsed;
+        }
+
+        if (backend_n == 0) {
+            memcpy(expected, hashes, sizeof(uint64_t) * num_blocks);
+        } else if (memcmp(expected, hashes, sizeof(uint64_t) * num_blocks) != 0) {
+            fprintf(stderr, "Error: %s hashes differ from stdio\n", backends[backend_n].name);
+            return 1;
+        }
+
+        printf("%-8s %8.3f s %8.3f GB/s\n", backends[backend_n].name, best, size / best / 1e9);
+    }
+
+    fclose(input);
+    unlink(pathname);
+    free(hashes);
+    free(expected);
+
+    return 0;
+}
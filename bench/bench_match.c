@@ -0,0 +1,157 @@
+// Benchmark for match.c, written by Connor Li (z5425430)
+// Packs the match bytes of one large record with every kernel this CPU
+// supports, then walks its changed blocks with a Match_Iter and with the
+// old bit-by-bit loop, and reports how many blocks per second each gets
+// through (best of a few runs). Every kernel is checked against the
+// scalar one, and the Match_Iter against the bit-by-bit loop.
+//
+// Usage: ./bench_match [blocks in millions] [percent changed] [runs]
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "../rbuoy.h"
+#include "../helpers.h"
+#include "../match.h"
+
+#define DEFAULT_MILLION_BLOCKS 16
+#define DEFAULT_PERCENT_CHANGED 10
+#define DEFAULT_RUNS 5
+
+struct Kernel {
+    char *name;
+    enum Match_Kernel kernel;
+};
+
+double seconds_now(void) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec + now.tv_nsec / 1e9;
+}
+
+// Function to step a xorshift generator
+uint64_t next_random(uint64_t *state) {
+    *state ^= *state << 13;
+    *state ^= *state >> 7;
+    *state ^= *state << 17;
+    return *state;
+}
+
+// Function to walk the changed blocks the way stage 3 used to, one bit
+// at a time. Returns the sum of their indexes, to check against.
+uint64_t walk_bits(uint8_t match_bytes[], size_t num_blocks) {
+    uint64_t sum = 0;
+
+    for (size_t block_n = 0; block_n < num_blocks; block_n++) {
+        uint8_t match_bit = 0x80 >> (block_n % MATCH_BYTE_BITS);
+        if ((match_bytes[block_n / MATCH_BYTE_BITS] & match_bit) == 0) {
+            sum += block_n;
+        }
+    }
+
+    return sum;
+}
+
+// Function to walk the changed blocks with a Match_Iter
+uint64_t walk_next(uint8_t match_bytes[], size_t num_blocks) {
+    uint64_t sum = 0;
+
+    struct Match_Iter iter;
+    Match_Iter_Start(&iter, match_bytes, num_blocks, false);
+    for (
+        size_t block_n = Match_Iter_Next(&iter); block_n < num_blocks;
+        block_n = Match_Iter_Next(&iter)
+    ) {
+        sum += block_n;
+    }
+
+    return sum;
+}
+
+int main(int argc, char *argv[]) {
+    size_t num_blocks = ((argc > 1) ? strtoull(argv[1], NULL, 10) : DEFAULT_MILLION_BLOCKS) * 1000000;
+    int percent_changed = (argc > 2) ? atoi(argv[2]) : DEFAULT_PERCENT_CHANGED;
+    int runs = (argc > 3) ? atoi(argv[3]) : DEFAULT_RUNS;
+    size_t num_bytes = num_tbbi_match_bytes(num_blocks);
+
+    uint8_t *sender_hashes = malloc(num_blocks * HASH_SIZE);
+    uint64_t *hashes = malloc(sizeof(uint64_t) * num_blocks);
+    uint8_t *match_bytes = malloc(num_bytes);
+    uint8_t *expected = malloc(num_bytes);
+    if (sender_hashes == NULL || hashes == NULL || match_bytes == NULL || expected == NULL) {
+        perror("Error");
+        return 1;
+    }
+
+    uint64_t state = 0x9e3779b97f4a7c15ull;
+    for (size_t block_n = 0; block_n < num_blocks; block_n++) {
+        hashes[block_n] = next_random(&state);
+        uint64_t sent = hashes[block_n];
+        if ((int) (next_random(&state) % 100) < percent_changed) sent++;
+        int_to_bytes(sent, sender_hashes + block_n * HASH_SIZE, HASH_SIZE);
+    }
+
+    struct Kernel kernels[] = {
+        {"scalar", MATCH_KERNEL_SCALAR},
+        {"words", MATCH_KERNEL_WORDS},
+        {"avx2", MATCH_KERNEL_AVX2},
+        {"avx512", MATCH_KERNEL_AVX512},
+        {"auto", MATCH_KERNEL_AUTO},
+    };
+    size_t num_kernels = sizeof(kernels) / sizeof(kernels[0]);
+
+    printf("matching %zu blocks, %d%% changed, best of %d runs\n", num_blocks, percent_changed, runs);
+    for (size_t kernel_n = 0; kernel_n < num_kernels; kernel_n++) {
+        if (!Match_Kernel_Supported(kernels[kernel_n].kernel)) {
+            printf("pack/%-7s unsupported\n", kernels[kernel_n].name);
+            continue;
+        }
+
+        double best = 0;
+        for (int run = 0; run < runs; run++) {
+            double start = seconds_now();
+            Match_Pack(
+                sender_hashes, hashes, num_blocks, num_blocks, match_bytes,
+                kernels[kernel_n].kernel
+            );
+            double elapsed = seconds_now() - start;
+            if (run == 0 || elapsed < best) best = elapsed;
+        }
+
+        if (kernel_n == 0) {
+            memcpy(expected, match_bytes, num_bytes);
+        } else if (memcmp(expected, match_bytes, num_bytes) != 0) {
+            fprintf(stderr, "Error: %s match bytes differ from scalar\n", kernels[kernel_n].name);
+            return 1;
+        }
+
+        printf("pack/%-7s %8.3f s %8.1f Mblocks/s\n", kernels[kernel_n].name, best, num_blocks / best / 1e6);
+    }
+
+    uint64_t (*walks[])(uint8_t[], size_t) = {walk_bits, walk_next};
+    char *walk_names[] = {"bits", "next"};
+    uint64_t sums[2];
+    for (int walk_n = 0; walk_n < 2; walk_n++) {
+        double best = 0;
+        for (int run = 0; run < runs; run++) {
+            double start = seconds_now();
+            sums[walk_n] = walks[walk_n](expected, num_blocks);
+            double elapsed = seconds_now() - start;
+            if (run == 0 || elapsed < best) best = elapsed;
+        }
+
+        printf("walk/%-7s %8.3f s %8.1f Mblocks/s\n", walk_names[walk_n], best, num_blocks / best / 1e6);
+    }
+    if (sums[0] != sums[1]) {
+        fprintf(stderr, "Error: Match_Iter visited different blocks\n");
+        return 1;
+    }
+
+    free(sender_hashes);
+    free(hashes);
+    free(match_bytes);
+    free(expected);
+
+    return 0;
+}
@@ -0,0 +1,382 @@
+// Benchmark for the four stages, written by Connor Li (z5425430).
+// Syncs a corpus from gen_corpus (`CORPUS/src` to a copy of `CORPUS/dst`)
+// by running the rbuoy binary once per stage, and prints one JSON object
+// with, for each stage:
+//
+//      seconds         the best wall time of the runs
+//      bytes           the size of the tree the stage reads
+//      mb_per_s        bytes / seconds
+//      index_bytes     the size of the index the stage writes
+//      peak_rss_kib    the largest peak RSS of the runs
+//      syscalls        syscalls made, counted on one extra traced run,
+//                      in total and for the most common ones
+//
+// Every run checks that the receiver's tree ends up the same as the
+// sender's. Syscalls are counted with ptrace, so the timed runs aren't
+// slowed down by it.
+//
+// Usage: ./bench_stages [--rbuoy PATH] [--runs N] [-1 FLAGS] [-2 FLAGS]
+//                       [-3 FLAGS] [-4 FLAGS] CORPUS
+// where FLAGS are extra options for that stage, e.g. -1 "--wide --jobs 4".
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <signal.h>
+#include <time.h>
+#include <ftw.h>
+#include <getopt.h>
+#include <limits.h>
+#include <unistd.h>
+#include <sys/wait.h>
+#include <sys/ptrace.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+
+#define NUM_STAGES 4
+#define DEFAULT_RUNS 3
+#define MAX_ARGS 64
+#define MAX_SYSCALL 1024
+
+struct Stage_Result {
+    double seconds;
+    uint64_t bytes;
+    uint64_t index_bytes;
+    long peak_rss_kib;
+    uint64_t syscalls[MAX_SYSCALL];
+};
+
+// The syscalls worth reporting by name; everything is in the total
+struct Syscall_Name {
+    long number;
+    char *name;
+};
+
+static struct Syscall_Name syscall_names[] = {
+    {SYS_read, "read"}, {SYS_write, "write"}, {SYS_pread64, "pread64"},
+    {SYS_pwrite64, "pwrite64"}, {SYS_lseek, "lseek"}, {SYS_openat, "openat"},
+    {SYS_close, "close"}, {SYS_fstat, "fstat"}, {SYS_newfstatat, "newfstatat"},
+    {SYS_mmap, "mmap"}, {SYS_munmap, "munmap"}, {SYS_madvise, "madvise"},
+    {SYS_getdents64, "getdents64"}, {SYS_futex, "futex"}, {SYS_brk, "brk"},
+    {SYS_fsync, "fsync"}, {SYS_renameat, "renameat"}, {SYS_fchmod, "fchmod"},
+    {SYS_ftruncate, "ftruncate"}, {SYS_copy_file_range, "copy_file_range"},
+#ifdef SYS_open
+    {SYS_open, "open"}, {SYS_stat, "stat"}, {SYS_rename, "rename"},
+#endif
+};
+
+static uint64_t tree_bytes;
+
+double seconds_now(void) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec + now.tv_nsec / 1e9;
+}
+
+// Function for nftw to add up the size of every regular file
+int add_file_size(
+    const char *pathname, const struct stat *stat, int type, struct FTW *ftw
+) {
+    if (type == FTW_F && S_ISREG(stat->st_mode)) tree_bytes += stat->st_size;
+    return 0;
+}
+
+// Function to get the total size of the files in a tree
+uint64_t get_tree_bytes(char *pathname) {
+    tree_bytes = 0;
+    if (nftw(pathname, add_file_size, 64, FTW_PHYS) != 0) {
+        perror(pathname);
+        exit(1);
+    }
+
+    return tree_bytes;
+}
+
+// Function to get the size of a file, or 0 if it doesn't exist
+uint64_t get_file_bytes(char *pathname) {
+    struct stat stat_buffer;
+    return stat(pathname, &stat_buffer) == 0 ? stat_buffer.st_size : 0;
+}
+
+// Function to run a command in `directory` and wait for it. With
+// `traced`, every syscall of every thread is counted into `syscalls`.
+// Returns the exit status, and fills in the child's resource usage.
+int run_command(
+    char *directory, char *argv[], bool traced, struct rusage *usage,
+    uint64_t syscalls[MAX_SYSCALL]
+) {
+    pid_t pid = fork();
+    if (pid < 0) {
+        perror("fork");
+        exit(1);
+    }
+
+    if (pid == 0) {
+        if (chdir(directory) != 0) {
+            perror(directory);
+            _exit(127);
+        }
+        if (traced) {
+            ptrace(PTRACE_TRACEME, 0, NULL, NULL);
+            raise(SIGSTOP);
+        }
+        execv(argv[0], argv);
+        perror(argv[0]);
+        _exit(127);
+    }
+
+    int status;
+    if (!traced) {
+        wait4(pid, &status, 0, usage);
+        return WIFEXITED(status) ? WEXITSTATUS(status) : 128;
+    }
+
+    // Wait for the child to stop itself, then follow it and its threads
+    waitpid(pid, &status, 0);
+    ptrace(
+        PTRACE_SETOPTIONS, pid, NULL,
+        PTRACE_O_TRACESYSGOOD | PTRACE_O_TRACECLONE | PTRACE_O_EXITKILL
+    );
+    ptrace(PTRACE_SYSCALL, pid, NULL, NULL);
+
+    int exit_code = 128;
+    for (;;) {
+        pid_t stopped = wait4(-1, &status, __WALL, usage);
+        if (stopped < 0) break;
+
+        if (WIFEXITED(status) || WIFSIGNALED(status)) {
+            if (stopped == pid) {
+                exit_code = WIFEXITED(status) ? WEXITSTATUS(status) : 128;
+            }
+            continue;
+        }
+
+        int signal = 0;
+        if (WSTOPSIG(status) == (SIGTRAP | 0x80)) {
+            struct __ptrace_syscall_info info;
+            if (
+                ptrace(PTRACE_GET_SYSCALL_INFO, stopped, sizeof(info), &info) > 0 &&
+                info.op == PTRACE_SYSCALL_INFO_ENTRY &&
+                info.entry.nr < MAX_SYSCALL
+            ) {
+                syscalls[info.entry.nr]++;
+            }
+        } else if (WSTOPSIG(status) != SIGTRAP && WSTOPSIG(status) != SIGSTOP) {
+            // Pass real signals on to the child
+            signal = WSTOPSIG(status);
+        }
+        ptrace(PTRACE_SYSCALL, stopped, NULL, (void *) (long) signal);
+    }
+
+    return exit_code;
+}
+
+// Function to run a command and error out if it fails
+void run_or_die(char *directory, char *argv[]) {
+    struct rusage usage;
+    if (run_command(directory, argv, false, &usage, NULL) != 0) {
+        fprintf(stderr, "Error: '%s' failed\n", argv[0]);
+        exit(1);
+    }
+}
+
+// Function to build the arguments for one stage: rbuoy, the stage, the
+// extra flags (split on spaces) and then the operands
+void build_args(
+    char *args[MAX_ARGS], char *rbuoy, int stage, char *flags,
+    char *operand_1, char *operand_2
+) {
+    static char stage_options[NUM_STAGES][16];
+    static char flag_copies[NUM_STAGES][1024];
+
+    size_t num_args = 0;
+    args[num_args++] = rbuoy;
+    snprintf(stage_options[stage - 1], 16, "--stage-%d", stage);
+    args[num_args++] = stage_options[stage - 1];
+
+    snprintf(flag_copies[stage - 1], 1024, "%s", flags == NULL ? "" : flags);
+    for (
+        char *flag = strtok(flag_copies[stage - 1], " "); flag != NULL;
+        flag = strtok(NULL, " ")
+    ) {
+        if (num_args + 3 >= MAX_ARGS) break;
+        args[num_args++] = flag;
+    }
+
+    args[num_args++] = operand_1;
+    if (operand_2 != NULL) args[num_args++] = operand_2;
+    args[num_args] = NULL;
+}
+
+// Function to sync the corpus once, timing (or tracing) every stage
+void run_pipeline(
+    char *rbuoy, char *flags[NUM_STAGES], char *src, char *dst,
+    bool traced, struct Stage_Result results[NUM_STAGES]
+) {
+    char work[] = "/tmp/rbuoy_bench_stages.XXXXXX";
+    if (mkdtemp(work) == NULL) {
+        perror("mkdtemp");
+        exit(1);
+    }
+
+    char receiver[PATH_MAX], tabi[PATH_MAX], tbbi[PATH_MAX], tcbi[PATH_MAX];
+    snprintf(receiver, PATH_MAX, "%s/dst", work);
+    snprintf(tabi, PATH_MAX, "%s/index.tabi", work);
+    snprintf(tbbi, PATH_MAX, "%s/index.tbbi", work);
+    snprintf(tcbi, PATH_MAX, "%s/index.tcbi", work);
+
+    char *copy[] = {"/bin/cp", "-a", dst, receiver, NULL};
+    run_or_die(".", copy);
+
+    char *directories[NUM_STAGES] = {src, receiver, src, receiver};
+    char *outputs[NUM_STAGES] = {tabi, tbbi, tcbi, NULL};
+    char *inputs[NUM_STAGES] = {NULL, tabi, tbbi, tcbi};
+
+    for (int stage = 1; stage <= NUM_STAGES; stage++) {
+        struct Stage_Result *result = &results[stage - 1];
+        char *args[MAX_ARGS];
+        if (stage == 1) {
+            build_args(args, rbuoy, stage, flags[0], tabi, NULL);
+        } else if (stage == 4) {
+            build_args(args, rbuoy, stage, flags[3], tcbi, NULL);
+        } else {
+            build_args(
+                args, rbuoy, stage, flags[stage - 1],
+                outputs[stage - 1], inputs[stage - 1]
+            );
+        }
+
+        struct rusage usage;
+        uint64_t *syscalls = traced ? result->syscalls : NULL;
+        double start = seconds_now();
+        int status = run_command(
+            directories[stage - 1], args, traced, &usage, syscalls
+        );
+        double elapsed = seconds_now() - start;
+        if (status != 0) {
+            fprintf(stderr, "Error: stage %d failed (exit %d)\n", stage, status);
+            exit(1);
+        }
+
+        if (traced) continue;
+
+        if (result->seconds == 0 || elapsed < result->seconds) {
+            result->seconds = elapsed;
+        }
+        if (usage.ru_maxrss > result->peak_rss_kib) {
+            result->peak_rss_kib = usage.ru_maxrss;
+        }
+        if (stage < NUM_STAGES) result->index_bytes = get_file_bytes(outputs[stage - 1]);
+    }
+
+    char *compare[] = {"/usr/bin/diff", "-rq", src, receiver, NULL};
+    struct rusage usage;
+    if (run_command(".", compare, false, &usage, NULL) != 0) {
+        fprintf(stderr, "Error: the receiver's tree doesn't match the sender's\n");
+        exit(1);
+    }
+
+    char *remove[] = {"/bin/rm", "-rf", work, NULL};
+    run_or_die(".", remove);
+}
+
+// Function to print the syscall counts of a stage as JSON
+void print_syscalls(struct Stage_Result *result) {
+    uint64_t total = 0;
+    for (size_t nr = 0; nr < MAX_SYSCALL; nr++) total += result->syscalls[nr];
+
+    printf("\"syscalls\": {\"total\": %lu", total);
+    size_t num_names = sizeof(syscall_names) / sizeof(syscall_names[0]);
+    for (size_t name_n = 0; name_n < num_names; name_n++) {
+        uint64_t count = result->syscalls[syscall_names[name_n].number];
+        if (count > 0) printf(", \"%s\": %lu", syscall_names[name_n].name, count);
+    }
+    printf("}");
+}
+
+// Function to print a string as a JSON string
+void print_json_string(char *text) {
+    putchar('"');
+    for (char *c = text; *c != '\0'; c++) {
+        if (*c == '"' || *c == '\\') putchar('\\');
+        putchar(*c);
+    }
+    putchar('"');
+}
+
+int main(int argc, char *argv[]) {
+    char *rbuoy = "./rbuoy";
+    int runs = DEFAULT_RUNS;
+    char *flags[NUM_STAGES] = {"", "", "", ""};
+
+    for (;;) {
+        int opt = getopt_long(argc, argv, "1:2:3:4:", (struct option[]) {
+            {"rbuoy", required_argument, NULL, 'b'},
+            {"runs", required_argument, NULL, 'n'},
+            {0, 0, 0, 0},
+        }, NULL);
+        if (opt == -1) break;
+
+        switch (opt) {
+            case 'b': rbuoy = optarg; break;
+            case 'n': runs = atoi(optarg); break;
+            case '1': case '2': case '3': case '4': flags[opt - '1'] = optarg; break;
+            default: {
+                fprintf(stderr, "Usage: %s [--rbuoy PATH] [--runs N] [-1 FLAGS] [-2 FLAGS] [-3 FLAGS] [-4 FLAGS] CORPUS\n", argv[0]);
+                return 1;
+            }
+        }
+    }
+    if (optind != argc - 1 || runs < 1) {
+        fprintf(stderr, "Usage: %s [options] CORPUS\n", argv[0]);
+        return 1;
+    }
+
+    // The stages run in other directories, so every path must be absolute
+    char rbuoy_path[PATH_MAX], corpus[PATH_MAX];
+    char src[PATH_MAX + 8], dst[PATH_MAX + 8];
+    if (realpath(rbuoy, rbuoy_path) == NULL || realpath(argv[optind], corpus) == NULL) {
+        perror("Error");
+        return 1;
+    }
+    snprintf(src, sizeof(src), "%s/src", corpus);
+    snprintf(dst, sizeof(dst), "%s/dst", corpus);
+
+    static struct Stage_Result results[NUM_STAGES];
+    for (int run = 0; run < runs; run++) {
+        run_pipeline(rbuoy_path, flags, src, dst, false, results);
+    }
+    run_pipeline(rbuoy_path, flags, src, dst, true, results);
+
+    uint64_t src_bytes = get_tree_bytes(src);
+    uint64_t dst_bytes = get_tree_bytes(dst);
+    uint64_t stage_bytes[NUM_STAGES] = {src_bytes, dst_bytes, src_bytes, dst_bytes};
+
+    printf("{\"corpus\": ");
+    print_json_string(corpus);
+    printf(", \"src_bytes\": %lu, \"dst_bytes\": %lu, \"runs\": %d, \"stages\": [", src_bytes, dst_bytes, runs);
+    for (int stage = 1; stage <= NUM_STAGES; stage++) {
+        struct Stage_Result *result = &results[stage - 1];
+        result->bytes = stage_bytes[stage - 1];
+
+        printf("%s\n  {\"stage\": %d, \"flags\": ", stage == 1 ? "" : ",", stage);
+        print_json_string(flags[stage - 1]);
+        printf(
+            ", \"seconds\": %.6f, \"bytes\": %lu, \"mb_per_s\": %.1f, "
+            "\"index_bytes\": %lu, \"peak_rss_kib\": %ld, ",
+            result->seconds, result->bytes,
+            result->bytes / result->seconds / 1e6,
+            result->index_bytes, result->peak_rss_kib
+        );
+        print_syscalls(result);
+        printf("}");
+    }
+    printf("\n]}\n");
+
+    return 0;
+}
@@ -0,0 +1,417 @@
+// Synthetic corpus generator for the benchmarks, written by Connor Li
+// (z5425430). Builds a sender tree `OUT/src` and a receiver tree `OUT/dst`
+// that is the same tree with some files edited, so a run of the four
+// stages has real work to do. Everything comes from the seed, so the same
+// options always give byte for byte the same corpus.
+//
+// Usage: ./gen_corpus [options] OUT
+//      --files N        number of files (default 100)
+//      --size DIST      fixed:S, uniform:MIN-MAX or log:MIN-MAX, where
+//                       sizes take a K, M or G suffix (default log:1-1M)
+//      --depth D        deepest directory level (default 3)
+//      --fanout F       subdirectories per directory (default 4)
+//      --edit PATTERN   none, append, insert, flip or mixed (default mixed)
+//      --edit-rate R    fraction of files edited, 0 to 1 (default 0.5)
+//      --flips N        bytes flipped in each flipped file (default 8)
+//      --seed S         (default 1)
+//
+// A JSON summary of the corpus is printed to stdout.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <math.h>
+#include <errno.h>
+#include <getopt.h>
+#include <sys/stat.h>
+
+#define CHUNK_SIZE (64 * 1024)
+#define MAX_PATH_LENGTH 4096
+#define MAX_APPEND 4096
+#define MAX_INSERT 512
+
+enum Size_Kind { SIZE_FIXED, SIZE_UNIFORM, SIZE_LOG };
+
+enum Edit { EDIT_NONE, EDIT_APPEND, EDIT_INSERT, EDIT_FLIP, EDIT_MIXED };
+
+struct Corpus_Options {
+    size_t num_files;
+    enum Size_Kind size_kind;
+    uint64_t min_size;
+    uint64_t max_size;
+    int depth;
+    int fanout;
+    enum Edit edit;
+    double edit_rate;
+    size_t num_flips;
+    uint64_t seed;
+};
+
+// How one file of the receiver's tree differs from the sender's
+struct File_Edit {
+    enum Edit kind;
+    uint64_t offset;
+    uint64_t length;
+    uint64_t *flips;
+    size_t num_flips;
+};
+
+struct Corpus_Stats {
+    size_t num_dirs;
+    uint64_t src_bytes;
+    uint64_t dst_bytes;
+    size_t num_edited;
+};
+
+// Function to mix a counter into a well spread 64 bit value (splitmix64)
+uint64_t mix(uint64_t x) {
+    x += 0x9e3779b97f4a7c15ull;
+    x = (x ^ (x >> 30)) * 0xbf58476d1ce4e5b9ull;
+    x = (x ^ (x >> 27)) * 0x94d049bb133111ebull;
+    return x ^ (x >> 31);
+}
+
+// Function to get the next random number from a generator state
+uint64_t next_random(uint64_t *state) {
+    *state += 1;
+    return mix(*state);
+}
+
+// Function to get a random number in [0, bound)
+uint64_t random_below(uint64_t *state, uint64_t bound) {
+    return bound == 0 ? 0 : next_random(state) % bound;
+}
+
+// Function to fill `buffer` with the bytes of a file's contents from
+// `offset`. Any range of any file can be made on its own, so files are
+// streamed rather than held in memory.
+void fill_contents(uint64_t file_seed, uint64_t offset, unsigned char buffer[], size_t size) {
+    for (size_t i = 0; i < size; i++) {
+        uint64_t pos = offset + i;
+        buffer[i] = mix(file_seed ^ (pos / 8)) >> (8 * (pos % 8));
+    }
+}
+
+// Function to parse a size like 4096, 64K or 2M
+uint64_t parse_size(char *text) {
+    char *end;
+    double value = strtod(text, &end);
+    switch (*end) {
+        case 'k': case 'K': value *= 1024; end++; break;
+        case 'm': case 'M': value *= 1024 * 1024; end++; break;
+        case 'g': case 'G': value *= 1024.0 * 1024 * 1024; end++; break;
+    }
+    if (end == text || *end != '\0' || value < 0) {
+        fprintf(stderr, "Error: bad size '%s'\n", text);
+        exit(1);
+    }
+
+    return value;
+}
+
+// Function to parse a size distribution, e.g. log:1-1M
+void parse_distribution(char *text, struct Corpus_Options *options) {
+    char *colon = strchr(text, ':');
+    if (colon == NULL) {
+        fprintf(stderr, "Error: bad size distribution '%s'\n", text);
+        exit(1);
+    }
+    *colon = '\0';
+    char *range = colon + 1;
+
+    if (strcmp(text, "fixed") == 0) {
+        options->size_kind = SIZE_FIXED;
+        options->min_size = options->max_size = parse_size(range);
+        return;
+    }
+
+    if (strcmp(text, "uniform") == 0) {
+        options->size_kind = SIZE_UNIFORM;
+    } else if (strcmp(text, "log") == 0) {
+        options->size_kind = SIZE_LOG;
+    } else {
+        fprintf(stderr, "Error: unknown size distribution '%s'\n", text);
+        exit(1);
+    }
+
+    char *dash = strchr(range, '-');
+    if (dash == NULL) {
+        fprintf(stderr, "Error: expected MIN-MAX, got '%s'\n", range);
+        exit(1);
+    }
+    *dash = '\0';
+    options->min_size = parse_size(range);
+    options->max_size = parse_size(dash + 1);
+    if (options->min_size > options->max_size) {
+        fprintf(stderr, "Error: MIN is larger than MAX\n");
+        exit(1);
+    }
+}
+
+// Function to pick the size of a file
+uint64_t pick_size(struct Corpus_Options *options, uint64_t *state) {
+    uint64_t span = options->max_size - options->min_size;
+
+    switch (options->size_kind) {
+        case SIZE_FIXED: return options->min_size;
+        case SIZE_UNIFORM: return options->min_size + random_below(state, span + 1);
+        case SIZE_LOG: {
+            // Evenly spread over the orders of magnitude, like real trees
+            double low = log((double) options->min_size + 1);
+            double high = log((double) options->max_size + 1);
+            double unit = (next_random(state) >> 11) / (double) (1ull << 53);
+            uint64_t size = exp(low + (high - low) * unit) - 1;
+            return size > options->max_size ? options->max_size : size;
+        }
+    }
+
+    return 0;
+}
+
+// Function to make a directory and any missing parents. Returns how
+// many were made.
+size_t make_directories(char *pathname) {
+    char partial[MAX_PATH_LENGTH * 2];
+    size_t num_made = 0;
+    size_t length = strlen(pathname);
+
+    for (size_t i = 1; i <= length; i++) {
+        if (pathname[i] != '/' && pathname[i] != '\0') continue;
+
+        memcpy(partial, pathname, i);
+        partial[i] = '\0';
+        if (mkdir(partial, 0755) == 0) {
+            num_made++;
+        } else if (errno != EEXIST) {
+            perror(partial);
+            exit(1);
+        }
+    }
+
+    return num_made;
+}
+
+// Function to write a file, applying `edit` to its contents on the way
+uint64_t write_file(
+    char *pathname, uint64_t file_seed, uint64_t size, struct File_Edit *edit
+) {
+    FILE *f = fopen(pathname, "wb");
+    if (f == NULL) {
+        perror(pathname);
+        exit(1);
+    }
+
+    static unsigned char buffer[CHUNK_SIZE];
+    uint64_t written = 0;
+    size_t flip_n = 0;
+
+    for (uint64_t offset = 0; offset < size; offset += CHUNK_SIZE) {
+        size_t count = (size - offset < CHUNK_SIZE) ? size - offset : CHUNK_SIZE;
+        fill_contents(file_seed, offset, buffer, count);
+
+        // Flips are sorted, so each chunk takes the next few
+        while (
+            flip_n < edit->num_flips && edit->flips[flip_n] < offset + count
+        ) {
+            buffer[edit->flips[flip_n] - offset] ^= 0xff;
+            flip_n++;
+        }
+
+        size_t split = count;
+        bool inserting = edit->kind == EDIT_INSERT &&
+            edit->offset >= offset && edit->offset < offset + count;
+        if (inserting) split = edit->offset - offset;
+
+        fwrite(buffer, 1, split, f);
+        if (inserting) {
+            unsigned char inserted[MAX_INSERT];
+            fill_contents(~file_seed, 0, inserted, edit->length);
+            fwrite(inserted, 1, edit->length, f);
+            written += edit->length;
+        }
+        fwrite(buffer + split, 1, count - split, f);
+        written += count;
+    }
+
+    if (edit->kind == EDIT_APPEND) {
+        unsigned char appended[MAX_APPEND];
+        fill_contents(~file_seed, 0, appended, edit->length);
+        fwrite(appended, 1, edit->length, f);
+        written += edit->length;
+    }
+
+    if (fclose(f) != 0) {
+        perror(pathname);
+        exit(1);
+    }
+
+    return written;
+}
+
+// Function to compare offsets for qsort
+int compare_offsets(const void *a, const void *b) {
+    uint64_t x = *(const uint64_t *) a;
+    uint64_t y = *(const uint64_t *) b;
+    return (x > y) - (x < y);
+}
+
+// Function to decide how a file is edited in the receiver's tree
+void pick_edit(
+    struct Corpus_Options *options, uint64_t size, uint64_t *state,
+    struct File_Edit *edit
+) {
+    edit->kind = EDIT_NONE;
+    edit->num_flips = 0;
+
+    double unit = (next_random(state) >> 11) / (double) (1ull << 53);
+    if (options->edit == EDIT_NONE || unit >= options->edit_rate) return;
+
+    edit->kind = options->edit;
+    if (edit->kind == EDIT_MIXED) edit->kind = EDIT_APPEND + random_below(state, 3);
+
+    // Nothing to insert into or flip in an empty file
+    if (size == 0) edit->kind = EDIT_APPEND;
+
+    switch (edit->kind) {
+        case EDIT_APPEND: {
+            edit->length = 1 + random_below(state, MAX_APPEND);
+            break;
+        }
+        case EDIT_INSERT: {
+            edit->offset = random_below(state, size);
+            edit->length = 1 + random_below(state, MAX_INSERT);
+            break;
+        }
+        case EDIT_FLIP: {
+            edit->num_flips = options->num_flips;
+            for (size_t i = 0; i < edit->num_flips; i++) {
+                edit->flips[i] = random_below(state, size);
+            }
+            qsort(edit->flips, edit->num_flips, sizeof(uint64_t), compare_offsets);
+            break;
+        }
+        default: break;
+    }
+}
+
+// Function to build a path for file `file_n`, some random number of
+// directories down
+void pick_path(
+    struct Corpus_Options *options, size_t file_n, uint64_t *state,
+    char relative[MAX_PATH_LENGTH]
+) {
+    int depth = random_below(state, options->depth + 1);
+    size_t length = 0;
+
+    for (int level = 0; level < depth; level++) {
+        length += snprintf(
+            relative + length, MAX_PATH_LENGTH - length, "d%d_%d/",
+            level, (int) random_below(state, options->fanout)
+        );
+    }
+    snprintf(relative + length, MAX_PATH_LENGTH - length, "f%06zu", file_n);
+}
+
+enum Edit parse_edit(char *text) {
+    char *names[] = {"none", "append", "insert", "flip", "mixed"};
+    for (int edit = EDIT_NONE; edit <= EDIT_MIXED; edit++) {
+        if (strcmp(text, names[edit]) == 0) return edit;
+    }
+
+    fprintf(stderr, "Error: unknown edit pattern '%s'\n", text);
+    exit(1);
+}
+
+int main(int argc, char *argv[]) {
+    struct Corpus_Options options = {
+        .num_files = 100,
+        .size_kind = SIZE_LOG,
+        .min_size = 1,
+        .max_size = 1024 * 1024,
+        .depth = 3,
+        .fanout = 4,
+        .edit = EDIT_MIXED,
+        .edit_rate = 0.5,
+        .num_flips = 8,
+        .seed = 1,
+    };
+    char *edit_name = "mixed";
+
+    for (;;) {
+        int opt = getopt_long(argc, argv, "", (struct option[]) {
+            {"files", required_argument, NULL, 'n'},
+            {"size", required_argument, NULL, 's'},
+            {"depth", required_argument, NULL, 'd'},
+            {"fanout", required_argument, NULL, 'f'},
+            {"edit", required_argument, NULL, 'e'},
+            {"edit-rate", required_argument, NULL, 'r'},
+            {"flips", required_argument, NULL, 'x'},
+            {"seed", required_argument, NULL, 'S'},
+            {0, 0, 0, 0},
+        }, NULL);
+        if (opt == -1) break;
+
+        switch (opt) {
+            case 'n': options.num_files = strtoull(optarg, NULL, 10); break;
+            case 's': parse_distribution(optarg, &options); break;
+            case 'd': options.depth = atoi(optarg); break;
+            case 'f': options.fanout = atoi(optarg); break;
+            case 'e': options.edit = parse_edit(optarg); edit_name = optarg; break;
+            case 'r': options.edit_rate = atof(optarg); break;
+            case 'x': options.num_flips = strtoull(optarg, NULL, 10); break;
+            case 'S': options.seed = strtoull(optarg, NULL, 10); break;
+            default: {
+                fprintf(stderr, "Usage: %s [--files N] [--size DIST] [--depth D] [--fanout F] [--edit PATTERN] [--edit-rate R] [--flips N] [--seed S] OUT\n", argv[0]);
+                return 1;
+            }
+        }
+    }
+    if (optind != argc - 1 || options.depth < 0 || options.fanout < 1) {
+        fprintf(stderr, "Usage: %s [options] OUT\n", argv[0]);
+        return 1;
+    }
+    char *out = argv[optind];
+
+    struct Corpus_Stats stats = {0};
+    struct File_Edit no_edit = { .kind = EDIT_NONE };
+    struct File_Edit edit = { .flips = malloc(sizeof(uint64_t) * (options.num_flips + 1)) };
+    uint64_t state = mix(options.seed);
+
+    for (size_t file_n = 0; file_n < options.num_files; file_n++) {
+        char relative[MAX_PATH_LENGTH];
+        pick_path(&options, file_n, &state, relative);
+        uint64_t size = pick_size(&options, &state);
+        uint64_t file_seed = next_random(&state);
+        pick_edit(&options, size, &state, &edit);
+
+        for (int side = 0; side < 2; side++) {
+            char pathname[MAX_PATH_LENGTH * 2];
+            snprintf(pathname, sizeof(pathname), "%s/%s/%s", out, side == 0 ? "src" : "dst", relative);
+
+            char *slash = strrchr(pathname, '/');
+            *slash = '\0';
+            size_t num_made = make_directories(pathname);
+            if (side == 0) stats.num_dirs += num_made;
+            *slash = '/';
+
+            if (side == 0) {
+                stats.src_bytes += write_file(pathname, file_seed, size, &no_edit);
+            } else {
+                stats.dst_bytes += write_file(pathname, file_seed, size, &edit);
+            }
+        }
+        if (edit.kind != EDIT_NONE) stats.num_edited++;
+    }
+
+    printf(
+        "{\"files\": %zu, \"dirs\": %zu, \"src_bytes\": %lu, \"dst_bytes\": %lu, "
+        "\"edited\": %zu, \"edit\": \"%s\", \"seed\": %lu}\n",
+        options.num_files, stats.num_dirs, stats.src_bytes, stats.dst_bytes,
+        stats.num_edited, edit_name, options.seed
+    );
+
+    free(edit.flips);
+    return 0;
+}
@@ -0,0 +1,449 @@
+// Implementation for 'block_hash.h', written by Connor Li (z5425430)
+// Faster ways to compute the strong hash of every block of a file.
+//
+// FNV-1a is a chain of one multiply per byte, each waiting on the last,
+// so a single block can't go any faster than that chain. Different blocks
+// don't depend on each other though, so these kernels hash several blocks
+// side by side, one per lane, and the chains overlap:
+//
+//      - LANES interleaves 4 plain 64 bit chains, which any CPU with a
+//        pipelined multiplier (including ARM, where NEON has no 64 bit
+//        multiply) runs about as fast as one.
+//      - AVX2 and AVX-512 have no 64 bit multiply either, but the FNV
+//        prime is 2^40 + 0x1b3, so h * prime is
+//            (h << 40) + lo(h) * 0x1b3 + ((hi(h) * 0x1b3) << 32)
+//        which is two 32x32->64 multiplies. Each vector holds one block
+//        per lane and two vectors are kept in flight.
+//
+// The kernel is picked once, at runtime, from what the CPU supports.
+//
+// XXH64 is here for wide indexes that ask for it. It reads 8 bytes at a
+// time in 4 independent lanes, so one block is already fast.
+
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include "block_hash.h"
+#include "rbuoy.h"
+#include "stats.h"
+
+#if defined(__x86_64__) && defined(__GNUC__)
+#include <immintrin.h>
+#define HAVE_X86_KERNELS 1
+#else
+#define HAVE_X86_KERNELS 0
+#endif
+
+#define FNV_OFFSET 0xcbf29ce484222325ull
+#define FNV_PRIME 0x100000001b3ull
+#define FNV_PRIME_LOW 0x1b3
+#define FNV_PRIME_SHIFT 40
+#define NUM_LANES 4
+
+#define XXH_PRIME_1 0x9e3779b185ebca87ull
+#define XXH_PRIME_2 0xc2b2ae3d27d4eb4full
+#define XXH_PRIME_3 0x165667b19e3779f9ull
+#define XXH_PRIME_4 0x85ebca77c2b2ae63ull
+#define XXH_PRIME_5 0x27d4eb2f165667c5ull
+#define XXH_STRIPE_SIZE 32
+
+static enum FNV_Kernel best_kernel = FNV_KERNEL_SCALAR;
+static pthread_once_t best_kernel_once = PTHREAD_ONCE_INIT;
+
+//////////////////////////////////////////////////////////////////////
+//                        FUNCTION PROTOTYPES
+//////////////////////////////////////////////////////////////////////
+
+void fnv_pick_kernel(void);
+
+void fnv_hash_scalar(
+    const unsigned char data[], size_t num_blocks, uint64_t hashes[]
+);
+
+void fnv_hash_lanes(
+    const unsigned char data[], size_t num_blocks, uint64_t hashes[]
+);
+
+size_t fnv_hash_avx2(
+    const unsigned char data[], size_t num_blocks, uint64_t hashes[]
+);
+
+size_t fnv_hash_avx512(
+    const unsigned char data[], size_t num_blocks, uint64_t hashes[]
+);
+
+uint64_t xxh64(const unsigned char data[], size_t size);
+
+uint64_t xxh64_round(uint64_t acc, uint64_t input);
+
+uint64_t xxh64_merge_round(uint64_t acc, uint64_t value);
+
+uint64_t rotate_left(uint64_t value, int bits);
+
+uint64_t load_64_le(const unsigned char bytes[]);
+
+uint32_t load_32_le(const unsigned char bytes[]);
+
+//////////////////////////////////////////////////////////////////////
+//                        INTERFACE FUNCTIONS
+//////////////////////////////////////////////////////////////////////
+
+uint64_t Block_Hash_One(
+    const unsigned char block[], size_t block_size, enum Block_Hash algorithm
+) {
+    Stats_Add(STATS_BYTES_HASHED, block_size);
+    Stats_Add(STATS_BLOCKS_HASHED, 1);
+
+    if (algorithm == BLOCK_HASH_XXH64) return xxh64(block, block_size);
+
+    return hash_block((char *) block, block_size);
+}
+
+void Block_Hash_Many(
+    const unsigned char data[], size_t data_size, uint64_t hashes[],
+    enum Block_Hash algorithm
+) {
+    size_t block_size = rbuoy_options.block_size;
+    size_t num_full_blocks = data_size / block_size;
+    size_t trailing_size = data_size % block_size;
+
+    // The trailing block is counted by Block_Hash_One
+    Stats_Add(STATS_BYTES_HASHED, data_size - trailing_size);
+    Stats_Add(STATS_BLOCKS_HASHED, num_full_blocks);
+
+    if (algorithm == BLOCK_HASH_XXH64) {
+        for (size_t block_n = 0; block_n < num_full_blocks; block_n++) {
+            hashes[block_n] = xxh64(data + block_n * block_size, block_size);
+        }
+    } else {
+        FNV_Hash_Blocks(data, num_full_blocks, hashes, FNV_KERNEL_AUTO);
+    }
+
+    if (trailing_size > 0) {
+        hashes[num_full_blocks] = Block_Hash_One(
+            data + num_full_blocks * block_size, trailing_size, algorithm
+        );
+    }
+}
+
+void FNV_Hash_Blocks(
+    const unsigned char data[], size_t num_blocks, uint64_t hashes[],
+    enum FNV_Kernel kernel
+) {
+    if (kernel == FNV_KERNEL_AUTO) {
+        pthread_once(&best_kernel_once, fnv_pick_kernel);
+        kernel = best_kernel;
+    }
+
+    // The vector kernels only take whole vectors' worth of blocks
+    size_t done = 0;
+    if (kernel == FNV_KERNEL_AVX512) {
+        done = fnv_hash_avx512(data, num_blocks, hashes);
+    } else if (kernel == FNV_KERNEL_AVX2) {
+        done = fnv_hash_avx2(data, num_blocks, hashes);
+    } else if (kernel == FNV_KERNEL_SCALAR) {
+        fnv_hash_scalar(data, num_blocks, hashes);
+        return;
+    }
+
+    fnv_hash_lanes(
+        data + done * rbuoy_options.block_size, num_blocks - done,
+        hashes + done
+    );
+}
+
+bool FNV_Kernel_Supported(enum FNV_Kernel kernel) {
+    switch (kernel) {
+#if HAVE_X86_KERNELS
+        case FNV_KERNEL_AVX2: return __builtin_cpu_supports("avx2");
+        case FNV_KERNEL_AVX512: return __builtin_cpu_supports("avx512f");
+#else
+        case FNV_KERNEL_AVX2: return false;
+        case FNV_KERNEL_AVX512: return false;
+#endif
+        default: return true;
+    }
+}
+
+//////////////////////////////////////////////////////////////////////
+//                           LOCAL HELPERS
+//////////////////////////////////////////////////////////////////////
+
+// Function to pick the fastest kernel this CPU supports
+void fnv_pick_kernel(void) {
+    if (FNV_Kernel_Supported(FNV_KERNEL_AVX512)) {
+        best_kernel = FNV_KERNEL_AVX512;
+    } else if (FNV_Kernel_Supported(FNV_KERNEL_AVX2)) {
+        best_kernel = FNV_KERNEL_AVX2;
+    } else {
+        best_kernel = FNV_KERNEL_LANES;
+    }
+}
+
+// Function to hash blocks one after another, as hash_block always has
+void fnv_hash_scalar(
+    const unsigned char data[], size_t num_blocks, uint64_t hashes[]
+) {
+    size_t block_size = rbuoy_options.block_size;
+
+    for (size_t block_n = 0; block_n < num_blocks; block_n++) {
+        hashes[block_n] = hash_block(
+            (char *) data + block_n * block_size, block_size
+        );
+    }
+}
+
+// Function to hash blocks NUM_LANES at a time with interleaved chains,
+// then any left over one at a time
+void fnv_hash_lanes(
+    const unsigned char data[], size_t num_blocks, uint64_t hashes[]
+) {
+    size_t block_size = rbuoy_options.block_size;
+    size_t block_n = 0;
+
+    for (; block_n + NUM_LANES <= num_blocks; block_n += NUM_LANES) {
+        const unsigned char *b0 = data + block_n * block_size;
+        const unsigned char *b1 = b0 + block_size;
+        const unsigned char *b2 = b1 + block_size;
+        const unsigned char *b3 = b2 + block_size;
+        uint64_t h0 = FNV_OFFSET, h1 = FNV_OFFSET;
+        uint64_t h2 = FNV_OFFSET, h3 = FNV_OFFSET;
+
+        for (size_t i = 0; i < block_size; i++) {
+            h0 = (h0 ^ b0[i]) * FNV_PRIME;
+            h1 = (h1 ^ b1[i]) * FNV_PRIME;
+            h2 = (h2 ^ b2[i]) * FNV_PRIME;
+            h3 = (h3 ^ b3[i]) * FNV_PRIME;
+        }
+
+        hashes[block_n] = h0;
+        hashes[block_n + 1] = h1;
+        hashes[block_n + 2] = h2;
+        hashes[block_n + 3] = h3;
+    }
+
+    fnv_hash_scalar(
+        data + block_n * block_size, num_blocks - block_n, hashes + block_n
+    );
+}
+
+#if HAVE_X86_KERNELS
+
+// One FNV-1a step on every lane: h = (h ^ byte) * prime
+#define FNV_STEP_256(h, bytes, prime_low) do {                              \
+    h = _mm256_xor_si256(h, _mm256_and_si256(bytes, _mm256_set1_epi64x(0xff))); \
+    h = _mm256_add_epi64(                                                   \
+        _mm256_slli_epi64(h, FNV_PRIME_SHIFT),                              \
+        _mm256_add_epi64(                                                   \
+            _mm256_mul_epu32(h, prime_low),                                 \
+            _mm256_slli_epi64(                                              \
+                _mm256_mul_epu32(_mm256_srli_epi64(h, 32), prime_low), 32   \
+            )                                                               \
+        )                                                                   \
+    );                                                                      \
+} while (0)
+
+#define FNV_STEP_512(h, bytes, prime_low) do {                              \
+    h = _mm512_xor_si512(h, _mm512_and_si512(bytes, _mm512_set1_epi64(0xff))); \
+    h = _mm512_add_epi64(                                                   \
+        _mm512_slli_epi64(h, FNV_PRIME_SHIFT),                              \
+        _mm512_add_epi64(                                                   \
+            _mm512_mul_epu32(h, prime_low),                                 \
+            _mm512_slli_epi64(                                              \
+                _mm512_mul_epu32(_mm512_srli_epi64(h, 32), prime_low), 32   \
+            )                                                               \
+        )                                                                   \
+    );                                                                      \
+} while (0)
+
+// Function to hash blocks 8 at a time, in two vectors of 4 lanes. Every
+// 8 bytes, each lane's next word is gathered from its own block and its
+// bytes are fed in lowest first. Returns how many blocks were hashed.
+__attribute__((target("avx2")))
+size_t fnv_hash_avx2(
+    const unsigned char data[], size_t num_blocks, uint64_t hashes[]
+) {
+    const long long block_size = rbuoy_options.block_size;
+    const __m256i prime_low = _mm256_set1_epi64x(FNV_PRIME_LOW);
+    const __m256i offsets = _mm256_setr_epi64x(
+        0, block_size, 2 * block_size, 3 * block_size
+    );
+
+    size_t block_n = 0;
+    for (; block_n + 8 <= num_blocks; block_n += 8) {
+        const unsigned char *blocks = data + block_n * block_size;
+        __m256i h0 = _mm256_set1_epi64x(FNV_OFFSET);
+        __m256i h1 = h0;
+
+        for (long long i = 0; i < block_size; i += sizeof(uint64_t)) {
+            __m256i w0 = _mm256_i64gather_epi64(
+                (const long long *) (blocks + i), offsets, 1
+            );
+            __m256i w1 = _mm256_i64gather_epi64(
+                (const long long *) (blocks + 4 * block_size + i), offsets, 1
+            );
+
+            for (int byte_n = 0; byte_n < 8; byte_n++) {
+                FNV_STEP_256(h0, w0, prime_low);
+                FNV_STEP_256(h1, w1, prime_low);
+                w0 = _mm256_srli_epi64(w0, 8);
+                w1 = _mm256_srli_epi64(w1, 8);
+            }
+        }
+
+        _mm256_storeu_si256((__m256i *) (hashes + block_n), h0);
+        _mm256_storeu_si256((__m256i *) (hashes + block_n + 4), h1);
+    }
+
+    return block_n;
+}
+
+// Function to hash blocks 16 at a time, in two vectors of 8 lanes.
+// Returns how many blocks were hashed.
+__attribute__((target("avx512f")))
+size_t fnv_hash_avx512(
+    const unsigned char data[], size_t num_blocks, uint64_t hashes[]
+) {
+    const long long block_size = rbuoy_options.block_size;
+    const __m512i prime_low = _mm512_set1_epi64(FNV_PRIME_LOW);
+    const __m512i offsets = _mm512_setr_epi64(
+        0, block_size, 2 * block_size, 3 * block_size,
+        4 * block_size, 5 * block_size, 6 * block_size, 7 * block_size
+    );
+
+    size_t block_n = 0;
+    for (; block_n + 16 <= num_blocks; block_n += 16) {
+        const unsigned char *blocks = data + block_n * block_size;
+        __m512i h0 = _mm512_set1_epi64(FNV_OFFSET);
+        __m512i h1 = h0;
+
+        for (long long i = 0; i < block_size; i += sizeof(uint64_t)) {
+            __m512i w0 = _mm512_i64gather_epi64(
+                offsets, (const void *) (blocks + i), 1
+            );
+            __m512i w1 = _mm512_i64gather_epi64(
+                offsets, (const void *) (blocks + 8 * block_size + i), 1
+            );
+
+            for (int byte_n = 0; byte_n < 8; byte_n++) {
+                FNV_STEP_512(h0, w0, prime_low);
+                FNV_STEP_512(h1, w1, prime_low);
+                w0 = _mm512_srli_epi64(w0, 8);
+                w1 = _mm512_srli_epi64(w1, 8);
+            }
+        }
+
+        _mm512_storeu_si512((void *) (hashes + block_n), h0);
+        _mm512_storeu_si512((void *) (hashes + block_n + 8), h1);
+    }
+
+    return block_n;
+}
+
+#else
+
+size_t fnv_hash_avx2(
+    const unsigned char data[], size_t num_blocks, uint64_t hashes[]
+) {
+    return 0;
+}
+
+size_t fnv_hash_avx512(
+    const unsigned char data[], size_t num_blocks, uint64_t hashes[]
+) {
+    return 0;
+}
+
+#endif
+
+// Function to compute XXH64 (seed 0) of some bytes
+uint64_t xxh64(const unsigned char data[], size_t size) {
+    const unsigned char *p = data;
+    const unsigned char *end = data + size;
+    uint64_t hash;
+
+    if (size >= XXH_STRIPE_SIZE) {
+        uint64_t v1 = XXH_PRIME_1 + XXH_PRIME_2;
+        uint64_t v2 = XXH_PRIME_2;
+        uint64_t v3 = 0;
+        uint64_t v4 = -XXH_PRIME_1;
+
+        for (; p + XXH_STRIPE_SIZE <= end; p += XXH_STRIPE_SIZE) {
+            v1 = xxh64_round(v1, load_64_le(p));
+            v2 = xxh64_round(v2, load_64_le(p + 8));
+            v3 = xxh64_round(v3, load_64_le(p + 16));
+            v4 = xxh64_round(v4, load_64_le(p + 24));
+        }
+
+        hash = rotate_left(v1, 1) + rotate_left(v2, 7) +
+            rotate_left(v3, 12) + rotate_left(v4, 18);
+        hash = xxh64_merge_round(hash, v1);
+        hash = xxh64_merge_round(hash, v2);
+        hash = xxh64_merge_round(hash, v3);
+        hash = xxh64_merge_round(hash, v4);
+    } else {
+        hash = XXH_PRIME_5;
+    }
+
+    hash += size;
+
+    for (; p + 8 <= end; p += 8) {
+        hash ^= xxh64_round(0, load_64_le(p));
+        hash = rotate_left(hash, 27) * XXH_PRIME_1 + XXH_PRIME_4;
+    }
+    if (p + 4 <= end) {
+        hash ^= (uint64_t) load_32_le(p) * XXH_PRIME_1;
+        hash = rotate_left(hash, 23) * XXH_PRIME_2 + XXH_PRIME_3;
+        p += 4;
+    }
+    for (; p < end; p++) {
+        hash ^= *p * XXH_PRIME_5;
+        hash = rotate_left(hash, 11) * XXH_PRIME_1;
+    }
+
+    hash ^= hash >> 33;
+    hash *= XXH_PRIME_2;
+    hash ^= hash >> 29;
+    hash *= XXH_PRIME_3;
+    hash ^= hash >> 32;
+
+    return hash;
+}
+
+// Function to mix 8 bytes of input into one of the XXH64 lanes
+uint64_t xxh64_round(uint64_t acc, uint64_t input) {
+    acc += input * XXH_PRIME_2;
+    acc = rotate_left(acc, 31);
+    return acc * XXH_PRIME_1;
+}
+
+// Function to fold one of the XXH64 lanes into the hash
+uint64_t xxh64_merge_round(uint64_t acc, uint64_t value) {
+    acc ^= xxh64_round(0, value);
+    return acc * XXH_PRIME_1 + XXH_PRIME_4;
+}
+
+// Function to rotate the bits of a word left
+uint64_t rotate_left(uint64_t value, int bits) {
+    return (value << bits) | (value >> (64 - bits));
+}
+
+// Function to read 8 little-endian bytes
+uint64_t load_64_le(const unsigned char bytes[]) {
+    uint64_t value;
+    memcpy(&value, bytes, sizeof(value));
+#if __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+    value = __builtin_bswap64(value);
+#endif
+    return value;
+}
+
+// Function to read 4 little-endian bytes
+uint32_t load_32_le(const unsigned char bytes[]) {
+    uint32_t value;
+    memcpy(&value, bytes, sizeof(value));
+#if __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+    value = __builtin_bswap32(value);
+#endif
+    return value;
+}
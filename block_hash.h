@@ -0,0 +1,61 @@
+// Header file for block_hash.c written by Connor Li (z5425430)
+// For implementation details go to block_hash.c.
+
+#ifndef BLOCK_HASH_H_
+#define BLOCK_HASH_H_
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+/// @brief The strong hash of each block in an index.
+enum Block_Hash {
+    BLOCK_HASH_FNV1A = 0,   // hash_block, used by every v1 index
+    BLOCK_HASH_XXH64,       // XXH64 (seed 0), wide indexes only
+};
+
+/// @brief The ways a run of blocks can be hashed with FNV-1a. Every one
+///        of them gives exactly the same hashes as hash_block.
+enum FNV_Kernel {
+    FNV_KERNEL_AUTO = 0,    // the fastest this CPU supports
+    FNV_KERNEL_SCALAR,      // hash_block on one block at a time
+    FNV_KERNEL_LANES,       // 4 blocks at a time, interleaved
+    FNV_KERNEL_AVX2,        // 8 blocks at a time in 4 lane vectors
+    FNV_KERNEL_AVX512,      // 16 blocks at a time in 8 lane vectors
+};
+
+/// @brief Hash one block.
+/// @param block The bytes of the block.
+/// @param block_size The size of the block (or chunk), at most
+///                   CHUNK_SIZE_MAX.
+/// @param algorithm Which hash to use.
+uint64_t Block_Hash_One(
+    const unsigned char block[], size_t block_size, enum Block_Hash algorithm
+);
+
+/// @brief Hash a run of blocks that are already in memory.
+/// @param data The bytes of the blocks, `data_size` long.
+/// @param data_size The number of bytes; every block but the last is full
+///                  (rbuoy_options.block_size).
+/// @param hashes Filled in with the hash of each block.
+/// @param algorithm Which hash to use.
+void Block_Hash_Many(
+    const unsigned char data[], size_t data_size, uint64_t hashes[],
+    enum Block_Hash algorithm
+);
+
+/// @brief Hash full blocks with FNV-1a using a particular kernel.
+/// @param data The bytes of the blocks, `num_blocks` times
+///             rbuoy_options.block_size long.
+/// @param num_blocks The number of blocks.
+/// @param hashes Filled in with the hash of each block.
+/// @param kernel The kernel to use. It must be supported.
+void FNV_Hash_Blocks(
+    const unsigned char data[], size_t num_blocks, uint64_t hashes[],
+    enum FNV_Kernel kernel
+);
+
+/// @brief Check whether this CPU (and compiler) can run a kernel.
+bool FNV_Kernel_Supported(enum FNV_Kernel kernel);
+
+#endif
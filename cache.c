@@ -0,0 +1,654 @@
+// Implementation for 'cache.h', written by Connor Li (z5425430)
+// An on-disk cache of block hashes, so files that haven't changed since
+// the last run cost a stat rather than a full read.
+//
+// The cache is an append-only log of entries, mapped in whole when it is
+// opened and indexed by a hash table that points straight into the
+// mapping. New entries are collected in memory and appended when the
+// cache is closed. When more than half of the log is entries that have
+// since been replaced (or the end of it is torn), it is compacted into a
+// new file that is renamed over the old one instead.
+//
+//      header: magic "RBHC" | version (4) | reserved (8)
+//      entry:  dev | ino | size | mtime_ns | num_blocks | flags |
+//              payload check | head check          (8 bytes each)
+//              hashes (8 bytes each, from the hash and block size in the flags) | weak hashes (4 bytes each),
+//              padded to a multiple of 8 bytes
+//
+// The cache is only ever used on the machine that wrote it, so numbers
+// are in the host's byte order and entries are 8 byte aligned, which
+// lets them be read in place. Files modified in the last couple of
+// seconds aren't cached, since a change in the same clock tick wouldn't
+// move their mtime.
+//
+// Several processes can have the cache open at once (e.g. the sessions
+// of a daemon, which share its file descriptor). The log is locked while
+// it is written, with a record lock since those belong to a process.
+// Once it has the lock, a process reloads the log as it is then: another
+// may have appended to it since it was loaded, or compacted it into a new
+// file, in which case the one at the pathname is opened and locked
+// instead. Whether to compact is decided from that current log, and new
+// entries go at its end, so nothing another process wrote is lost.
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stddef.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "cache.h"
+#include "rbuoy.h"
+
+#define CACHE_MAGIC "RBHC"
+#define CACHE_VERSION 1
+#define CACHE_HEADER_SIZE 16
+#define CACHE_FLAG_WEAK 0x01
+#define CACHE_FLAG_XXH64 0x02
+#define CACHE_FLAG_BLOCK_SHIFT 8
+#define CACHE_MIN_SLOTS 1024
+#define CACHE_COMPACT_MIN (64 * 1024)
+#define CACHE_RACY_NS (2 * 1000000000ull)
+#define CACHE_CHECK_SEED 0xcbf29ce484222325ull
+#define CACHE_CHECK_PRIME 0x100000001b3ull
+
+struct Cache_Entry_Head {
+    struct Cache_Key key;
+    uint64_t num_blocks;
+    uint64_t flags;
+    uint64_t payload_check;
+    uint64_t head_check;
+};
+
+struct Cache_Slot {
+    const struct Cache_Entry_Head *entry;
+    bool replaced;
+};
+
+struct Hash_Cache {
+    char *pathname;
+    int fd;
+    unsigned char *map;
+    size_t map_size;
+    size_t log_end;         // End of the last whole entry
+    bool torn;
+
+    struct Cache_Slot *slots;
+    size_t num_slots;
+    size_t num_entries;
+    size_t dead_bytes;
+
+    // Entries stored this run, waiting to be written
+    pthread_mutex_t lock;
+    unsigned char *pending;
+    size_t pending_size;
+    size_t pending_capacity;
+};
+
+static struct Hash_Cache *cache = NULL;
+
+//////////////////////////////////////////////////////////////////////
+//                        FUNCTION PROTOTYPES
+//////////////////////////////////////////////////////////////////////
+
+void cache_load(struct Hash_Cache *cache);
+
+void cache_reload(struct Hash_Cache *cache);
+
+void cache_free(struct Hash_Cache *cache);
+
+void cache_index(struct Hash_Cache *cache, const struct Cache_Entry_Head *entry);
+
+struct Cache_Slot *cache_find_slot(
+    struct Hash_Cache *cache, struct Cache_Key *key
+);
+
+void cache_grow_slots(struct Hash_Cache *cache);
+
+void cache_mark_replaced(struct Hash_Cache *cache, struct Cache_Key *key);
+
+bool cache_key_equal(struct Cache_Key *a, const struct Cache_Key *b);
+
+size_t cache_entry_size(uint64_t num_blocks, uint64_t flags);
+
+uint64_t cache_checksum(const void *data, size_t size);
+
+uint64_t cache_hash_flag(void);
+
+void cache_lock(struct Hash_Cache *cache, short type);
+
+void cache_lock_current(struct Hash_Cache *cache);
+
+void cache_append(struct Hash_Cache *cache);
+
+void cache_compact(struct Hash_Cache *cache);
+
+void cache_write_all(int fd, const void *data, size_t size, char *pathname);
+
+//////////////////////////////////////////////////////////////////////
+//                        INTERFACE FUNCTIONS
+//////////////////////////////////////////////////////////////////////
+
+void Cache_Open(char *pathname) {
+    cache = calloc(1, sizeof(struct Hash_Cache));
+    if (cache == NULL) {
+        perror("Error");
+        exit(1);
+    }
+
+    cache->pathname = pathname;
+    cache->fd = open(pathname, O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+    if (cache->fd < 0) {
+        perror("Error");
+        exit(1);
+    }
+    pthread_mutex_init(&cache->lock, NULL);
+
+    cache_load(cache);
+}
+
+bool Cache_Key_Get(int fd, struct Cache_Key *key) {
+    if (cache == NULL) return false;
+
+    struct stat stat;
+    if (fstat(fd, &stat) != 0 || !S_ISREG(stat.st_mode)) return false;
+
+    key->dev = stat.st_dev;
+    key->ino = stat.st_ino;
+    key->size = stat.st_size;
+    key->mtime_ns = (uint64_t) stat.st_mtim.tv_sec * 1000000000ull +
+        stat.st_mtim.tv_nsec;
+
+    return true;
+}
+
+bool Cache_Lookup(
+    struct Cache_Key *key, uint64_t hashes[], uint32_t weak_hashes[],
+    size_t num_blocks
+) {
+    if (cache == NULL) return false;
+
+    struct Cache_Slot *slot = cache_find_slot(cache, key);
+    if (slot->entry == NULL) return false;
+
+    const struct Cache_Entry_Head *entry = slot->entry;
+    if (!cache_key_equal(key, &entry->key)) return false;
+    if (entry->num_blocks != num_blocks) return false;
+    if (weak_hashes != NULL && (entry->flags & CACHE_FLAG_WEAK) == 0) {
+        return false;
+    }
+    if ((entry->flags & ~CACHE_FLAG_WEAK) != cache_hash_flag()) return false;
+
+    // Only the head was checked when the cache was loaded
+    const unsigned char *payload = (const unsigned char *) (entry + 1);
+    size_t payload_size = cache_entry_size(num_blocks, entry->flags) -
+        sizeof(struct Cache_Entry_Head);
+    if (cache_checksum(payload, payload_size) != entry->payload_check) {
+        return false;
+    }
+
+    memcpy(hashes, payload, sizeof(uint64_t) * num_blocks);
+    if (weak_hashes != NULL) {
+        memcpy(
+            weak_hashes, payload + sizeof(uint64_t) * num_blocks,
+            sizeof(uint32_t) * num_blocks
+        );
+    }
+
+    return true;
+}
+
+void Cache_Store(
+    int fd, struct Cache_Key *key, uint64_t hashes[], uint32_t weak_hashes[],
+    size_t num_blocks
+) {
+    if (cache == NULL) return;
+
+    // Don't keep anything that changed while it was hashed, or that could
+    // still change without its mtime moving
+    struct Cache_Key now_key;
+    if (!Cache_Key_Get(fd, &now_key) || !cache_key_equal(key, &now_key)) {
+        return;
+    }
+    struct timespec now;
+    clock_gettime(CLOCK_REALTIME, &now);
+    uint64_t now_ns = (uint64_t) now.tv_sec * 1000000000ull + now.tv_nsec;
+    if (key->mtime_ns + CACHE_RACY_NS > now_ns) return;
+
+    uint64_t flags = weak_hashes != NULL ? CACHE_FLAG_WEAK : 0;
+    flags |= cache_hash_flag();
+    size_t entry_size = cache_entry_size(num_blocks, flags);
+
+    pthread_mutex_lock(&cache->lock);
+
+    if (cache->pending_size + entry_size > cache->pending_capacity) {
+        size_t capacity = cache->pending_capacity * 2;
+        if (capacity < cache->pending_size + entry_size) {
+            capacity = cache->pending_size + entry_size;
+        }
+        cache->pending = realloc(cache->pending, capacity);
+        if (cache->pending == NULL) {
+            perror("Error");
+            exit(1);
+        }
+        cache->pending_capacity = capacity;
+    }
+
+    unsigned char *start = cache->pending + cache->pending_size;
+    memset(start, 0, entry_size);
+
+    struct Cache_Entry_Head head = {
+        .key = *key, .num_blocks = num_blocks, .flags = flags,
+    };
+    unsigned char *payload = start + sizeof(struct Cache_Entry_Head);
+    memcpy(payload, hashes, sizeof(uint64_t) * num_blocks);
+    if (weak_hashes != NULL) {
+        memcpy(
+            payload + sizeof(uint64_t) * num_blocks, weak_hashes,
+            sizeof(uint32_t) * num_blocks
+        );
+    }
+    head.payload_check = cache_checksum(
+        payload, entry_size - sizeof(struct Cache_Entry_Head)
+    );
+    head.head_check = cache_checksum(
+        &head, offsetof(struct Cache_Entry_Head, head_check)
+    );
+    memcpy(start, &head, sizeof(struct Cache_Entry_Head));
+    cache->pending_size += entry_size;
+
+    cache_mark_replaced(cache, key);
+
+    pthread_mutex_unlock(&cache->lock);
+}
+
+void Cache_Close(void) {
+    if (cache == NULL) return;
+
+    // With nothing to add, the log is left for the next process that has
+    // something to add to tidy up
+    if (cache->pending_size > 0) {
+        cache_lock_current(cache);
+        cache_reload(cache);
+
+        size_t log_bytes = cache->log_end - CACHE_HEADER_SIZE;
+        if (
+            cache->torn ||
+            (cache->dead_bytes > CACHE_COMPACT_MIN &&
+             cache->dead_bytes * 2 > log_bytes)
+        ) {
+            cache_compact(cache);
+        } else {
+            cache_append(cache);
+        }
+        cache_lock(cache, F_UNLCK);
+    }
+
+    cache_free(cache);
+    cache = NULL;
+}
+
+void Cache_Reload(void) {
+    if (cache == NULL) return;
+
+    char *pathname = cache->pathname;
+    cache_free(cache);
+    cache = NULL;
+    Cache_Open(pathname);
+}
+
+//////////////////////////////////////////////////////////////////////
+//                           LOCAL HELPERS
+//////////////////////////////////////////////////////////////////////
+
+// Function to map the cache and index every whole entry in it. A later
+// entry for the same file replaces an earlier one. Reading stops at the
+// first entry that isn't whole, which only happens if a run was killed
+// part way through writing it.
+void cache_load(struct Hash_Cache *cache) {
+    struct stat stat;
+    if (fstat(cache->fd, &stat) != 0) {
+        perror("Error");
+        exit(1);
+    }
+
+    cache->num_slots = CACHE_MIN_SLOTS;
+    cache->slots = calloc(cache->num_slots, sizeof(struct Cache_Slot));
+    if (cache->slots == NULL) {
+        perror("Error");
+        exit(1);
+    }
+
+    if (stat.st_size == 0) {
+        unsigned char header[CACHE_HEADER_SIZE] = CACHE_MAGIC;
+        uint32_t version = CACHE_VERSION;
+        memcpy(header + 4, &version, sizeof(version));
+        cache_write_all(cache->fd, header, CACHE_HEADER_SIZE, cache->pathname);
+        cache->log_end = CACHE_HEADER_SIZE;
+        return;
+    }
+
+    cache->map_size = stat.st_size;
+    cache->map = mmap(
+        NULL, cache->map_size, PROT_READ, MAP_SHARED, cache->fd, 0
+    );
+    if (cache->map == MAP_FAILED) {
+        perror("Error");
+        exit(1);
+    }
+
+    uint32_t version = 0;
+    if (cache->map_size >= CACHE_HEADER_SIZE) {
+        memcpy(&version, cache->map + 4, sizeof(version));
+    }
+    if (
+        memcmp(cache->map, CACHE_MAGIC, 4) != 0 || version != CACHE_VERSION
+    ) {
+        fprintf(stderr, "Error: '%s' is not a hash cache\n", cache->pathname);
+        exit(1);
+    }
+
+    size_t pos = CACHE_HEADER_SIZE;
+    while (pos + sizeof(struct Cache_Entry_Head) <= cache->map_size) {
+        const struct Cache_Entry_Head *entry =
+            (const struct Cache_Entry_Head *) (cache->map + pos);
+
+        uint64_t head_check = cache_checksum(
+            entry, offsetof(struct Cache_Entry_Head, head_check)
+        );
+        if (head_check != entry->head_check) break;
+
+        size_t entry_size = cache_entry_size(entry->num_blocks, entry->flags);
+        if (entry_size > cache->map_size - pos) break;
+
+        cache_index(cache, entry);
+        pos += entry_size;
+    }
+
+    cache->log_end = pos;
+    cache->torn = pos != cache->map_size;
+}
+
+// Function to bring the index up to date with the log as it is now, which
+// is locked, then count whatever this run stored as replacing the log's
+// entries for the same files again
+void cache_reload(struct Hash_Cache *cache) {
+    if (cache->map != NULL) munmap(cache->map, cache->map_size);
+    free(cache->slots);
+    cache->map = NULL;
+    cache->map_size = 0;
+    cache->slots = NULL;
+    cache->num_entries = 0;
+    cache->dead_bytes = 0;
+
+    cache_load(cache);
+
+    size_t pos = 0;
+    while (pos < cache->pending_size) {
+        struct Cache_Entry_Head head;
+        memcpy(&head, cache->pending + pos, sizeof(struct Cache_Entry_Head));
+        cache_mark_replaced(cache, &head.key);
+        pos += cache_entry_size(head.num_blocks, head.flags);
+    }
+}
+
+// Function to unmap and close the cache, and free everything it holds
+// without writing any of it
+void cache_free(struct Hash_Cache *cache) {
+    if (cache->map != NULL) munmap(cache->map, cache->map_size);
+    close(cache->fd);
+    pthread_mutex_destroy(&cache->lock);
+    free(cache->slots);
+    free(cache->pending);
+    free(cache);
+}
+
+// Function to add an entry to the index, replacing any older entry for
+// the same file (which must be out of date)
+void cache_index(struct Hash_Cache *cache, const struct Cache_Entry_Head *entry) {
+    if ((cache->num_entries + 1) * 2 > cache->num_slots) cache_grow_slots(cache);
+
+    struct Cache_Key key = entry->key;
+    struct Cache_Slot *slot = cache_find_slot(cache, &key);
+    if (slot->entry != NULL) {
+        cache->dead_bytes += cache_entry_size(
+            slot->entry->num_blocks, slot->entry->flags
+        );
+    } else {
+        cache->num_entries++;
+    }
+
+    slot->entry = entry;
+}
+
+// Function to find the slot of a file, or the empty slot it would go in.
+// There is one slot per file (device and inode), whatever its size and
+// mtime were when it was cached.
+struct Cache_Slot *cache_find_slot(
+    struct Hash_Cache *cache, struct Cache_Key *key
+) {
+    uint64_t hash = (key->ino ^ (key->dev << 32)) * 0x9e3779b97f4a7c15ull;
+    size_t mask = cache->num_slots - 1;
+
+    for (size_t slot_n = hash & mask;; slot_n = (slot_n + 1) & mask) {
+        struct Cache_Slot *slot = &cache->slots[slot_n];
+        if (
+            slot->entry == NULL ||
+            (slot->entry->key.dev == key->dev && slot->entry->key.ino == key->ino)
+        ) {
+            return slot;
+        }
+    }
+}
+
+// Function to double the number of slots in the index
+void cache_grow_slots(struct Hash_Cache *cache) {
+    struct Cache_Slot *old_slots = cache->slots;
+    size_t old_num_slots = cache->num_slots;
+
+    cache->num_slots *= 2;
+    cache->slots = calloc(cache->num_slots, sizeof(struct Cache_Slot));
+    if (cache->slots == NULL) {
+        perror("Error");
+        exit(1);
+    }
+
+    for (size_t slot_n = 0; slot_n < old_num_slots; slot_n++) {
+        if (old_slots[slot_n].entry == NULL) continue;
+
+        struct Cache_Key key = old_slots[slot_n].entry->key;
+        *cache_find_slot(cache, &key) = old_slots[slot_n];
+    }
+
+    free(old_slots);
+}
+
+// Function to count the entry the index has for a file as replaced by one
+// stored this run. Whatever was cached for it before is now dead weight,
+// even if it was cached under an older size or mtime.
+void cache_mark_replaced(struct Hash_Cache *cache, struct Cache_Key *key) {
+    struct Cache_Slot *slot = cache_find_slot(cache, key);
+    if (slot->entry != NULL && !slot->replaced) {
+        slot->replaced = true;
+        cache->dead_bytes += cache_entry_size(
+            slot->entry->num_blocks, slot->entry->flags
+        );
+    }
+}
+
+// Function to compare two keys
+bool cache_key_equal(struct Cache_Key *a, const struct Cache_Key *b) {
+    return a->dev == b->dev && a->ino == b->ino &&
+        a->size == b->size && a->mtime_ns == b->mtime_ns;
+}
+
+// Function to get the size of an entry, including its padding
+size_t cache_entry_size(uint64_t num_blocks, uint64_t flags) {
+    size_t size = sizeof(struct Cache_Entry_Head) + sizeof(uint64_t) * num_blocks;
+    if (flags & CACHE_FLAG_WEAK) size += sizeof(uint32_t) * num_blocks;
+
+    return (size + 7) & ~(size_t) 7;
+}
+
+// Function to checksum some whole 8 byte words, FNV style but a word at
+// a time so it keeps up with the memcpy it guards
+uint64_t cache_checksum(const void *data, size_t size) {
+    const unsigned char *bytes = data;
+    uint64_t check = CACHE_CHECK_SEED;
+
+    for (size_t pos = 0; pos + sizeof(uint64_t) <= size; pos += sizeof(uint64_t)) {
+        uint64_t word;
+        memcpy(&word, bytes + pos, sizeof(word));
+        check = (check ^ word) * CACHE_CHECK_PRIME;
+    }
+
+    return check;
+}
+
+// Function to get the flags for the strong hash and block size this run
+// uses, so hashes made with one are never handed out for another. The
+// block size is only there (as log2 of it) if it isn't the default, so
+// older entries still match.
+uint64_t cache_hash_flag(void) {
+    uint64_t flags = rbuoy_options.block_hash == BLOCK_HASH_XXH64 ?
+        CACHE_FLAG_XXH64 : 0;
+
+    if (rbuoy_options.block_size != BLOCK_SIZE) {
+        uint64_t shift = 0;
+        while (((size_t) 1 << shift) < rbuoy_options.block_size) shift++;
+        flags |= shift << CACHE_FLAG_BLOCK_SHIFT;
+    }
+
+    return flags;
+}
+
+// Function to lock (or unlock) the whole cache against other processes,
+// waiting for any other to finish with it
+void cache_lock(struct Hash_Cache *cache, short type) {
+    struct flock lock = {
+        .l_type = type,
+        .l_whence = SEEK_SET,
+        .l_start = 0,
+        .l_len = 0,
+    };
+    while (fcntl(cache->fd, F_SETLKW, &lock) != 0 && errno == EINTR) {}
+}
+
+// Function to lock the log at the cache's pathname for writing. If it was
+// compacted by another process since this one opened it, the file open
+// here has been renamed over, and the new one is opened and locked
+// instead.
+void cache_lock_current(struct Hash_Cache *cache) {
+    for (;;) {
+        cache_lock(cache, F_WRLCK);
+
+        struct stat fd_stat;
+        struct stat path_stat;
+        if (fstat(cache->fd, &fd_stat) != 0) {
+            perror("Error");
+            exit(1);
+        }
+        if (
+            stat(cache->pathname, &path_stat) == 0 &&
+            path_stat.st_dev == fd_stat.st_dev &&
+            path_stat.st_ino == fd_stat.st_ino
+        ) {
+            return;
+        }
+
+        // Closing the old file releases its lock
+        close(cache->fd);
+        cache->fd = open(cache->pathname, O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+        if (cache->fd < 0) {
+            perror("Error");
+            exit(1);
+        }
+    }
+}
+
+// Function to append this run's entries to the end of the log, which has
+// just been reloaded and ends in a whole entry
+void cache_append(struct Hash_Cache *cache) {
+    if (lseek(cache->fd, cache->log_end, SEEK_SET) < 0) {
+        perror("Error");
+        exit(1);
+    }
+
+    cache_write_all(
+        cache->fd, cache->pending, cache->pending_size, cache->pathname
+    );
+}
+
+// Function to write a new log with only the newest entry for each file,
+// then rename it over the old one
+void cache_compact(struct Hash_Cache *cache) {
+    size_t length = strlen(cache->pathname);
+    char *temp_path = malloc(length + sizeof(".XXXXXX"));
+    if (temp_path == NULL) {
+        perror("Error");
+        exit(1);
+    }
+    sprintf(temp_path, "%s.XXXXXX", cache->pathname);
+
+    int fd = mkstemp(temp_path);
+    struct stat stat;
+    if (fd < 0 || fstat(cache->fd, &stat) != 0 ||
+        fchmod(fd, stat.st_mode & 07777) != 0) {
+        perror("Error");
+        exit(1);
+    }
+
+    unsigned char header[CACHE_HEADER_SIZE] = CACHE_MAGIC;
+    uint32_t version = CACHE_VERSION;
+    memcpy(header + 4, &version, sizeof(version));
+    cache_write_all(fd, header, CACHE_HEADER_SIZE, temp_path);
+
+    // Go through the log in order so the new one keeps the same order
+    size_t pos = CACHE_HEADER_SIZE;
+    while (pos < cache->log_end) {
+        const struct Cache_Entry_Head *entry =
+            (const struct Cache_Entry_Head *) (cache->map + pos);
+        size_t entry_size = cache_entry_size(entry->num_blocks, entry->flags);
+
+        struct Cache_Key key = entry->key;
+        struct Cache_Slot *slot = cache_find_slot(cache, &key);
+        if (slot->entry == entry && !slot->replaced) {
+            cache_write_all(fd, entry, entry_size, temp_path);
+        }
+
+        pos += entry_size;
+    }
+
+    cache_write_all(fd, cache->pending, cache->pending_size, temp_path);
+
+    if (fsync(fd) != 0 || rename(temp_path, cache->pathname) != 0) {
+        perror("Error");
+        unlink(temp_path);
+        exit(1);
+    }
+
+    close(fd);
+    free(temp_path);
+}
+
+// Function to write all of a buffer, erroring out on fail
+void cache_write_all(int fd, const void *data, size_t size, char *pathname) {
+    const unsigned char *bytes = data;
+
+    while (size > 0) {
+        ssize_t written = write(fd, bytes, size);
+        if (written < 0 && errno == EINTR) continue;
+        if (written <= 0) {
+            fprintf(stderr, "Error: could not write '%s'\n", pathname);
+            exit(1);
+        }
+        bytes += written;
+        size -= written;
+    }
+}
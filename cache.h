@@ -0,0 +1,63 @@
+// Header file for cache.c written by Connor Li (z5425430)
+// For implementation details go to cache.c.
+
+#ifndef CACHE_H_
+#define CACHE_H_
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+/// @brief What a file's hashes are cached under. If any of these change,
+///        the file is hashed again.
+struct Cache_Key {
+    uint64_t dev;
+    uint64_t ino;
+    uint64_t size;
+    uint64_t mtime_ns;
+};
+
+/// @brief Open (or create) the hash cache at `pathname`. Until this is
+///        called, lookups always miss and stores do nothing.
+/// @param pathname Where the cache lives.
+void Cache_Open(char *pathname);
+
+/// @brief Get the key of an open file.
+/// @param fd The file.
+/// @param key Filled in with the file's key.
+/// @return false if the file can't be cached (e.g. it isn't a regular
+///         file, or no cache is open).
+bool Cache_Key_Get(int fd, struct Cache_Key *key);
+
+/// @brief Look up the hashes of a file. Safe to call from any thread.
+/// @param key The file's key, from Cache_Key_Get.
+/// @param hashes Filled in with the hash of every block on a hit.
+/// @param weak_hashes If not NULL, the weak checksums are wanted too.
+/// @param num_blocks The number of blocks in the file.
+/// @return Whether the hashes were found.
+bool Cache_Lookup(
+    struct Cache_Key *key, uint64_t hashes[], uint32_t weak_hashes[],
+    size_t num_blocks
+);
+
+/// @brief Remember the hashes of a file, unless it changed while it was
+///        being hashed. Safe to call from any thread.
+/// @param fd The file, still open.
+/// @param key The file's key from before it was hashed.
+/// @param hashes The hash of every block.
+/// @param weak_hashes The weak checksums, or NULL.
+/// @param num_blocks The number of blocks in the file.
+void Cache_Store(
+    int fd, struct Cache_Key *key, uint64_t hashes[], uint32_t weak_hashes[],
+    size_t num_blocks
+);
+
+/// @brief Write out everything stored since Cache_Open and close the cache.
+void Cache_Close(void);
+
+/// @brief Drop the cache as loaded, and anything stored since, and load
+///        it again as it is now, e.g. with whatever other processes have
+///        added to it.
+void Cache_Reload(void);
+
+#endif
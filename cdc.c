@@ -0,0 +1,277 @@
+// Implementation for 'cdc.h', written by Connor Li (z5425430)
+// Content-defined chunking, in the style of FastCDC. Fixed size blocks
+// all shift along after an insert, so none of them match again. Chunks
+// instead end wherever a rolling "gear" hash of the last few bytes hits
+// a pattern, so an insert only changes the chunks around it:
+//
+//      fp = (fp << 1) + gear[byte]         (the top bits see ~64 bytes)
+//
+// A chunk can't end in its first quarter of the average size. Up to the
+// average the pattern is 2 bits harder to hit than it would be, and past
+// it 2 bits easier, which pulls chunk sizes in close to the average
+// ("normalised chunking"). No chunk is longer than 4 times the average.
+//
+// Both ends must cut in the same places, so the gear table is made from
+// a fixed seed rather than at random.
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <pthread.h>
+#include "cdc.h"
+#include "rbuoy.h"
+
+#define CDC_MIN_DIVISOR 4
+#define CDC_MAX_MULTIPLE 4
+#define CDC_NORMAL_BITS 2
+#define CDC_GEAR_SEED 0x2545f4914f6cdd1dull
+
+// Files are read this much at a time, on top of room for a whole chunk
+#define CDC_READ_SIZE (4 * 1024 * 1024)
+
+#define CHUNK_LIST_MIN_CAPACITY 64
+
+static uint64_t gear[256];
+static pthread_once_t gear_once = PTHREAD_ONCE_INIT;
+
+//////////////////////////////////////////////////////////////////////
+//                        FUNCTION PROTOTYPES
+//////////////////////////////////////////////////////////////////////
+
+void gear_fill(void);
+
+uint64_t cdc_mask(size_t avg_size, int extra_bits);
+
+size_t cdc_read(int fd, uint8_t buffer[], size_t size, uint64_t offset);
+
+size_t chunk_table_slot(uint64_t hash, size_t mask);
+
+//////////////////////////////////////////////////////////////////////
+//                        INTERFACE FUNCTIONS
+//////////////////////////////////////////////////////////////////////
+
+size_t Cdc_Cut(const uint8_t data[], size_t size, size_t avg_size) {
+    pthread_once(&gear_once, gear_fill);
+
+    size_t min_size = avg_size / CDC_MIN_DIVISOR;
+    if (size <= min_size) return size;
+    if (size > avg_size * CDC_MAX_MULTIPLE) size = avg_size * CDC_MAX_MULTIPLE;
+
+    size_t normal_size = (avg_size < size) ? avg_size : size;
+    uint64_t hard_mask = cdc_mask(avg_size, CDC_NORMAL_BITS);
+    uint64_t easy_mask = cdc_mask(avg_size, -CDC_NORMAL_BITS);
+
+    uint64_t fp = 0;
+    size_t i = min_size;
+    for (; i < normal_size; i++) {
+        fp = (fp << 1) + gear[data[i]];
+        if ((fp & hard_mask) == 0) return i + 1;
+    }
+    for (; i < size; i++) {
+        fp = (fp << 1) + gear[data[i]];
+        if ((fp & easy_mask) == 0) return i + 1;
+    }
+
+    return size;
+}
+
+// The buffer is refilled whenever less than a whole chunk is left in it,
+// so a chunk is always cut with all of its bytes in view.
+void Cdc_Chunk_File(
+    int fd, uint64_t size, size_t avg_size, bool hash,
+    struct Chunk_List *chunks
+) {
+    memset(chunks, 0, sizeof(struct Chunk_List));
+    if (size == 0) return;
+
+    size_t max_size = avg_size * CDC_MAX_MULTIPLE;
+    size_t buffer_size = CDC_READ_SIZE + max_size;
+    uint8_t *buffer = malloc(buffer_size);
+    if (buffer == NULL) {
+        perror("Error");
+        exit(1);
+    }
+
+    uint64_t buffer_start = 0;
+    size_t buffer_len = 0;
+    size_t pos = 0;
+    uint64_t end = 0;
+
+    while (end < size) {
+        uint64_t buffer_end = buffer_start + buffer_len;
+        if (buffer_len - pos < max_size && buffer_end < size) {
+            memmove(buffer, buffer + pos, buffer_len - pos);
+            buffer_start += pos;
+            buffer_len -= pos;
+            pos = 0;
+
+            uint64_t want = size - buffer_end;
+            if (want > buffer_size - buffer_len) want = buffer_size - buffer_len;
+            buffer_len += cdc_read(fd, buffer + buffer_len, want, buffer_end);
+        }
+
+        size_t length = Cdc_Cut(buffer + pos, buffer_len - pos, avg_size);
+        uint64_t chunk_hash = hash ? Block_Hash_One(
+            buffer + pos, length, rbuoy_options.block_hash
+        ) : 0;
+
+        pos += length;
+        end += length;
+        Chunk_List_Add(chunks, end, chunk_hash);
+    }
+
+    free(buffer);
+}
+
+void Chunk_List_Add(struct Chunk_List *chunks, uint64_t end, uint64_t hash) {
+    if (chunks->num_chunks == chunks->capacity) {
+        chunks->capacity = (chunks->capacity == 0) ?
+            CHUNK_LIST_MIN_CAPACITY : chunks->capacity * 2;
+        chunks->ends = realloc(
+            chunks->ends, sizeof(uint64_t) * chunks->capacity
+        );
+        chunks->hashes = realloc(
+            chunks->hashes, sizeof(uint64_t) * chunks->capacity
+        );
+        if (chunks->ends == NULL || chunks->hashes == NULL) {
+            perror("Error");
+            exit(1);
+        }
+    }
+
+    chunks->ends[chunks->num_chunks] = end;
+    chunks->hashes[chunks->num_chunks] = hash;
+    chunks->num_chunks++;
+}
+
+void Chunk_List_Free(struct Chunk_List *chunks) {
+    free(chunks->ends);
+    free(chunks->hashes);
+    memset(chunks, 0, sizeof(struct Chunk_List));
+}
+
+uint64_t Block_Offset(const struct Chunk_List *chunks, size_t block_n) {
+    if (chunks == NULL) return (uint64_t) block_n * rbuoy_options.block_size;
+
+    return (block_n == 0) ? 0 : chunks->ends[block_n - 1];
+}
+
+size_t Block_Length(
+    const struct Chunk_List *chunks, size_t block_n, uint64_t file_size
+) {
+    if (chunks != NULL) {
+        return chunks->ends[block_n] - Block_Offset(chunks, block_n);
+    }
+
+    uint64_t offset = Block_Offset(NULL, block_n);
+    if (file_size - offset < rbuoy_options.block_size) {
+        return file_size - offset;
+    }
+
+    return rbuoy_options.block_size;
+}
+
+// An open addressed table of chunk indexes, at most half full
+void Chunk_Table_Build(
+    struct Chunk_Table *table, const struct Chunk_List *chunks
+) {
+    size_t num_slots = 1;
+    while (num_slots < chunks->num_chunks * 2) num_slots <<= 1;
+
+    table->chunks = chunks;
+    table->mask = num_slots - 1;
+    table->slots = malloc(sizeof(size_t) * num_slots);
+    if (table->slots == NULL) {
+        perror("Error");
+        exit(1);
+    }
+    for (size_t slot = 0; slot < num_slots; slot++) table->slots[slot] = SIZE_MAX;
+
+    // The first of any identical chunks is the one that's found
+    for (size_t chunk_n = 0; chunk_n < chunks->num_chunks; chunk_n++) {
+        size_t slot = chunk_table_slot(chunks->hashes[chunk_n], table->mask);
+        while (table->slots[slot] != SIZE_MAX) slot = (slot + 1) & table->mask;
+        table->slots[slot] = chunk_n;
+    }
+}
+
+size_t Chunk_Table_Find(
+    const struct Chunk_Table *table, uint64_t hash, uint64_t length
+) {
+    const struct Chunk_List *chunks = table->chunks;
+
+    for (
+        size_t slot = chunk_table_slot(hash, table->mask);
+        table->slots[slot] != SIZE_MAX; slot = (slot + 1) & table->mask
+    ) {
+        size_t chunk_n = table->slots[slot];
+        if (chunks->hashes[chunk_n] == hash &&
+            Block_Length(chunks, chunk_n, 0) == length) {
+            return chunk_n;
+        }
+    }
+
+    return SIZE_MAX;
+}
+
+void Chunk_Table_Free(struct Chunk_Table *table) {
+    free(table->slots);
+    table->slots = NULL;
+}
+
+//////////////////////////////////////////////////////////////////////
+//                           LOCAL HELPERS
+//////////////////////////////////////////////////////////////////////
+
+// Function to make the gear table, with splitmix64 from a fixed seed
+void gear_fill(void) {
+    uint64_t state = CDC_GEAR_SEED;
+
+    for (int byte = 0; byte < 256; byte++) {
+        state += 0x9e3779b97f4a7c15ull;
+        uint64_t z = state;
+        z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ull;
+        z = (z ^ (z >> 27)) * 0x94d049bb133111ebull;
+        gear[byte] = z ^ (z >> 31);
+    }
+}
+
+// Function to get the mask a chunk ends on: log2(avg_size) top bits (the
+// ones that have seen the most bytes), plus or minus some
+uint64_t cdc_mask(size_t avg_size, int extra_bits) {
+    int bits = extra_bits;
+    for (size_t size = avg_size; size > 1; size >>= 1) bits++;
+
+    return ~0ull << (64 - bits);
+}
+
+// Function to pread exactly `size` bytes, erroring out if the file has
+// got shorter since its size was taken
+size_t cdc_read(int fd, uint8_t buffer[], size_t size, uint64_t offset) {
+    size_t done = 0;
+
+    while (done < size) {
+        ssize_t n = pread(fd, buffer + done, size - done, offset + done);
+        if (n < 0 && errno == EINTR) continue;
+        if (n < 0) {
+            perror("Read Failed");
+            exit(1);
+        }
+        if (n == 0) {
+            fprintf(stderr, "Error: file changed size while being hashed\n");
+            exit(1);
+        }
+        done += n;
+    }
+
+    return done;
+}
+
+// Function to pick a chunk's first slot. Hashes are already well mixed.
+size_t chunk_table_slot(uint64_t hash, size_t mask) {
+    return (hash ^ (hash >> 32)) & mask;
+}
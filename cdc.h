@@ -0,0 +1,79 @@
+// Header file for cdc.c written by Connor Li (z5425430)
+// For implementation details go to cdc.c.
+
+#ifndef CDC_H_
+#define CDC_H_
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+/// @brief The content-defined chunks of a file, in order. Chunk n is
+///        [ends[n - 1], ends[n]), the first starting at 0.
+struct Chunk_List {
+    size_t num_chunks;
+    uint64_t *ends;
+    uint64_t *hashes;
+    size_t capacity;
+};
+
+/// @brief The receiver's chunks of a file, by hash, to find the sender's in.
+struct Chunk_Table {
+    const struct Chunk_List *chunks;
+    size_t *slots;
+    size_t mask;
+};
+
+/// @brief Find where the next chunk of some data ends.
+/// @param data The data, starting where the chunk starts.
+/// @param size How much data there is. If it's the end of the file, the
+///             last chunk ends there.
+/// @param avg_size The average chunk size, a power of 2. Chunks are from
+///                 a quarter of it to 4 times it.
+/// @return The size of the chunk.
+size_t Cdc_Cut(const uint8_t data[], size_t size, size_t avg_size);
+
+/// @brief Split a file into chunks, reading it front to back once.
+/// @param fd The file.
+/// @param size The size of the file.
+/// @param avg_size The average chunk size.
+/// @param hash Whether to hash each chunk too (rbuoy_options.block_hash).
+/// @param chunks Filled in with the chunks. Free with Chunk_List_Free.
+void Cdc_Chunk_File(
+    int fd, uint64_t size, size_t avg_size, bool hash,
+    struct Chunk_List *chunks
+);
+
+/// @brief Add a chunk to the end of a list.
+/// @param chunks The list, zeroed to start with.
+/// @param end Where the chunk ends in the file.
+/// @param hash Its hash, if the list has them.
+void Chunk_List_Add(struct Chunk_List *chunks, uint64_t end, uint64_t hash);
+
+/// @brief Free the chunks of a list, leaving it empty.
+void Chunk_List_Free(struct Chunk_List *chunks);
+
+/// @brief Where a block of a file starts: one of `chunks` if there are
+///        any, otherwise a fixed size block (rbuoy_options.block_size).
+uint64_t Block_Offset(const struct Chunk_List *chunks, size_t block_n);
+
+/// @brief How long a block of a file is, as for Block_Offset.
+/// @param file_size The size of the file, which ends the last block.
+size_t Block_Length(
+    const struct Chunk_List *chunks, size_t block_n, uint64_t file_size
+);
+
+/// @brief Index a list of hashed chunks by hash.
+void Chunk_Table_Build(
+    struct Chunk_Table *table, const struct Chunk_List *chunks
+);
+
+/// @brief Look for a chunk with a given hash and length.
+/// @return Its index in the list, or SIZE_MAX if there isn't one.
+size_t Chunk_Table_Find(
+    const struct Chunk_Table *table, uint64_t hash, uint64_t length
+);
+
+void Chunk_Table_Free(struct Chunk_Table *table);
+
+#endif
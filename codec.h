@@ -0,0 +1,201 @@
+// Header-only codecs for the fields of an index, written by Connor Li
+// (z5425430). Every fixed size field is little-endian, so on a
+// little-endian host a field is one unaligned load or store (a memcpy the
+// compiler turns into a single mov), and on a big-endian one it is that
+// plus a byte swap. Hashes are encoded a whole array at a time.
+//
+// These are all small enough to be inlined into the loops that parse and
+// write records, which is why they live in a header.
+
+#ifndef CODEC_H_
+#define CODEC_H_
+
+#include <stdint.h>
+#include <stddef.h>
+#include <string.h>
+
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+#define HOST_LITTLE_ENDIAN 1
+#else
+#define HOST_LITTLE_ENDIAN 0
+#endif
+
+// Unsigned LEB128 varints: 7 bits a byte, lowest first, with the top bit
+// set on every byte but the last. No varint is longer than 10 bytes.
+#define CODEC_VARINT_DATA_BITS 7
+#define CODEC_VARINT_DATA_MASK 0x7F
+#define CODEC_VARINT_MORE_BIT  0x80
+#define CODEC_VARINT_MAX_SIZE  10
+
+/// @brief Convert a 64 bit value between the host's order and little-endian.
+static inline uint64_t Codec_Le64(uint64_t value) {
+#if HOST_LITTLE_ENDIAN
+    return value;
+#else
+    return __builtin_bswap64(value);
+#endif
+}
+
+/// @brief Convert a 32 bit value between the host's order and little-endian.
+static inline uint32_t Codec_Le32(uint32_t value) {
+#if HOST_LITTLE_ENDIAN
+    return value;
+#else
+    return __builtin_bswap32(value);
+#endif
+}
+
+/// @brief Read an 8 byte little-endian field, at any alignment.
+static inline uint64_t Codec_Load_U64(const uint8_t bytes[]) {
+    uint64_t value;
+    memcpy(&value, bytes, sizeof(uint64_t));
+    return Codec_Le64(value);
+}
+
+/// @brief Read a 4 byte little-endian field, at any alignment.
+static inline uint32_t Codec_Load_U32(const uint8_t bytes[]) {
+    uint32_t value;
+    memcpy(&value, bytes, sizeof(uint32_t));
+    return Codec_Le32(value);
+}
+
+/// @brief Write an 8 byte little-endian field, at any alignment.
+static inline void Codec_Store_U64(uint8_t bytes[], uint64_t value) {
+    value = Codec_Le64(value);
+    memcpy(bytes, &value, sizeof(uint64_t));
+}
+
+/// @brief Write a 4 byte little-endian field, at any alignment.
+static inline void Codec_Store_U32(uint8_t bytes[], uint32_t value) {
+    value = Codec_Le32(value);
+    memcpy(bytes, &value, sizeof(uint32_t));
+}
+
+/// @brief Read a little-endian field of 0 to 8 bytes. The bytes go into
+///        the low end of a zeroed word, which is the low end of the value
+///        once it's in the host's order.
+static inline uint64_t Codec_Load_Uint(const uint8_t bytes[], size_t num_bytes) {
+    if (num_bytes == sizeof(uint64_t)) return Codec_Load_U64(bytes);
+
+    uint64_t value = 0;
+    memcpy(&value, bytes, num_bytes);
+    return Codec_Le64(value);
+}
+
+/// @brief Write the low `num_bytes` bytes (0 to 8) of a value as a
+///        little-endian field.
+static inline void Codec_Store_Uint(
+    uint8_t bytes[], uint64_t value, size_t num_bytes
+) {
+    if (num_bytes == sizeof(uint64_t)) {
+        Codec_Store_U64(bytes, value);
+        return;
+    }
+
+    value = Codec_Le64(value);
+    memcpy(bytes, &value, num_bytes);
+}
+
+/// @brief Write a varint.
+/// @param bytes Room for at least CODEC_VARINT_MAX_SIZE bytes.
+/// @return The number of bytes written.
+static inline size_t Codec_Varint_Encode(uint8_t bytes[], uint64_t value) {
+    if (value <= CODEC_VARINT_DATA_MASK) {
+        bytes[0] = value;
+        return 1;
+    }
+
+    size_t num_bytes = 0;
+    while (value > CODEC_VARINT_DATA_MASK) {
+        bytes[num_bytes++] = (value & CODEC_VARINT_DATA_MASK) |
+            CODEC_VARINT_MORE_BIT;
+        value >>= CODEC_VARINT_DATA_BITS;
+    }
+    bytes[num_bytes++] = value;
+
+    return num_bytes;
+}
+
+/// @brief Read a varint that ends before `end`.
+/// @param value Set to the value of the varint.
+/// @return The number of bytes read, or 0 if the varint runs past `end`,
+///         is longer than CODEC_VARINT_MAX_SIZE or doesn't fit in 64 bits.
+static inline size_t Codec_Varint_Decode(
+    const uint8_t bytes[], const uint8_t *end, uint64_t *value
+) {
+    if (bytes < end && bytes[0] < CODEC_VARINT_MORE_BIT) {
+        *value = bytes[0];
+        return 1;
+    }
+
+    uint64_t result = 0;
+    for (size_t byte_n = 0; byte_n < CODEC_VARINT_MAX_SIZE; byte_n++) {
+        if (bytes + byte_n >= end) return 0;
+
+        // Only the lowest bit of the last byte there can be is left
+        uint8_t byte = bytes[byte_n];
+        if (byte_n == CODEC_VARINT_MAX_SIZE - 1 &&
+            (byte & CODEC_VARINT_DATA_MASK) > 1) {
+            return 0;
+        }
+        result |= (uint64_t) (byte & CODEC_VARINT_DATA_MASK) <<
+            (byte_n * CODEC_VARINT_DATA_BITS);
+        if ((byte & CODEC_VARINT_MORE_BIT) == 0) {
+            *value = result;
+            return byte_n + 1;
+        }
+    }
+
+    return 0;
+}
+
+/// @brief Encode an array of hashes as they appear in an index, each
+///        preceded by its 4 byte weak checksum if there are any.
+/// @param bytes Room for `num_hashes` hashes (and weak checksums).
+/// @return The number of bytes written.
+static inline size_t Codec_Encode_Hashes(
+    uint8_t bytes[], const uint64_t hashes[], const uint32_t weak_hashes[],
+    size_t num_hashes
+) {
+    if (weak_hashes == NULL && HOST_LITTLE_ENDIAN) {
+        memcpy(bytes, hashes, num_hashes * sizeof(uint64_t));
+        return num_hashes * sizeof(uint64_t);
+    }
+
+    uint8_t *pos = bytes;
+    for (size_t hash_n = 0; hash_n < num_hashes; hash_n++) {
+        if (weak_hashes != NULL) {
+            Codec_Store_U32(pos, weak_hashes[hash_n]);
+            pos += sizeof(uint32_t);
+        }
+        Codec_Store_U64(pos, hashes[hash_n]);
+        pos += sizeof(uint64_t);
+    }
+
+    return pos - bytes;
+}
+
+/// @brief Decode an array of hashes as written by Codec_Encode_Hashes.
+/// @param weak_hashes If not NULL, the hashes are each preceded by a weak
+///                    checksum, which is decoded into here.
+static inline void Codec_Decode_Hashes(
+    const uint8_t bytes[], uint64_t hashes[], uint32_t weak_hashes[],
+    size_t num_hashes
+) {
+    if (weak_hashes == NULL && HOST_LITTLE_ENDIAN) {
+        memcpy(hashes, bytes, num_hashes * sizeof(uint64_t));
+        return;
+    }
+
+    const uint8_t *pos = bytes;
+    for (size_t hash_n = 0; hash_n < num_hashes; hash_n++) {
+        if (weak_hashes != NULL) {
+            weak_hashes[hash_n] = Codec_Load_U32(pos);
+            pos += sizeof(uint32_t);
+        }
+        hashes[hash_n] = Codec_Load_U64(pos);
+        pos += sizeof(uint64_t);
+    }
+}
+
+#endif
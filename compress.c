@@ -0,0 +1,456 @@
+// Implementation for 'compress.h', written by Connor Li (z5425430)
+// Compressing the parts of an index records are mostly made of.
+//
+// A compressed part of a record is a run of frames, each one an
+// independent zlib stream of up to FRAME_SIZE bytes, ended by a frame of
+// no bytes:
+//
+//      size (varint) | compressed size (varint) | zlib stream ... | 0
+//
+// Every frame is primed with the same dictionary, so even a small record
+// can refer back to bytes the reader already has. As frames don't depend
+// on each other, they are compressed on a pool while the ones after them
+// are still being read in. Whatever isn't compressed (headers and so on)
+// is queued in between them, and everything goes out in order.
+//
+// Both ends are stdio streams (fopencookie), so the code writing and
+// reading records doesn't need to know whether they're compressed.
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+#include <zlib.h>
+#include "compress.h"
+#include "helpers.h"
+#include "rbuoy.h"
+
+#define FRAME_SIZE (256 * 1024)
+
+// Frames (compressed or not) waiting on the pool or to be written, per
+// worker, before the writer waits for the oldest
+#define FRAMES_IN_FLIGHT_PER_JOB 4
+
+#define INITIAL_FRAME_CAPACITY 4096
+
+// A part of the index, either to be compressed or written out as it is
+struct Frame {
+    bool compressed;
+    uint8_t *data;
+    size_t size;
+    size_t capacity;
+
+    uint8_t *dict;
+    size_t dict_size;
+
+    uint8_t *out;
+    size_t out_size;
+    struct Latch done;
+};
+
+struct Frame_Writer {
+    FILE *dest;
+    FILE *file;
+    struct Index_Format format;
+    struct Pool *pool;
+
+    // frames[num_started % window] is being filled
+    struct Frame *frames;
+    size_t window;
+    size_t num_started;
+    size_t num_written;
+
+    bool compressing;
+    uint8_t dict[COMPRESS_DICT_MAX_SIZE];
+    size_t dict_size;
+};
+
+struct Frame_Reader {
+    FILE *src;
+    struct Index_Format format;
+    uint8_t dict[COMPRESS_DICT_MAX_SIZE];
+    size_t dict_size;
+
+    uint8_t *in;
+    uint8_t *raw;
+    size_t raw_size;
+    size_t raw_pos;
+    bool ended;
+};
+
+//////////////////////////////////////////////////////////////////////
+//                        FUNCTION PROTOTYPES
+//////////////////////////////////////////////////////////////////////
+
+ssize_t writer_cookie_write(void *cookie, const char *buffer, size_t size);
+
+int writer_cookie_close(void *cookie);
+
+void writer_setup_frame(struct Frame_Writer *writer);
+
+void writer_seal_frame(struct Frame_Writer *writer);
+
+void writer_write_oldest(struct Frame_Writer *writer);
+
+void compress_frame_task(void *arg);
+
+ssize_t reader_cookie_read(void *cookie, char *buffer, size_t size);
+
+int reader_cookie_close(void *cookie);
+
+void reader_next_frame(struct Frame_Reader *reader);
+
+void *compress_alloc(size_t size);
+
+//////////////////////////////////////////////////////////////////////
+//                        INTERFACE FUNCTIONS
+//////////////////////////////////////////////////////////////////////
+
+struct Frame_Writer *Frame_Writer_Open(
+    FILE *dest, struct Index_Format format, struct Pool *pool
+) {
+    struct Frame_Writer *writer = compress_alloc(sizeof(struct Frame_Writer));
+    writer->dest = dest;
+    writer->format = format;
+    writer->pool = pool;
+    writer->window = rbuoy_options.jobs * FRAMES_IN_FLIGHT_PER_JOB;
+    writer->frames = calloc(writer->window, sizeof(struct Frame));
+    writer->num_started = 0;
+    writer->num_written = 0;
+    writer->compressing = false;
+    writer->dict_size = 0;
+    if (writer->frames == NULL) {
+        perror("Error");
+        exit(1);
+    }
+    writer_setup_frame(writer);
+
+    writer->file = fopencookie(writer, "w", (cookie_io_functions_t) {
+        .write = writer_cookie_write,
+        .close = writer_cookie_close,
+    });
+    if (writer->file == NULL) {
+        perror("Error");
+        exit(1);
+    }
+
+    return writer;
+}
+
+FILE *Frame_Writer_File(struct Frame_Writer *writer) {
+    return writer->file;
+}
+
+void Frame_Writer_Begin(
+    struct Frame_Writer *writer, const uint8_t dict[], size_t dict_size
+) {
+    fflush(writer->file);
+    writer_seal_frame(writer);
+
+    writer->compressing = true;
+    writer->dict_size = dict_size;
+    if (dict_size > 0) memcpy(writer->dict, dict, dict_size);
+    writer_setup_frame(writer);
+}
+
+void Frame_Writer_End(struct Frame_Writer *writer) {
+    fflush(writer->file);
+    writer_seal_frame(writer);
+
+    writer->compressing = false;
+    writer_setup_frame(writer);
+
+    Format_Write_Uint(writer->file, writer->format, 0, FILE_SIZE_SIZE);
+}
+
+void Frame_Writer_Close(struct Frame_Writer *writer) {
+    if (fclose(writer->file) != 0) {
+        perror("Error");
+        exit(1);
+    }
+
+    for (size_t frame_n = 0; frame_n < writer->window; frame_n++) {
+        free(writer->frames[frame_n].data);
+    }
+    free(writer->frames);
+    free(writer);
+}
+
+FILE *Frame_Reader_Open(
+    FILE *src, struct Index_Format format, const uint8_t dict[],
+    size_t dict_size
+) {
+    struct Frame_Reader *reader = compress_alloc(sizeof(struct Frame_Reader));
+    reader->src = src;
+    reader->format = format;
+    reader->dict_size = dict_size;
+    if (dict_size > 0) memcpy(reader->dict, dict, dict_size);
+    reader->in = NULL;
+    reader->raw = NULL;
+    reader->raw_size = 0;
+    reader->raw_pos = 0;
+    reader->ended = false;
+
+    FILE *f = fopencookie(reader, "r", (cookie_io_functions_t) {
+        .read = reader_cookie_read,
+        .close = reader_cookie_close,
+    });
+    if (f == NULL) {
+        perror("Error");
+        exit(1);
+    }
+
+    return f;
+}
+
+// Reading one more byte makes sure the end frame was reached too
+void Frame_Reader_Close(FILE *reader) {
+    if (fgetc(reader) != EOF) {
+        fprintf(stderr, "Error: compressed record has data left over\n");
+        exit(1);
+    }
+
+    fclose(reader);
+}
+
+//////////////////////////////////////////////////////////////////////
+//                           LOCAL HELPERS
+//////////////////////////////////////////////////////////////////////
+
+// Function to add what's written to the frame being filled, sealing it
+// and starting another whenever it is full
+ssize_t writer_cookie_write(void *cookie, const char *buffer, size_t size) {
+    struct Frame_Writer *writer = cookie;
+    size_t written = 0;
+
+    while (written < size) {
+        struct Frame *frame = &writer->frames[writer->num_started % writer->window];
+        if (frame->size == FRAME_SIZE) {
+            writer_seal_frame(writer);
+            writer_setup_frame(writer);
+            continue;
+        }
+
+        size_t n = size - written;
+        if (n > FRAME_SIZE - frame->size) n = FRAME_SIZE - frame->size;
+
+        if (frame->size + n > frame->capacity) {
+            size_t capacity = frame->capacity == 0 ?
+                INITIAL_FRAME_CAPACITY : frame->capacity;
+            while (capacity < frame->size + n) capacity *= 2;
+            if (capacity > FRAME_SIZE) capacity = FRAME_SIZE;
+
+            frame->data = realloc(frame->data, capacity);
+            if (frame->data == NULL) {
+                perror("Error");
+                exit(1);
+            }
+            frame->capacity = capacity;
+        }
+
+        memcpy(frame->data + frame->size, buffer + written, n);
+        frame->size += n;
+        written += n;
+    }
+
+    return size;
+}
+
+// Function to seal the last frame and write out every one still waiting
+int writer_cookie_close(void *cookie) {
+    struct Frame_Writer *writer = cookie;
+
+    writer_seal_frame(writer);
+    while (writer->num_written < writer->num_started) {
+        writer_write_oldest(writer);
+    }
+
+    return 0;
+}
+
+// Function to get the frame being filled ready for what's written next
+void writer_setup_frame(struct Frame_Writer *writer) {
+    struct Frame *frame = &writer->frames[writer->num_started % writer->window];
+
+    frame->compressed = writer->compressing;
+    frame->size = 0;
+    frame->dict = NULL;
+    frame->dict_size = 0;
+    frame->out = NULL;
+    frame->out_size = 0;
+
+    if (writer->compressing && writer->dict_size > 0) {
+        frame->dict = compress_alloc(writer->dict_size);
+        memcpy(frame->dict, writer->dict, writer->dict_size);
+        frame->dict_size = writer->dict_size;
+    }
+}
+
+// Function to hand the frame being filled over to be compressed (if it
+// is to be) and written. Once the window is full, the oldest frame is
+// waited for and written to make room. An empty frame is left as it is.
+void writer_seal_frame(struct Frame_Writer *writer) {
+    struct Frame *frame = &writer->frames[writer->num_started % writer->window];
+    if (frame->size == 0) {
+        free(frame->dict);
+        frame->dict = NULL;
+        return;
+    }
+
+    if (frame->compressed) {
+        Latch_Init(&frame->done, 1);
+        Pool_Submit(writer->pool, compress_frame_task, frame);
+    } else {
+        Latch_Init(&frame->done, 0);
+    }
+    writer->num_started++;
+
+    if (writer->num_started - writer->num_written == writer->window) {
+        writer_write_oldest(writer);
+    }
+}
+
+// Function to wait for the oldest frame and write it to the index
+void writer_write_oldest(struct Frame_Writer *writer) {
+    struct Frame *frame = &writer->frames[writer->num_written % writer->window];
+    Latch_Wait(&frame->done);
+    Latch_Destroy(&frame->done);
+
+    if (frame->compressed) {
+        Format_Write_Uint(writer->dest, writer->format, frame->size, FILE_SIZE_SIZE);
+        Format_Write_Uint(
+            writer->dest, writer->format, frame->out_size, FILE_SIZE_SIZE
+        );
+        fwrite(frame->out, sizeof(uint8_t), frame->out_size, writer->dest);
+    } else {
+        fwrite(frame->data, sizeof(uint8_t), frame->size, writer->dest);
+    }
+
+    free(frame->out);
+    free(frame->dict);
+    frame->out = NULL;
+    frame->dict = NULL;
+    writer->num_written++;
+}
+
+// Task to compress one frame into its own zlib stream
+void compress_frame_task(void *arg) {
+    struct Frame *frame = arg;
+
+    z_stream stream = { 0 };
+    if (deflateInit(&stream, Z_DEFAULT_COMPRESSION) != Z_OK || (
+        frame->dict_size > 0 && deflateSetDictionary(
+            &stream, frame->dict, frame->dict_size
+        ) != Z_OK
+    )) {
+        fprintf(stderr, "Error: can't start compressing\n");
+        exit(1);
+    }
+
+    size_t bound = deflateBound(&stream, frame->size);
+    frame->out = compress_alloc(bound);
+
+    stream.next_in = frame->data;
+    stream.avail_in = frame->size;
+    stream.next_out = frame->out;
+    stream.avail_out = bound;
+    if (deflate(&stream, Z_FINISH) != Z_STREAM_END) {
+        fprintf(stderr, "Error: compressing failed\n");
+        exit(1);
+    }
+    frame->out_size = stream.total_out;
+    deflateEnd(&stream);
+
+    Latch_Count_Down(&frame->done);
+}
+
+// Function to hand out what's been decompressed, a frame at a time
+ssize_t reader_cookie_read(void *cookie, char *buffer, size_t size) {
+    struct Frame_Reader *reader = cookie;
+
+    while (reader->raw_pos == reader->raw_size) {
+        if (reader->ended) return 0;
+        reader_next_frame(reader);
+    }
+
+    size_t n = reader->raw_size - reader->raw_pos;
+    if (n > size) n = size;
+    memcpy(buffer, reader->raw + reader->raw_pos, n);
+    reader->raw_pos += n;
+
+    return n;
+}
+
+int reader_cookie_close(void *cookie) {
+    struct Frame_Reader *reader = cookie;
+
+    free(reader->in);
+    free(reader->raw);
+    free(reader);
+
+    return 0;
+}
+
+// Function to read and decompress the next frame, or notice the end
+void reader_next_frame(struct Frame_Reader *reader) {
+    reader->raw_pos = 0;
+    reader->raw_size = Format_Read_Uint(
+        reader->src, reader->format, FILE_SIZE_SIZE
+    );
+    if (reader->raw_size == 0) {
+        reader->ended = true;
+        return;
+    }
+
+    size_t in_size = Format_Read_Uint(
+        reader->src, reader->format, FILE_SIZE_SIZE
+    );
+    if (reader->raw_size > FRAME_SIZE || in_size > compressBound(FRAME_SIZE)) {
+        fprintf(stderr, "Error: invalid compressed frame\n");
+        exit(1);
+    }
+
+    if (reader->in == NULL) {
+        reader->in = compress_alloc(compressBound(FRAME_SIZE));
+        reader->raw = compress_alloc(FRAME_SIZE);
+    }
+    fread_handler(reader->in, sizeof(uint8_t), in_size, reader->src);
+
+    z_stream stream = { 0 };
+    if (inflateInit(&stream) != Z_OK) {
+        fprintf(stderr, "Error: can't start decompressing\n");
+        exit(1);
+    }
+    stream.next_in = reader->in;
+    stream.avail_in = in_size;
+    stream.next_out = reader->raw;
+    stream.avail_out = reader->raw_size;
+
+    int status = inflate(&stream, Z_FINISH);
+    if (status == Z_NEED_DICT) {
+        // Fails if our dictionary isn't the one it was compressed with
+        status = inflateSetDictionary(&stream, reader->dict, reader->dict_size);
+        if (status == Z_OK) status = inflate(&stream, Z_FINISH);
+    }
+    if (
+        status != Z_STREAM_END || stream.avail_in != 0 ||
+        stream.total_out != reader->raw_size
+    ) {
+        fprintf(stderr, "Error: invalid compressed frame\n");
+        exit(1);
+    }
+    inflateEnd(&stream);
+}
+
+// Simple function that calls malloc but errors out on fail
+void *compress_alloc(size_t size) {
+    void *memory = malloc(size);
+    if (memory == NULL) {
+        perror("Error");
+        exit(1);
+    }
+
+    return memory;
+}
@@ -0,0 +1,63 @@
+// Header file for compress.c written by Connor Li (z5425430)
+// For implementation details go to compress.c.
+
+#ifndef COMPRESS_H_
+#define COMPRESS_H_
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stddef.h>
+#include "format.h"
+#include "pool.h"
+
+// The most a dictionary can hold: deflate can't look back any further
+#define COMPRESS_DICT_MAX_SIZE (32 * 1024)
+
+struct Frame_Writer;
+
+/// @brief Start writing an index whose records have compressed parts.
+///        Everything is written through Frame_Writer_File, in order.
+/// @param dest The index.
+/// @param format The format of the index.
+/// @param pool The pool frames are compressed on, while the caller goes
+///             on writing the ones after them.
+struct Frame_Writer *Frame_Writer_Open(
+    FILE *dest, struct Index_Format format, struct Pool *pool
+);
+
+/// @brief The stream to write the index through.
+FILE *Frame_Writer_File(struct Frame_Writer *writer);
+
+/// @brief Compress everything written from here to Frame_Writer_End,
+///        in frames primed with a dictionary.
+/// @param writer The writer.
+/// @param dict Bytes the reader will also have, which are likely to
+///             look like what's being compressed. Copied.
+/// @param dict_size The size of `dict`, at most COMPRESS_DICT_MAX_SIZE.
+void Frame_Writer_Begin(
+    struct Frame_Writer *writer, const uint8_t dict[], size_t dict_size
+);
+
+/// @brief Stop compressing, ending the frames.
+void Frame_Writer_End(struct Frame_Writer *writer);
+
+/// @brief Wait for every frame, write everything out to the index and
+///        free the writer. The index itself is left open.
+void Frame_Writer_Close(struct Frame_Writer *writer);
+
+/// @brief Start reading the frames of a record.
+/// @param src The index, where the frames start.
+/// @param format The format of the index.
+/// @param dict The same dictionary the frames were written with.
+/// @param dict_size The size of `dict`.
+/// @return A stream of what was compressed.
+FILE *Frame_Reader_Open(
+    FILE *src, struct Index_Format format, const uint8_t dict[],
+    size_t dict_size
+);
+
+/// @brief Stop reading frames, erroring out unless every byte of them
+///        was read. `src` is left just after them.
+void Frame_Reader_Close(FILE *reader);
+
+#endif
@@ -0,0 +1,507 @@
+// Implementation for 'daemon.h', written by Connor Li (z5425430)
+// A receiver that keeps running, so a sync is one process on the sender's
+// side instead of four, and no index is ever written to disk. The daemon
+// listens on a Unix-domain socket, and each connection is one sync
+// session, exchanged as framed messages:
+//
+//      frame: type (1) | length of payload (8) | payload
+//
+//      sender                          daemon
+//      'A' TABI            ->          stage 2
+//                          <-          'B' TBBI
+//      stage 3
+//      'C' TCBI            ->          stage 4
+//                          <-          'D' (empty, once it's applied)
+//
+// Indexes are held in memory files (memfd), which the stages map, seek
+// and ftell just like the files they'd otherwise write, and are sent
+// with sendfile.
+//
+// Every stage errors out by exiting, and sets the block size and hash of
+// its index as global options, so each session runs in a forked process
+// of its own. The hash cache is loaded and indexed once by the daemon,
+// and every session starts with it already warm. Whatever a session adds
+// to it is appended when the session is done, and the daemon reloads it
+// after reaping the session. Sessions are reaped whenever the daemon
+// wakes up, which is at least every DAEMON_REAP_INTERVAL_MS.
+//
+// A session writes anywhere the daemon can, so the socket is made only
+// accessible to the daemon's user, and a connection from anyone else
+// (e.g. with the socket in a shared directory) is closed unanswered.
+// A daemon holds a lock on "<socket>.lock" for as long as it runs, which
+// says whether the socket is still in use without connecting to it.
+//
+// With --watch, the sender keeps running after its first sync, and each
+// time files change it syncs just those (see watch.c), so the cost of a
+// sync follows how much changed rather than how big the tree is.
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <errno.h>
+#include <signal.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <unistd.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/sendfile.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+#include "daemon.h"
+#include "helpers.h"
+#include "receive.h"
+#include "apply.h"
+#include "cache.h"
+#include "codec.h"
+#include "watch.h"
+#include "rbuoy.h"
+#include "stats.h"
+
+#define DAEMON_FRAME_TYPE_SIZE 1
+#define DAEMON_FRAME_LENGTH_SIZE 8
+#define DAEMON_FRAME_HEAD_SIZE \
+    (DAEMON_FRAME_TYPE_SIZE + DAEMON_FRAME_LENGTH_SIZE)
+
+#define DAEMON_BACKLOG 16
+#define DAEMON_COPY_SIZE (256 * 1024)
+#define DAEMON_REAP_INTERVAL_MS 1000
+#define DAEMON_LOCK_SUFFIX ".lock"
+
+// What the payload of a frame is
+enum Daemon_Frame {
+    DAEMON_FRAME_TABI = 'A',
+    DAEMON_FRAME_TBBI = 'B',
+    DAEMON_FRAME_TCBI = 'C',
+    DAEMON_FRAME_DONE = 'D',
+};
+
+//////////////////////////////////////////////////////////////////////
+//                        FUNCTION PROTOTYPES
+//////////////////////////////////////////////////////////////////////
+
+int daemon_listen(char *socket_path);
+
+void daemon_remove_stale_socket(char *socket_path);
+
+bool daemon_peer_allowed(int sock);
+
+int daemon_connect(char *socket_path);
+
+void daemon_address(char *socket_path, struct sockaddr_un *address);
+
+void daemon_session(int sock);
+
+void daemon_sync_once(
+    char *socket_path, char *in_pathnames[], size_t num_in_pathnames
+);
+
+void daemon_reap(size_t *num_sessions, bool wait);
+
+FILE *daemon_memory_file(char *name, char *open_type);
+
+void daemon_send(int sock, enum Daemon_Frame type, FILE *f);
+
+FILE *daemon_receive(int sock, enum Daemon_Frame type);
+
+void daemon_read_all(int fd, void *data, size_t size);
+
+void daemon_write_all(int fd, const void *data, size_t size);
+
+//////////////////////////////////////////////////////////////////////
+//                        INTERFACE FUNCTIONS
+//////////////////////////////////////////////////////////////////////
+
+void Daemon_Serve(char *socket_path) {
+    int listener = daemon_listen(socket_path);
+    if (rbuoy_options.cache_path != NULL) Cache_Open(rbuoy_options.cache_path);
+
+    // A session whose sender goes away gets EPIPE, rather than being killed
+    signal(SIGPIPE, SIG_IGN);
+
+    size_t num_sessions = 0;
+    for (;;) {
+        // Sessions that have finished are reaped first, so the next one
+        // gets the cache with everything they added, and none is left a
+        // zombie for long while no one connects
+        struct pollfd poll_fd = { .fd = listener, .events = POLLIN };
+        int ready = poll(&poll_fd, 1, DAEMON_REAP_INTERVAL_MS);
+        if (ready < 0 && errno != EINTR) {
+            perror("Error");
+            exit(1);
+        }
+        daemon_reap(&num_sessions, false);
+        if (ready <= 0) continue;
+
+        // The listener doesn't block, in case the connection went away
+        // after it was polled
+        int sock = accept4(listener, NULL, NULL, SOCK_CLOEXEC);
+        if (sock < 0 && (errno == EINTR || errno == ECONNABORTED ||
+            errno == EAGAIN)) continue;
+        if (sock < 0) {
+            perror("Error");
+            exit(1);
+        }
+
+        if (!daemon_peer_allowed(sock)) {
+            close(sock);
+            continue;
+        }
+
+        while (num_sessions >= DAEMON_MAX_SESSIONS) {
+            daemon_reap(&num_sessions, true);
+        }
+
+        pid_t pid = fork();
+        if (pid < 0) {
+            perror("Error");
+            exit(1);
+        }
+        if (pid == 0) {
+            close(listener);
+            daemon_session(sock);
+            exit(0);
+        }
+
+        close(sock);
+        num_sessions++;
+    }
+}
+
+void Daemon_Sync(
+    char *socket_path, char *in_pathnames[], size_t num_in_pathnames
+) {
+    // A hash tree index takes a round trip per round, which isn't part
+    // of a session
+    if (rbuoy_options.merkle || rbuoy_options.refine_path != NULL) {
+        fprintf(stderr, "Error: --sync can't be used with --merkle or --refine\n");
+        exit(1);
+    }
+    stage_1_check_options();
+
+    signal(SIGPIPE, SIG_IGN);
+    if (!rbuoy_options.watch) {
+        daemon_sync_once(socket_path, in_pathnames, num_in_pathnames);
+        return;
+    }
+
+    // Changes are watched for from before the first sync, so none made
+    // while it runs are missed
+    if (num_in_pathnames > 0) {
+        fprintf(stderr, "Error: --watch syncs the whole tree, so takes no pathnames\n");
+        exit(1);
+    }
+    struct Watch *watch = Watch_Start(rbuoy_options.cache_path);
+    daemon_sync_once(socket_path, NULL, 0);
+    for (;;) {
+        struct Watch_Batch batch;
+        Watch_Wait(watch, &batch);
+
+        // Once changes have been lost, only a whole sync will do
+        if (batch.rescan) {
+            daemon_sync_once(socket_path, NULL, 0);
+        } else {
+            daemon_sync_once(socket_path, batch.pathnames, batch.num_pathnames);
+        }
+        Watch_Batch_Free(&batch);
+    }
+}
+
+//////////////////////////////////////////////////////////////////////
+//                           LOCAL HELPERS
+//////////////////////////////////////////////////////////////////////
+
+// Function to make the daemon's socket and start listening on it. It's
+// made with mode 0600, so only the daemon's user can connect.
+int daemon_listen(char *socket_path) {
+    struct sockaddr_un address;
+    daemon_address(socket_path, &address);
+    daemon_remove_stale_socket(socket_path);
+
+    int listener = socket(
+        AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC | SOCK_NONBLOCK, 0
+    );
+    if (listener < 0) {
+        perror("Error");
+        exit(1);
+    }
+
+    // The socket's mode comes from the umask, and there's no fchmod for
+    // one that's bound
+    mode_t old_umask = umask(0177);
+    int bound = bind(listener, (struct sockaddr *) &address, sizeof(address));
+    umask(old_umask);
+    if (bound != 0 || listen(listener, DAEMON_BACKLOG) != 0) {
+        perror("Error");
+        exit(1);
+    }
+
+    return listener;
+}
+
+// Function to remove a socket left behind by a daemon that was killed.
+// Nothing else is removed, and a socket is only stale if no daemon holds
+// its lock file, which this one then holds until it exits.
+void daemon_remove_stale_socket(char *socket_path) {
+    char *lock_path = malloc(strlen(socket_path) + sizeof(DAEMON_LOCK_SUFFIX));
+    if (lock_path == NULL) {
+        perror("Error");
+        exit(1);
+    }
+    sprintf(lock_path, "%s%s", socket_path, DAEMON_LOCK_SUFFIX);
+
+    int lock_fd = open(lock_path, O_RDWR | O_CREAT | O_CLOEXEC, 0600);
+    if (lock_fd < 0) {
+        perror("Error");
+        exit(1);
+    }
+    free(lock_path);
+
+    if (flock(lock_fd, LOCK_EX | LOCK_NB) != 0) {
+        if (errno != EWOULDBLOCK) {
+            perror("Error");
+            exit(1);
+        }
+        fprintf(
+            stderr, "Error: a daemon is already listening on '%s'\n",
+            socket_path
+        );
+        exit(1);
+    }
+
+    struct stat path_stat;
+    if (lstat(socket_path, &path_stat) == 0 && S_ISSOCK(path_stat.st_mode)) {
+        unlink(socket_path);
+    }
+}
+
+// Function to check that a connection is from the daemon's own user. The
+// socket's mode should already see to that, but not every system honours
+// it.
+bool daemon_peer_allowed(int sock) {
+    struct ucred peer;
+    socklen_t length = sizeof(struct ucred);
+    if (getsockopt(sock, SOL_SOCKET, SO_PEERCRED, &peer, &length) != 0) {
+        return false;
+    }
+
+    if (peer.uid != getuid()) {
+        fprintf(
+            stderr, "Error: refused a connection from uid %u\n",
+            (unsigned) peer.uid
+        );
+        return false;
+    }
+
+    return true;
+}
+
+// Function to connect to a daemon's socket
+int daemon_connect(char *socket_path) {
+    struct sockaddr_un address;
+    daemon_address(socket_path, &address);
+
+    int sock = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (sock < 0 ||
+        connect(sock, (struct sockaddr *) &address, sizeof(address)) != 0) {
+        perror("Error");
+        exit(1);
+    }
+
+    return sock;
+}
+
+// Function to fill in the address of a socket, which has to fit in
+// sun_path
+void daemon_address(char *socket_path, struct sockaddr_un *address) {
+    memset(address, 0, sizeof(struct sockaddr_un));
+    address->sun_family = AF_UNIX;
+    if (strlen(socket_path) >= sizeof(address->sun_path)) {
+        fprintf(stderr, "Error: socket path '%s' is too long\n", socket_path);
+        exit(1);
+    }
+    strcpy(address->sun_path, socket_path);
+}
+
+// Function to be the receiver for one sync, in a process of its own
+void daemon_session(int sock) {
+    FILE *tabi = daemon_receive(sock, DAEMON_FRAME_TABI);
+    FILE *tbbi = daemon_memory_file("rbuoy-tbbi", "w+");
+    Stats_Set_Stage(2);
+    Out_Create_TBBI(tabi, tbbi);
+    fclose(tabi);
+    daemon_send(sock, DAEMON_FRAME_TBBI, tbbi);
+    fclose(tbbi);
+
+    // Nothing is hashed after stage 2, so the cache can be written now
+    Cache_Close();
+
+    FILE *tcbi = daemon_receive(sock, DAEMON_FRAME_TCBI);
+    Stats_Set_Stage(4);
+    In_Apply_TCBI(tcbi);
+    fclose(tcbi);
+    daemon_send(sock, DAEMON_FRAME_DONE, NULL);
+    close(sock);
+}
+
+// Function to run one sync session with a daemon, as the sender
+void daemon_sync_once(
+    char *socket_path, char *in_pathnames[], size_t num_in_pathnames
+) {
+    int sock = daemon_connect(socket_path);
+
+    FILE *tabi = daemon_memory_file("rbuoy-tabi", "w+");
+    stage_1_write(tabi, in_pathnames, num_in_pathnames);
+    daemon_send(sock, DAEMON_FRAME_TABI, tabi);
+    fclose(tabi);
+
+    FILE *tbbi = daemon_receive(sock, DAEMON_FRAME_TBBI);
+    FILE *tcbi = daemon_memory_file("rbuoy-tcbi", "w+");
+    Stats_Set_Stage(3);
+    Out_Create_TCBI(tbbi, tcbi);
+    fclose(tbbi);
+    daemon_send(sock, DAEMON_FRAME_TCBI, tcbi);
+    fclose(tcbi);
+
+    fclose(daemon_receive(sock, DAEMON_FRAME_DONE));
+    close(sock);
+}
+
+// Function to reap sessions that have finished, waiting for one if
+// `wait` is set, then reload the cache if any have
+void daemon_reap(size_t *num_sessions, bool wait) {
+    bool reaped = false;
+    for (;;) {
+        int status;
+        pid_t pid = waitpid(-1, &status, (wait && !reaped) ? 0 : WNOHANG);
+        if (pid < 0 && errno == EINTR) continue;
+        if (pid <= 0) break;
+
+        (*num_sessions)--;
+        reaped = true;
+    }
+
+    // The daemon never stores anything itself, and writing out its old
+    // view of the cache would only lose what the sessions added
+    if (reaped) Cache_Reload();
+}
+
+// Function to make an empty file in memory
+FILE *daemon_memory_file(char *name, char *open_type) {
+    int fd = memfd_create(name, MFD_CLOEXEC);
+    FILE *f = (fd < 0) ? NULL : fdopen(fd, open_type);
+    if (f == NULL) {
+        perror("Error");
+        exit(1);
+    }
+
+    return f;
+}
+
+// Function to send the whole of a file as a frame, or an empty frame if
+// there is no file
+void daemon_send(int sock, enum Daemon_Frame type, FILE *f) {
+    uint64_t length = 0;
+    struct stat file_stat;
+    if (f != NULL) {
+        if (fflush(f) != 0 || fstat(fileno(f), &file_stat) != 0) {
+            perror("Error");
+            exit(1);
+        }
+        length = file_stat.st_size;
+    }
+
+    uint8_t head[DAEMON_FRAME_HEAD_SIZE];
+    head[0] = type;
+    Codec_Store_U64(head + DAEMON_FRAME_TYPE_SIZE, length);
+    daemon_write_all(sock, head, DAEMON_FRAME_HEAD_SIZE);
+
+    off_t offset = 0;
+    while ((uint64_t) offset < length) {
+        ssize_t sent = sendfile(sock, fileno(f), &offset, length - offset);
+        if (sent < 0 && errno == EINTR) continue;
+        if (sent <= 0) {
+            perror("Error");
+            exit(1);
+        }
+    }
+}
+
+// Function to receive a frame of the type expected into a file in memory,
+// which is left at its start for reading
+FILE *daemon_receive(int sock, enum Daemon_Frame type) {
+    uint8_t head[DAEMON_FRAME_HEAD_SIZE];
+    daemon_read_all(sock, head, DAEMON_FRAME_HEAD_SIZE);
+    if (head[0] != type) {
+        fprintf(stderr, "Error: expected a '%c' frame, got 0x%02x\n", type, head[0]);
+        exit(1);
+    }
+    uint64_t length = Codec_Load_U64(head + DAEMON_FRAME_TYPE_SIZE);
+
+    FILE *f = daemon_memory_file("rbuoy-frame", "r");
+    uint8_t *buffer = malloc(DAEMON_COPY_SIZE);
+    if (buffer == NULL) {
+        perror("Error");
+        exit(1);
+    }
+
+    while (length > 0) {
+        size_t n = (length < DAEMON_COPY_SIZE) ? length : DAEMON_COPY_SIZE;
+        daemon_read_all(sock, buffer, n);
+        daemon_write_all(fileno(f), buffer, n);
+        length -= n;
+    }
+    free(buffer);
+
+    if (lseek(fileno(f), 0, SEEK_SET) != 0) {
+        perror("Error");
+        exit(1);
+    }
+
+    return f;
+}
+
+// Function to read exactly `size` bytes, erroring out if the other end
+// hangs up first
+void daemon_read_all(int fd, void *data, size_t size) {
+    uint8_t *bytes = data;
+
+    while (size > 0) {
+        ssize_t n = read(fd, bytes, size);
+        if (n < 0 && errno == EINTR) continue;
+        if (n < 0) {
+            perror("Error");
+            exit(1);
+        }
+        if (n == 0) {
+            fprintf(stderr, "Error: the other end of the session hung up\n");
+            exit(1);
+        }
+
+        bytes += n;
+        size -= n;
+    }
+}
+
+// Function to write all of a buffer, erroring out on fail
+void daemon_write_all(int fd, const void *data, size_t size) {
+    const uint8_t *bytes = data;
+
+    while (size > 0) {
+        ssize_t n = write(fd, bytes, size);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) {
+            perror("Error");
+            exit(1);
+        }
+
+        bytes += n;
+        size -= n;
+    }
+}
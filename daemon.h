@@ -0,0 +1,33 @@
+// Header file for daemon.c written by Connor Li (z5425430)
+// For implementation details go to daemon.c.
+
+#ifndef DAEMON_H_
+#define DAEMON_H_
+
+#include <stddef.h>
+
+// How many sync sessions a daemon runs at once. Any more wait to be
+// accepted until one finishes.
+#define DAEMON_MAX_SESSIONS 4
+
+/// @brief Run as the receiver of any number of syncs, from the current
+///        directory, until killed. Each connection to the socket is one
+///        sync, which runs stage 2 and stage 4 in memory.
+///        Only the daemon's own user can connect.
+/// @param socket_path Where the Unix-domain socket is made. A socket
+///                    already there is replaced, unless a daemon is still
+///                    listening on it.
+void Daemon_Serve(char *socket_path);
+
+/// @brief Sync files below the current directory to a daemon, running
+///        stage 1 and stage 3 here and exchanging every index in memory.
+/// @param socket_path The daemon's socket.
+/// @param in_pathnames The files to sync, as for stage 1.
+/// @param num_in_pathnames The length of the `in_pathnames` array. When
+///                         this is zero, everything below the current
+///                         directory is synced.
+void Daemon_Sync(
+    char *socket_path, char *in_pathnames[], size_t num_in_pathnames
+);
+
+#endif
@@ -0,0 +1,248 @@
+// Implementation for 'footer.h', written by Connor Li (z5425430)
+// A wide index can end with a footer: a table of where every record
+// starts, sorted by pathname, so one file's record can be found without
+// reading every record before it. Every field is a fixed 8 bytes, so the
+// table can be binary searched straight out of a mapped index:
+//
+//      number of entries | size of names | names (each nul-terminated)
+//      entries: pathname's offset in names | record's offset in index
+//      trailer: offset of the footer | "TIDX"
+//
+// The trailer is a fixed size at the very end, which is where a reader
+// that can seek starts from. One reading in order (e.g. from a pipe) knows
+// the footer comes after the last record.
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "footer.h"
+#include "helpers.h"
+#include "codec.h"
+
+#define FOOTER_MIN_CAPACITY 64
+#define FOOTER_HEAD_SIZE (2 * FOOTER_FIELD_SIZE)
+
+// One entry while the footer is being sorted
+struct Footer_Entry {
+    const char *pathname;
+    uint64_t offset;
+};
+
+//////////////////////////////////////////////////////////////////////
+//                        FUNCTION PROTOTYPES
+//////////////////////////////////////////////////////////////////////
+
+int footer_entry_compare(const void *a, const void *b);
+
+void footer_write_field(FILE *f, uint64_t value);
+
+uint64_t footer_read_field(FILE *f);
+
+const char *footer_entry_name(const struct Footer *footer, uint64_t entry_n);
+
+void footer_corrupt(void);
+
+//////////////////////////////////////////////////////////////////////
+//                        INTERFACE FUNCTIONS
+//////////////////////////////////////////////////////////////////////
+
+void Footer_Builder_Init(struct Footer_Builder *builder) {
+    memset(builder, 0, sizeof(struct Footer_Builder));
+}
+
+void Footer_Builder_Add(
+    struct Footer_Builder *builder, const char *pathname, uint64_t offset
+) {
+    if (builder->num_entries == builder->capacity) {
+        builder->capacity = (builder->capacity == 0) ?
+            FOOTER_MIN_CAPACITY : builder->capacity * 2;
+        builder->pathnames = realloc(
+            builder->pathnames, sizeof(char *) * builder->capacity
+        );
+        builder->offsets = realloc(
+            builder->offsets, sizeof(uint64_t) * builder->capacity
+        );
+        if (builder->pathnames == NULL || builder->offsets == NULL) {
+            perror("Error");
+            exit(1);
+        }
+    }
+
+    char *copy = strdup(pathname);
+    if (copy == NULL) {
+        perror("Error");
+        exit(1);
+    }
+    builder->pathnames[builder->num_entries] = copy;
+    builder->offsets[builder->num_entries] = offset;
+    builder->num_entries++;
+}
+
+void Footer_Write(FILE *f, struct Footer_Builder *builder, uint64_t offset) {
+    size_t num_entries = builder->num_entries;
+    struct Footer_Entry *entries = malloc(
+        sizeof(struct Footer_Entry) * (num_entries + 1)
+    );
+    if (entries == NULL) {
+        perror("Error");
+        exit(1);
+    }
+
+    uint64_t names_size = 0;
+    for (size_t entry_n = 0; entry_n < num_entries; entry_n++) {
+        entries[entry_n].pathname = builder->pathnames[entry_n];
+        entries[entry_n].offset = builder->offsets[entry_n];
+        names_size += strlen(builder->pathnames[entry_n]) + 1;
+    }
+    qsort(entries, num_entries, sizeof(struct Footer_Entry), footer_entry_compare);
+
+    footer_write_field(f, num_entries);
+    footer_write_field(f, names_size);
+    for (size_t entry_n = 0; entry_n < num_entries; entry_n++) {
+        const char *pathname = entries[entry_n].pathname;
+        fwrite(pathname, sizeof(char), strlen(pathname) + 1, f);
+    }
+
+    uint64_t name_offset = 0;
+    for (size_t entry_n = 0; entry_n < num_entries; entry_n++) {
+        footer_write_field(f, name_offset);
+        footer_write_field(f, entries[entry_n].offset);
+        name_offset += strlen(entries[entry_n].pathname) + 1;
+    }
+
+    footer_write_field(f, offset);
+    fwrite(FOOTER_MAGIC, sizeof(char), FOOTER_MAGIC_SIZE, f);
+
+    for (size_t entry_n = 0; entry_n < num_entries; entry_n++) {
+        free(builder->pathnames[entry_n]);
+    }
+    free(builder->pathnames);
+    free(builder->offsets);
+    free(entries);
+    Footer_Builder_Init(builder);
+}
+
+void Footer_Skip(FILE *f) {
+    uint64_t num_entries = footer_read_field(f);
+    uint64_t names_size = footer_read_field(f);
+    if (num_entries > UINT64_MAX / FOOTER_ENTRY_SIZE) footer_corrupt();
+
+    // The names and entries are only read through
+    uint64_t left = names_size + num_entries * FOOTER_ENTRY_SIZE + FOOTER_FIELD_SIZE;
+    if (left < names_size) footer_corrupt();
+    uint8_t buffer[4096];
+    while (left > 0) {
+        size_t n = (left < sizeof(buffer)) ? left : sizeof(buffer);
+        fread_handler(buffer, sizeof(uint8_t), n, f);
+        left -= n;
+    }
+
+    char magic[FOOTER_MAGIC_SIZE];
+    fread_handler(magic, sizeof(char), FOOTER_MAGIC_SIZE, f);
+    if (memcmp(magic, FOOTER_MAGIC, FOOTER_MAGIC_SIZE) != 0) footer_corrupt();
+}
+
+void Footer_Locate(const uint8_t data[], size_t size, struct Footer *footer) {
+    if (size < FOOTER_TRAILER_SIZE || memcmp(
+        data + size - FOOTER_MAGIC_SIZE, FOOTER_MAGIC, FOOTER_MAGIC_SIZE
+    ) != 0) {
+        footer_corrupt();
+    }
+
+    uint64_t end = size - FOOTER_TRAILER_SIZE;
+    footer->start = Codec_Load_U64(data + end);
+    if (footer->start > end || end - footer->start < FOOTER_HEAD_SIZE) {
+        footer_corrupt();
+    }
+
+    const uint8_t *head = data + footer->start;
+    footer->num_entries = Codec_Load_U64(head);
+    footer->names_size = Codec_Load_U64(head + FOOTER_FIELD_SIZE);
+    footer->names = head + FOOTER_HEAD_SIZE;
+
+    // The names and entries have to fill the footer exactly
+    uint64_t room = end - footer->start - FOOTER_HEAD_SIZE;
+    if (footer->names_size > room ||
+        footer->num_entries > (room - footer->names_size) / FOOTER_ENTRY_SIZE ||
+        footer->num_entries * FOOTER_ENTRY_SIZE != room - footer->names_size) {
+        footer_corrupt();
+    }
+    footer->entries = footer->names + footer->names_size;
+}
+
+uint64_t Footer_Find(const struct Footer *footer, const char *pathname) {
+    uint64_t low = 0;
+    uint64_t high = footer->num_entries;
+
+    while (low < high) {
+        uint64_t middle = low + (high - low) / 2;
+        int order = strcmp(footer_entry_name(footer, middle), pathname);
+        if (order == 0) {
+            return Codec_Load_U64(
+                footer->entries + middle * FOOTER_ENTRY_SIZE + FOOTER_FIELD_SIZE
+            );
+        }
+
+        if (order < 0) {
+            low = middle + 1;
+        } else {
+            high = middle;
+        }
+    }
+
+    return UINT64_MAX;
+}
+
+//////////////////////////////////////////////////////////////////////
+//                           LOCAL HELPERS
+//////////////////////////////////////////////////////////////////////
+
+// Function to order entries by pathname, as strcmp does. Two records of
+// the same file stay in the order they were written.
+int footer_entry_compare(const void *a, const void *b) {
+    const struct Footer_Entry *entry_a = a;
+    const struct Footer_Entry *entry_b = b;
+
+    int order = strcmp(entry_a->pathname, entry_b->pathname);
+    if (order != 0) return order;
+
+    return (entry_a->offset > entry_b->offset) - (entry_a->offset < entry_b->offset);
+}
+
+// Function to write an 8 byte little-endian field
+void footer_write_field(FILE *f, uint64_t value) {
+    uint8_t bytes[FOOTER_FIELD_SIZE];
+    Codec_Store_U64(bytes, value);
+    fwrite(bytes, sizeof(uint8_t), FOOTER_FIELD_SIZE, f);
+}
+
+// Function to read an 8 byte little-endian field
+uint64_t footer_read_field(FILE *f) {
+    uint8_t bytes[FOOTER_FIELD_SIZE];
+    fread_handler(bytes, sizeof(uint8_t), FOOTER_FIELD_SIZE, f);
+
+    return Codec_Load_U64(bytes);
+}
+
+// Function to get the pathname of an entry, checking it ends inside the
+// footer's names
+const char *footer_entry_name(const struct Footer *footer, uint64_t entry_n) {
+    uint64_t name_offset = Codec_Load_U64(
+        footer->entries + entry_n * FOOTER_ENTRY_SIZE
+    );
+    if (name_offset >= footer->names_size || memchr(
+        footer->names + name_offset, '\0', footer->names_size - name_offset
+    ) == NULL) {
+        footer_corrupt();
+    }
+
+    return (const char *) footer->names + name_offset;
+}
+
+// Function to give up on a footer that doesn't add up
+void footer_corrupt(void) {
+    fprintf(stderr, "Error: index footer is corrupt\n");
+    exit(1);
+}
@@ -0,0 +1,74 @@
+// Header file for footer.c written by Connor Li (z5425430)
+// For implementation details go to footer.c.
+
+#ifndef FOOTER_H_
+#define FOOTER_H_
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+// The trailer at the very end of an index with a footer: where the
+// footer starts (8 bytes), then this magic number
+#define FOOTER_MAGIC "TIDX"
+#define FOOTER_MAGIC_SIZE 4
+#define FOOTER_FIELD_SIZE 8
+#define FOOTER_TRAILER_SIZE (FOOTER_FIELD_SIZE + FOOTER_MAGIC_SIZE)
+
+// Each entry of the table is where its pathname is in the footer's names
+// and where its record is in the index, 8 bytes each
+#define FOOTER_ENTRY_SIZE (2 * FOOTER_FIELD_SIZE)
+
+/// @brief The offsets of the records of an index as it is written, to go
+///        in its footer.
+struct Footer_Builder {
+    char **pathnames;
+    uint64_t *offsets;
+    size_t num_entries;
+    size_t capacity;
+};
+
+/// @brief The footer of an index in memory, to look records up in.
+struct Footer {
+    uint64_t start;
+    const uint8_t *names;
+    uint64_t names_size;
+    const uint8_t *entries;
+    uint64_t num_entries;
+};
+
+void Footer_Builder_Init(struct Footer_Builder *builder);
+
+/// @brief Note where a record starts.
+/// @param builder The footer being built.
+/// @param pathname The pathname of the record.
+/// @param offset Where the record starts in the index.
+void Footer_Builder_Add(
+    struct Footer_Builder *builder, const char *pathname, uint64_t offset
+);
+
+/// @brief Write the footer (and trailer) after the last record, then free
+///        the builder.
+/// @param f The index, just after its last record.
+/// @param builder The footer.
+/// @param offset Where the footer starts in the index, which is where `f` is.
+void Footer_Write(FILE *f, struct Footer_Builder *builder, uint64_t offset);
+
+/// @brief Read past the footer of an index that is being read in order,
+///        checking it is all there.
+/// @param f The index, just after its last record.
+void Footer_Skip(FILE *f);
+
+/// @brief Find the footer of an index that is all in memory (or mapped),
+///        from the trailer at its end.
+/// @param data The index.
+/// @param size The size of the index.
+/// @param footer Filled in with the footer.
+void Footer_Locate(const uint8_t data[], size_t size, struct Footer *footer);
+
+/// @brief Look up the record of a pathname, by binary search.
+/// @return Where the record starts, or UINT64_MAX if there isn't one.
+uint64_t Footer_Find(const struct Footer *footer, const char *pathname);
+
+#endif
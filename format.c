@@ -0,0 +1,372 @@
+// Implementation for 'format.h', written by Connor Li (z5425430)
+// Reading and writing the parts of an index that differ between versions.
+//
+// A v1 index has a one byte record count and fixed size fields, which
+// caps it at 255 records, 2^24 blocks a file and 4 GiB files. A wide (v2)
+// index has an eight byte record count, a flags byte and LEB128 varints
+// for every other number, so there are no practical limits:
+//
+//      magic (4) | flags (1) | number of records (8) | records...
+//
+// A wide index whose block size isn't BLOCK_SIZE (or whose blocks are
+// content-defined chunks) has a flag saying so, and log2 of the block
+// size in one more byte before the records.
+//
+// A wide index can also end with a footer after its last record, saying
+// where each file's record is (see footer.c).
+//
+// Everything else about a record (hashes, match bytes, mode, block data)
+// is the same in both versions.
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include "format.h"
+#include "helpers.h"
+#include "rbuoy.h"
+#include "codec.h"
+
+//////////////////////////////////////////////////////////////////////
+//                        FUNCTION PROTOTYPES
+//////////////////////////////////////////////////////////////////////
+
+char *format_magic(struct Index_Format format);
+
+void format_match_magic(struct Index_Format *format, const uint8_t magic[]);
+
+void format_apply_flags(struct Index_Format *format, uint8_t flags);
+
+bool format_has_block_shift(struct Index_Format format);
+
+void format_apply_block_shift(struct Index_Format *format, uint8_t shift);
+
+uint8_t format_block_shift(struct Index_Format format);
+
+uint64_t varint_read(FILE *f);
+
+void varint_check_fits(int byte_n, uint8_t byte);
+
+void varint_write(FILE *f, uint64_t value);
+
+//////////////////////////////////////////////////////////////////////
+//                        INTERFACE FUNCTIONS
+//////////////////////////////////////////////////////////////////////
+
+struct Index_Format Format_Read_Header(
+    FILE *f, enum Index_Type type, uint64_t *num_records
+) {
+    struct Index_Format format = { .type = type, .block_size = BLOCK_SIZE };
+
+    unsigned char magic[MAGIC_SIZE];
+    fread_handler(magic, sizeof(char), MAGIC_SIZE, f);
+    format_match_magic(&format, magic);
+
+    if (!format.wide) {
+        uint8_t num_records_bytes[NUM_RECORDS_SIZE];
+        fread_handler(num_records_bytes, sizeof(uint8_t), NUM_RECORDS_SIZE, f);
+        *num_records = bytes_to_uint(num_records_bytes, NUM_RECORDS_SIZE);
+        return format;
+    }
+
+    uint8_t flags;
+    fread_handler(&flags, sizeof(uint8_t), WIDE_FLAGS_SIZE, f);
+    format_apply_flags(&format, flags);
+
+    uint8_t num_records_bytes[WIDE_NUM_RECORDS_SIZE];
+    fread_handler(num_records_bytes, sizeof(uint8_t), WIDE_NUM_RECORDS_SIZE, f);
+    *num_records = bytes_to_uint(num_records_bytes, WIDE_NUM_RECORDS_SIZE);
+
+    if (flags & WIDE_FLAG_BLOCK_SIZE) {
+        uint8_t shift;
+        fread_handler(&shift, sizeof(uint8_t), WIDE_BLOCK_SHIFT_SIZE, f);
+        format_apply_block_shift(&format, shift);
+    }
+
+    return format;
+}
+
+void Format_Write_Header(
+    FILE *f, struct Index_Format format, uint64_t num_records
+) {
+    if (!format.wide && num_records > 0xFF) {
+        fprintf(stderr, "Error: Too many records (> 255), use --wide");
+        exit(1);
+    }
+
+    // The header is put together first, then written in one go
+    uint8_t header[MAGIC_SIZE + WIDE_FLAGS_SIZE + WIDE_NUM_RECORDS_SIZE +
+        WIDE_BLOCK_SHIFT_SIZE];
+    size_t header_size = MAGIC_SIZE;
+    memcpy(header, format_magic(format), MAGIC_SIZE);
+
+    if (!format.wide) {
+        header[header_size++] = num_records;
+        fwrite(header, sizeof(uint8_t), header_size, f);
+        return;
+    }
+
+    uint8_t flags = format.rolling ? WIDE_FLAG_ROLLING : 0;
+    if (format.block_hash == BLOCK_HASH_XXH64) flags |= WIDE_FLAG_XXH64;
+    if (format.runs) flags |= WIDE_FLAG_RUNS;
+    if (format.compressed) flags |= WIDE_FLAG_DEFLATE;
+    if (format.cdc) flags |= WIDE_FLAG_CDC;
+    if (format.merkle) flags |= WIDE_FLAG_MERKLE;
+    if (format.footer) flags |= WIDE_FLAG_FOOTER;
+    if (format_has_block_shift(format)) flags |= WIDE_FLAG_BLOCK_SIZE;
+    header[header_size++] = flags;
+
+    Codec_Store_U64(header + header_size, num_records);
+    header_size += WIDE_NUM_RECORDS_SIZE;
+
+    if (format_has_block_shift(format)) {
+        header[header_size++] = format_block_shift(format);
+    }
+    fwrite(header, sizeof(uint8_t), header_size, f);
+}
+
+long Format_Header_Size(struct Index_Format format) {
+    if (format.wide) {
+        return MAGIC_SIZE + WIDE_FLAGS_SIZE + WIDE_NUM_RECORDS_SIZE +
+            (format_has_block_shift(format) ? WIDE_BLOCK_SHIFT_SIZE : 0);
+    }
+
+    return MAGIC_SIZE + NUM_RECORDS_SIZE;
+}
+
+struct Index_Format Format_As_Type(
+    struct Index_Format format, enum Index_Type type
+) {
+    format.type = type;
+
+    // A TCBI is the same whether or not its TBBI came from a hash tree
+    if (type == INDEX_TCBI) format.merkle = false;
+    return format;
+}
+
+uint64_t Format_Read_Uint(FILE *f, struct Index_Format format, size_t v1_size) {
+    if (format.wide) return varint_read(f);
+
+    uint8_t bytes[sizeof(uint64_t)];
+    fread_handler(bytes, sizeof(uint8_t), v1_size, f);
+
+    return Codec_Load_Uint(bytes, v1_size);
+}
+
+void Format_Write_Uint(
+    FILE *f, struct Index_Format format, uint64_t value, size_t v1_size
+) {
+    if (format.wide) {
+        varint_write(f, value);
+        return;
+    }
+
+    if (v1_size < sizeof(uint64_t) && (value >> (v1_size * 8)) != 0) {
+        fprintf(
+            stderr, "Error: %lu doesn't fit in a %zu byte field, use --wide",
+            (unsigned long) value, v1_size
+        );
+        exit(1);
+    }
+
+    uint8_t bytes[sizeof(uint64_t)];
+    Codec_Store_Uint(bytes, value, v1_size);
+    fwrite(bytes, sizeof(uint8_t), v1_size, f);
+}
+
+uint64_t Format_Copy_Uint(
+    FILE *src, FILE *dest, struct Index_Format format, size_t v1_size
+) {
+    uint64_t value = Format_Read_Uint(src, format, v1_size);
+    Format_Write_Uint(dest, format, value, v1_size);
+
+    return value;
+}
+
+struct Index_Format Format_Parse_Header(
+    struct Format_Cursor *cursor, enum Index_Type type, uint64_t *num_records
+) {
+    struct Index_Format format = { .type = type, .block_size = BLOCK_SIZE };
+
+    format_match_magic(&format, Format_Parse_Bytes(cursor, MAGIC_SIZE));
+
+    if (!format.wide) {
+        *num_records = Format_Parse_Uint(cursor, format, NUM_RECORDS_SIZE);
+        return format;
+    }
+
+    uint8_t flags = *Format_Parse_Bytes(cursor, WIDE_FLAGS_SIZE);
+    format_apply_flags(&format, flags);
+
+    uint8_t num_records_bytes[WIDE_NUM_RECORDS_SIZE];
+    memcpy(
+        num_records_bytes,
+        Format_Parse_Bytes(cursor, WIDE_NUM_RECORDS_SIZE),
+        WIDE_NUM_RECORDS_SIZE
+    );
+    *num_records = bytes_to_uint(num_records_bytes, WIDE_NUM_RECORDS_SIZE);
+
+    if (flags & WIDE_FLAG_BLOCK_SIZE) {
+        format_apply_block_shift(
+            &format, *Format_Parse_Bytes(cursor, WIDE_BLOCK_SHIFT_SIZE)
+        );
+    }
+
+    return format;
+}
+
+uint64_t Format_Parse_Uint(
+    struct Format_Cursor *cursor, struct Index_Format format, size_t v1_size
+) {
+    if (!format.wide) {
+        return Codec_Load_Uint(Format_Parse_Bytes(cursor, v1_size), v1_size);
+    }
+
+    uint64_t value;
+    size_t num_bytes = Codec_Varint_Decode(cursor->pos, cursor->end, &value);
+    if (num_bytes > 0) {
+        cursor->pos += num_bytes;
+        return value;
+    }
+
+    // Only a bad varint gets this far, so step through it a byte at a
+    // time to find out which error it is
+    for (int byte_n = 0; byte_n < VARINT_MAX_SIZE; byte_n++) {
+        uint8_t byte = *Format_Parse_Bytes(cursor, 1);
+        varint_check_fits(byte_n, byte);
+        if ((byte & CODEC_VARINT_MORE_BIT) == 0) return 0;
+    }
+
+    fprintf(stderr, "Error: varint longer than %d bytes\n", VARINT_MAX_SIZE);
+    exit(1);
+}
+
+const uint8_t *Format_Parse_Bytes(struct Format_Cursor *cursor, size_t size) {
+    if ((size_t) (cursor->end - cursor->pos) < size) {
+        // Say what fread_handler says when the file runs out
+        errno = 0;
+        perror("Read Failed");
+        exit(1);
+    }
+
+    const uint8_t *bytes = cursor->pos;
+    cursor->pos += size;
+
+    return bytes;
+}
+
+//////////////////////////////////////////////////////////////////////
+//                           LOCAL HELPERS
+//////////////////////////////////////////////////////////////////////
+
+// Function to get the magic number of a format
+char *format_magic(struct Index_Format format) {
+    switch (format.type) {
+        case INDEX_TABI: return format.wide ? TYPE_A_WIDE_MAGIC :
+            format.rolling ? TYPE_A_ROLLING_MAGIC : TYPE_A_MAGIC;
+        case INDEX_TBBI: return format.wide ? TYPE_B_WIDE_MAGIC :
+            format.rolling ? TYPE_B_ROLLING_MAGIC : TYPE_B_MAGIC;
+        default: return format.wide ? TYPE_C_WIDE_MAGIC :
+            format.rolling ? TYPE_C_ROLLING_MAGIC : TYPE_C_MAGIC;
+    }
+}
+
+// Function to work out the version of an index from its magic number,
+// trying each variant of its type until one matches
+void format_match_magic(struct Index_Format *format, const uint8_t magic[]) {
+    for (int variant = 0; variant < 3; variant++) {
+        format->wide = (variant == 2);
+        format->rolling = (variant == 1);
+        if (memcmp(magic, format_magic(*format), MAGIC_SIZE) == 0) return;
+    }
+
+    format->wide = false;
+    format->rolling = false;
+    fprintf(stderr, "Error: Invalid file (missing %s)", format_magic(*format));
+    exit(1);
+}
+
+// Function to check and apply the flags byte of a wide index
+void format_apply_flags(struct Index_Format *format, uint8_t flags) {
+    uint8_t known = WIDE_FLAG_ROLLING | WIDE_FLAG_XXH64 | WIDE_FLAG_RUNS |
+        WIDE_FLAG_DEFLATE | WIDE_FLAG_BLOCK_SIZE | WIDE_FLAG_CDC |
+        WIDE_FLAG_MERKLE | WIDE_FLAG_FOOTER;
+    if ((flags & ~known) != 0) {
+        fprintf(stderr, "Error: Unknown flags 0x%02x in header\n", flags);
+        exit(1);
+    }
+    format->rolling = (flags & WIDE_FLAG_ROLLING) != 0;
+    if (flags & WIDE_FLAG_XXH64) format->block_hash = BLOCK_HASH_XXH64;
+    format->runs = (flags & WIDE_FLAG_RUNS) != 0;
+    format->compressed = (flags & WIDE_FLAG_DEFLATE) != 0;
+    format->cdc = (flags & WIDE_FLAG_CDC) != 0;
+    format->merkle = (flags & WIDE_FLAG_MERKLE) != 0;
+    format->footer = (flags & WIDE_FLAG_FOOTER) != 0;
+    bool merkle_conflict = format->merkle && (
+        format->rolling || format->cdc || format->runs ||
+        format->compressed || format->footer
+    );
+    if ((format->cdc && format->rolling) || merkle_conflict) {
+        fprintf(stderr, "Error: Invalid flags 0x%02x in header\n", flags);
+        exit(1);
+    }
+}
+
+// Function to check whether a wide index needs its block size written
+// out, rather than having BLOCK_SIZE blocks
+bool format_has_block_shift(struct Index_Format format) {
+    return format.block_size != BLOCK_SIZE || format.cdc;
+}
+
+// Function to check and apply the block size byte of a wide index
+void format_apply_block_shift(struct Index_Format *format, uint8_t shift) {
+    if (shift >= sizeof(size_t) * 8 || (1ul << shift) < BLOCK_SIZE_MIN ||
+        (1ul << shift) > BLOCK_SIZE_MAX) {
+        fprintf(stderr, "Error: Invalid block size 2^%u in header\n", shift);
+        exit(1);
+    }
+    format->block_size = 1ul << shift;
+}
+
+// Function to get log2 of the block size of an index
+uint8_t format_block_shift(struct Index_Format format) {
+    uint8_t shift = 0;
+    while (((size_t) 1 << shift) < format.block_size) shift++;
+
+    return shift;
+}
+
+// Function to read an unsigned LEB128 varint: 7 bits at a time, lowest
+// first, with the top bit set on every byte but the last.
+uint64_t varint_read(FILE *f) {
+    uint64_t value = 0;
+
+    for (int byte_n = 0; byte_n < VARINT_MAX_SIZE; byte_n++) {
+        uint8_t byte;
+        fread_handler(&byte, sizeof(uint8_t), 1, f);
+        varint_check_fits(byte_n, byte);
+
+        value |= (uint64_t) (byte & CODEC_VARINT_DATA_MASK) <<
+            (byte_n * CODEC_VARINT_DATA_BITS);
+        if ((byte & CODEC_VARINT_MORE_BIT) == 0) return value;
+    }
+
+    fprintf(stderr, "Error: varint longer than %d bytes\n", VARINT_MAX_SIZE);
+    exit(1);
+}
+
+// Function to error out if a byte of a varint would take it past 64 bits.
+// Only the lowest bit of the last byte there can be is left.
+void varint_check_fits(int byte_n, uint8_t byte) {
+    if (byte_n == VARINT_MAX_SIZE - 1 && (byte & CODEC_VARINT_DATA_MASK) > 1) {
+        fprintf(stderr, "Error: varint doesn't fit in 64 bits\n");
+        exit(1);
+    }
+}
+
+// Function to write an unsigned LEB128 varint
+void varint_write(FILE *f, uint64_t value) {
+    uint8_t bytes[CODEC_VARINT_MAX_SIZE];
+    size_t num_bytes = Codec_Varint_Encode(bytes, value);
+
+    fwrite(bytes, sizeof(uint8_t), num_bytes, f);
+}
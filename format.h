@@ -0,0 +1,119 @@
+// Header file for format.c written by Connor Li (z5425430)
+// For implementation details go to format.c.
+
+#ifndef FORMAT_H_
+#define FORMAT_H_
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include "block_hash.h"
+
+/// @brief Which of the three indexes a file is.
+enum Index_Type { INDEX_TABI = 'A', INDEX_TBBI = 'B', INDEX_TCBI = 'C' };
+
+/// @brief Everything the magic number (and v2 flags) say about an index.
+struct Index_Format {
+    enum Index_Type type;
+    bool wide;
+    bool rolling;
+    enum Block_Hash block_hash;
+
+    // A TCBI whose updates each cover a run of changed blocks rather
+    // than one block (wide indexes only)
+    bool runs;
+
+    // A TCBI whose updates (and copies) are deflated, in frames primed
+    // with blocks the receiver already has (wide indexes only)
+    bool compressed;
+
+    // The size of every block but a file's last, or the average size of
+    // a chunk when the blocks are content-defined (wide indexes only)
+    size_t block_size;
+    bool cdc;
+
+    // A TABI (or TBBI) of one round of a hash tree index, whose records
+    // are nodes of a tree rather than every block (wide indexes only)
+    bool merkle;
+
+    // An index that ends with a footer, a table of where each file's
+    // record is (wide indexes only, see footer.h)
+    bool footer;
+};
+
+/// @brief Read and check the header of an index, leaving the file just
+///        after it. Any version of the index is accepted.
+/// @param f The index file, at its start.
+/// @param type The type of index expected.
+/// @param num_records Set to the number of records in the index.
+/// @return The format of the index.
+struct Index_Format Format_Read_Header(
+    FILE *f, enum Index_Type type, uint64_t *num_records
+);
+
+/// @brief Write the header of an index where `f` is, which is its start.
+/// @param f The index file being written.
+/// @param format The format of the index.
+/// @param num_records The number of records in the index.
+void Format_Write_Header(
+    FILE *f, struct Index_Format format, uint64_t num_records
+);
+
+/// @brief The number of bytes taken up by the header of an index.
+/// @param format The format of the index.
+long Format_Header_Size(struct Index_Format format);
+
+/// @brief The same version and options, but for another type of index
+///        (e.g. the TBBI that answers a TABI).
+/// @param format The format to convert.
+/// @param type The type of index wanted.
+struct Index_Format Format_As_Type(
+    struct Index_Format format, enum Index_Type type
+);
+
+/// @brief Read an unsigned field of a record: `v1_size` little-endian
+///        bytes in a v1 index, or a varint in a wide index.
+/// @param f The index file.
+/// @param format The format of the index.
+/// @param v1_size The size of the field in a v1 index.
+uint64_t Format_Read_Uint(FILE *f, struct Index_Format format, size_t v1_size);
+
+/// @brief Write an unsigned field of a record, erroring out if it doesn't
+///        fit in a v1 index.
+/// @param f The index file.
+/// @param format The format of the index.
+/// @param value The value of the field.
+/// @param v1_size The size of the field in a v1 index.
+void Format_Write_Uint(
+    FILE *f, struct Index_Format format, uint64_t value, size_t v1_size
+);
+
+/// @brief Read an unsigned field and write it straight out again.
+/// @return The value of the field.
+uint64_t Format_Copy_Uint(
+    FILE *src, FILE *dest, struct Index_Format format, size_t v1_size
+);
+
+/// @brief A position in an index that is already in memory, for parsing
+///        it without copying. Reading past `end` errors out the same way
+///        a short read of the file would.
+struct Format_Cursor {
+    const uint8_t *pos;
+    const uint8_t *end;
+};
+
+/// @brief Format_Read_Header, but for an index in memory.
+struct Index_Format Format_Parse_Header(
+    struct Format_Cursor *cursor, enum Index_Type type, uint64_t *num_records
+);
+
+/// @brief Format_Read_Uint, but for an index in memory.
+uint64_t Format_Parse_Uint(
+    struct Format_Cursor *cursor, struct Index_Format format, size_t v1_size
+);
+
+/// @brief Step over `size` bytes of an index in memory.
+/// @return Where those bytes are.
+const uint8_t *Format_Parse_Bytes(struct Format_Cursor *cursor, size_t size);
+
+#endif
@@ -0,0 +1,184 @@
+// Implementation for 'hash_io.h', written by Connor Li (z5425430)
+// There are 3 'interface' functions:
+//      - Hash_File_Blocks()
+//      - Hash_File_Range()
+//      - Hash_Buffer_Blocks()
+//
+// The stdio path in helpers.c seeks before every block and freads it,
+// which for a large file is millions of syscalls. These backends instead
+// read the file front to back exactly once, either by mapping it or by
+// streaming it through a large aligned buffer.
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "hash_io.h"
+#include "rolling.h"
+#include "rbuoy.h"
+
+// A multiple of any block size, so only the last read can end mid-block
+#define STREAM_BUFFER_SIZE (4 * 1024 * 1024)
+#define STREAM_BUFFER_ALIGN 4096
+
+//////////////////////////////////////////////////////////////////////
+//                        FUNCTION PROTOTYPES
+//////////////////////////////////////////////////////////////////////
+
+bool hash_mapped(
+    int fd, uint64_t size, uint64_t hashes[], uint32_t weak_hashes[]
+);
+
+bool hash_streamed(
+    int fd, uint64_t size, uint64_t hashes[], uint32_t weak_hashes[]
+);
+
+void hash_streamed_range(
+    int fd, uint64_t offset, uint64_t size,
+    uint64_t hashes[], uint32_t weak_hashes[]
+);
+
+//////////////////////////////////////////////////////////////////////
+//                        INTERFACE FUNCTIONS
+//////////////////////////////////////////////////////////////////////
+
+// The size comes from fstat rather than seeking to the end and back.
+bool Hash_File_Blocks(
+    int fd, uint64_t hashes[], uint32_t weak_hashes[], size_t num_blocks,
+    enum Hash_Backend backend
+) {
+    struct stat stat;
+    if (fstat(fd, &stat) != 0 || !S_ISREG(stat.st_mode)) return false;
+
+    if (number_of_blocks_in_file(stat.st_size) != num_blocks) {
+        fprintf(stderr, "Error: file changed size while being hashed\n");
+        exit(1);
+    }
+    if (num_blocks == 0) return true;
+
+    if (backend == HASH_BACKEND_MMAP || backend == HASH_BACKEND_AUTO) {
+        if (hash_mapped(fd, stat.st_size, hashes, weak_hashes)) return true;
+        if (backend == HASH_BACKEND_MMAP) return false;
+    }
+
+    return hash_streamed(fd, stat.st_size, hashes, weak_hashes);
+}
+
+void Hash_File_Range(
+    int fd, uint64_t file_size, size_t first_block, size_t num_blocks,
+    uint64_t hashes[], uint32_t weak_hashes[], enum Hash_Backend backend
+) {
+    uint64_t offset = (uint64_t) first_block * rbuoy_options.block_size;
+    uint64_t size = (uint64_t) num_blocks * rbuoy_options.block_size;
+    if (offset + size > file_size) size = file_size - offset;
+
+    unsigned char *data = MAP_FAILED;
+    if (backend != HASH_BACKEND_STREAM) {
+        data = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, offset);
+    }
+    if (data == MAP_FAILED) {
+        hash_streamed_range(fd, offset, size, hashes, weak_hashes);
+        return;
+    }
+
+    madvise(data, size, MADV_SEQUENTIAL);
+    Hash_Buffer_Blocks(data, size, hashes, weak_hashes);
+    munmap(data, size);
+}
+
+void Hash_Buffer_Blocks(
+    const unsigned char data[], size_t data_size,
+    uint64_t hashes[], uint32_t weak_hashes[]
+) {
+    Block_Hash_Many(data, data_size, hashes, rbuoy_options.block_hash);
+    if (weak_hashes == NULL) return;
+
+    size_t full_size = rbuoy_options.block_size;
+    size_t num_blocks = number_of_blocks_in_file(data_size);
+    for (size_t block_n = 0; block_n < num_blocks; block_n++) {
+        const unsigned char *block = data + block_n * full_size;
+        size_t block_size = data_size - block_n * full_size;
+        if (block_size > full_size) block_size = full_size;
+
+        weak_hashes[block_n] = weak_hash_block(block, block_size);
+    }
+}
+
+//////////////////////////////////////////////////////////////////////
+//                           LOCAL HELPERS
+//////////////////////////////////////////////////////////////////////
+
+// Function to hash a file by mapping it in whole. The kernel is told the
+// access is sequential so it reads ahead aggressively and drops pages
+// behind us.
+bool hash_mapped(
+    int fd, uint64_t size, uint64_t hashes[], uint32_t weak_hashes[]
+) {
+    if (size > SIZE_MAX) return false;
+
+    unsigned char *data = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (data == MAP_FAILED) return false;
+
+    madvise(data, size, MADV_SEQUENTIAL);
+
+    Hash_Buffer_Blocks(data, size, hashes, weak_hashes);
+
+    munmap(data, size);
+    return true;
+}
+
+// Function to hash a file through a large aligned buffer, for when it
+// can't be mapped.
+bool hash_streamed(
+    int fd, uint64_t size, uint64_t hashes[], uint32_t weak_hashes[]
+) {
+    hash_streamed_range(fd, 0, size, hashes, weak_hashes);
+    return true;
+}
+
+// Function to hash `size` bytes from `offset` through a large aligned
+// buffer. Each read fills the buffer with whole blocks.
+void hash_streamed_range(
+    int fd, uint64_t offset, uint64_t size,
+    uint64_t hashes[], uint32_t weak_hashes[]
+) {
+    unsigned char *buffer;
+    if (posix_memalign(
+        (void **) &buffer, STREAM_BUFFER_ALIGN, STREAM_BUFFER_SIZE
+    ) != 0) {
+        perror("Error");
+        exit(1);
+    }
+
+    uint64_t done = 0;
+    while (done < size) {
+        size_t want = (size - done < STREAM_BUFFER_SIZE) ?
+            size - done : STREAM_BUFFER_SIZE;
+
+        size_t filled = 0;
+        while (filled < want) {
+            ssize_t n = pread(
+                fd, buffer + filled, want - filled, offset + done + filled
+            );
+            if (n < 0 && errno == EINTR) continue;
+            if (n <= 0) {
+                perror("Read Failed");
+                exit(1);
+            }
+            filled += n;
+        }
+
+        size_t block_n = done / rbuoy_options.block_size;
+        Hash_Buffer_Blocks(
+            buffer, filled, hashes + block_n,
+            weak_hashes == NULL ? NULL : weak_hashes + block_n
+        );
+        done += filled;
+    }
+
+    free(buffer);
+}
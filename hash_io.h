@@ -0,0 +1,60 @@
+// Header file for hash_io.c written by Connor Li (z5425430)
+// For implementation details go to hash_io.c.
+
+#ifndef HASH_IO_H_
+#define HASH_IO_H_
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+/// @brief How the blocks of a file are read in to be hashed.
+enum Hash_Backend {
+    HASH_BACKEND_AUTO = 0,  // mmap, then streaming, then stdio
+    HASH_BACKEND_MMAP,      // map the whole file, one linear pass
+    HASH_BACKEND_STREAM,    // large aligned read()s, one linear pass
+    HASH_BACKEND_STDIO,     // original fseek/fread per block
+};
+
+/// @brief Hash every block of a regular file in one linear pass, using
+///        the given backend.
+/// @param fd An open file descriptor of the file to hash.
+/// @param hashes Filled in with the strong hash of every block.
+/// @param weak_hashes If not NULL, filled in with each block's weak checksum.
+/// @param num_blocks The number of blocks expected in the file.
+/// @param backend HASH_BACKEND_MMAP, HASH_BACKEND_STREAM or HASH_BACKEND_AUTO.
+/// @return false if the file can't be hashed this way (e.g. it isn't a
+///         regular file), in which case the caller should fall back to stdio.
+bool Hash_File_Blocks(
+    int fd, uint64_t hashes[], uint32_t weak_hashes[], size_t num_blocks,
+    enum Hash_Backend backend
+);
+
+/// @brief Hash the blocks [first_block, first_block + num_blocks) of a
+///        regular file, so a large file can be split between threads or
+///        hashed a window at a time.
+/// @param fd An open file descriptor of the file to hash.
+/// @param file_size The size of the whole file.
+/// @param first_block The first block to hash. Its offset must be a
+///                    multiple of the page size.
+/// @param num_blocks The number of blocks to hash.
+/// @param hashes Filled in with the hash of each block in the range.
+/// @param weak_hashes If not NULL, filled in with each block's weak checksum.
+/// @param backend HASH_BACKEND_STREAM to read the range, otherwise it is
+///                mapped if it can be.
+void Hash_File_Range(
+    int fd, uint64_t file_size, size_t first_block, size_t num_blocks,
+    uint64_t hashes[], uint32_t weak_hashes[], enum Hash_Backend backend
+);
+
+/// @brief Hash a run of whole blocks that are already in memory.
+/// @param data The bytes of the blocks, `data_size` long.
+/// @param data_size The number of bytes; every block but the last is full.
+/// @param hashes Filled in with the hash of each block.
+/// @param weak_hashes If not NULL, filled in with each block's weak checksum.
+void Hash_Buffer_Blocks(
+    const unsigned char data[], size_t data_size,
+    uint64_t hashes[], uint32_t weak_hashes[]
+);
+
+#endif
@@ -1,32 +1,127 @@
 // Implementation for 'helpers.h', written by Connor Li (z5425430)
-// There are 4 'interface' functions:
+// There are 3 'interface' functions:
 //      - Open_File
 //      - Out_Create_TABI()
-//      - Out_Create_TBBI()
 //      - Out_Create_TCBI()
 //
 // There are also a large number of helper functions.
 
+#define _GNU_SOURCE
+
 #include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <stdint.h>
 #include <sys/stat.h>
 #include <string.h>
 #include <limits.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
 #include "helpers.h"
 #include "rbuoy.h"
+#include "rolling.h"
+#include "hash_io.h"
+#include "parallel.h"
+#include "walk.h"
+#include "cache.h"
+#include "arena.h"
+#include "match.h"
+#include "compress.h"
+#include "cdc.h"
+#include "merkle.h"
+#include "io_engine.h"
+#include "codec.h"
+#include "index_writer.h"
+#include "footer.h"
+#include "stats.h"
 
 #define BITS_IN_BYTE 8
-#define START_BYTE (MAGIC_SIZE + NUM_RECORDS_SIZE)
+#define MAX_3_BYTES 0xFFFFFF
+
+// Runs of changed blocks are read through a buffer this big, unless they
+// are at least ZERO_COPY_MIN_SIZE long. Then they are sent without being
+// copied through it, which isn't worth flushing the TCBI for when short.
+#define RUN_BUFFER_SIZE (64 * 1024)
+#define ZERO_COPY_MIN_SIZE (64 * 1024)
+
+// Files hashed through an I/O engine are read this much at a time, a
+// multiple of every block size. Half the engine's depth can be reads, so
+// opens and stats of the files after them are never stuck behind them.
+#define ASYNC_READ_SIZE (256 * 1024)
+
+// Hashes are written to an index this many at a time
+#define HASH_BATCH_SIZE 512
+
+// The permissions of a mode, which are written as 9 letters
+#define PERMISSION_BITS 0777
+#define PERMISSIONS_SIZE 9
+
+// Where stage 1 gets its pathnames from: the command line, or a walk of
+// the current directory when none were given.
+struct Path_Source {
+    char **pathnames;
+    size_t num_pathnames;
+    size_t next;
+    struct Walker *walker;
+    bool owned;
+};
+
+// Where each record of the TABI being written starts, for its footer
+static struct Footer_Builder tabi_footer;
+
+static char permission_strings[PERMISSION_BITS + 1][PERMISSIONS_SIZE];
+static pthread_once_t permission_strings_once = PTHREAD_ONCE_INIT;
+
+// Where a file being hashed through an I/O engine is up to
+enum Async_State {
+    ASYNC_STAT,
+    ASYNC_OPEN,
+    ASYNC_READ,
+    ASYNC_DONE,
+};
+
+// A file being hashed through an I/O engine, from its stat until its
+// record is written
+struct Async_File {
+    char *pathname;
+    enum Async_State state;
+    struct Io_Request request;
+    bool busy;
+
+    struct statx statx;
+    int fd;
+    uint64_t size;
+    size_t num_blocks;
+    uint64_t *hashes;
+    uint32_t *weak_hashes;
+    struct Cache_Key cache_key;
+    bool cacheable;
+
+    // Where the next read starts, and how many reads are still going
+    uint64_t next_offset;
+    size_t num_reading;
+
+    // When the file was started on, for Stats_File
+    uint64_t started;
+
+    // Too big to hold all of its hashes, so left to be hashed a window
+    // at a time when its record is written
+    bool windowed;
+};
+
+// A read of part of an Async_File
+struct Async_Read {
+    struct Io_Request request;
+    struct Async_File *file;
+    uint8_t *buffer;
+};
 
 //////////////////////////////////////////////////////////////////////
 //                        FUNCTION PROTOTYPES
 //////////////////////////////////////////////////////////////////////
 
-// CONVERTING //
-
-void int_to_bytes(uint64_t num, unsigned char bytes[], int num_bytes);
-
-uint64_t bytes_to_uint(uint8_t bytes[], uint64_t num_bytes);
-
 // FETCHING //
 
 uint64_t file_get_size(FILE *f);
@@ -35,62 +130,163 @@ struct stat file_get_stat(char *pathname);
 
 size_t file_get_num_blocks(long bytes, char *pathname);
 
-void file_get_hashes(FILE *src, uint64_t hashes[], size_t num_blocks);
-
-void file_find_matches(
-    FILE *tabi, uint64_t hashes[], uint8_t match_bytes[], 
-    size_t num_blocks, size_t max_blocks, size_t num_match_bytes
+void file_get_hashes_stdio(
+    FILE *src, uint64_t hashes[], uint32_t weak_hashes[],
+    size_t first_block, size_t num_blocks
 );
 
+bool file_hashes_windowed(FILE *src, size_t num_blocks);
+
 uint64_t block_get_trailing(uint64_t size);
 
 uint64_t block_get_hash(
-    FILE *src, char block[BLOCK_SIZE], int isTrailing, long trailing_size
+    FILE *src, char block[], int isTrailing, long trailing_size
 );
 
-size_t file_get_num_records(FILE *f);
+void out_create_tabi_parallel(
+    FILE *f, struct Path_Source *source, struct Index_Format format
+);
+
+void out_create_tabi_async(
+    FILE *f, struct Path_Source *source, struct Index_Format format
+);
+
+void async_file_start(struct Async_File *file, char *pathname);
+
+void async_file_submit(
+    struct Io_Engine *engine, struct Async_File *file,
+    struct Async_Read *free_reads[], size_t *num_free_reads
+);
+
+void async_file_complete(
+    struct Io_Request *request, struct Index_Format format,
+    struct Async_Read *free_reads[], size_t *num_free_reads
+);
+
+void async_file_write(
+    FILE *f, struct Async_File *file, struct Index_Format format,
+    struct Arena *arena
+);
+
+void path_source_start(
+    struct Path_Source *source, FILE *index,
+    char *in_pathnames[], size_t num_in_pathnames
+);
+
+char *path_source_next(struct Path_Source *source);
+
+void path_source_release(struct Path_Source *source, char *pathname);
+
+void path_source_finish(struct Path_Source *source);
+
+size_t path_source_block_size(struct Path_Source *source);
+
+void out_append_cdc_record(
+    FILE *f, char *pathname, uint64_t size, struct Index_Format format
+);
+
+bool out_start_tabi(
+    FILE *f, struct Path_Source *source, struct Index_Format format
+);
+
+void out_finish_tabi(
+    FILE *f, bool header_written, struct Index_Format format,
+    size_t num_records
+);
+
+uint64_t file_get_index_size(struct stat stat);
+
+void out_write_hash_job(
+    FILE *f, struct Hash_Job *job, struct Index_Format format
+);
+
+void out_write_hash_windows(FILE *f, struct Hash_Job *job);
 
 // APPENDING & COPYING //
 
-void out_append_header(FILE *f, char *magic_number, int num_records);
+void out_append_tabi_record_head(
+    FILE *f, char *pathname, uint64_t size, size_t num_blocks,
+    struct Index_Format format
+);
 
 void file_append_hashes(
-    FILE *src, FILE *dest, uint64_t hashes[], size_t num_hashes
+    FILE *src, FILE *dest, uint64_t hashes[], uint32_t weak_hashes[],
+    size_t num_hashes
 );
 
-void file_append_matches(
-    FILE* src, FILE *dest, char *pathname, size_t num_blocks
+void file_append_all_hashes(
+    FILE *src, FILE *dest, size_t num_blocks, bool rolling,
+    struct Arena *arena
 );
 
-size_t file_append_updates(
-    FILE *src, FILE *tbbi, FILE *tcbi, size_t num_blocks
+void file_append_updates(
+    FILE *src, uint8_t match_bytes[], FILE *tcbi, size_t num_blocks,
+    uint64_t file_size, const struct Chunk_List *chunks,
+    struct Index_Format format, struct Io_Engine *engine,
+    struct Arena *arena
 );
 
-void file_append_size(FILE *f, FILE *src);
+void file_send_updates_async(
+    FILE *src, uint8_t match_bytes[], FILE *tcbi, size_t num_blocks,
+    uint64_t file_size, const struct Chunk_List *chunks,
+    struct Index_Format format, struct Io_Engine *engine,
+    struct Arena *arena
+);
 
-void file_append_type(FILE *f, uint64_t type);
+void file_append_copies(
+    FILE *tbbi, uint8_t match_bytes[], FILE *tcbi, size_t num_blocks,
+    const struct Chunk_List *chunks, struct Index_Format format,
+    struct Arena *arena
+);
 
-void file_append_permissions(FILE *f, uint64_t type);
+void file_append_chunks(
+    FILE *f, struct Chunk_List *chunks, struct Index_Format format
+);
 
-size_t file_copy_num_blocks(FILE *src, FILE *dest);
+void file_append_chunk_lengths(
+    FILE *f, struct Chunk_List *chunks, struct Index_Format format
+);
 
-void file_copy_pathname(
-    FILE* src, FILE* dest, size_t pathname_length, char pathname[]
+void file_append_runs(
+    FILE *src, uint8_t match_bytes[], FILE *tcbi, size_t num_blocks,
+    uint64_t file_size, struct Index_Format format, struct Arena *arena
+);
+
+size_t match_bytes_count_runs(uint8_t match_bytes[], size_t num_blocks);
+
+size_t file_append_dict(
+    FILE *src, uint8_t match_bytes[], FILE *tcbi, size_t num_blocks,
+    uint64_t file_size, struct Index_Format format, uint8_t dict[]
 );
 
-size_t file_copy_pathname_length(FILE* src, FILE* dest);
+void file_send_range(
+    FILE *src, FILE *dest, uint64_t offset, uint64_t length,
+    uint8_t buffer[]
+);
 
-// ERROR CHECKING //
+uint64_t file_send_zero_copy(
+    int src_fd, FILE *dest, uint64_t offset, uint64_t length
+);
 
-void enforce_identifier(FILE *f, char *magic_number);
+void file_append_size(FILE *f, uint64_t size, struct Index_Format format);
 
-void check_eof(FILE *f);
+void file_append_type(FILE *f, uint64_t type);
 
-// FUNCTION WRAPPERS (W/ ERROR CHECKS) //
+void file_append_permissions(FILE *f, uint64_t type);
 
-void fseek_handler(FILE *f, long offset, int whence);
+void permission_strings_fill(void);
 
-void fread_handler(void *ptr, size_t size, size_t n, FILE *stream);
+size_t file_copy_num_blocks(FILE *src, FILE *dest, struct Index_Format format);
+
+void file_copy_pathname(
+    FILE* src, FILE* dest, size_t pathname_length, char pathname[PATH_MAX]
+);
+
+size_t file_copy_pathname_length(
+    FILE* src, FILE* dest, struct Index_Format format
+);
+
+// FUNCTION WRAPPERS (W/ ERROR CHECKS) //
 
 void fputc_handler(FILE *f, int8_t c);
 
@@ -99,9 +295,51 @@ void fputc_handler(FILE *f, int8_t c);
 //////////////////////////////////////////////////////////////////////
 
 // Attempt to open file, and if unable to then either throw error or
-// return NULL pointer depending on if it should throw error or not
+// return NULL pointer depending on if it should throw error or not.
+// Indexes being written go through a large buffer of their own.
+FILE *Index_Open(char *pathname, char *open_type) {
+    if (strcmp(pathname, "-") == 0) {
+        return (open_type[0] == 'r') ? stdin : stdout;
+    }
+
+    if (open_type[0] == 'w') {
+        return Index_Writer_Open(
+            pathname, rbuoy_options.write_buffer_size,
+            rbuoy_options.write_cache
+        );
+    }
+
+    return File_Open(pathname, open_type, HANDLED);
+}
+
+size_t Hash_Window_Blocks(void) {
+    size_t window = HASH_WINDOW_BYTES / rbuoy_options.block_size;
+    window -= window % MATCH_BYTE_BITS;
+
+    return (window < MATCH_BYTE_BITS) ? MATCH_BYTE_BITS : window;
+}
+
+// Buffered writes can fail as late as the final flush, so unlike other
+// files an index's close is checked. stdin and stdout are left open.
+void Index_Close(FILE *f) {
+    int failed = ferror(f);
+    if (f == stdout) {
+        failed |= fflush(f);
+    } else if (f != stdin) {
+        failed |= fclose(f);
+    }
+
+    if (failed) {
+        perror("Error");
+        exit(1);
+    }
+}
+
 FILE *File_Open(char *pathname, char *open_type, enum Open_Errors handled) {
+    uint64_t started = Stats_Start();
     FILE *f = fopen(pathname, open_type);
+    Stats_Stop(STATS_TIMER_OPEN, started);
+    Stats_Add(STATS_OPEN_CALLS, 1);
 
     if (f == NULL) {
         if (handled == HANDLED) {
@@ -117,206 +355,1039 @@ FILE *File_Open(char *pathname, char *open_type, enum Open_Errors handled) {
 }
 
 // Carry out all operations to generate a TABI file from an array of
-// pathnames. Each target file is split into 256 byte blocks and each block is
-// hashed into 8 bytes.
+// pathnames. Each target file is split into blocks of the index's block size
+// (or content-defined chunks with --cdc) and each one is hashed into 8 bytes.
 // Generated by sender.
 void Out_Create_TABI(
-    FILE *f, char *in_pathnames[], size_t num_in_pathnames, char *magic_number
+    FILE *f, char *in_pathnames[], size_t num_in_pathnames,
+    struct Index_Format format
 ) {
-    int counter = 0;
+    // The footer is written at the offsets ftell gives
+    if (format.footer && ftell(f) < 0) {
+        fprintf(stderr, "Error: --footer can't write to a pipe\n");
+        exit(1);
+    }
+    Footer_Builder_Init(&tabi_footer);
+
+    struct Path_Source source;
+    path_source_start(&source, f, in_pathnames, num_in_pathnames);
+
+    // Every stage after this takes the block size from the header
+    if (rbuoy_options.block_size_auto) {
+        format.block_size = path_source_block_size(&source);
+        rbuoy_options.block_size = format.block_size;
+    }
+
+    // Chunks are cut one after another, so can't be read out of order
+    if (rbuoy_options.io_depth > 0 && !format.cdc) {
+        out_create_tabi_async(f, &source, format);
+        path_source_finish(&source);
+        return;
+    }
+
+    if (rbuoy_options.jobs > 1) {
+        out_create_tabi_parallel(f, &source, format);
+        path_source_finish(&source);
+        return;
+    }
+
+    size_t counter = 0;
+    struct Arena arena;
+    Arena_Init(&arena);
 
-    // Set pointer to just after the header
-    fseek_handler(f, START_BYTE, SEEK_SET);
-    for (size_t i = 0; i < num_in_pathnames; i++) {
-        if (counter > UCHAR_MAX) {
-            fprintf(stderr, "Error: Too many files, > %u", UCHAR_MAX);
+    bool header_written = out_start_tabi(f, &source, format);
+    for (
+        char *pathname = path_source_next(&source); pathname != NULL;
+        pathname = path_source_next(&source)
+    ) {
+        if (!format.wide && counter > UCHAR_MAX) {
+            fprintf(stderr, "Error: Too many files, > %u, use --wide", UCHAR_MAX);
             exit(1);
         }
 
+        uint64_t started = Stats_Start();
+
         // Get file status
-        struct stat stat = file_get_stat(in_pathnames[i]);
-
-        // Get path length
-        size_t path_length = strlen(in_pathnames[i]);
-        if ((path_length | USHRT_MAX) > USHRT_MAX) {
-            fprintf(
-                stderr, "Error: file '%s' length > %u", 
-                in_pathnames[i], USHRT_MAX
+        struct stat stat = file_get_stat(pathname);
+        uint64_t size = file_get_index_size(stat);
+
+        if (format.cdc) {
+            out_append_cdc_record(f, pathname, size, format);
+            counter++;
+            Stats_File(pathname, started);
+            path_source_release(&source, pathname);
+            continue;
+        }
+
+        // Get number of blocks
+        size_t num_blocks = file_get_num_blocks(size, pathname);
+
+        out_append_tabi_record_head(f, pathname, size, num_blocks, format);
+
+        counter++;
+
+        if (num_blocks <= 0) {
+            Stats_File(pathname, started);
+            path_source_release(&source, pathname);
+            continue;
+        }
+
+        // Write hashed blocks separately
+        FILE *local_file = File_Open(pathname, "rb", HANDLED);
+        file_append_all_hashes(
+            local_file, f, num_blocks, format.rolling, &arena
+        );
+
+        fclose(local_file);
+        Arena_Reset(&arena);
+        Stats_File(pathname, started);
+        path_source_release(&source, pathname);
+    }
+    out_finish_tabi(f, header_written, format, counter);
+    path_source_finish(&source);
+    Arena_Free(&arena);
+
+    return;
+}
+
+// Function to generate a TCBI file from a TBBI file. This
+// contains data for all updated blocks.
+// Generated by sender.
+void Out_Create_TCBI(FILE* tbbi, FILE *tcbi) {
+    uint64_t num_records;
+    struct Index_Format format = Format_Read_Header(
+        tbbi, INDEX_TBBI, &num_records
+    );
+    struct Index_Format tcbi_format = Format_As_Type(format, INDEX_TCBI);
+    if (rbuoy_options.runs && !format.wide) {
+        fprintf(stderr, "Error: --runs needs a wide TBBI\n");
+        exit(1);
+    }
+    tcbi_format.runs = rbuoy_options.runs;
+    if (rbuoy_options.compress && !format.wide) {
+        fprintf(stderr, "Error: --compress needs a wide TBBI\n");
+        exit(1);
+    }
+    tcbi_format.compressed = rbuoy_options.compress;
+
+    // The footer carries over, but only where its offsets mean something:
+    // not inside compressed frames, nor anywhere on a pipe
+    tcbi_format.footer = format.footer && !tcbi_format.compressed &&
+        ftell(tcbi) >= 0;
+    struct Footer_Builder footer;
+    Footer_Builder_Init(&footer);
+    if (tcbi_format.runs && format.cdc) {
+        fprintf(stderr, "Error: --runs can't be used with a chunked TBBI\n");
+        exit(1);
+    }
+    rbuoy_options.block_size = format.block_size;
+
+    // Compressed records are written through a writer, which compresses
+    // them on the pool while the next ones are read
+    struct Pool *pool = NULL;
+    struct Frame_Writer *writer = NULL;
+    uint8_t *dict = NULL;
+    if (tcbi_format.compressed) {
+        pool = Pool_Create(rbuoy_options.jobs);
+        writer = Frame_Writer_Open(tcbi, tcbi_format, pool);
+        tcbi = Frame_Writer_File(writer);
+        dict = malloc(COMPRESS_DICT_MAX_SIZE);
+        if (dict == NULL) {
+            perror("Error");
+            exit(1);
+        }
+    }
+
+    // Changed blocks are read through an engine, many at a time
+    struct Io_Engine *engine = NULL;
+    if (rbuoy_options.io_depth > 0) {
+        engine = Io_Engine_Create(
+            rbuoy_options.io_depth, rbuoy_options.io_backend
+        );
+    }
+
+    struct Arena arena;
+    Arena_Init(&arena);
+
+    Format_Write_Header(tcbi, tcbi_format, num_records);
+    for (size_t record_n = 0; record_n < num_records; record_n++) {
+        uint64_t started = Stats_Start();
+        long record_offset = ftell(tcbi);
+        size_t pathname_length = file_copy_pathname_length(tbbi, tcbi, format);
+        char pathname[PATH_MAX];
+        file_copy_pathname(tbbi, tcbi, pathname_length, pathname);
+        if (tcbi_format.footer) {
+            Footer_Builder_Add(&footer, pathname, record_offset);
+        }
+
+        size_t num_blocks = Format_Read_Uint(tbbi, format, NUM_BLOCKS_SIZE);
+
+        struct stat stat = file_get_stat(pathname);
+
+        // Directories have no contents to send, so are never opened
+        FILE *local_file = NULL;
+        size_t file_size = 0;
+        if (!S_ISDIR(stat.st_mode)) {
+            local_file = File_Open(pathname, "r", HANDLED);
+            file_size = file_get_size(local_file);
+        }
+
+        // Chunked records are cut again here, the same way as for the
+        // TABI, and the receiver is told where the chunks end
+        struct Chunk_List chunks;
+        memset(&chunks, 0, sizeof(struct Chunk_List));
+        if (format.cdc && local_file != NULL) {
+            Cdc_Chunk_File(
+                fileno(local_file), file_size, format.block_size, false,
+                &chunks
             );
+        }
+        size_t expected_blocks = format.cdc ?
+            chunks.num_chunks : number_of_blocks_in_file(file_size);
+        if (expected_blocks != num_blocks) {
+            fprintf(stderr, "Error: A record has wrong number of blocks");
             exit(1);
         }
 
-        // Get number of 256-byte blocks
-        size_t num_blocks = file_get_num_blocks(
-            stat.st_size, in_pathnames[i]
+        file_append_type(tcbi, stat.st_mode);
+        file_append_permissions(tcbi, stat.st_mode);
+        file_append_size(tcbi, file_size, format);
+        if (format.cdc) {
+            Format_Write_Uint(
+                tcbi, tcbi_format, chunks.num_chunks, NUM_BLOCKS_SIZE
+            );
+            file_append_chunk_lengths(tcbi, &chunks, tcbi_format);
+        }
+        struct Chunk_List *block_chunks = format.cdc ? &chunks : NULL;
+
+        size_t num_match_bytes = num_tbbi_match_bytes(num_blocks);
+        uint8_t *match_bytes = Arena_Alloc(&arena, num_match_bytes);
+        if (format.merkle) {
+            Merkle_Read_Match_Bytes(tbbi, format, num_blocks, match_bytes);
+        } else {
+            fread_handler(match_bytes, sizeof(uint8_t), num_match_bytes, tbbi);
+        }
+        if (Stats_Enabled()) {
+            size_t num_matched = Match_Count(match_bytes, num_blocks, true);
+            Stats_Add(STATS_BLOCKS_MATCHED, num_matched);
+            Stats_Add(STATS_BLOCKS_UNMATCHED, num_blocks - num_matched);
+        }
+
+        if (tcbi_format.compressed) {
+            size_t dict_size = 0;
+            if (local_file != NULL) {
+                dict_size = file_append_dict(
+                    local_file, match_bytes, tcbi, num_blocks, file_size,
+                    tcbi_format, dict
+                );
+            } else {
+                Format_Write_Uint(tcbi, tcbi_format, 0, BLOCK_INDEX_SIZE);
+            }
+            Frame_Writer_Begin(writer, dict, dict_size);
+        }
+
+        if (tcbi_format.runs) {
+            file_append_runs(
+                local_file, match_bytes, tcbi, num_blocks, file_size,
+                tcbi_format, &arena
+            );
+        } else {
+            uint64_t updates_started = Stats_Start();
+            file_append_updates(
+                local_file, match_bytes, tcbi, num_blocks, file_size,
+                block_chunks, format, engine, &arena
+            );
+            Stats_Stop(STATS_TIMER_APPEND_UPDATES, updates_started);
+        }
+
+        // Rolling and chunked records then list blocks the receiver has
+        // elsewhere
+        if (format.rolling || format.cdc) {
+            file_append_copies(
+                tbbi, match_bytes, tcbi, num_blocks, block_chunks, format,
+                &arena
+            );
+        }
+
+        if (tcbi_format.compressed) Frame_Writer_End(writer);
+
+        Chunk_List_Free(&chunks);
+        if (local_file != NULL) fclose(local_file);
+        Arena_Reset(&arena);
+        Stats_File(pathname, started);
+    }
+
+    Arena_Free(&arena);
+    if (format.footer) Footer_Skip(tbbi);
+    check_eof(tbbi);
+    if (engine != NULL) Io_Engine_Destroy(engine);
+    if (tcbi_format.footer) Footer_Write(tcbi, &footer, ftell(tcbi));
+
+    if (tcbi_format.compressed) {
+        Frame_Writer_Close(writer);
+        Pool_Destroy(pool);
+        free(dict);
+    }
+
+    return;
+}
+
+//////////////////////////////////////////////////////////////////////
+//                           LOCAL HELPERS
+//////////////////////////////////////////////////////////////////////
+
+// Function to generate a TABI with `rbuoy_options.jobs` threads. Files
+// are handed to a work-stealing pool in order, and a window of them is
+// kept in flight. Records are written strictly in order as each file
+// finishes, so the output is byte for byte the same as the serial one.
+void out_create_tabi_parallel(
+    FILE *f, struct Path_Source *source, struct Index_Format format
+) {
+    struct Pool *pool = Pool_Create(rbuoy_options.jobs);
+    size_t window = rbuoy_options.jobs * 4;
+    struct Hash_Job *jobs = calloc(window, sizeof(struct Hash_Job));
+    if (jobs == NULL) {
+        perror("Error");
+        exit(1);
+    }
+
+    size_t num_started = 0;
+    size_t next_write = 0;
+
+    bool header_written = out_start_tabi(f, source, format);
+    for (
+        char *pathname = path_source_next(source); pathname != NULL;
+        pathname = path_source_next(source)
+    ) {
+        if (!format.wide && num_started > UCHAR_MAX) {
+            fprintf(stderr, "Error: Too many files, > %u, use --wide", UCHAR_MAX);
+            exit(1);
+        }
+
+        struct stat stat = file_get_stat(pathname);
+
+        // Wait for the oldest file if the window is full
+        if (num_started - next_write == window) {
+            struct Hash_Job *oldest = &jobs[next_write % window];
+            out_write_hash_job(f, oldest, format);
+            Stats_File(oldest->pathname, oldest->started);
+            path_source_release(source, oldest->pathname);
+            next_write++;
+        }
+
+        struct Hash_Job *job = &jobs[num_started % window];
+        job->pathname = pathname;
+        job->file_size = file_get_index_size(stat);
+        job->num_blocks = file_get_num_blocks(job->file_size, pathname);
+        job->chunked = format.cdc;
+        Hash_Job_Start(pool, job, format.rolling);
+        num_started++;
+    }
+
+    while (next_write < num_started) {
+        struct Hash_Job *oldest = &jobs[next_write % window];
+        out_write_hash_job(f, oldest, format);
+        Stats_File(oldest->pathname, oldest->started);
+        path_source_release(source, oldest->pathname);
+        next_write++;
+    }
+
+    Pool_Destroy(pool);
+    free(jobs);
+
+    out_finish_tabi(f, header_written, format, num_started);
+}
+
+// Function to generate a TABI through an I/O engine, for when the files
+// are slow to get at (e.g. on a network filesystem) rather than to hash.
+// A window of files is stat'd, opened and read with many requests in
+// flight, and each part of a file is hashed as soon as it arrives. As
+// with --jobs, records are still written in order as the oldest finish.
+void out_create_tabi_async(
+    FILE *f, struct Path_Source *source, struct Index_Format format
+) {
+    size_t depth = rbuoy_options.io_depth;
+    struct Io_Engine *engine = Io_Engine_Create(depth, rbuoy_options.io_backend);
+
+    size_t window = depth;
+    struct Async_File *files = calloc(window, sizeof(struct Async_File));
+    size_t num_reads = (depth > 1) ? depth / 2 : 1;
+    struct Async_Read *reads = calloc(num_reads, sizeof(struct Async_Read));
+    struct Async_Read **free_reads = malloc(
+        sizeof(struct Async_Read *) * num_reads
+    );
+    uint8_t *read_buffers = malloc((size_t) num_reads * ASYNC_READ_SIZE);
+    if (!files || !reads || !free_reads || !read_buffers) {
+        perror("Error");
+        exit(1);
+    }
+    for (size_t read_n = 0; read_n < num_reads; read_n++) {
+        reads[read_n].buffer = read_buffers + read_n * ASYNC_READ_SIZE;
+        free_reads[read_n] = &reads[read_n];
+    }
+    size_t num_free_reads = num_reads;
+
+    struct Arena arena;
+    Arena_Init(&arena);
+
+    size_t num_started = 0;
+    size_t next_write = 0;
+    bool more_paths = true;
+
+    bool header_written = out_start_tabi(f, source, format);
+    while (true) {
+        while (more_paths && num_started - next_write < window) {
+            char *pathname = path_source_next(source);
+            if (pathname == NULL) {
+                more_paths = false;
+                break;
+            }
+            if (!format.wide && num_started > UCHAR_MAX) {
+                fprintf(stderr, "Error: Too many files, > %u, use --wide", UCHAR_MAX);
+                exit(1);
+            }
+
+            async_file_start(&files[num_started % window], pathname);
+            num_started++;
+        }
+
+        while (
+            next_write < num_started &&
+            files[next_write % window].state == ASYNC_DONE
+        ) {
+            struct Async_File *oldest = &files[next_write % window];
+            async_file_write(f, oldest, format, &arena);
+            Stats_File(oldest->pathname, oldest->started);
+            path_source_release(source, oldest->pathname);
+            next_write++;
+        }
+
+        if (next_write == num_started) {
+            if (!more_paths) break;
+            continue;
+        }
+
+        // The oldest files go first, as they're holding up the rest
+        for (
+            size_t file_n = next_write;
+            file_n < num_started && Io_Engine_Space(engine) > 0; file_n++
+        ) {
+            async_file_submit(
+                engine, &files[file_n % window], free_reads, &num_free_reads
+            );
+        }
+
+        async_file_complete(
+            Io_Engine_Wait(engine), format, free_reads, &num_free_reads
+        );
+    }
+    out_finish_tabi(f, header_written, format, num_started);
+
+    Io_Engine_Destroy(engine);
+    Arena_Free(&arena);
+    free(files);
+    free(reads);
+    free(free_reads);
+    free(read_buffers);
+}
+
+// Function to start a file off at its stat
+void async_file_start(struct Async_File *file, char *pathname) {
+    memset(file, 0, sizeof(struct Async_File));
+    file->pathname = pathname;
+    file->state = ASYNC_STAT;
+    file->fd = -1;
+    file->started = Stats_Start();
+}
+
+// Function to submit whatever a file needs next, as far as there's room:
+// its stat, its open, or reads of as many parts as there are buffers for
+void async_file_submit(
+    struct Io_Engine *engine, struct Async_File *file,
+    struct Async_Read *free_reads[], size_t *num_free_reads
+) {
+    if (file->busy || file->state == ASYNC_DONE) return;
+
+    if (file->state != ASYNC_READ) {
+        file->request.op = (file->state == ASYNC_STAT) ? IO_OP_STAT : IO_OP_OPEN;
+        file->request.pathname = file->pathname;
+        file->request.statx = &file->statx;
+        file->request.tag = file;
+        Io_Engine_Submit(engine, &file->request);
+        file->busy = true;
+        Stats_Add(
+            (file->state == ASYNC_STAT) ? STATS_STAT_CALLS : STATS_OPEN_CALLS, 1
+        );
+        return;
+    }
+
+    while (
+        file->next_offset < file->size && *num_free_reads > 0 &&
+        Io_Engine_Space(engine) > 0
+    ) {
+        struct Async_Read *read = free_reads[--*num_free_reads];
+        uint64_t left = file->size - file->next_offset;
+
+        read->file = file;
+        read->request.op = IO_OP_READ;
+        read->request.fd = file->fd;
+        read->request.buffer = read->buffer;
+        read->request.length = (left < ASYNC_READ_SIZE) ? left : ASYNC_READ_SIZE;
+        read->request.offset = file->next_offset;
+        read->request.tag = read;
+        Io_Engine_Submit(engine, &read->request);
+
+        file->next_offset += read->request.length;
+        file->num_reading++;
+    }
+}
+
+// Function to move a file along once one of its requests has finished.
+// Failures are reported as the serial stage 1 would report them.
+void async_file_complete(
+    struct Io_Request *request, struct Index_Format format,
+    struct Async_Read *free_reads[], size_t *num_free_reads
+) {
+    if (request->op == IO_OP_STAT) {
+        struct Async_File *file = request->tag;
+        file->busy = false;
+        if (request->result < 0) {
+            errno = -request->result;
+            perror("Missing File");
+            exit(1);
+        }
+
+        file->size = S_ISDIR(file->statx.stx_mode) ? 0 : file->statx.stx_size;
+        file->num_blocks = file_get_num_blocks(file->size, file->pathname);
+        file->state = (file->num_blocks == 0) ? ASYNC_DONE : ASYNC_OPEN;
+        return;
+    }
+
+    if (request->op == IO_OP_OPEN) {
+        struct Async_File *file = request->tag;
+        file->busy = false;
+        if (request->result < 0) {
+            errno = -request->result;
+            perror("Error");
+            exit(1);
+        }
+        file->fd = request->result;
+        file->cacheable = Cache_Key_Get(file->fd, &file->cache_key);
+
+        if (file->num_blocks > Hash_Window_Blocks()) {
+            file->windowed = true;
+            file->state = ASYNC_DONE;
+            return;
+        }
+
+        file->hashes = malloc(sizeof(uint64_t) * file->num_blocks);
+        file->weak_hashes = format.rolling ?
+            malloc(sizeof(uint32_t) * file->num_blocks) : NULL;
+        if (file->hashes == NULL || (format.rolling && !file->weak_hashes)) {
+            perror("Error");
+            exit(1);
+        }
+
+        if (file->cacheable && Cache_Lookup(
+            &file->cache_key, file->hashes, file->weak_hashes, file->num_blocks
+        )) {
+            file->state = ASYNC_DONE;
+            return;
+        }
+        file->state = ASYNC_READ;
+        return;
+    }
+
+    struct Async_Read *read = request->tag;
+    struct Async_File *file = read->file;
+    if (request->result < 0) {
+        errno = -request->result;
+        perror("Read Failed");
+        exit(1);
+    }
+    if ((uint64_t) request->result != request->length) {
+        fprintf(stderr, "Error: file changed size while being hashed\n");
+        exit(1);
+    }
+
+    size_t first_block = request->offset / rbuoy_options.block_size;
+    Hash_Buffer_Blocks(
+        read->buffer, request->length, file->hashes + first_block,
+        file->weak_hashes ? file->weak_hashes + first_block : NULL
+    );
+    free_reads[(*num_free_reads)++] = read;
+    file->num_reading--;
+
+    if (file->num_reading == 0 && file->next_offset == file->size) {
+        if (file->cacheable) {
+            Cache_Store(
+                file->fd, &file->cache_key, file->hashes, file->weak_hashes,
+                file->num_blocks
+            );
+        }
+        file->state = ASYNC_DONE;
+    }
+}
+
+// Function to write the record of a finished file, then let it go. A
+// windowed file is only hashed now, the same way as by the serial stage 1.
+void async_file_write(
+    FILE *f, struct Async_File *file, struct Index_Format format,
+    struct Arena *arena
+) {
+    out_append_tabi_record_head(
+        f, file->pathname, file->size, file->num_blocks, format
+    );
+
+    if (file->windowed) {
+        FILE *local_file = fdopen(file->fd, "rb");
+        if (local_file == NULL) {
+            perror("Error");
+            exit(1);
+        }
+        file_append_all_hashes(
+            local_file, f, file->num_blocks, format.rolling, arena
+        );
+        fclose(local_file);
+        Arena_Reset(arena);
+        return;
+    }
+
+    if (file->num_blocks > 0) {
+        file_append_hashes(
+            NULL, f, file->hashes, file->weak_hashes, file->num_blocks
         );
+    }
+
+    free(file->hashes);
+    free(file->weak_hashes);
+    if (file->fd >= 0) close(file->fd);
+}
+
+// Function to get pathnames from the command line or, if there are none,
+// start walking the current directory. The index being written is left
+// out of the walk. An index that can't seek (e.g. a pipe) needs its
+// number of records before any of them, and --block-size auto needs the
+// size of every file, so then the walk is finished up front.
+void path_source_start(
+    struct Path_Source *source, FILE *index,
+    char *in_pathnames[], size_t num_in_pathnames
+) {
+    source->pathnames = in_pathnames;
+    source->num_pathnames = num_in_pathnames;
+    source->next = 0;
+    source->walker = NULL;
+    source->owned = false;
+
+    if (num_in_pathnames > 0) return;
+
+    struct stat stat;
+    if (fstat(Index_Writer_Fileno(index), &stat) != 0) {
+        perror("Error");
+        exit(1);
+    }
+    size_t num_threads = rbuoy_options.jobs > 1 ? rbuoy_options.jobs : 0;
+    source->walker = Walker_Start(num_threads, stat.st_dev, stat.st_ino);
+
+    if (ftell(index) >= 0 && !rbuoy_options.block_size_auto) return;
+
+    size_t capacity = 0;
+    source->pathnames = NULL;
+    for (
+        char *pathname = Walker_Next(source->walker); pathname != NULL;
+        pathname = Walker_Next(source->walker)
+    ) {
+        if (source->num_pathnames == capacity) {
+            capacity = capacity == 0 ? 64 : capacity * 2;
+            source->pathnames = realloc(
+                source->pathnames, sizeof(char *) * capacity
+            );
+            if (source->pathnames == NULL) {
+                perror("Error");
+                exit(1);
+            }
+        }
+        source->pathnames[source->num_pathnames++] = pathname;
+    }
+
+    Walker_Finish(source->walker);
+    source->walker = NULL;
+    source->owned = true;
+}
+
+// Function to get the next pathname to index, or NULL once there are none
+char *path_source_next(struct Path_Source *source) {
+    if (source->walker != NULL) return Walker_Next(source->walker);
+    if (source->next == source->num_pathnames) return NULL;
+
+    return source->pathnames[source->next++];
+}
+
+// Function to let go of a pathname once its record has been written
+void path_source_release(struct Path_Source *source, char *pathname) {
+    if (source->walker != NULL || source->owned) free(pathname);
+}
+
+// Function to stop walking, if we were
+void path_source_finish(struct Path_Source *source) {
+    if (source->walker != NULL) Walker_Finish(source->walker);
+    source->walker = NULL;
+
+    if (source->owned) free(source->pathnames);
+    source->owned = false;
+}
+
+// Function to pick a block size from the largest file to be indexed, as
+// rsync does: about the square root of its size, so both the number of
+// blocks and the size of each only grow with the square root too.
+size_t path_source_block_size(struct Path_Source *source) {
+    uint64_t max_size = 0;
+    for (size_t path_n = 0; path_n < source->num_pathnames; path_n++) {
+        uint64_t size = file_get_index_size(
+            file_get_stat(source->pathnames[path_n])
+        );
+        if (size > max_size) max_size = size;
+    }
+
+    size_t block_size = BLOCK_SIZE;
+    while (
+        block_size < BLOCK_SIZE_MAX &&
+        (uint64_t) block_size * block_size < max_size
+    ) {
+        block_size *= 2;
+    }
+
+    return block_size;
+}
+
+// Function to split a file into content-defined chunks and write its
+// whole record: the head, then the length of every chunk, then the hash
+// of every chunk.
+void out_append_cdc_record(
+    FILE *f, char *pathname, uint64_t size, struct Index_Format format
+) {
+    struct Chunk_List chunks = { 0 };
+    if (size > 0) {
+        int fd = open(pathname, O_RDONLY);
+        if (fd < 0) {
+            perror("Error");
+            exit(1);
+        }
+        Cdc_Chunk_File(fd, size, format.block_size, true, &chunks);
+        close(fd);
+    }
+
+    out_append_tabi_record_head(f, pathname, size, chunks.num_chunks, format);
+    file_append_chunks(f, &chunks, format);
+
+    Chunk_List_Free(&chunks);
+}
+
+// Function to append the chunks of a chunked TABI record: the length of
+// every chunk, then the hash of every chunk
+void file_append_chunks(
+    FILE *f, struct Chunk_List *chunks, struct Index_Format format
+) {
+    file_append_chunk_lengths(f, chunks, format);
+    file_append_hashes(NULL, f, chunks->hashes, NULL, chunks->num_chunks);
+}
+
+// Function to append the length of every chunk of a file
+void file_append_chunk_lengths(
+    FILE *f, struct Chunk_List *chunks, struct Index_Format format
+) {
+    for (size_t chunk_n = 0; chunk_n < chunks->num_chunks; chunk_n++) {
+        Format_Write_Uint(
+            f, format, Block_Length(chunks, chunk_n, 0), UPDATE_LEN_SIZE
+        );
+    }
+}
+
+// Function to write the header of a TABI before its records when the
+// number of them is already known, so the index is written front to back.
+// A walk's count isn't known until it ends, so room is left for the
+// header instead. Returns whether the header was written.
+bool out_start_tabi(
+    FILE *f, struct Path_Source *source, struct Index_Format format
+) {
+    if (source->walker == NULL) {
+        Format_Write_Header(f, format, source->num_pathnames);
+        return true;
+    }
+
+    fseek_handler(f, Format_Header_Size(format), SEEK_SET);
+    return false;
+}
+
+// Function to end a TABI with its footer, if it has one, then go back and
+// fill in its header, if that couldn't be written up front
+void out_finish_tabi(
+    FILE *f, bool header_written, struct Index_Format format,
+    size_t num_records
+) {
+    if (format.footer) Footer_Write(f, &tabi_footer, ftell(f));
+    if (header_written) return;
+
+    fseek_handler(f, 0, SEEK_SET);
+    Format_Write_Header(f, format, num_records);
+}
 
-        unsigned char path_length_bytes[PATHNAME_LEN_SIZE];
-        int_to_bytes(path_length, path_length_bytes, PATHNAME_LEN_SIZE);
+// Function to get the size a file is indexed with. Directories are
+// recorded with no blocks, whatever size the filesystem gives them.
+uint64_t file_get_index_size(struct stat stat) {
+    if (S_ISDIR(stat.st_mode)) return 0;
 
-        unsigned char num_blocks_bytes[NUM_BLOCKS_SIZE];
-        int_to_bytes(num_blocks, num_blocks_bytes, NUM_BLOCKS_SIZE);
+    return stat.st_size;
+}
 
-        // Write record details
-        fwrite(path_length_bytes, sizeof(char), PATHNAME_LEN_SIZE, f);
-        fwrite(in_pathnames[i], sizeof(char), path_length, f);
-        fwrite(num_blocks_bytes, sizeof(char), NUM_BLOCKS_SIZE, f);
+// Function to wait for a file to be hashed, then write its whole record
+void out_write_hash_job(
+    FILE *f, struct Hash_Job *job, struct Index_Format format
+) {
+    uint64_t file_size = job->file_size;
+    Hash_Job_Wait(job);
 
-        // Write hashed blocks separately
-        FILE *local_file = File_Open(in_pathnames[i], "rb", NOT_HANDLED);
+    if (job->chunked) {
+        out_append_tabi_record_head(
+            f, job->pathname, file_size, job->chunks.num_chunks, format
+        );
+        file_append_chunks(f, &job->chunks, format);
+        Hash_Job_Free(job);
+        return;
+    }
 
-        counter++;
+    out_append_tabi_record_head(
+        f, job->pathname, file_size, job->num_blocks, format
+    );
+    if (job->windowed) {
+        out_write_hash_windows(f, job);
+    } else {
+        file_append_hashes(
+            NULL, f, job->hashes, job->weak_hashes, job->num_blocks
+        );
+    }
 
-        if (num_blocks <= 0) continue;
+    Hash_Job_Free(job);
+}
 
-        uint64_t hashes[num_blocks];
+// Function to write the hashes of a file too big to hold every hash of,
+// hashing it a window at a time on the job's pool
+void out_write_hash_windows(FILE *f, struct Hash_Job *job) {
+    size_t window = Hash_Window_Blocks();
+    uint64_t *hashes = malloc(sizeof(uint64_t) * window);
+    uint32_t *weak_hashes = job->weak ?
+        malloc(sizeof(uint32_t) * window) : NULL;
+    if (hashes == NULL || (job->weak && weak_hashes == NULL)) {
+        perror("Error");
+        exit(1);
+    }
 
-        file_get_hashes(local_file, hashes, num_blocks);
-        file_append_hashes(local_file, f, hashes, num_blocks);
+    for (size_t first = 0; first < job->num_blocks; first += window) {
+        size_t count = (job->num_blocks - first < window) ?
+            job->num_blocks - first : window;
 
-        fclose(local_file);
+        Hash_Job_Hash_Window(job, first, count, hashes, weak_hashes);
+        file_append_hashes(NULL, f, hashes, weak_hashes, count);
     }
-    out_append_header(f, magic_number, counter);
 
-    return;
+    free(hashes);
+    free(weak_hashes);
 }
 
-// Carry out all operations to generate a TBBI file from a TABBI file.
-// Generated by receiver.
-void Out_Create_TBBI(FILE *tabi, FILE *tbbi) {
-    enforce_identifier(tabi, TYPE_A_MAGIC);
+// Function to write everything in a TABI record that comes before the
+// hashes: pathname length, pathname, number of blocks and, for rolling
+// records, the size of the file.
+void out_append_tabi_record_head(
+    FILE *f, char *pathname, uint64_t size, size_t num_blocks,
+    struct Index_Format format
+) {
+    // Get path length
+    size_t path_length = strlen(pathname);
+    if (!format.wide && (path_length | USHRT_MAX) > USHRT_MAX) {
+        fprintf(
+            stderr, "Error: file '%s' length > %u", 
+            pathname, USHRT_MAX
+        );
+        exit(1);
+    }
 
-    size_t num_records = file_get_num_records(tabi);
+    if (!format.wide && (num_blocks | MAX_3_BYTES) > MAX_3_BYTES) {
+        fprintf(
+            stderr, "Error: file '%s' too large", 
+            pathname
+        );
+        exit(1);
+    }
 
-    fseek_handler(tabi, START_BYTE, SEEK_SET);
-    fseek_handler(tbbi, START_BYTE, SEEK_SET);
-    for (size_t record_n = 0; record_n < num_records; record_n++) {
-        size_t pathname_length = file_copy_pathname_length(tabi, tbbi);
-        char pathname[pathname_length + 1];
-        file_copy_pathname(tabi, tbbi, pathname_length, pathname);
-        size_t num_blocks = file_copy_num_blocks(tabi, tbbi);
+    if (format.footer) Footer_Builder_Add(&tabi_footer, pathname, ftell(f));
 
-        if (num_blocks == 0) continue;
+    // Write record details
+    Format_Write_Uint(f, format, path_length, PATHNAME_LEN_SIZE);
+    fwrite(pathname, sizeof(char), path_length, f);
+    Format_Write_Uint(f, format, num_blocks, NUM_BLOCKS_SIZE);
 
-        file_append_matches(tabi, tbbi, pathname, num_blocks);
+    // Rolling records also need the size to know the trailing block
+    if (format.rolling) {
+        Format_Write_Uint(f, format, size, FILE_SIZE_SIZE);
     }
-    out_append_header(tbbi, TYPE_B_MAGIC, num_records);
-
-    check_eof(tabi);
-    return;
 }
 
-// Function to generate a TCBI file from a TBBI file. This
-// contains data for all updated blocks.
-// Generated by sender.
-void Out_Create_TCBI(FILE* tbbi, FILE *tcbi) {
-    enforce_identifier(tbbi, TYPE_B_MAGIC);
-
-    size_t num_records = file_get_num_records(tbbi);
+// Function to get all the hashes of a file and return it in a
+// hashes array. Hashes are unsigned 64 bit integers. If `weak_hashes`
+// isn't NULL, the rolling checksum of each block is also filled in.
+// Regular files are hashed in a single pass by hash_io.c, anything else
+// falls back to reading block by block through stdio. With --cache,
+// unchanged files are looked up instead of being read at all.
+void file_get_hashes(
+    FILE *src, uint64_t hashes[], uint32_t weak_hashes[], size_t num_blocks
+) {
+    uint64_t started = Stats_Start();
+    struct Cache_Key key;
+    bool cacheable = Cache_Key_Get(fileno(src), &key);
+    if (cacheable && Cache_Lookup(&key, hashes, weak_hashes, num_blocks)) {
+        Stats_Stop(STATS_TIMER_GET_HASHES, started);
+        return;
+    }
 
-    fseek_handler(tbbi, START_BYTE, SEEK_SET);
-    fseek_handler(tcbi, START_BYTE, SEEK_SET);
-    for (size_t record_n = 0; record_n < num_records; record_n++) {
-        size_t pathname_length = file_copy_pathname_length(tbbi, tcbi);
-        char pathname[pathname_length + 1];
-        file_copy_pathname(tbbi, tcbi, pathname_length, pathname);
+    if (rbuoy_options.hash_backend == HASH_BACKEND_STDIO || !Hash_File_Blocks(
+        fileno(src), hashes, weak_hashes, num_blocks,
+        rbuoy_options.hash_backend
+    )) {
+        file_get_hashes_stdio(src, hashes, weak_hashes, 0, num_blocks);
+    }
 
-        uint8_t num_blocks_bytes[NUM_BLOCKS_SIZE];
-        fread_handler(num_blocks_bytes, sizeof(uint8_t), NUM_BLOCKS_SIZE, tbbi);
-        size_t num_blocks = bytes_to_uint(num_blocks_bytes, NUM_BLOCKS_SIZE);
+    if (cacheable) {
+        Cache_Store(fileno(src), &key, hashes, weak_hashes, num_blocks);
+    }
+    Stats_Stop(STATS_TIMER_GET_HASHES, started);
+}
 
-        struct stat stat = file_get_stat(pathname);
+// Function to get the hashes of blocks [first_block, first_block +
+// num_blocks) of a file by seeking to and reading each block in turn.
+void file_get_hashes_stdio(
+    FILE *src, uint64_t hashes[], uint32_t weak_hashes[],
+    size_t first_block, size_t num_blocks
+) {
+    uint64_t size = file_get_size(src);
 
-        FILE *local_file = File_Open(pathname, "r", HANDLED);
+    const size_t TRAILING_BLOCK = number_of_blocks_in_file(size) - 1;
 
-        size_t file_size = file_get_size(local_file);
-        if (number_of_blocks_in_file(file_size) != num_blocks) {
-            fprintf(stderr, "Error: A record has wrong number of blocks");
-            exit(1);
-        }
+    uint64_t trailing_size = block_get_trailing(size);
+    size_t block_size = rbuoy_options.block_size;
 
-        file_append_type(tcbi, stat.st_mode);
-        file_append_permissions(tcbi, stat.st_mode);
-        file_append_size(tcbi, local_file);
+    char *block = malloc(block_size);
+    if (block == NULL) {
+        perror("Error");
+        exit(1);
+    }
 
-        int64_t update_size_pos = ftell(tcbi); 
-        fseek_handler(tcbi, BLOCK_INDEX_SIZE, SEEK_CUR);
-        size_t num_updates = file_append_updates(
-            local_file, tbbi, tcbi, num_blocks
-        );
+    for (size_t block_n = 0; block_n < num_blocks; block_n++) {
+        size_t block_index = first_block + block_n;
+        fseek_handler(src, block_size * block_index, SEEK_SET);
 
-        int64_t curr_pos = ftell(tcbi); 
+        int isTrailing = (block_index == TRAILING_BLOCK) ? 1 : 0;
 
-        fseek_handler(tcbi, update_size_pos, SEEK_SET);
-        uint8_t size_bytes[BLOCK_INDEX_SIZE];
-        int_to_bytes(num_updates, size_bytes, BLOCK_INDEX_SIZE);
-        fwrite(size_bytes, sizeof(uint8_t), BLOCK_INDEX_SIZE, tcbi);
+        uint64_t hashed_block = block_get_hash(
+            src, block, isTrailing, trailing_size
+        );
 
-        // Return back to original spot
-        fseek_handler(tcbi, curr_pos, SEEK_SET);
+        hashes[block_n] = hashed_block;
 
-        fclose(local_file);
+        if (weak_hashes != NULL) {
+            weak_hashes[block_n] = weak_hash_block(
+                (unsigned char *) block, isTrailing ? trailing_size : block_size
+            );
+        }
     }
 
-    out_append_header(tcbi, TYPE_C_MAGIC, num_records);
-    check_eof(tbbi);
-
-    return;
+    free(block);
 }
 
-//////////////////////////////////////////////////////////////////////
-//                           LOCAL HELPERS
-//////////////////////////////////////////////////////////////////////
-
-// Function that takes in a file and appends the header which includes
-// magic number (TABI, TBBI, TCBI) and number of records. 
-void out_append_header(FILE *f, char *magic_number, int num_records) {
-    fseek_handler(f, 0, SEEK_SET);
-    if (num_records > 0xFF) {
-        fprintf(stderr, "Error: Too many records (> 256)");
-        exit(1);
-    }
-    
-    for (int i = 0; i < MAGIC_SIZE; i++) {
-        fputc(magic_number[i], f);
+// Function to get the hashes of one window of a large file, the same way
+// file_get_hashes would but without the cache.
+void file_get_hashes_range(
+    FILE *src, uint64_t hashes[], uint32_t weak_hashes[],
+    size_t first_block, size_t num_blocks
+) {
+    struct stat stat;
+    if (
+        rbuoy_options.hash_backend == HASH_BACKEND_STDIO ||
+        fstat(fileno(src), &stat) != 0 || !S_ISREG(stat.st_mode)
+    ) {
+        file_get_hashes_stdio(
+            src, hashes, weak_hashes, first_block, num_blocks
+        );
+        return;
     }
 
-    fputc(num_records, f);
-
-    return;
+    Hash_File_Range(
+        fileno(src), stat.st_size, first_block, num_blocks,
+        hashes, weak_hashes, rbuoy_options.hash_backend
+    );
 }
 
-// Function to get all the hashes of a file and return it in a
-// hashes array. Hashes are unsigned 64 bit integers.
-void file_get_hashes(FILE *src, uint64_t hashes[], size_t num_blocks) {
-    const size_t TRAILING_BLOCK = num_blocks - 1;
+// Function to decide whether a file is hashed a window at a time. Small
+// files aren't worth it, and with --cache the whole file is hashed at
+// once since that's how the cache stores it.
+bool file_hashes_windowed(FILE *src, size_t num_blocks) {
+    struct Cache_Key key;
+    if (num_blocks <= Hash_Window_Blocks()) return false;
 
-    uint64_t size = file_get_size(src);
+    return !Cache_Key_Get(fileno(src), &key);
+}
 
-    uint64_t trailing_size = block_get_trailing(size);
+// Function to hash a file and append its hashes, a window at a time for
+// large files so only one window's worth is ever held.
+void file_append_all_hashes(
+    FILE *src, FILE *dest, size_t num_blocks, bool rolling,
+    struct Arena *arena
+) {
+    bool windowed = file_hashes_windowed(src, num_blocks);
+    size_t window = windowed ? Hash_Window_Blocks() : num_blocks;
 
-    for (size_t block_n = 0; block_n < num_blocks; block_n++) {
-        fseek_handler(src, BLOCK_SIZE * block_n, SEEK_SET);
+    uint64_t *hashes = Arena_Alloc_Array(arena, window, sizeof(uint64_t));
+    uint32_t *weak_hashes = rolling ?
+        Arena_Alloc_Array(arena, window, sizeof(uint32_t)) : NULL;
 
-        int isTrailing = (block_n == TRAILING_BLOCK) ? 1 : 0;
+    if (!windowed) {
+        file_get_hashes(src, hashes, weak_hashes, num_blocks);
+        file_append_hashes(src, dest, hashes, weak_hashes, num_blocks);
+        return;
+    }
 
-        char block[BLOCK_SIZE];
-        uint64_t hashed_block = block_get_hash(
-            src, block, isTrailing, trailing_size
-        );
+    if (number_of_blocks_in_file(file_get_size(src)) != num_blocks) {
+        fprintf(stderr, "Error: file changed size while being hashed\n");
+        exit(1);
+    }
 
-        hashes[block_n] = hashed_block;
+    for (size_t first = 0; first < num_blocks; first += window) {
+        size_t count = (num_blocks - first < window) ?
+            num_blocks - first : window;
+
+        file_get_hashes_range(src, hashes, weak_hashes, first, count);
+        file_append_hashes(src, dest, hashes, weak_hashes, count);
     }
 }
 
 // Function to append all the hashes gathered from file_get_hashes.
-// Takes in the file to append to, hashes and number of hashes.
-void file_append_hashes(FILE *src, FILE *dest, uint64_t hashes[], size_t num_hashes) {
-    for (size_t hash_n = 0; hash_n < num_hashes; hash_n++) {
-        unsigned char hashed_chars[HASH_SIZE];
-        int_to_bytes(hashes[hash_n], hashed_chars, HASH_SIZE);
+// Takes in the file to append to, hashes and number of hashes. Rolling
+// records put each block's weak checksum in front of its hash. Hashes
+// are encoded a batch at a time, so each batch is one fwrite.
+void file_append_hashes(
+    FILE *src, FILE *dest, uint64_t hashes[], uint32_t weak_hashes[],
+    size_t num_hashes
+) {
+    uint8_t bytes[HASH_BATCH_SIZE * (WEAK_HASH_SIZE + HASH_SIZE)];
 
-        fwrite(hashed_chars, sizeof(char), HASH_SIZE, dest);
+    for (size_t first = 0; first < num_hashes; first += HASH_BATCH_SIZE) {
+        size_t count = (num_hashes - first < HASH_BATCH_SIZE) ?
+            num_hashes - first : HASH_BATCH_SIZE;
+
+        size_t num_bytes = Codec_Encode_Hashes(
+            bytes, hashes + first,
+            weak_hashes != NULL ? weak_hashes + first : NULL, count
+        );
+        fwrite(bytes, sizeof(uint8_t), num_bytes, dest);
     }
 
     return;
@@ -324,22 +1395,28 @@ void file_append_hashes(FILE *src, FILE *dest, uint64_t hashes[], size_t num_has
 
 // Function to get the size of the trailing block
 uint64_t block_get_trailing(uint64_t size) {
-    uint64_t trailing_size_mod = size % BLOCK_SIZE;
-    // If trailing block size is 256, don't make it equal to 0
-    return (trailing_size_mod == 0) ? BLOCK_SIZE : trailing_size_mod;
+    uint64_t trailing_size_mod = size % rbuoy_options.block_size;
+    // If the trailing block is full, don't make it equal to 0
+    return (trailing_size_mod == 0) ?
+        rbuoy_options.block_size : trailing_size_mod;
 }
 
 // Function to get the hash for a single block
 uint64_t block_get_hash(
-    FILE *src, char block[BLOCK_SIZE], int isTrailing, long trailing_size
+    FILE *src, char block[], int isTrailing, long trailing_size
 ) {
     uint64_t hashed_block;
     if (isTrailing) {
         fread_handler(block, sizeof(char), trailing_size, src);
-        hashed_block = hash_block(block, trailing_size);
+        hashed_block = Block_Hash_One(
+            (unsigned char *) block, trailing_size, rbuoy_options.block_hash
+        );
     } else {
-        fread_handler(block, sizeof(char), BLOCK_SIZE, src);
-        hashed_block = hash_block(block, BLOCK_SIZE);
+        fread_handler(block, sizeof(char), rbuoy_options.block_size, src);
+        hashed_block = Block_Hash_One(
+            (unsigned char *) block, rbuoy_options.block_size,
+            rbuoy_options.block_hash
+        );
     }
 
     return hashed_block;
@@ -350,7 +1427,11 @@ uint64_t block_get_hash(
 struct stat file_get_stat(char *pathname) {
     struct stat buffer;
     int status;
-    if ((status = stat(pathname, &buffer)) != 0) {
+    uint64_t started = Stats_Start();
+    status = stat(pathname, &buffer);
+    Stats_Stop(STATS_TIMER_STAT, started);
+    Stats_Add(STATS_STAT_CALLS, 1);
+    if (status != 0) {
         perror("Missing File");
         exit(1);
     }
@@ -358,29 +1439,16 @@ struct stat file_get_stat(char *pathname) {
     return buffer;
 }
 
-// Function to get num blocks from number of bytes
+// Function to get num blocks from number of bytes. Whether that many fit
+// in the index is checked when the record is written.
 size_t file_get_num_blocks(long bytes, char *pathname) {
-    // LOCAL CONSTS
-    const int MAX_3_BYTES = 0xFFFFFF;
-
-    size_t num_blocks = number_of_blocks_in_file(bytes);
-    if ((num_blocks | MAX_3_BYTES) > MAX_3_BYTES) {
-        fprintf(
-            stderr, "Error: file '%s' too large", 
-            pathname
-        );
-        exit(1);
-    }
-
-    return num_blocks;
+    return number_of_blocks_in_file(bytes);
 }
 
-// Function that takes in an array of bytes and number of bytes
+// Function that takes in an array of bytes and number of bytes, and
+// writes the number into them little-endian
 void int_to_bytes(uint64_t num, unsigned char bytes[], int num_bytes) {
-    // Put largest number in biggest index to make little-endian
-    for (int i = num_bytes - 1; i >= 0; i--) {
-        bytes[i] = (num >> i * BITS_IN_BYTE) & 0xFF;
-    }
+    Codec_Store_Uint(bytes, num, num_bytes);
 }
 
 // Simple function that call fseek but errors out on fail
@@ -401,15 +1469,9 @@ void fread_handler(void *ptr, size_t size, size_t n, FILE *stream) {
     }
 }
 
-// Function to convert an array of bytes into an int
-uint64_t bytes_to_uint(uint8_t bytes[], uint64_t num_bytes) {
-    uint64_t converted = 0;
-
-    for (uint64_t byte_n = 0; byte_n < num_bytes; byte_n++) {
-        converted += ((uint64_t)bytes[byte_n] << (byte_n * BITS_IN_BYTE));
-    }
-
-    return converted;
+// Function to convert an array of little-endian bytes into an int
+uint64_t bytes_to_uint(const uint8_t bytes[], uint64_t num_bytes) {
+    return Codec_Load_Uint(bytes, num_bytes);
 }
 
 // Function to get the byte size of a given file
@@ -424,23 +1486,6 @@ uint64_t file_get_size(FILE *f) {
     return size;
 }
 
-// Function to enforce the identifier for the file 
-// (TABI, TBBI, TCBI). If no identifier is present, throw error
-void enforce_identifier(FILE *f, char *magic_number) {
-    unsigned char magic[MAGIC_SIZE];
-    fread_handler(magic, sizeof(char), MAGIC_SIZE, f);
-
-    for (size_t i = 0; i < MAGIC_SIZE; i++) {
-        if (magic[i] != magic_number[i]) {
-            fprintf(stderr, "Error: Invalid file (missing TABI)");
-            exit(1);
-        }
-    }
-
-    fseek_handler(f, 0, SEEK_SET);
-    return;
-}
-
 // Function to check the given file for EOF
 void check_eof(FILE *f) {
     if (fgetc(f) != EOF) {
@@ -449,211 +1494,416 @@ void check_eof(FILE *f) {
     }
 }
 
-// Function to get all the matches between two files
-void file_find_matches(
-    FILE *tabi, uint64_t hashes[], uint8_t match_bytes[], 
-    size_t num_blocks, size_t max_blocks, size_t num_match_bytes
-) {
-    uint64_t match_index = 0;
-
-    // Cover for first byte. Should have at least 1 byte but just in case.
-    if (num_match_bytes > 0) match_bytes[0] = 0;
-
-    for (size_t block_n = 0; block_n < num_blocks; block_n++) {
-        if (block_n % 8 == 0 && block_n != 0) {
-            match_index++;
-            match_bytes[match_index] = 0;
-        } else {
-            match_bytes[match_index] = match_bytes[match_index] << 1;
-        }
+// Function to copy the pathname length from a source file to destination
+size_t file_copy_pathname_length(
+    FILE* src, FILE* dest, struct Index_Format format
+) { 
+    return Format_Copy_Uint(src, dest, format, PATHNAME_LEN_SIZE);
+}
 
-        uint8_t buffer[HASH_SIZE];
-        fread_handler(buffer, sizeof(char), HASH_SIZE, tabi);
+// Function to copy the pathname from a source file to destination
+void file_copy_pathname(
+    FILE* src, FILE* dest, size_t pathname_length, char pathname[PATH_MAX]
+) { 
+    if (pathname_length >= PATH_MAX) {
+        fprintf(stderr, "Error: pathname too long\n");
+        exit(1);
+    }
 
-        if (block_n >= max_blocks) continue;
+    fread_handler(
+        pathname, sizeof(char), pathname_length, src
+    );
+    pathname[pathname_length] = '\0';
 
-        uint64_t src_block_hash = bytes_to_uint(buffer, HASH_SIZE);
-        // If they are the same hash, then this block is a match
-        if (src_block_hash == hashes[block_n]) {
-            match_bytes[match_index] |= 0x01;
-        }
+    fwrite(pathname, sizeof(char), pathname_length, dest);
+}
 
-        if (block_n == num_blocks - 1) {
-            uint8_t right_padding_amount = 7 - (block_n % 8);
-            match_bytes[match_index] <<=  right_padding_amount;
-        }
-    }
+// Function to copy num blocks from a source file to destination
+size_t file_copy_num_blocks(FILE *src, FILE *dest, struct Index_Format format) {
+    return Format_Copy_Uint(src, dest, format, NUM_BLOCKS_SIZE);
 }
 
-// Function to take all the matches from file_find_matches,
-// and append them to the destination file.
-void file_append_matches(
-    FILE* src, FILE *dest, char *pathname, size_t num_blocks
+// Function to get and append updates, preceded by how many there are.
+// Only the changed blocks are visited, found a word of match bytes at a
+// time rather than bit by bit. The blocks are `chunks`, if the record has
+// content-defined ones.
+void file_append_updates(
+    FILE *src, uint8_t match_bytes[], FILE *tcbi, size_t num_blocks,
+    uint64_t file_size, const struct Chunk_List *chunks,
+    struct Index_Format format, struct Io_Engine *engine,
+    struct Arena *arena
 ) {
-    FILE *local_file = File_Open(pathname, "r", NOT_HANDLED);
+    size_t num_updates = Match_Count(match_bytes, num_blocks, false);
+    Format_Write_Uint(tcbi, format, num_updates, BLOCK_INDEX_SIZE);
 
-    size_t num_local_blocks = file_get_num_blocks(
-        file_get_size(local_file),
-        pathname
-    );
+    if (num_blocks == 0) return;
 
-    // If file not found or no blocks, then matches is 0
-    size_t num_match_bytes = num_tbbi_match_bytes(num_blocks);
-    uint8_t match_bytes[num_match_bytes];
-    
-    if (local_file == NULL || num_local_blocks == 0) {
-        uint64_t placeholder_array[1];
-        file_find_matches(
-            src, placeholder_array, match_bytes, 
-            num_blocks, 0, num_match_bytes
-        );
-    } else {
-        uint64_t hashes[num_local_blocks];
-        file_get_hashes(local_file, hashes, num_local_blocks);
+    if (!Match_Padding_Clear(match_bytes, num_blocks)) {
+        fprintf(stderr, "Error: Record has been incorrectly padded");
+        exit(1);
+    }
 
-        size_t max_num_blocks = (num_blocks > num_local_blocks) ? 
-        num_local_blocks : num_blocks;
+    if (num_updates == 0) return;
 
-        file_find_matches(
-            src, hashes, match_bytes, 
-            num_blocks, max_num_blocks, num_match_bytes
+    if (engine != NULL) {
+        file_send_updates_async(
+            src, match_bytes, tcbi, num_blocks, file_size, chunks, format,
+            engine, arena
         );
+        return;
     }
 
-    fwrite(match_bytes, sizeof(char), num_match_bytes, dest);
-    if (local_file != NULL) fclose(local_file);
+    uint8_t *buffer = Arena_Alloc(arena, RUN_BUFFER_SIZE);
+
+    struct Match_Iter iter;
+    Match_Iter_Start(&iter, match_bytes, num_blocks, false);
+    for (
+        size_t block_index = Match_Iter_Next(&iter); block_index < num_blocks;
+        block_index = Match_Iter_Next(&iter)
+    ) {
+        // Get the update length (i.e. block length)
+        size_t update_length = Block_Length(chunks, block_index, file_size);
+
+        // Write in that order (block_index, update_length, block data)
+        Format_Write_Uint(tcbi, format, block_index, BLOCK_INDEX_SIZE);
+        Format_Write_Uint(tcbi, format, update_length, UPDATE_LEN_SIZE);
+        file_send_range(
+            src, tcbi, Block_Offset(chunks, block_index), update_length,
+            buffer
+        );
+    }
 }
 
-// Function to copy the pathname length from a source file to destination
-size_t file_copy_pathname_length(FILE* src, FILE* dest) { 
-    uint8_t pathname_length_bytes[PATHNAME_LEN_SIZE];
-    fread_handler(
-        pathname_length_bytes, sizeof(char), PATHNAME_LEN_SIZE, src
-    );
-    size_t pathname_length = bytes_to_uint(
-        pathname_length_bytes, PATHNAME_LEN_SIZE
+// Function to send the changed blocks of a record through an I/O engine.
+// Blocks are read many at a time, into a ring of buffers, and each is
+// written out (in order) once it and every block before it has arrived.
+void file_send_updates_async(
+    FILE *src, uint8_t match_bytes[], FILE *tcbi, size_t num_blocks,
+    uint64_t file_size, const struct Chunk_List *chunks,
+    struct Index_Format format, struct Io_Engine *engine,
+    struct Arena *arena
+) {
+    size_t num_updates = Match_Count(match_bytes, num_blocks, false);
+    size_t num_slots = Io_Engine_Space(engine);
+    if (num_slots > num_updates) num_slots = num_updates;
+
+    // Every slot's buffer fits the longest changed block
+    size_t slot_size = 0;
+    struct Match_Iter iter;
+    Match_Iter_Start(&iter, match_bytes, num_blocks, false);
+    for (
+        size_t block_index = Match_Iter_Next(&iter); block_index < num_blocks;
+        block_index = Match_Iter_Next(&iter)
+    ) {
+        size_t length = Block_Length(chunks, block_index, file_size);
+        if (length > slot_size) slot_size = length;
+    }
+
+    struct Io_Request *slots = Arena_Alloc_Array(
+        arena, num_slots, sizeof(struct Io_Request)
     );
+    size_t *slot_blocks = Arena_Alloc_Array(arena, num_slots, sizeof(size_t));
+    bool *slot_done = Arena_Alloc_Array(arena, num_slots, sizeof(bool));
+    uint8_t *buffers = Arena_Alloc_Array(arena, num_slots, slot_size);
+
+    Match_Iter_Start(&iter, match_bytes, num_blocks, false);
+    size_t num_submitted = 0;
+    size_t num_written = 0;
+    while (num_written < num_updates) {
+        while (
+            num_submitted < num_updates &&
+            num_submitted - num_written < num_slots
+        ) {
+            size_t slot_n = num_submitted % num_slots;
+            size_t block_index = Match_Iter_Next(&iter);
+            struct Io_Request *request = &slots[slot_n];
+
+            request->op = IO_OP_READ;
+            request->fd = fileno(src);
+            request->buffer = buffers + slot_n * slot_size;
+            request->length = Block_Length(chunks, block_index, file_size);
+            request->offset = Block_Offset(chunks, block_index);
+            request->tag = &slot_done[slot_n];
+            slot_blocks[slot_n] = block_index;
+            slot_done[slot_n] = false;
+            Io_Engine_Submit(engine, request);
+            num_submitted++;
+        }
+
+        size_t slot_n = num_written % num_slots;
+        if (!slot_done[slot_n]) {
+            struct Io_Request *request = Io_Engine_Wait(engine);
+            *(bool *) request->tag = true;
+            continue;
+        }
 
-    fwrite(pathname_length_bytes, sizeof(char), PATHNAME_LEN_SIZE, dest);
+        struct Io_Request *request = &slots[slot_n];
+        if (request->result < 0 || (size_t) request->result != request->length) {
+            errno = (request->result < 0) ? -request->result : EIO;
+            perror("Read Failed");
+            exit(1);
+        }
 
-    return pathname_length;
+        // Write in that order (block_index, update_length, block data)
+        Format_Write_Uint(tcbi, format, slot_blocks[slot_n], BLOCK_INDEX_SIZE);
+        Format_Write_Uint(tcbi, format, request->length, UPDATE_LEN_SIZE);
+        fwrite(request->buffer, sizeof(uint8_t), request->length, tcbi);
+        num_written++;
+    }
 }
 
-// Function to copy the pathname from a source file to destination
-void file_copy_pathname(
-    FILE* src, FILE* dest, size_t pathname_length, char pathname[]
-) { 
-    fread_handler(
-        pathname, sizeof(char), pathname_length, src
-    );
-    pathname[pathname_length] = '\0';
+// Function to append the updates of a record as runs of consecutive
+// changed blocks, preceded by how many runs there are. Each run is its
+// first block and its length in bytes, then its data.
+void file_append_runs(
+    FILE *src, uint8_t match_bytes[], FILE *tcbi, size_t num_blocks,
+    uint64_t file_size, struct Index_Format format, struct Arena *arena
+) {
+    size_t num_runs = match_bytes_count_runs(match_bytes, num_blocks);
+    Format_Write_Uint(tcbi, format, num_runs, BLOCK_INDEX_SIZE);
 
-    fwrite(pathname, sizeof(char), pathname_length, dest);
-}
+    if (num_runs == 0) return;
 
-// Function to copy num blocks from a source file to destination
-size_t file_copy_num_blocks(FILE *src, FILE *dest) {
-    uint8_t num_blocks_bytes[NUM_BLOCKS_SIZE];
-    fread_handler(
-        num_blocks_bytes, sizeof(char), NUM_BLOCKS_SIZE, src
-    );
+    uint8_t *buffer = Arena_Alloc(arena, RUN_BUFFER_SIZE);
 
-    fwrite(num_blocks_bytes, sizeof(char), NUM_BLOCKS_SIZE, dest);
+    struct Match_Iter iter;
+    Match_Iter_Start(&iter, match_bytes, num_blocks, false);
+    size_t block_n = Match_Iter_Next(&iter);
+    while (block_n < num_blocks) {
+        size_t first_block = block_n;
+        size_t end_block = first_block + 1;
+        while (
+            (block_n = Match_Iter_Next(&iter)) < num_blocks &&
+            block_n == end_block
+        ) {
+            end_block++;
+        }
+
+        uint64_t offset = Block_Offset(NULL, first_block);
+        uint64_t end = Block_Offset(NULL, end_block);
+        if (end > file_size) end = file_size;
 
-    return bytes_to_uint(num_blocks_bytes, NUM_BLOCKS_SIZE);;
+        Format_Write_Uint(tcbi, format, first_block, BLOCK_INDEX_SIZE);
+        Format_Write_Uint(tcbi, format, end - offset, UPDATE_LEN_SIZE);
+        file_send_range(src, tcbi, offset, end - offset, buffer);
+    }
 }
 
-// Function to get the number of records
-size_t file_get_num_records(FILE *f) {
-    fseek_handler(f, MAGIC_SIZE, SEEK_SET);
-    unsigned char num_record_char[NUM_RECORDS_SIZE];
-    fread_handler(num_record_char, sizeof(char), NUM_RECORDS_SIZE, f);
-    fseek_handler(f, 0, SEEK_SET);
+// Function to count the runs of consecutive changed blocks in a record,
+// checking the padding on the way
+size_t match_bytes_count_runs(uint8_t match_bytes[], size_t num_blocks) {
+    if (!Match_Padding_Clear(match_bytes, num_blocks)) {
+        fprintf(stderr, "Error: Record has been incorrectly padded");
+        exit(1);
+    }
 
-    return bytes_to_uint(num_record_char, 1); 
+    size_t num_runs = 0;
+    size_t end_block = SIZE_MAX;
+
+    struct Match_Iter iter;
+    Match_Iter_Start(&iter, match_bytes, num_blocks, false);
+    for (
+        size_t block_n = Match_Iter_Next(&iter); block_n < num_blocks;
+        block_n = Match_Iter_Next(&iter)
+    ) {
+        if (block_n != end_block) num_runs++;
+        end_block = block_n + 1;
+    }
+
+    return num_runs;
 }
 
-// Function to get and append updates. This maybe could've been split into
-// another function, but for now tis quite ugly.
-size_t file_append_updates(
-    FILE *src, FILE *tbbi, FILE *tcbi, size_t num_blocks
+// Function to pick the matched blocks a compressed record's dictionary is
+// made of, append them (a count, then the gap before each one) and read
+// them into `dict`. These are the ones just before the first changed
+// block, then the ones after it, as those are the likeliest to look like
+// the changes. Only the first COMPRESS_DICT_MAX_SIZE bytes of them are
+// used. Returns the size of the dictionary.
+size_t file_append_dict(
+    FILE *src, uint8_t match_bytes[], FILE *tcbi, size_t num_blocks,
+    uint64_t file_size, struct Index_Format format, uint8_t dict[]
 ) {
-    if (num_blocks == 0) return 0;
+    size_t blocks[COMPRESS_DICT_MAX_SIZE / BLOCK_SIZE_MIN];
+    size_t max_blocks = (COMPRESS_DICT_MAX_SIZE + format.block_size - 1) /
+        format.block_size;
+    size_t num_dict_blocks = 0;
+    size_t first_block = 0;
+
+    struct Match_Iter iter;
+    Match_Iter_Start(&iter, match_bytes, num_blocks, false);
+    size_t first_changed = Match_Iter_Next(&iter);
+
+    // Rolling (and chunked) records' matches are somewhere else in the
+    // receiver's file
+    if (first_changed < num_blocks && !format.rolling && !format.cdc) {
+        Match_Iter_Start(&iter, match_bytes, num_blocks, true);
+        for (
+            size_t block_n = Match_Iter_Next(&iter); block_n < num_blocks;
+            block_n = Match_Iter_Next(&iter)
+        ) {
+            if (block_n < first_changed) {
+                // Keep the last few before it, in a ring
+                blocks[(first_block + num_dict_blocks) % max_blocks] = block_n;
+                if (num_dict_blocks < max_blocks) {
+                    num_dict_blocks++;
+                } else {
+                    first_block = (first_block + 1) % max_blocks;
+                }
+            } else if (num_dict_blocks < max_blocks) {
+                blocks[(first_block + num_dict_blocks) % max_blocks] = block_n;
+                num_dict_blocks++;
+            } else {
+                break;
+            }
+        }
+    }
 
-    size_t num_match_bytes = num_tbbi_match_bytes(num_blocks);
+    Format_Write_Uint(tcbi, format, num_dict_blocks, BLOCK_INDEX_SIZE);
 
-    size_t counter = 0;
+    size_t dict_size = 0;
+    size_t next_block = 0;
+    for (size_t dict_n = 0; dict_n < num_dict_blocks; dict_n++) {
+        size_t block_n = blocks[(first_block + dict_n) % max_blocks];
+        Format_Write_Uint(
+            tcbi, format, block_n - next_block, BLOCK_INDEX_SIZE
+        );
+        next_block = block_n + 1;
 
-    uint8_t match_bytes[num_match_bytes];
-    fread_handler(match_bytes, sizeof(uint8_t), num_match_bytes, tbbi);
+        uint64_t offset = Block_Offset(NULL, block_n);
+        size_t length = Block_Length(NULL, block_n, file_size);
+        if (length > COMPRESS_DICT_MAX_SIZE - dict_size) {
+            length = COMPRESS_DICT_MAX_SIZE - dict_size;
+        }
+        if (pread(fileno(src), dict + dict_size, length, offset) != (ssize_t) length) {
+            perror("Read Failed");
+            exit(1);
+        }
+        dict_size += length;
+    }
 
-    for (
-        size_t match_byte_n = 0; match_byte_n < num_match_bytes; match_byte_n++
-    ) {
-        size_t block_n = 0;
+    return dict_size;
+}
 
-        while (
-            (block_n < MATCH_BYTE_BITS) && 
-            ((match_byte_n * MATCH_BYTE_BITS + block_n) < num_blocks)
-        ) {
-            if ((match_bytes[match_byte_n] & 0x80) != 0x80) {
-                // Get the block's index
-                size_t block_index = (match_byte_n * MATCH_BYTE_BITS) + block_n;
-                uint8_t block_index_bytes[BLOCK_INDEX_SIZE];
-                int_to_bytes(block_index, block_index_bytes, BLOCK_INDEX_SIZE);
-
-                // Get the update length (i.e. block length)
-                size_t update_length = (block_index + 1 == num_blocks) ?
-                block_get_trailing(file_get_size(src)) : BLOCK_SIZE;
-                uint8_t update_length_bytes[UPDATE_LEN_SIZE];
-                int_to_bytes(
-                    update_length, update_length_bytes, UPDATE_LEN_SIZE
-                );
+// Function to copy `length` bytes of a file, from `offset`, to the end of
+// another. Long ranges go straight from one to the other in the kernel if
+// they can, anything else is pread through `buffer` (RUN_BUFFER_SIZE long).
+void file_send_range(
+    FILE *src, FILE *dest, uint64_t offset, uint64_t length,
+    uint8_t buffer[]
+) {
+    if (length >= ZERO_COPY_MIN_SIZE) {
+        uint64_t sent = file_send_zero_copy(
+            fileno(src), dest, offset, length
+        );
+        offset += sent;
+        length -= sent;
+    }
 
-                // Get bytes for file
-                uint8_t buffer[update_length];
-                fseek_handler(src, block_index * BLOCK_SIZE, SEEK_SET);
-                fread_handler(buffer, sizeof(uint8_t), update_length, src);
+    while (length > 0) {
+        size_t wanted = (length < RUN_BUFFER_SIZE) ? length : RUN_BUFFER_SIZE;
+        ssize_t n = pread(fileno(src), buffer, wanted, offset);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) {
+            perror("Read Failed");
+            exit(1);
+        }
 
-                // Write in that order (block_index, update_length, block data)
-                fwrite(
-                    block_index_bytes, sizeof(uint8_t), BLOCK_INDEX_SIZE, tcbi
-                );
-                fwrite(
-                    update_length_bytes, sizeof(uint8_t), UPDATE_LEN_SIZE, tcbi
-                );
-                fwrite(
-                    buffer, sizeof(uint8_t), update_length, tcbi
-                );
+        fwrite(buffer, sizeof(uint8_t), n, dest);
+        offset += n;
+        length -= n;
+    }
+}
 
-                counter++;
-            }
+// Function to copy a range of a file to the end of another without it
+// passing through user space: copy_file_range into a regular file, or
+// splice into a pipe. Returns how much was sent, which is less than
+// `length` (maybe 0) if the kernel couldn't do it.
+uint64_t file_send_zero_copy(
+    int src_fd, FILE *dest, uint64_t offset, uint64_t length
+) {
+    // Everything buffered has to go out first
+    int dest_fd = Index_Writer_Flush_Fd(dest);
+    if (dest_fd < 0) {
+        if (fflush(dest) != 0) return 0;
+        dest_fd = fileno(dest);
+    }
 
-            match_bytes[match_byte_n] <<= 1;
-            block_n++;
-        }
+    struct stat stat;
+    if (dest_fd < 0 || fstat(dest_fd, &stat) != 0) return 0;
 
-        if (
-            (match_byte_n * MATCH_BYTE_BITS + block_n == num_blocks) &&
-            ((match_bytes[match_byte_n] & 0xFF) != 0x00)
-        ) {
-            fprintf(stderr, "Error: Record has been incorrectly padded");
-            exit(1);
+    loff_t in_offset = offset;
+    uint64_t sent = 0;
+    while (sent < length) {
+        ssize_t n;
+        if (S_ISREG(stat.st_mode)) {
+            n = copy_file_range(
+                src_fd, &in_offset, dest_fd, NULL, length - sent, 0
+            );
+        } else if (S_ISFIFO(stat.st_mode)) {
+            n = splice(
+                src_fd, &in_offset, dest_fd, NULL, length - sent, 0
+            );
+        } else {
+            break;
         }
+
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) break;
+        sent += n;
+        Stats_Add(STATS_WRITE_CALLS, 1);
+        Stats_Add(STATS_BYTES_WRITTEN, n);
     }
-    
-    return counter;
+
+    return sent;
 }
 
-// Function that gets the size of a source file,
-// appending it to destination file
-void file_append_size(FILE *f, FILE *src) {
-    uint8_t file_size_bytes[FILE_SIZE_SIZE];
+// Function to read the receiver's offset of every matched block of a
+// rolling (or chunked) record, and append a copy (block index, offset)
+// for each one that the receiver has somewhere other than its own offset.
+// The offsets are all read first so the number of copies can go before
+// them.
+void file_append_copies(
+    FILE *tbbi, uint8_t match_bytes[], FILE *tcbi, size_t num_blocks,
+    const struct Chunk_List *chunks, struct Index_Format format,
+    struct Arena *arena
+) {
+    size_t num_matched = Match_Count(match_bytes, num_blocks, true);
+    uint64_t *offsets = Arena_Alloc_Array(
+        arena, num_matched, sizeof(uint64_t)
+    );
 
-    uint64_t size = file_get_size(src);
-    int_to_bytes(size, file_size_bytes, FILE_SIZE_SIZE);
+    size_t num_copies = 0;
+    size_t matched_n = 0;
+    struct Match_Iter iter;
+    Match_Iter_Start(&iter, match_bytes, num_blocks, true);
+    for (
+        size_t block_n = Match_Iter_Next(&iter); block_n < num_blocks;
+        block_n = Match_Iter_Next(&iter)
+    ) {
+        uint64_t offset = Format_Read_Uint(tbbi, format, BLOCK_OFFSET_SIZE);
+        if (offset != Block_Offset(chunks, block_n)) num_copies++;
+        offsets[matched_n++] = offset;
+    }
 
-    fwrite(file_size_bytes, sizeof(uint8_t), FILE_SIZE_SIZE, f);
+    Format_Write_Uint(tcbi, format, num_copies, BLOCK_INDEX_SIZE);
+
+    matched_n = 0;
+    Match_Iter_Start(&iter, match_bytes, num_blocks, true);
+    for (
+        size_t block_n = Match_Iter_Next(&iter); block_n < num_blocks;
+        block_n = Match_Iter_Next(&iter)
+    ) {
+        uint64_t offset = offsets[matched_n++];
+        if (offset == Block_Offset(chunks, block_n)) continue;
+
+        Format_Write_Uint(tcbi, format, block_n, BLOCK_INDEX_SIZE);
+        Format_Write_Uint(tcbi, format, offset, BLOCK_OFFSET_SIZE);
+    }
+}
+
+// Function that appends the size of a file to destination file
+void file_append_size(FILE *f, uint64_t size, struct Index_Format format) {
+    Format_Write_Uint(f, format, size, FILE_SIZE_SIZE);
 
     return;
 }
@@ -677,28 +1927,29 @@ void fputc_handler(FILE *f, int8_t c) {
     }
 }
 
-// Function to take the stat mode (st_mode) and use masking
-// to check for permissions.
+// Function to take the stat mode (st_mode) and write its permissions
+// (e.g. "rwxr-xr-x"), looked up from every one of the 512 there can be
 void file_append_permissions(FILE *f, uint64_t type) {
-    // Probably a much better way to do this but whatever
-    (type & S_IRUSR) ? 
-    fputc_handler(f, 'r') : fputc_handler(f, '-');
-    (type & S_IWUSR) ? 
-    fputc_handler(f, 'w') : fputc_handler(f, '-');
-    (type & S_IXUSR) ? 
-    fputc_handler(f, 'x') : fputc_handler(f, '-');
-    (type & S_IRGRP) ? 
-    fputc_handler(f, 'r') : fputc_handler(f, '-');
-    (type & S_IWGRP) ? 
-    fputc_handler(f, 'w') : fputc_handler(f, '-');
-    (type & S_IXGRP) ? 
-    fputc_handler(f, 'x') : fputc_handler(f, '-');
-    (type & S_IROTH) ? 
-    fputc_handler(f, 'r') : fputc_handler(f, '-');
-    (type & S_IWOTH) ?
-    fputc_handler(f, 'w') : fputc_handler(f, '-');
-    (type & S_IXOTH) ? 
-    fputc_handler(f, 'x') : fputc_handler(f, '-');
+    pthread_once(&permission_strings_once, permission_strings_fill);
 
-    return;
+    if (fwrite(
+        permission_strings[type & PERMISSION_BITS], sizeof(char),
+        PERMISSIONS_SIZE, f
+    ) < PERMISSIONS_SIZE) {
+        fprintf(stderr, "Error: fputc failed");
+        exit(1);
+    }
+}
+
+// Function to fill in the string of every set of permission bits: each
+// of the 9 bits, from the top down, is a letter of "rwxrwxrwx" or a '-'
+void permission_strings_fill(void) {
+    const char letters[] = "rwxrwxrwx";
+
+    for (int bits = 0; bits <= PERMISSION_BITS; bits++) {
+        for (int char_n = 0; char_n < PERMISSIONS_SIZE; char_n++) {
+            bool set = bits & (1 << (PERMISSIONS_SIZE - 1 - char_n));
+            permission_strings[bits][char_n] = set ? letters[char_n] : '-';
+        }
+    }
 }
\ No newline at end of file
@@ -4,6 +4,16 @@
 #ifndef HELPERS_H_
 #define HELPERS_H_
 
+#include <stdio.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include "format.h"
+
+// Large files are hashed and matched this many bytes at a time, so
+// neither their hashes nor their contents ever have to be held all at
+// once. See Hash_Window_Blocks for how many blocks that is.
+#define HASH_WINDOW_BYTES (16 * 1024 * 1024)
+
 enum Open_Errors { HANDLED = 0, NOT_HANDLED };
 
 /// @brief Open a file given the pathname, open_type and handled values.
@@ -11,26 +21,74 @@ enum Open_Errors { HANDLED = 0, NOT_HANDLED };
 /// @param handled An enum to describe how to handle opening errors.
 FILE *File_Open(char *pathname, char *open_type, enum Open_Errors handled);
 
+/// @brief Open an index for one of the stages. "-" is stdin (for reading)
+///        or stdout (for writing), so stages can be piped together.
+/// @param pathname A path to the index, or "-".
+/// @param open_type The mode to open it with, as for fopen.
+FILE *Index_Open(char *pathname, char *open_type);
+
+/// @brief How many blocks of the current block size make up a window of
+///        HASH_WINDOW_BYTES. It is a multiple of 8, so each window fills
+///        whole match bytes, and the window a multiple of the page size.
+size_t Hash_Window_Blocks(void);
+
+/// @brief Close an index from Index_Open, erroring out if anything
+///        written to it didn't make it out.
+/// @param f The index.
+void Index_Close(FILE *f);
+
 /// @brief Create a TABI file from an array of pathnames.
 /// @param f The newly created TABI file
 /// @param in_pathnames An array of strings containing, in order, the files
 //                      that should be placed in the new TABI file.
-/// @param num_in_pathnames The length of the `in_pathnames` array. In
-///                         subset 5, when this is zero, you should include
-///                         everything in the current directory.
-/// @param magic_number The associated magic number (TABI)
+/// @param num_in_pathnames The length of the `in_pathnames` array. When
+///                         this is zero, everything below the current
+///                         directory is included (see walk.h).
+/// @param format The version of TABI to write, and whether it is a rolling
+///               index that also carries weak checksums.
 void Out_Create_TABI(
-    FILE *f, char *in_pathnames[], size_t num_in_pathnames, char *magic_number
+    FILE *f, char *in_pathnames[], size_t num_in_pathnames,
+    struct Index_Format format
 );
 
-/// @brief Create a TBBI file from a TABI file.
-/// @param out_pathname A path to where the new TBBI file should be created.
-/// @param in_pathname A path to where the existing TABI file is located.
-void Out_Create_TBBI(FILE *tabi, FILE *tbbi);
-
 /// @brief Create a TBBI file from a TABI file.
 /// @param out_pathname A path to where the new TBBI file should be created.
 /// @param in_pathname A path to where the existing TABI file is located.
 void Out_Create_TCBI(FILE* tbbi, FILE *tcbi);
 
-#endif
\ No newline at end of file
+//////////////////////////////////////////////////////////////////////
+//                 HELPERS SHARED WITH OTHER MODULES
+//////////////////////////////////////////////////////////////////////
+
+/// @brief Write `num` as `num_bytes` little-endian bytes.
+void int_to_bytes(uint64_t num, unsigned char bytes[], int num_bytes);
+
+/// @brief Read `num_bytes` little-endian bytes as an unsigned integer.
+uint64_t bytes_to_uint(const uint8_t bytes[], uint64_t num_bytes);
+
+/// @brief Hash every block of a file, optionally with weak checksums.
+/// @param src The file to hash.
+/// @param hashes Filled in with the hash of every block.
+/// @param weak_hashes If not NULL, filled in with each block's weak checksum.
+/// @param num_blocks The number of blocks in the file.
+void file_get_hashes(
+    FILE *src, uint64_t hashes[], uint32_t weak_hashes[], size_t num_blocks
+);
+
+/// @brief Hash blocks [first_block, first_block + num_blocks) of a file,
+///        for files too large to hash all at once. Never cached.
+void file_get_hashes_range(
+    FILE *src, uint64_t hashes[], uint32_t weak_hashes[],
+    size_t first_block, size_t num_blocks
+);
+
+/// @brief Error out unless the file has been read to the end.
+void check_eof(FILE *f);
+
+/// @brief fseek, but errors out on fail.
+void fseek_handler(FILE *f, long offset, int whence);
+
+/// @brief fread, but errors out on a short read.
+void fread_handler(void *ptr, size_t size, size_t n, FILE *stream);
+
+#endif
@@ -0,0 +1,377 @@
+// Implementation for 'index_writer.h', written by Connor Li (z5425430)
+// An index is written as many small fields, which stdio would hand to
+// the kernel a few KiB at a time. An index writer is a stdio stream
+// (fopencookie) that gathers them into a buffer of several MiB instead,
+// and writes it out in big aligned pieces.
+//
+// An index is written once and read once, often long after everything
+// else has been, so it can also be kept out of the page cache:
+//  - WRITE_CACHE_DONTNEED starts each piece's writeback as soon as it is
+//    written, and drops the piece before it (by then written back) from
+//    the cache, so only the last couple of pieces are ever cached.
+//  - WRITE_CACHE_DIRECT writes with O_DIRECT, which needs the buffer, the
+//    file offset and the length all aligned. The buffer is kept so that
+//    its offset from an aligned address matches the file offset's, and
+//    anything unaligned (e.g. the header, after a seek back to the start)
+//    is written without O_DIRECT. Filesystems without O_DIRECT (e.g.
+//    tmpfs) get WRITE_CACHE_DONTNEED instead.
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include "index_writer.h"
+#include "stats.h"
+
+struct Index_Writer {
+    FILE *file;
+    int fd;
+    enum Write_Cache cache;
+    bool direct;
+
+    // Bytes [start, end) of the buffer are still to be written, and
+    // buffer[start] goes at `offset` in the file. `offset` isn't known
+    // after something else has written to the file descriptor.
+    uint8_t *buffer;
+    size_t capacity;
+    size_t start;
+    size_t end;
+    uint64_t offset;
+    bool offset_known;
+    bool seekable;
+
+    // Writeback has been started up to `started`, and everything before
+    // `dropped` has been dropped from the page cache
+    uint64_t started;
+    uint64_t dropped;
+
+    struct Index_Writer *next;
+};
+
+// Every open writer, so Index_Writer_Flush_Fd can find a stream's
+static struct Index_Writer *writers = NULL;
+
+//////////////////////////////////////////////////////////////////////
+//                        FUNCTION PROTOTYPES
+//////////////////////////////////////////////////////////////////////
+
+struct Index_Writer *index_writer_find(FILE *f);
+
+ssize_t index_writer_cookie_write(void *cookie, const char *data, size_t size);
+
+int index_writer_cookie_seek(void *cookie, off64_t *offset, int whence);
+
+int index_writer_cookie_close(void *cookie);
+
+void index_writer_find_offset(struct Index_Writer *writer);
+
+bool index_writer_drain(struct Index_Writer *writer, bool all);
+
+bool index_writer_write(
+    struct Index_Writer *writer, const uint8_t data[], size_t size,
+    bool direct
+);
+
+bool index_writer_set_direct(struct Index_Writer *writer, bool direct);
+
+void index_writer_drop_behind(struct Index_Writer *writer, bool all);
+
+//////////////////////////////////////////////////////////////////////
+//                        INTERFACE FUNCTIONS
+//////////////////////////////////////////////////////////////////////
+
+FILE *Index_Writer_Open(
+    char *pathname, size_t buffer_size, enum Write_Cache cache
+) {
+    int fd = open(pathname, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0666);
+    if (fd < 0) {
+        perror("Error");
+        exit(1);
+    }
+
+    struct Index_Writer *writer = calloc(1, sizeof(struct Index_Writer));
+    if (writer == NULL) {
+        perror("Error");
+        exit(1);
+    }
+    writer->fd = fd;
+    writer->cache = cache;
+
+    // Only regular files have a page cache worth keeping out of
+    struct stat file_stat;
+    if (fstat(fd, &file_stat) != 0 || !S_ISREG(file_stat.st_mode)) {
+        writer->cache = WRITE_CACHE_KEEP;
+    }
+
+    // One more aligned block than asked for, for the start of the buffer
+    // to line up with an unaligned file offset
+    size_t blocks = (buffer_size + INDEX_WRITER_ALIGN - 1) / INDEX_WRITER_ALIGN;
+    if (blocks == 0) blocks = 1;
+    writer->capacity = (blocks + 1) * INDEX_WRITER_ALIGN;
+    if (posix_memalign(
+        (void **) &writer->buffer, INDEX_WRITER_ALIGN, writer->capacity
+    ) != 0) {
+        perror("Error");
+        exit(1);
+    }
+
+    writer->file = fopencookie(writer, "w", (cookie_io_functions_t) {
+        .write = index_writer_cookie_write,
+        .seek = index_writer_cookie_seek,
+        .close = index_writer_cookie_close,
+    });
+    if (writer->file == NULL) {
+        perror("Error");
+        exit(1);
+    }
+
+    writer->next = writers;
+    writers = writer;
+
+    return writer->file;
+}
+
+int Index_Writer_Fileno(FILE *f) {
+    struct Index_Writer *writer = index_writer_find(f);
+    return (writer != NULL) ? writer->fd : fileno(f);
+}
+
+int Index_Writer_Flush_Fd(FILE *f) {
+    struct Index_Writer *writer = index_writer_find(f);
+    if (writer == NULL) return -1;
+
+    if (fflush(f) != 0 || !index_writer_drain(writer, true)) return -1;
+
+    // Whoever has the descriptor moves its offset along
+    writer->offset_known = false;
+    return writer->fd;
+}
+
+//////////////////////////////////////////////////////////////////////
+//                           LOCAL HELPERS
+//////////////////////////////////////////////////////////////////////
+
+// Function to find the writer behind a stream, if it has one
+struct Index_Writer *index_writer_find(FILE *f) {
+    struct Index_Writer *writer = writers;
+    while (writer != NULL && writer->file != f) writer = writer->next;
+
+    return writer;
+}
+
+// Function to add what stdio hands over to the buffer, writing the buffer
+// out whenever it fills up
+ssize_t index_writer_cookie_write(void *cookie, const char *data, size_t size) {
+    struct Index_Writer *writer = cookie;
+    if (!writer->offset_known) index_writer_find_offset(writer);
+
+    size_t written = 0;
+    while (written < size) {
+        if (writer->end == writer->capacity &&
+            !index_writer_drain(writer, false)) {
+            return -1;
+        }
+
+        size_t n = size - written;
+        if (n > writer->capacity - writer->end) {
+            n = writer->capacity - writer->end;
+        }
+        memcpy(writer->buffer + writer->end, data + written, n);
+        writer->end += n;
+        written += n;
+    }
+
+    return written;
+}
+
+// Function to move to somewhere else in the file, once everything before
+// it has been written. stdio's ftell comes through here too, as a seek
+// to where it already is, which is answered without writing anything.
+int index_writer_cookie_seek(void *cookie, off64_t *offset, int whence) {
+    struct Index_Writer *writer = cookie;
+    if (whence == SEEK_CUR && *offset == 0) {
+        if (!writer->offset_known) index_writer_find_offset(writer);
+        if (!writer->seekable) return -1;
+
+        *offset = writer->offset + (writer->end - writer->start);
+        return 0;
+    }
+
+    if (!index_writer_drain(writer, true)) return -1;
+
+    off64_t position = lseek(writer->fd, *offset, whence);
+    if (position < 0) return -1;
+
+    *offset = position;
+    writer->offset_known = false;
+    return 0;
+}
+
+// Function to write out whatever is left, then close the file
+int index_writer_cookie_close(void *cookie) {
+    struct Index_Writer *writer = cookie;
+    bool ok = index_writer_drain(writer, true);
+    index_writer_drop_behind(writer, true);
+    if (close(writer->fd) != 0) ok = false;
+
+    struct Index_Writer **link = &writers;
+    while (*link != writer) link = &(*link)->next;
+    *link = writer->next;
+
+    free(writer->buffer);
+    free(writer);
+
+    return ok ? 0 : EOF;
+}
+
+// Function to find out where the file descriptor is up to, and line the
+// empty buffer up with it
+void index_writer_find_offset(struct Index_Writer *writer) {
+    off64_t position = lseek(writer->fd, 0, SEEK_CUR);
+    writer->seekable = position >= 0;
+    writer->offset = writer->seekable ? position : 0;
+    writer->offset_known = true;
+
+    writer->start = writer->offset % INDEX_WRITER_ALIGN;
+    writer->end = writer->start;
+}
+
+// Function to write out the buffer. With O_DIRECT, whole aligned blocks
+// go out directly and the rest waits for more unless `all` is set.
+bool index_writer_drain(struct Index_Writer *writer, bool all) {
+    if (!writer->offset_known) return true;
+
+    uint8_t *pos = writer->buffer + writer->start;
+    size_t length = writer->end - writer->start;
+
+    if (writer->cache == WRITE_CACHE_DIRECT && length > 0) {
+        size_t misalign = writer->start % INDEX_WRITER_ALIGN;
+        size_t head = (misalign == 0) ? 0 : INDEX_WRITER_ALIGN - misalign;
+        if (head > length) head = length;
+        if (!index_writer_write(writer, pos, head, false)) return false;
+        pos += head;
+        length -= head;
+
+        size_t body = length & ~(size_t) (INDEX_WRITER_ALIGN - 1);
+        if (!index_writer_write(writer, pos, body, true)) return false;
+        pos += body;
+        length -= body;
+    }
+
+    if (all || writer->cache != WRITE_CACHE_DIRECT) {
+        if (!index_writer_write(writer, pos, length, false)) return false;
+        pos += length;
+        length = 0;
+    }
+
+    // What's left starts on an aligned offset, so goes at the very start
+    memmove(writer->buffer, pos, length);
+    writer->start = writer->offset % INDEX_WRITER_ALIGN;
+    if (length > 0) writer->start = 0;
+    writer->end = writer->start + length;
+
+    if (writer->cache != WRITE_CACHE_KEEP) {
+        index_writer_drop_behind(writer, false);
+    }
+
+    return true;
+}
+
+// Function to write all of some data where the file is up to
+bool index_writer_write(
+    struct Index_Writer *writer, const uint8_t data[], size_t size,
+    bool direct
+) {
+    if (size == 0) return true;
+
+    if (direct && !index_writer_set_direct(writer, true)) direct = false;
+    if (!direct && writer->direct) index_writer_set_direct(writer, false);
+
+    size_t written = 0;
+    while (written < size) {
+        uint64_t started = Stats_Start();
+        ssize_t n = write(writer->fd, data + written, size - written);
+        Stats_Stop(STATS_TIMER_WRITE, started);
+        Stats_Add(STATS_WRITE_CALLS, 1);
+        if (n < 0 && errno == EINTR) continue;
+
+        // Some filesystems only refuse O_DIRECT once it's used
+        if (n < 0 && errno == EINVAL && writer->direct) {
+            index_writer_set_direct(writer, false);
+            writer->cache = WRITE_CACHE_DONTNEED;
+            continue;
+        }
+        if (n < 0) return false;
+
+        written += n;
+        Stats_Add(STATS_BYTES_WRITTEN, n);
+    }
+
+    writer->offset += size;
+    return true;
+}
+
+// Function to turn O_DIRECT on or off. If it can't be turned on, the
+// writer drops pages behind itself instead.
+bool index_writer_set_direct(struct Index_Writer *writer, bool direct) {
+    if (writer->direct == direct) return true;
+
+    int flags = fcntl(writer->fd, F_GETFL);
+    flags = direct ? (flags | O_DIRECT) : (flags & ~O_DIRECT);
+    if (flags < 0 || fcntl(writer->fd, F_SETFL, flags) != 0) {
+        if (direct) writer->cache = WRITE_CACHE_DONTNEED;
+        return false;
+    }
+
+    writer->direct = direct;
+    return true;
+}
+
+// Function to start writing back what has just been written, then drop
+// what was written before that (waiting for its writeback, which has had
+// a whole buffer's worth of time to finish). `all` drops everything.
+void index_writer_drop_behind(struct Index_Writer *writer, bool all) {
+    if (writer->cache == WRITE_CACHE_KEEP || !writer->seekable) return;
+
+    uint64_t written = writer->offset;
+    if (written > writer->started) {
+        sync_file_range(
+            writer->fd, writer->started, written - writer->started,
+            SYNC_FILE_RANGE_WRITE
+        );
+    }
+
+    // The header can be written last, back at the start, so the whole
+    // file goes at the end
+    if (all) {
+        sync_file_range(
+            writer->fd, 0, 0, SYNC_FILE_RANGE_WAIT_BEFORE |
+            SYNC_FILE_RANGE_WRITE | SYNC_FILE_RANGE_WAIT_AFTER
+        );
+        posix_fadvise(writer->fd, 0, 0, POSIX_FADV_DONTNEED);
+        return;
+    }
+
+    uint64_t drop_end = writer->started;
+    if (drop_end > writer->dropped) {
+        sync_file_range(
+            writer->fd, writer->dropped, drop_end - writer->dropped,
+            SYNC_FILE_RANGE_WAIT_BEFORE | SYNC_FILE_RANGE_WRITE |
+            SYNC_FILE_RANGE_WAIT_AFTER
+        );
+        posix_fadvise(
+            writer->fd, writer->dropped, drop_end - writer->dropped,
+            POSIX_FADV_DONTNEED
+        );
+        writer->dropped = drop_end;
+    }
+
+    writer->started = written;
+}
@@ -0,0 +1,45 @@
+// Header file for index_writer.c written by Connor Li (z5425430)
+// For implementation details go to index_writer.c.
+
+#ifndef INDEX_WRITER_H_
+#define INDEX_WRITER_H_
+
+#include <stdio.h>
+#include <stddef.h>
+
+// How much of an index is gathered before it is written out, by default
+#define INDEX_WRITER_BUFFER_SIZE (4 * 1024 * 1024)
+
+// Writes are aligned to this, which suits O_DIRECT on any common device
+#define INDEX_WRITER_ALIGN 4096
+
+/// @brief What becomes of the page cache behind an index as it's written.
+enum Write_Cache {
+    WRITE_CACHE_KEEP = 0,   // left to the kernel, as for any other write
+    WRITE_CACHE_DONTNEED,   // dropped once written back (posix_fadvise)
+    WRITE_CACHE_DIRECT,     // never cached (O_DIRECT), where the fs allows
+};
+
+/// @brief Open an index for writing through a large buffer, which is
+///        written out in big aligned write()s.
+/// @param pathname Where the index goes. It is created or truncated.
+/// @param buffer_size How much to gather before writing, rounded up to
+///                    INDEX_WRITER_ALIGN.
+/// @param cache What to do about the page cache.
+/// @return A stream to write the index to. Close it with fclose, whose
+///         result says whether every write made it.
+FILE *Index_Writer_Open(
+    char *pathname, size_t buffer_size, enum Write_Cache cache
+);
+
+/// @brief The file descriptor an index is written to, whether or not it
+///        is written through an index writer (whose stream has none).
+int Index_Writer_Fileno(FILE *f);
+
+/// @brief Write out everything written to a stream so far, so something
+///        else can append to its file descriptor directly.
+/// @param f The stream.
+/// @return The file descriptor, or -1 if the stream isn't an index writer.
+int Index_Writer_Flush_Fd(FILE *f);
+
+#endif
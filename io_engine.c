@@ -0,0 +1,425 @@
+// Implementation for 'io_engine.h', written by Connor Li (z5425430)
+// An engine keeps many opens, stats and reads in flight at once, so one
+// slow file (a cold cache, a network filesystem) doesn't hold up the rest.
+// Requests are queued, started in a batch, and handed back as they finish.
+//
+// With io_uring, queued requests are written straight into the ring the
+// kernel shares with us, and one io_uring_enter() starts the lot. There
+// is no liburing here, so the ring is set up with the raw syscalls:
+//
+//      submission ring:  head (kernel) .. tail (us), indexes into sqes[]
+//      completion ring:  head (us) .. tail (kernel), with cqes[] inline
+//
+// Otherwise every request is a blocking call on a pool worker, and each
+// worker puts what it finished on a queue for Io_Engine_Wait.
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+#include "io_engine.h"
+#include "pool.h"
+
+// More threads than this only wait on each other in the kernel
+#define IO_MAX_THREADS 32
+
+struct Uring {
+    int fd;
+    unsigned *sq_head;
+    unsigned *sq_tail;
+    unsigned *sq_mask;
+    unsigned *sq_array;
+    struct io_uring_sqe *sqes;
+    unsigned *cq_head;
+    unsigned *cq_tail;
+    unsigned *cq_mask;
+    struct io_uring_cqe *cqes;
+
+    void *sq_ring;
+    size_t sq_ring_size;
+    void *cq_ring;
+    size_t cq_ring_size;
+    size_t sqes_size;
+
+    // Requests written to the ring but not yet handed to the kernel
+    unsigned sq_local_tail;
+    unsigned num_queued;
+};
+
+struct Io_Engine {
+    enum Io_Backend backend;
+    size_t depth;
+    size_t in_flight;
+
+    struct Uring uring;
+
+    // The thread backend's workers, and the requests they've finished
+    struct Pool *pool;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    struct Io_Request **finished;
+    size_t finished_head;
+    size_t num_finished;
+};
+
+//////////////////////////////////////////////////////////////////////
+//                        FUNCTION PROTOTYPES
+//////////////////////////////////////////////////////////////////////
+
+bool uring_setup(struct Uring *uring, size_t depth);
+
+void uring_teardown(struct Uring *uring);
+
+void uring_queue(struct Uring *uring, struct Io_Request *request);
+
+void uring_flush(struct Uring *uring);
+
+struct Io_Request *uring_reap(struct Uring *uring);
+
+int uring_enter(
+    int fd, unsigned to_submit, unsigned min_complete, unsigned flags
+);
+
+void io_thread_task(void *arg);
+
+void io_request_finish(struct Io_Request *request, int64_t result);
+
+//////////////////////////////////////////////////////////////////////
+//                        INTERFACE FUNCTIONS
+//////////////////////////////////////////////////////////////////////
+
+struct Io_Engine *Io_Engine_Create(size_t depth, enum Io_Backend backend) {
+    struct Io_Engine *engine = calloc(1, sizeof(struct Io_Engine));
+    if (engine == NULL) {
+        perror("Error");
+        exit(1);
+    }
+    engine->depth = depth;
+
+    if (backend != IO_BACKEND_THREADS) {
+        if (uring_setup(&engine->uring, depth)) {
+            engine->backend = IO_BACKEND_URING;
+            return engine;
+        }
+        if (backend == IO_BACKEND_URING) {
+            fprintf(stderr, "Error: io_uring isn't available\n");
+            exit(1);
+        }
+    }
+
+    engine->backend = IO_BACKEND_THREADS;
+    engine->pool = Pool_Create(depth < IO_MAX_THREADS ? depth : IO_MAX_THREADS);
+    pthread_mutex_init(&engine->lock, NULL);
+    pthread_cond_init(&engine->cond, NULL);
+    engine->finished = malloc(sizeof(struct Io_Request *) * depth);
+    if (engine->finished == NULL) {
+        perror("Error");
+        exit(1);
+    }
+
+    return engine;
+}
+
+size_t Io_Engine_Space(struct Io_Engine *engine) {
+    return engine->depth - engine->in_flight;
+}
+
+void Io_Engine_Submit(struct Io_Engine *engine, struct Io_Request *request) {
+    if (engine->in_flight == engine->depth) {
+        fprintf(stderr, "Error: too many requests in flight\n");
+        exit(1);
+    }
+
+    request->done = 0;
+    request->result = 0;
+    request->engine = engine;
+    engine->in_flight++;
+
+    if (engine->backend == IO_BACKEND_URING) {
+        uring_queue(&engine->uring, request);
+    } else {
+        Pool_Submit(engine->pool, io_thread_task, request);
+    }
+}
+
+struct Io_Request *Io_Engine_Wait(struct Io_Engine *engine) {
+    if (engine->in_flight == 0) return NULL;
+
+    struct Io_Request *request;
+    if (engine->backend == IO_BACKEND_URING) {
+        uring_flush(&engine->uring);
+        request = uring_reap(&engine->uring);
+    } else {
+        pthread_mutex_lock(&engine->lock);
+        while (engine->num_finished == 0) {
+            pthread_cond_wait(&engine->cond, &engine->lock);
+        }
+        request = engine->finished[engine->finished_head];
+        engine->finished_head = (engine->finished_head + 1) % engine->depth;
+        engine->num_finished--;
+        pthread_mutex_unlock(&engine->lock);
+    }
+
+    engine->in_flight--;
+    return request;
+}
+
+void Io_Engine_Destroy(struct Io_Engine *engine) {
+    if (engine->backend == IO_BACKEND_URING) {
+        uring_teardown(&engine->uring);
+    } else {
+        Pool_Destroy(engine->pool);
+        pthread_mutex_destroy(&engine->lock);
+        pthread_cond_destroy(&engine->cond);
+        free(engine->finished);
+    }
+
+    free(engine);
+}
+
+//////////////////////////////////////////////////////////////////////
+//                           LOCAL HELPERS
+//////////////////////////////////////////////////////////////////////
+
+// Function to set up a ring with room for `depth` requests. Opens and
+// stats only went into io_uring in Linux 5.6, the same release as
+// IORING_FEAT_RW_CUR_POS, so an older kernel's ring isn't used at all.
+bool uring_setup(struct Uring *uring, size_t depth) {
+    struct io_uring_params params;
+    memset(&params, 0, sizeof(struct io_uring_params));
+
+    uring->fd = syscall(__NR_io_uring_setup, (unsigned) depth, &params);
+    if (uring->fd < 0) return false;
+    if (!(params.features & IORING_FEAT_RW_CUR_POS)) {
+        close(uring->fd);
+        return false;
+    }
+
+    uring->sq_ring_size =
+        params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    uring->cq_ring_size =
+        params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+
+    // Newer kernels put both rings in one mapping
+    bool single_mmap = params.features & IORING_FEAT_SINGLE_MMAP;
+    if (single_mmap) {
+        if (uring->cq_ring_size > uring->sq_ring_size) {
+            uring->sq_ring_size = uring->cq_ring_size;
+        }
+        uring->cq_ring_size = uring->sq_ring_size;
+    }
+
+    uring->sq_ring = mmap(
+        NULL, uring->sq_ring_size, PROT_READ | PROT_WRITE,
+        MAP_SHARED | MAP_POPULATE, uring->fd, IORING_OFF_SQ_RING
+    );
+    if (uring->sq_ring == MAP_FAILED) {
+        close(uring->fd);
+        return false;
+    }
+
+    uring->cq_ring = single_mmap ? uring->sq_ring : mmap(
+        NULL, uring->cq_ring_size, PROT_READ | PROT_WRITE,
+        MAP_SHARED | MAP_POPULATE, uring->fd, IORING_OFF_CQ_RING
+    );
+    uring->sqes_size = params.sq_entries * sizeof(struct io_uring_sqe);
+    uring->sqes = mmap(
+        NULL, uring->sqes_size, PROT_READ | PROT_WRITE,
+        MAP_SHARED | MAP_POPULATE, uring->fd, IORING_OFF_SQES
+    );
+    if (uring->cq_ring == MAP_FAILED || uring->sqes == MAP_FAILED) {
+        perror("Error");
+        exit(1);
+    }
+
+    char *sq = uring->sq_ring;
+    uring->sq_head = (unsigned *) (sq + params.sq_off.head);
+    uring->sq_tail = (unsigned *) (sq + params.sq_off.tail);
+    uring->sq_mask = (unsigned *) (sq + params.sq_off.ring_mask);
+    uring->sq_array = (unsigned *) (sq + params.sq_off.array);
+
+    char *cq = uring->cq_ring;
+    uring->cq_head = (unsigned *) (cq + params.cq_off.head);
+    uring->cq_tail = (unsigned *) (cq + params.cq_off.tail);
+    uring->cq_mask = (unsigned *) (cq + params.cq_off.ring_mask);
+    uring->cqes = (struct io_uring_cqe *) (cq + params.cq_off.cqes);
+
+    uring->sq_local_tail = *uring->sq_tail;
+    uring->num_queued = 0;
+
+    return true;
+}
+
+// Function to unmap a ring and close it
+void uring_teardown(struct Uring *uring) {
+    munmap(uring->sqes, uring->sqes_size);
+    if (uring->cq_ring != uring->sq_ring) {
+        munmap(uring->cq_ring, uring->cq_ring_size);
+    }
+    munmap(uring->sq_ring, uring->sq_ring_size);
+    close(uring->fd);
+}
+
+// Function to write a request into the next free submission slot. What
+// is left of a short read is queued again the same way.
+void uring_queue(struct Uring *uring, struct Io_Request *request) {
+    unsigned index = uring->sq_local_tail & *uring->sq_mask;
+    struct io_uring_sqe *sqe = &uring->sqes[index];
+    memset(sqe, 0, sizeof(struct io_uring_sqe));
+
+    switch (request->op) {
+        case IO_OP_STAT: {
+            sqe->opcode = IORING_OP_STATX;
+            sqe->fd = AT_FDCWD;
+            sqe->addr = (uintptr_t) request->pathname;
+            sqe->len = STATX_BASIC_STATS;
+            sqe->off = (uintptr_t) request->statx;
+            break;
+        }
+        case IO_OP_OPEN: {
+            sqe->opcode = IORING_OP_OPENAT;
+            sqe->fd = AT_FDCWD;
+            sqe->addr = (uintptr_t) request->pathname;
+            sqe->open_flags = O_RDONLY | O_CLOEXEC;
+            break;
+        }
+        case IO_OP_READ: {
+            sqe->opcode = IORING_OP_READ;
+            sqe->fd = request->fd;
+            sqe->addr = (uintptr_t) request->buffer + request->done;
+            sqe->len = request->length - request->done;
+            sqe->off = request->offset + request->done;
+            break;
+        }
+    }
+    sqe->user_data = (uintptr_t) request;
+
+    uring->sq_array[index] = index;
+    uring->sq_local_tail++;
+    uring->num_queued++;
+}
+
+// Function to publish every queued request to the kernel and start them
+void uring_flush(struct Uring *uring) {
+    if (uring->num_queued == 0) return;
+
+    __atomic_store_n(uring->sq_tail, uring->sq_local_tail, __ATOMIC_RELEASE);
+    while (uring->num_queued > 0) {
+        int submitted = uring_enter(uring->fd, uring->num_queued, 0, 0);
+        uring->num_queued -= submitted;
+    }
+}
+
+// Function to take the next completion, waiting for one if need be. Reads
+// that came up short (but not at the end of the file) go round again.
+struct Io_Request *uring_reap(struct Uring *uring) {
+    while (true) {
+        unsigned head = *uring->cq_head;
+        while (head == __atomic_load_n(uring->cq_tail, __ATOMIC_ACQUIRE)) {
+            uring_enter(uring->fd, 0, 1, IORING_ENTER_GETEVENTS);
+        }
+
+        struct io_uring_cqe *cqe = &uring->cqes[head & *uring->cq_mask];
+        struct Io_Request *request = (struct Io_Request *) cqe->user_data;
+        int32_t result = cqe->res;
+        __atomic_store_n(uring->cq_head, head + 1, __ATOMIC_RELEASE);
+
+        if (request->op == IO_OP_READ && result == -EINTR) {
+            result = 0;
+        } else if (request->op != IO_OP_READ || result <= 0) {
+            io_request_finish(request, result);
+            return request;
+        }
+
+        request->done += result;
+        if (request->done == request->length) {
+            io_request_finish(request, request->done);
+            return request;
+        }
+
+        uring_queue(uring, request);
+        uring_flush(uring);
+    }
+}
+
+// Function to call io_uring_enter, retrying if interrupted
+int uring_enter(
+    int fd, unsigned to_submit, unsigned min_complete, unsigned flags
+) {
+    while (true) {
+        int result = syscall(
+            __NR_io_uring_enter, fd, to_submit, min_complete, flags, NULL, 0
+        );
+        if (result >= 0) return result;
+        if (errno != EINTR) {
+            perror("Error");
+            exit(1);
+        }
+    }
+}
+
+// Function to carry out a request with blocking calls, on a pool worker
+void io_thread_task(void *arg) {
+    struct Io_Request *request = arg;
+    int64_t result = 0;
+
+    switch (request->op) {
+        case IO_OP_STAT: {
+            if (statx(
+                AT_FDCWD, request->pathname, 0, STATX_BASIC_STATS,
+                request->statx
+            ) != 0) {
+                result = -errno;
+            }
+            break;
+        }
+        case IO_OP_OPEN: {
+            result = open(request->pathname, O_RDONLY | O_CLOEXEC);
+            if (result < 0) result = -errno;
+            break;
+        }
+        case IO_OP_READ: {
+            while (request->done < request->length) {
+                ssize_t n = pread(
+                    request->fd, (char *) request->buffer + request->done,
+                    request->length - request->done,
+                    request->offset + request->done
+                );
+                if (n < 0 && errno == EINTR) continue;
+                if (n < 0) result = -errno;
+                if (n <= 0) break;
+                request->done += n;
+            }
+            break;
+        }
+    }
+
+    struct Io_Engine *engine = request->engine;
+    io_request_finish(request, result);
+
+    pthread_mutex_lock(&engine->lock);
+    size_t tail = (engine->finished_head + engine->num_finished) % engine->depth;
+    engine->finished[tail] = request;
+    engine->num_finished++;
+    pthread_cond_signal(&engine->cond);
+    pthread_mutex_unlock(&engine->lock);
+}
+
+// Function to record how a request went. A read that fails part way
+// through still fails.
+void io_request_finish(struct Io_Request *request, int64_t result) {
+    if (request->op == IO_OP_READ && result >= 0) {
+        result = request->done;
+    }
+    request->result = result;
+}
@@ -0,0 +1,80 @@
+// Header file for io_engine.c written by Connor Li (z5425430)
+// For implementation details go to io_engine.c.
+
+#ifndef IO_ENGINE_H_
+#define IO_ENGINE_H_
+
+#include <stdint.h>
+#include <stddef.h>
+
+// The most requests an engine can have in flight
+#define IO_DEPTH_MAX 4096
+
+struct Io_Engine;
+struct statx;
+
+/// @brief What carries out the requests of an engine.
+enum Io_Backend {
+    IO_BACKEND_AUTO = 0,    // io_uring if the kernel has it, otherwise threads
+    IO_BACKEND_URING,       // io_uring, batched through one shared ring
+    IO_BACKEND_THREADS,     // blocking calls, one request per pool worker
+};
+
+enum Io_Op {
+    IO_OP_STAT,
+    IO_OP_OPEN,
+    IO_OP_READ,
+};
+
+/// @brief One request to an engine. The caller owns it, and must leave it
+///        (and whatever it points to) alone until it is handed back by
+///        Io_Engine_Wait.
+struct Io_Request {
+    enum Io_Op op;
+
+    // IO_OP_STAT fills in `statx` for `pathname`, following symlinks.
+    // IO_OP_OPEN opens `pathname` for reading.
+    const char *pathname;
+    struct statx *statx;
+
+    // IO_OP_READ reads `length` bytes of `fd` at `offset` into `buffer`
+    int fd;
+    void *buffer;
+    size_t length;
+    uint64_t offset;
+
+    // Once done: the new file descriptor (IO_OP_OPEN), 0 (IO_OP_STAT) or
+    // the number of bytes read (IO_OP_READ, which is only short at the
+    // end of the file), or -errno if the request failed
+    int64_t result;
+
+    // Whatever the caller wants back with the request
+    void *tag;
+
+    // Used by the engine
+    size_t done;
+    struct Io_Engine *engine;
+};
+
+/// @brief Start an engine.
+/// @param depth The most requests that can be in flight at once.
+/// @param backend What to carry the requests out with.
+struct Io_Engine *Io_Engine_Create(size_t depth, enum Io_Backend backend);
+
+/// @brief How many more requests can be submitted before one has to be
+///        waited for.
+size_t Io_Engine_Space(struct Io_Engine *engine);
+
+/// @brief Queue a request. Queued requests are only started in a batch,
+///        by the next Io_Engine_Wait. There must be space for it.
+void Io_Engine_Submit(struct Io_Engine *engine, struct Io_Request *request);
+
+/// @brief Start any queued requests, then wait for one to finish. They
+///        finish in any order.
+/// @return The finished request, or NULL if none are in flight.
+struct Io_Request *Io_Engine_Wait(struct Io_Engine *engine);
+
+/// @brief Stop an engine. Nothing can be in flight.
+void Io_Engine_Destroy(struct Io_Engine *engine);
+
+#endif
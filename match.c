@@ -0,0 +1,351 @@
+// Implementation for 'match.h', written by Connor Li (z5425430)
+// Packing and unpacking the match bytes of a TBBI record.
+//
+// Each match byte holds 8 blocks, the first in its top bit. Setting them
+// one bit at a time, with a branch and a byte-by-byte hash conversion per
+// block, is slower than hashing the blocks was. Instead each kernel
+// compares a whole byte's worth of hashes at once:
+//
+//      - WORDS loads the sender's hashes as plain 64 bit words and ORs the
+//        8 compares together without branching.
+//      - AVX2 compares 4 hashes per instruction and movemasks the results,
+//        which come out lowest lane first, so the byte is bit-reversed.
+//      - AVX-512 compares all 8 into a mask register in one go.
+//
+// Going the other way, the bytes are read 8 at a time as one word with
+// the bits of each byte reversed, so the next block is the word's count
+// of trailing zeros and is cleared with word & (word - 1).
+
+#include <string.h>
+#include <pthread.h>
+#include "match.h"
+#include "helpers.h"
+#include "rbuoy.h"
+#include "codec.h"
+
+#if defined(__x86_64__) && defined(__GNUC__)
+#include <immintrin.h>
+#define HAVE_X86_KERNELS 1
+#else
+#define HAVE_X86_KERNELS 0
+#endif
+
+#define WORD_BYTES 8
+#define WORD_BITS 64
+
+static enum Match_Kernel best_kernel = MATCH_KERNEL_SCALAR;
+static pthread_once_t best_kernel_once = PTHREAD_ONCE_INIT;
+
+//////////////////////////////////////////////////////////////////////
+//                        FUNCTION PROTOTYPES
+//////////////////////////////////////////////////////////////////////
+
+void match_pick_kernel(void);
+
+void match_pack_scalar(
+    const uint8_t sender_hashes[], const uint64_t hashes[],
+    size_t num_local_blocks, uint8_t match_bytes[]
+);
+
+void match_pack_words(
+    const uint8_t sender_hashes[], const uint64_t hashes[],
+    size_t num_bytes, uint8_t match_bytes[]
+);
+
+size_t match_pack_avx2(
+    const uint8_t sender_hashes[], const uint64_t hashes[],
+    size_t num_bytes, uint8_t match_bytes[]
+);
+
+size_t match_pack_avx512(
+    const uint8_t sender_hashes[], const uint64_t hashes[],
+    size_t num_bytes, uint8_t match_bytes[]
+);
+
+uint8_t reverse_byte(uint8_t byte);
+
+uint64_t load_hash(const uint8_t bytes[]);
+
+uint64_t match_iter_load(struct Match_Iter *iter);
+
+//////////////////////////////////////////////////////////////////////
+//                        INTERFACE FUNCTIONS
+//////////////////////////////////////////////////////////////////////
+
+// Whole bytes of local blocks go through the kernel, and whatever is left
+// (a partial byte, then blocks the receiver doesn't have) is finished off
+// one bit at a time.
+void Match_Pack(
+    const uint8_t sender_hashes[], const uint64_t hashes[],
+    size_t num_blocks, size_t num_local_blocks, uint8_t match_bytes[],
+    enum Match_Kernel kernel
+) {
+    if (kernel == MATCH_KERNEL_AUTO) {
+        pthread_once(&best_kernel_once, match_pick_kernel);
+        kernel = best_kernel;
+    }
+
+    size_t num_bytes = num_tbbi_match_bytes(num_blocks);
+    size_t num_local_bytes = num_local_blocks / MATCH_BYTE_BITS;
+
+    size_t done = 0;
+    if (kernel == MATCH_KERNEL_AVX512) {
+        done = match_pack_avx512(
+            sender_hashes, hashes, num_local_bytes, match_bytes
+        );
+    } else if (kernel == MATCH_KERNEL_AVX2) {
+        done = match_pack_avx2(
+            sender_hashes, hashes, num_local_bytes, match_bytes
+        );
+    }
+    if (kernel != MATCH_KERNEL_SCALAR) {
+        match_pack_words(
+            sender_hashes + done * MATCH_BYTE_BITS * HASH_SIZE,
+            hashes + done * MATCH_BYTE_BITS,
+            num_local_bytes - done, match_bytes + done
+        );
+        done = num_local_bytes;
+    }
+
+    size_t first_block = done * MATCH_BYTE_BITS;
+    memset(match_bytes + done, 0, num_bytes - done);
+    match_pack_scalar(
+        sender_hashes + first_block * HASH_SIZE, hashes + first_block,
+        num_local_blocks - first_block, match_bytes + done
+    );
+}
+
+bool Match_Kernel_Supported(enum Match_Kernel kernel) {
+    switch (kernel) {
+#if HAVE_X86_KERNELS
+        case MATCH_KERNEL_AVX2: return __builtin_cpu_supports("avx2");
+        case MATCH_KERNEL_AVX512: return __builtin_cpu_supports("avx512f");
+#else
+        case MATCH_KERNEL_AVX2: return false;
+        case MATCH_KERNEL_AVX512: return false;
+#endif
+        default: return true;
+    }
+}
+
+void Match_Iter_Start(
+    struct Match_Iter *iter, const uint8_t match_bytes[], size_t num_blocks,
+    bool matched
+) {
+    iter->match_bytes = match_bytes;
+    iter->num_blocks = num_blocks;
+    iter->matched = matched;
+    iter->word_start = 0;
+    iter->word = match_iter_load(iter);
+}
+
+// Each block found is cleared from the word, so the next is again its
+// lowest set bit. The bits of the last word past the end of the match
+// bytes are read as cleared, so a walk of changed blocks can run off the
+// end and is cut short.
+size_t Match_Iter_Next(struct Match_Iter *iter) {
+    while (iter->word == 0) {
+        iter->word_start += WORD_BITS;
+        if (iter->word_start >= iter->num_blocks) return iter->num_blocks;
+
+        iter->word = match_iter_load(iter);
+    }
+
+    size_t block_n = iter->word_start + __builtin_ctzll(iter->word);
+    iter->word &= iter->word - 1;
+    if (block_n < iter->num_blocks) return block_n;
+
+    iter->word = 0;
+    iter->word_start = iter->num_blocks;
+    return iter->num_blocks;
+}
+
+size_t Match_Count(
+    const uint8_t match_bytes[], size_t num_blocks, bool matched
+) {
+    size_t num_full_bytes = num_blocks / MATCH_BYTE_BITS;
+    size_t counter = 0;
+
+    size_t byte_n = 0;
+    for (; byte_n + WORD_BYTES <= num_full_bytes; byte_n += WORD_BYTES) {
+        uint64_t word;
+        memcpy(&word, match_bytes + byte_n, WORD_BYTES);
+        counter += __builtin_popcountll(word);
+    }
+    for (; byte_n < num_full_bytes; byte_n++) {
+        counter += __builtin_popcount(match_bytes[byte_n]);
+    }
+
+    // Only the top bits of the last byte are blocks
+    size_t trailing_bits = num_blocks % MATCH_BYTE_BITS;
+    if (trailing_bits > 0) {
+        uint8_t mask = 0xFF << (MATCH_BYTE_BITS - trailing_bits);
+        counter += __builtin_popcount(match_bytes[num_full_bytes] & mask);
+    }
+
+    return matched ? counter : num_blocks - counter;
+}
+
+bool Match_Padding_Clear(const uint8_t match_bytes[], size_t num_blocks) {
+    size_t trailing_bits = num_blocks % MATCH_BYTE_BITS;
+    if (trailing_bits == 0) return true;
+
+    uint8_t padding = 0xFF >> trailing_bits;
+    return (match_bytes[num_blocks / MATCH_BYTE_BITS] & padding) == 0;
+}
+
+//////////////////////////////////////////////////////////////////////
+//                           LOCAL HELPERS
+//////////////////////////////////////////////////////////////////////
+
+// Function to pick the fastest kernel this CPU supports
+void match_pick_kernel(void) {
+    if (Match_Kernel_Supported(MATCH_KERNEL_AVX512)) {
+        best_kernel = MATCH_KERNEL_AVX512;
+    } else if (Match_Kernel_Supported(MATCH_KERNEL_AVX2)) {
+        best_kernel = MATCH_KERNEL_AVX2;
+    } else {
+        best_kernel = MATCH_KERNEL_WORDS;
+    }
+}
+
+// Function to set the bit of every matching block one at a time, into
+// match bytes that are already cleared
+void match_pack_scalar(
+    const uint8_t sender_hashes[], const uint64_t hashes[],
+    size_t num_local_blocks, uint8_t match_bytes[]
+) {
+    for (size_t block_n = 0; block_n < num_local_blocks; block_n++) {
+        uint64_t src_block_hash = Codec_Load_U64(
+            sender_hashes + block_n * HASH_SIZE
+        );
+        // If they are the same hash, then this block is a match
+        if (src_block_hash == hashes[block_n]) {
+            match_bytes[block_n / MATCH_BYTE_BITS] |= 0x80 >>
+                (block_n % MATCH_BYTE_BITS);
+        }
+    }
+}
+
+// Function to pack `num_bytes` whole match bytes, 8 branchless compares
+// at a time
+void match_pack_words(
+    const uint8_t sender_hashes[], const uint64_t hashes[],
+    size_t num_bytes, uint8_t match_bytes[]
+) {
+    for (size_t byte_n = 0; byte_n < num_bytes; byte_n++) {
+        const uint8_t *sender = sender_hashes + byte_n * MATCH_BYTE_BITS * HASH_SIZE;
+        const uint64_t *local = hashes + byte_n * MATCH_BYTE_BITS;
+        uint8_t byte = 0;
+
+        for (int bit_n = 0; bit_n < MATCH_BYTE_BITS; bit_n++) {
+            uint8_t equal = load_hash(sender + bit_n * HASH_SIZE) == local[bit_n];
+            byte |= equal << (MATCH_BYTE_BITS - 1 - bit_n);
+        }
+
+        match_bytes[byte_n] = byte;
+    }
+}
+
+#if HAVE_X86_KERNELS
+
+// Function to pack whole match bytes with two 4 lane compares each.
+// Returns how many bytes were packed.
+__attribute__((target("avx2")))
+size_t match_pack_avx2(
+    const uint8_t sender_hashes[], const uint64_t hashes[],
+    size_t num_bytes, uint8_t match_bytes[]
+) {
+    for (size_t byte_n = 0; byte_n < num_bytes; byte_n++) {
+        const uint8_t *sender = sender_hashes + byte_n * MATCH_BYTE_BITS * HASH_SIZE;
+        const uint64_t *local = hashes + byte_n * MATCH_BYTE_BITS;
+
+        __m256i equal_low = _mm256_cmpeq_epi64(
+            _mm256_loadu_si256((const __m256i *) sender),
+            _mm256_loadu_si256((const __m256i *) local)
+        );
+        __m256i equal_high = _mm256_cmpeq_epi64(
+            _mm256_loadu_si256((const __m256i *) (sender + 4 * HASH_SIZE)),
+            _mm256_loadu_si256((const __m256i *) (local + 4))
+        );
+
+        int mask = _mm256_movemask_pd(_mm256_castsi256_pd(equal_low)) |
+            _mm256_movemask_pd(_mm256_castsi256_pd(equal_high)) << 4;
+        match_bytes[byte_n] = reverse_byte(mask);
+    }
+
+    return num_bytes;
+}
+
+// Function to pack whole match bytes with one 8 lane compare each.
+// Returns how many bytes were packed.
+__attribute__((target("avx512f")))
+size_t match_pack_avx512(
+    const uint8_t sender_hashes[], const uint64_t hashes[],
+    size_t num_bytes, uint8_t match_bytes[]
+) {
+    for (size_t byte_n = 0; byte_n < num_bytes; byte_n++) {
+        __mmask8 mask = _mm512_cmpeq_epi64_mask(
+            _mm512_loadu_si512(
+                sender_hashes + byte_n * MATCH_BYTE_BITS * HASH_SIZE
+            ),
+            _mm512_loadu_si512(hashes + byte_n * MATCH_BYTE_BITS)
+        );
+        match_bytes[byte_n] = reverse_byte(mask);
+    }
+
+    return num_bytes;
+}
+
+#else
+
+size_t match_pack_avx2(
+    const uint8_t sender_hashes[], const uint64_t hashes[],
+    size_t num_bytes, uint8_t match_bytes[]
+) {
+    return 0;
+}
+
+size_t match_pack_avx512(
+    const uint8_t sender_hashes[], const uint64_t hashes[],
+    size_t num_bytes, uint8_t match_bytes[]
+) {
+    return 0;
+}
+
+#endif
+
+// Function to reverse the bits of a byte, so a mask with the first block
+// in its lowest bit has it in its top bit instead
+uint8_t reverse_byte(uint8_t byte) {
+    static const uint8_t reversed_nibbles[16] = {
+        0x0, 0x8, 0x4, 0xc, 0x2, 0xa, 0x6, 0xe,
+        0x1, 0x9, 0x5, 0xd, 0x3, 0xb, 0x7, 0xf,
+    };
+
+    return reversed_nibbles[byte & 0xF] << 4 | reversed_nibbles[byte >> 4];
+}
+
+// Function to read a little-endian hash out of an index
+uint64_t load_hash(const uint8_t bytes[]) {
+    return Codec_Load_U64(bytes);
+}
+
+// Function to read the word of match bytes a walk is up to, with the bits
+// it's looking for set. The bits of each byte are reversed, so the first
+// block is the lowest bit. Bytes past the end are read as zero.
+uint64_t match_iter_load(struct Match_Iter *iter) {
+    size_t num_bytes = num_tbbi_match_bytes(iter->num_blocks);
+    size_t byte_n = iter->word_start / MATCH_BYTE_BITS;
+    const uint8_t *bytes = iter->match_bytes + byte_n;
+
+    size_t num_word_bytes = num_bytes - byte_n;
+    if (num_word_bytes > WORD_BYTES) num_word_bytes = WORD_BYTES;
+    uint64_t word = Codec_Load_Uint(bytes, num_word_bytes);
+
+    word = (word >> 1 & 0x5555555555555555ull) | (word & 0x5555555555555555ull) << 1;
+    word = (word >> 2 & 0x3333333333333333ull) | (word & 0x3333333333333333ull) << 2;
+    word = (word >> 4 & 0x0f0f0f0f0f0f0f0full) | (word & 0x0f0f0f0f0f0f0f0full) << 4;
+
+    return iter->matched ? word : ~word;
+}
@@ -0,0 +1,74 @@
+// Header file for match.c written by Connor Li (z5425430)
+// For implementation details go to match.c.
+
+#ifndef MATCH_H_
+#define MATCH_H_
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+/// @brief The ways the match bytes of a TBBI record can be packed. Every
+///        one of them gives exactly the same bytes.
+enum Match_Kernel {
+    MATCH_KERNEL_AUTO = 0,  // the fastest this CPU supports
+    MATCH_KERNEL_SCALAR,    // one block at a time, bit by bit
+    MATCH_KERNEL_WORDS,     // 8 blocks (one match byte) at a time
+    MATCH_KERNEL_AVX2,      // 8 blocks in two 4 lane compares
+    MATCH_KERNEL_AVX512,    // 8 blocks in one 8 lane compare
+};
+
+/// @brief Compare the sender's hashes of a run of blocks with the local
+///        ones, and pack the result into match bytes (the first block is
+///        the top bit of the first byte).
+/// @param sender_hashes The sender's hashes, as HASH_SIZE little-endian
+///                      bytes each, straight out of the TABI.
+/// @param hashes The local hash of each of the first `num_local_blocks`.
+/// @param num_blocks The number of blocks the sender has.
+/// @param num_local_blocks How many of them exist locally (at most
+///                         `num_blocks`). The rest never match.
+/// @param match_bytes Filled in with num_tbbi_match_bytes(num_blocks)
+///                    bytes, with the padding bits cleared.
+/// @param kernel The kernel to use. It must be supported.
+void Match_Pack(
+    const uint8_t sender_hashes[], const uint64_t hashes[],
+    size_t num_blocks, size_t num_local_blocks, uint8_t match_bytes[],
+    enum Match_Kernel kernel
+);
+
+/// @brief Check whether this CPU (and compiler) can run a kernel.
+bool Match_Kernel_Supported(enum Match_Kernel kernel);
+
+/// @brief Walks the blocks of a record that did (or didn't) match, a
+///        word of match bytes at a time.
+struct Match_Iter {
+    const uint8_t *match_bytes;
+    size_t num_blocks;
+    bool matched;
+    size_t word_start;
+    uint64_t word;
+};
+
+/// @brief Start walking the blocks of a record.
+/// @param iter The walk.
+/// @param match_bytes The match bytes of the record.
+/// @param num_blocks The number of blocks in the record.
+/// @param matched Whether to visit the matched blocks or the changed ones.
+void Match_Iter_Start(
+    struct Match_Iter *iter, const uint8_t match_bytes[], size_t num_blocks,
+    bool matched
+);
+
+/// @brief Get the next block of a walk.
+/// @return The block, or the number of blocks once there are no more.
+size_t Match_Iter_Next(struct Match_Iter *iter);
+
+/// @brief Count the blocks that did (or didn't) match.
+size_t Match_Count(
+    const uint8_t match_bytes[], size_t num_blocks, bool matched
+);
+
+/// @brief Check that the bits after the last block are all cleared.
+bool Match_Padding_Clear(const uint8_t match_bytes[], size_t num_blocks);
+
+#endif
@@ -0,0 +1,939 @@
+// Implementation for 'merkle.h', written by Connor Li (z5425430)
+// There are 4 'interface' functions:
+//      - Out_Create_Merkle_TABI()
+//      - Out_Refine_Merkle_TABI()
+//      - Out_Create_Merkle_TBBI()
+//      - Merkle_Read_Match_Bytes()
+//
+// A hash tree index (--merkle), so that an unchanged tree costs a handful
+// of hashes rather than one for every block. A file's block hashes are
+// the leaves of a tree with MERKLE_FANOUT children to a node:
+//
+//      node = hash(child 0 | child 1 | ...)    (8 little-endian bytes each)
+//
+// A file's own node is hash(size | permissions | root of its tree), and a
+// directory's is hash(permissions | name '\0' node | ...) over the files
+// and directories in it (as the walk would find them), sorted by name.
+//
+// Instead of one pass, stages 1 and 2 go back and forth in rounds. The
+// first TABI has one node for each pathname. Each TBBI says which nodes
+// the receiver has, and the next TABI (--refine) only goes one level down
+// from the ones it doesn't: a directory into its entries, a file into the
+// top of its tree, a node into its children. Once every record is down to
+// blocks the TBBI goes to stage 3 as usual, any block it doesn't list
+// having been matched further up. Only the parts that changed are ever
+// sent, at most MERKLE_FANOUT hashes a node for each level.
+//
+// A record of a hash tree TABI (or TBBI) is:
+//      pathname length | pathname | number of blocks | level (1) |
+//      number of nodes | the gap before each node |
+//      the hash of each node (TABI) or match bytes (TBBI)
+// A file or directory whose own node didn't match is kept in every round
+// after that, with no nodes once nothing in it is left to look at, so
+// that stage 3 still sends it.
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+#include <errno.h>
+#include <limits.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <sys/stat.h>
+#include "merkle.h"
+#include "helpers.h"
+#include "hash_io.h"
+#include "index_writer.h"
+#include "block_hash.h"
+#include "rbuoy.h"
+#include "codec.h"
+
+// Enough levels for 2^64 blocks
+#define MERKLE_MAX_LEVELS 17
+
+// Leaves are hashed from reads of about this much at a time
+#define MERKLE_READ_SIZE (4 * 1024 * 1024)
+
+// A file whose tree is being hashed. `num_blocks` gives the shape of the
+// tree (the sender's number of blocks), which the receiver's copy may
+// not have all of.
+struct Merkle_File {
+    FILE *f;
+    uint64_t size;
+    size_t num_local_blocks;
+    size_t num_blocks;
+};
+
+// A tree being hashed from its leaves up, with the children of the node
+// being built at each level so far
+struct Merkle_Fold {
+    uint64_t children[MERKLE_MAX_LEVELS][MERKLE_FANOUT];
+    size_t num_children[MERKLE_MAX_LEVELS];
+    unsigned level;
+};
+
+struct Merkle_Record {
+    char pathname[PATH_MAX];
+    size_t num_blocks;
+    unsigned level;
+    size_t num_nodes;
+    size_t *nodes;
+};
+
+// The index being written, which is left out of directories' nodes
+static dev_t merkle_skip_dev = 0;
+static ino_t merkle_skip_ino = 0;
+
+//////////////////////////////////////////////////////////////////////
+//                        FUNCTION PROTOTYPES
+//////////////////////////////////////////////////////////////////////
+
+void merkle_set_skip(FILE *index);
+
+size_t merkle_refine_record(
+    FILE *out, struct Index_Format format, struct Merkle_Record *record,
+    uint8_t match_bytes[]
+);
+
+void merkle_answer_record(
+    FILE *tabi, FILE *tbbi, struct Index_Format format,
+    struct Merkle_Record *record
+);
+
+void merkle_read_head(
+    FILE *f, struct Index_Format format, struct Merkle_Record *record
+);
+
+void merkle_read_nodes(
+    FILE *f, struct Index_Format format, struct Merkle_Record *record
+);
+
+void merkle_write_record(
+    FILE *f, struct Index_Format format, char *pathname, size_t num_blocks,
+    unsigned level, size_t nodes[], size_t num_nodes, uint64_t hashes[]
+);
+
+void merkle_append_path(FILE *f, struct Index_Format format, char *pathname);
+
+void merkle_append_nodes(
+    FILE *f, struct Index_Format format, char *pathname, size_t num_blocks,
+    unsigned level, size_t nodes[], size_t num_nodes
+);
+
+bool merkle_path_hash(char *pathname, unsigned *level, uint64_t *hash);
+
+bool merkle_file_hash(char *pathname, struct stat *stat, uint64_t *hash);
+
+bool merkle_dir_hash(char *pathname, struct stat *stat, uint64_t *hash);
+
+size_t merkle_list_dir(char *pathname, char ***names);
+
+bool merkle_entry_wanted(DIR *dir, struct dirent *dirent);
+
+int merkle_name_compare(const void *a, const void *b);
+
+void merkle_join(char *dir_path, char *name, char path[PATH_MAX]);
+
+bool merkle_open(char *pathname, struct Merkle_File *file);
+
+bool merkle_node(
+    struct Merkle_File *file, unsigned level, size_t index, uint64_t *hash
+);
+
+void merkle_hash_leaves(
+    struct Merkle_File *file, size_t first, size_t last,
+    struct Merkle_Fold *fold
+);
+
+void merkle_fold_push(struct Merkle_Fold *fold, unsigned level, uint64_t hash);
+
+uint64_t merkle_fold_finish(struct Merkle_Fold *fold);
+
+uint64_t merkle_combine(uint64_t children[], size_t num_children);
+
+size_t merkle_level_size(size_t num_blocks, unsigned level);
+
+unsigned merkle_top_level(size_t num_blocks);
+
+size_t merkle_node_limit(struct Merkle_Record *record);
+
+bool match_bytes_get(uint8_t match_bytes[], size_t n);
+
+//////////////////////////////////////////////////////////////////////
+//                        INTERFACE FUNCTIONS
+//////////////////////////////////////////////////////////////////////
+
+// With no pathnames, the whole current directory is one node
+void Out_Create_Merkle_TABI(
+    FILE *f, char *in_pathnames[], size_t num_in_pathnames,
+    struct Index_Format format
+) {
+    merkle_set_skip(f);
+
+    char *here = ".";
+    if (num_in_pathnames == 0) {
+        in_pathnames = &here;
+        num_in_pathnames = 1;
+    }
+
+    Format_Write_Header(f, format, num_in_pathnames);
+    for (size_t path_n = 0; path_n < num_in_pathnames; path_n++) {
+        merkle_append_path(f, format, in_pathnames[path_n]);
+    }
+}
+
+// The records are built up in memory, since how many there will be isn't
+// known until every one has been refined
+void Out_Refine_Merkle_TABI(FILE *tbbi, FILE *tabi) {
+    uint64_t num_records;
+    struct Index_Format format = Format_Read_Header(
+        tbbi, INDEX_TBBI, &num_records
+    );
+    if (!format.merkle) {
+        fprintf(stderr, "Error: --refine needs the TBBI of a --merkle round\n");
+        exit(1);
+    }
+    struct Index_Format tabi_format = Format_As_Type(format, INDEX_TABI);
+
+    // Hash the same way as the rounds before
+    rbuoy_options.block_hash = format.block_hash;
+    rbuoy_options.block_size = format.block_size;
+    merkle_set_skip(tabi);
+
+    char *data;
+    size_t size;
+    FILE *out = open_memstream(&data, &size);
+    if (out == NULL) {
+        perror("Error");
+        exit(1);
+    }
+
+    bool down_to_blocks = true;
+    uint64_t num_out_records = 0;
+    for (uint64_t record_n = 0; record_n < num_records; record_n++) {
+        struct Merkle_Record record;
+        merkle_read_head(tbbi, format, &record);
+        merkle_read_nodes(tbbi, format, &record);
+
+        size_t num_match_bytes = num_tbbi_match_bytes(record.num_nodes);
+        uint8_t *match_bytes = malloc(num_match_bytes + 1);
+        if (match_bytes == NULL) {
+            perror("Error");
+            exit(1);
+        }
+        fread_handler(match_bytes, sizeof(uint8_t), num_match_bytes, tbbi);
+
+        if (record.level != 0) down_to_blocks = false;
+        num_out_records += merkle_refine_record(
+            out, tabi_format, &record, match_bytes
+        );
+
+        free(match_bytes);
+        free(record.nodes);
+    }
+    check_eof(tbbi);
+
+    if (down_to_blocks) {
+        fprintf(stderr, "Error: TBBI is already down to blocks, use --stage-3\n");
+        exit(1);
+    }
+
+    if (fclose(out) != 0) {
+        perror("Error");
+        exit(1);
+    }
+    Format_Write_Header(tabi, tabi_format, num_out_records);
+    fwrite(data, sizeof(char), size, tabi);
+    free(data);
+}
+
+void Out_Create_Merkle_TBBI(
+    FILE *tabi, struct Index_Format format, uint64_t num_records, FILE *tbbi
+) {
+    merkle_set_skip(tbbi);
+    Format_Write_Header(
+        tbbi, Format_As_Type(format, INDEX_TBBI), num_records
+    );
+
+    for (uint64_t record_n = 0; record_n < num_records; record_n++) {
+        struct Merkle_Record record;
+        merkle_read_head(tabi, format, &record);
+        merkle_read_nodes(tabi, format, &record);
+        merkle_answer_record(tabi, tbbi, format, &record);
+        free(record.nodes);
+    }
+
+    check_eof(tabi);
+}
+
+void Merkle_Read_Match_Bytes(
+    FILE *tbbi, struct Index_Format format, size_t num_blocks,
+    uint8_t match_bytes[]
+) {
+    struct Merkle_Record record = { .num_blocks = num_blocks };
+    merkle_read_nodes(tbbi, format, &record);
+    if (record.level != 0) {
+        fprintf(stderr, "Error: TBBI isn't down to blocks yet, --refine it\n");
+        exit(1);
+    }
+
+    size_t num_node_bytes = num_tbbi_match_bytes(record.num_nodes);
+    uint8_t *node_bytes = malloc(num_node_bytes + 1);
+    if (node_bytes == NULL) {
+        perror("Error");
+        exit(1);
+    }
+    fread_handler(node_bytes, sizeof(uint8_t), num_node_bytes, tbbi);
+
+    // Every block matched, but for the listed ones that didn't
+    size_t num_match_bytes = num_tbbi_match_bytes(num_blocks);
+    memset(match_bytes, 0xFF, num_match_bytes);
+    if (num_blocks % MATCH_BYTE_BITS != 0) {
+        match_bytes[num_match_bytes - 1] = 0xFF << (
+            MATCH_BYTE_BITS - num_blocks % MATCH_BYTE_BITS
+        );
+    }
+    for (size_t node_n = 0; node_n < record.num_nodes; node_n++) {
+        if (match_bytes_get(node_bytes, node_n)) continue;
+
+        size_t block_n = record.nodes[node_n];
+        match_bytes[block_n / MATCH_BYTE_BITS] &= ~(
+            0x80 >> (block_n % MATCH_BYTE_BITS)
+        );
+    }
+
+    free(node_bytes);
+    free(record.nodes);
+}
+
+//////////////////////////////////////////////////////////////////////
+//                           LOCAL HELPERS
+//////////////////////////////////////////////////////////////////////
+
+// Function to leave the index being written out of directories' nodes
+void merkle_set_skip(FILE *index) {
+    struct stat stat;
+    if (fstat(Index_Writer_Fileno(index), &stat) == 0 && S_ISREG(stat.st_mode)) {
+        merkle_skip_dev = stat.st_dev;
+        merkle_skip_ino = stat.st_ino;
+    }
+}
+
+// Function to write the next round's records for a record the receiver
+// has answered. Returns how many were written.
+size_t merkle_refine_record(
+    FILE *out, struct Index_Format format, struct Merkle_Record *record,
+    uint8_t match_bytes[]
+) {
+    char *pathname = record->pathname;
+
+    if (record->level == MERKLE_LEVEL_DIR) {
+        if (match_bytes_get(match_bytes, 0)) return 0;
+
+        // The directory itself still has to be sent, before what's in it,
+        // unless it's where everything is being sent to
+        size_t num_written = 0;
+        if (strcmp(pathname, ".") != 0) {
+            merkle_write_record(out, format, pathname, 0, 0, NULL, 0, NULL);
+            num_written++;
+        }
+
+        char **names;
+        size_t num_names = merkle_list_dir(pathname, &names);
+        for (size_t name_n = 0; name_n < num_names; name_n++) {
+            char path[PATH_MAX];
+            merkle_join(pathname, names[name_n], path);
+            merkle_append_path(out, format, path);
+            num_written++;
+            free(names[name_n]);
+        }
+        free(names);
+
+        return num_written;
+    }
+
+    size_t num_blocks = record->num_blocks;
+    size_t *children = NULL;
+    size_t num_children = 0;
+    unsigned level = 0;
+
+    if (record->level == MERKLE_LEVEL_FILE) {
+        if (match_bytes_get(match_bytes, 0)) return 0;
+
+        // Straight to the root's children, as the root was in the file's
+        // node already
+        unsigned top = merkle_top_level(num_blocks);
+        level = (top > 0) ? top - 1 : 0;
+        num_children = merkle_level_size(num_blocks, level);
+        children = malloc(sizeof(size_t) * (num_children + 1));
+        if (children == NULL) {
+            perror("Error");
+            exit(1);
+        }
+        for (size_t child_n = 0; child_n < num_children; child_n++) {
+            children[child_n] = child_n;
+        }
+    } else {
+        // Blocks stay as they are, nodes are replaced by their children
+        size_t fanout = (record->level == 0) ? 1 : MERKLE_FANOUT;
+        level = (record->level == 0) ? 0 : record->level - 1;
+        size_t level_size = merkle_level_size(num_blocks, level);
+
+        children = malloc(sizeof(size_t) * (record->num_nodes * fanout + 1));
+        if (children == NULL) {
+            perror("Error");
+            exit(1);
+        }
+        for (size_t node_n = 0; node_n < record->num_nodes; node_n++) {
+            if (match_bytes_get(match_bytes, node_n)) continue;
+
+            size_t first = record->nodes[node_n] * fanout;
+            for (
+                size_t child = first;
+                child < first + fanout && child < level_size; child++
+            ) {
+                children[num_children++] = child;
+            }
+        }
+    }
+
+    merkle_append_nodes(
+        out, format, pathname, num_blocks, level, children, num_children
+    );
+    free(children);
+
+    return 1;
+}
+
+// Function to hash the receiver's side of a record's nodes and append
+// the record with which of them match
+void merkle_answer_record(
+    FILE *tabi, FILE *tbbi, struct Index_Format format,
+    struct Merkle_Record *record
+) {
+    size_t num_nodes = record->num_nodes;
+    size_t num_match_bytes = num_tbbi_match_bytes(num_nodes);
+    uint8_t *match_bytes = calloc(num_match_bytes + 1, sizeof(uint8_t));
+    if (match_bytes == NULL) {
+        perror("Error");
+        exit(1);
+    }
+
+    struct Merkle_File file = { 0 };
+    bool is_node = record->level != MERKLE_LEVEL_FILE &&
+        record->level != MERKLE_LEVEL_DIR;
+    bool opened = is_node && num_nodes > 0 &&
+        merkle_open(record->pathname, &file);
+    if (opened) file.num_blocks = record->num_blocks;
+
+    for (size_t node_n = 0; node_n < num_nodes; node_n++) {
+        uint8_t hash_bytes[HASH_SIZE];
+        fread_handler(hash_bytes, sizeof(uint8_t), HASH_SIZE, tabi);
+        uint64_t sender_hash = Codec_Load_U64(hash_bytes);
+
+        bool present;
+        uint64_t hash;
+        if (is_node) {
+            present = opened && merkle_node(
+                &file, record->level, record->nodes[node_n], &hash
+            );
+        } else {
+            unsigned level;
+            present = merkle_path_hash(record->pathname, &level, &hash) &&
+                level == record->level;
+        }
+
+        if (present && hash == sender_hash) {
+            match_bytes[node_n / MATCH_BYTE_BITS] |= 0x80 >>
+                (node_n % MATCH_BYTE_BITS);
+        }
+    }
+    if (opened) fclose(file.f);
+
+    merkle_write_record(
+        tbbi, format, record->pathname, record->num_blocks, record->level,
+        record->nodes, num_nodes, NULL
+    );
+    fwrite(match_bytes, sizeof(uint8_t), num_match_bytes, tbbi);
+    free(match_bytes);
+}
+
+// Function to read the pathname and number of blocks of a record
+void merkle_read_head(
+    FILE *f, struct Index_Format format, struct Merkle_Record *record
+) {
+    size_t pathname_length = Format_Read_Uint(f, format, PATHNAME_LEN_SIZE);
+    if (pathname_length == 0 || pathname_length >= PATH_MAX) {
+        fprintf(stderr, "Error: invalid pathname length\n");
+        exit(1);
+    }
+    fread_handler(record->pathname, sizeof(char), pathname_length, f);
+    record->pathname[pathname_length] = '\0';
+
+    record->num_blocks = Format_Read_Uint(f, format, NUM_BLOCKS_SIZE);
+}
+
+// Function to read the level and nodes of a record, which must be in
+// order and part of the file's tree
+void merkle_read_nodes(
+    FILE *f, struct Index_Format format, struct Merkle_Record *record
+) {
+    uint8_t level;
+    fread_handler(&level, sizeof(uint8_t), MERKLE_LEVEL_SIZE, f);
+    record->level = level;
+
+    size_t limit = merkle_node_limit(record);
+    record->num_nodes = Format_Read_Uint(f, format, NUM_BLOCKS_SIZE);
+    if (record->num_nodes > limit) {
+        fprintf(stderr, "Error: invalid nodes for '%s'\n", record->pathname);
+        exit(1);
+    }
+
+    record->nodes = malloc(sizeof(size_t) * (record->num_nodes + 1));
+    if (record->nodes == NULL) {
+        perror("Error");
+        exit(1);
+    }
+
+    size_t next = 0;
+    for (size_t node_n = 0; node_n < record->num_nodes; node_n++) {
+        uint64_t gap = Format_Read_Uint(f, format, BLOCK_INDEX_SIZE);
+        if (gap >= limit - next) {
+            fprintf(stderr, "Error: invalid nodes for '%s'\n", record->pathname);
+            exit(1);
+        }
+        record->nodes[node_n] = next + gap;
+        next = record->nodes[node_n] + 1;
+    }
+}
+
+// Function to write a record up to its hashes, then its hashes if there
+// are any (a TBBI has match bytes there instead)
+void merkle_write_record(
+    FILE *f, struct Index_Format format, char *pathname, size_t num_blocks,
+    unsigned level, size_t nodes[], size_t num_nodes, uint64_t hashes[]
+) {
+    size_t pathname_length = strlen(pathname);
+    Format_Write_Uint(f, format, pathname_length, PATHNAME_LEN_SIZE);
+    fwrite(pathname, sizeof(char), pathname_length, f);
+    Format_Write_Uint(f, format, num_blocks, NUM_BLOCKS_SIZE);
+
+    fputc(level, f);
+    Format_Write_Uint(f, format, num_nodes, NUM_BLOCKS_SIZE);
+    size_t next = 0;
+    for (size_t node_n = 0; node_n < num_nodes; node_n++) {
+        Format_Write_Uint(f, format, nodes[node_n] - next, BLOCK_INDEX_SIZE);
+        next = nodes[node_n] + 1;
+    }
+
+    if (hashes == NULL) return;
+
+    for (size_t node_n = 0; node_n < num_nodes; node_n++) {
+        uint8_t hash_bytes[HASH_SIZE];
+        Codec_Store_U64(hash_bytes, hashes[node_n]);
+        fwrite(hash_bytes, sizeof(uint8_t), HASH_SIZE, f);
+    }
+}
+
+// Function to append a record with the node of a whole file or directory
+void merkle_append_path(FILE *f, struct Index_Format format, char *pathname) {
+    struct stat path_stat;
+    if (stat(pathname, &path_stat) != 0) {
+        perror("Error");
+        exit(1);
+    }
+
+    unsigned level;
+    uint64_t hash;
+    if (!merkle_path_hash(pathname, &level, &hash)) {
+        fprintf(stderr, "Error: can't hash '%s'\n", pathname);
+        exit(1);
+    }
+
+    size_t num_blocks = (level == MERKLE_LEVEL_FILE) ?
+        number_of_blocks_in_file(path_stat.st_size) : 0;
+    size_t node = 0;
+    merkle_write_record(f, format, pathname, num_blocks, level, &node, 1, &hash);
+}
+
+// Function to append a record with some nodes of a file's tree, which
+// must be the same size as in the last round
+void merkle_append_nodes(
+    FILE *f, struct Index_Format format, char *pathname, size_t num_blocks,
+    unsigned level, size_t nodes[], size_t num_nodes
+) {
+    uint64_t *hashes = malloc(sizeof(uint64_t) * (num_nodes + 1));
+    if (hashes == NULL) {
+        perror("Error");
+        exit(1);
+    }
+
+    if (num_nodes > 0) {
+        struct Merkle_File file;
+        if (!merkle_open(pathname, &file) ||
+            file.num_local_blocks != num_blocks) {
+            fprintf(stderr, "Error: '%s' changed since the last round\n", pathname);
+            exit(1);
+        }
+        file.num_blocks = num_blocks;
+
+        for (size_t node_n = 0; node_n < num_nodes; node_n++) {
+            merkle_node(&file, level, nodes[node_n], &hashes[node_n]);
+        }
+        fclose(file.f);
+    }
+
+    merkle_write_record(
+        f, format, pathname, num_blocks, level, nodes, num_nodes, hashes
+    );
+    free(hashes);
+}
+
+// Function to get the node of a whole file or directory, and which of
+// the two it is. Returns false if it's neither, or can't be read.
+bool merkle_path_hash(char *pathname, unsigned *level, uint64_t *hash) {
+    struct stat path_stat;
+    if (stat(pathname, &path_stat) != 0) return false;
+
+    if (S_ISDIR(path_stat.st_mode)) {
+        *level = MERKLE_LEVEL_DIR;
+        return merkle_dir_hash(pathname, &path_stat, hash);
+    }
+    if (S_ISREG(path_stat.st_mode)) {
+        *level = MERKLE_LEVEL_FILE;
+        return merkle_file_hash(pathname, &path_stat, hash);
+    }
+
+    return false;
+}
+
+// Function to get the node of a file: its size, its permissions and the
+// root of its tree
+bool merkle_file_hash(char *pathname, struct stat *stat, uint64_t *hash) {
+    struct Merkle_File file;
+    if (!merkle_open(pathname, &file)) return false;
+    file.num_blocks = file.num_local_blocks;
+
+    unsigned char empty[1] = { 0 };
+    uint64_t root = Block_Hash_One(empty, 0, rbuoy_options.block_hash);
+    if (file.num_blocks > 0) {
+        merkle_node(&file, merkle_top_level(file.num_blocks), 0, &root);
+    }
+    fclose(file.f);
+
+    unsigned char bytes[3 * HASH_SIZE];
+    int_to_bytes(stat->st_size, bytes, HASH_SIZE);
+    int_to_bytes(stat->st_mode & 0777, bytes + HASH_SIZE, HASH_SIZE);
+    int_to_bytes(root, bytes + 2 * HASH_SIZE, HASH_SIZE);
+    *hash = Block_Hash_One(bytes, sizeof(bytes), rbuoy_options.block_hash);
+
+    return true;
+}
+
+// Function to get the node of a directory, from its permissions and the
+// name and node of everything in it
+bool merkle_dir_hash(char *pathname, struct stat *stat, uint64_t *hash) {
+    char *data;
+    size_t size;
+    FILE *buffer = open_memstream(&data, &size);
+    if (buffer == NULL) {
+        perror("Error");
+        exit(1);
+    }
+
+    unsigned char bytes[HASH_SIZE];
+    int_to_bytes(stat->st_mode & 0777, bytes, HASH_SIZE);
+    fwrite(bytes, sizeof(char), HASH_SIZE, buffer);
+
+    char **names;
+    size_t num_names = merkle_list_dir(pathname, &names);
+    for (size_t name_n = 0; name_n < num_names; name_n++) {
+        char path[PATH_MAX];
+        merkle_join(pathname, names[name_n], path);
+
+        unsigned level;
+        uint64_t entry_hash;
+        if (merkle_path_hash(path, &level, &entry_hash)) {
+            fwrite(names[name_n], sizeof(char), strlen(names[name_n]) + 1, buffer);
+            int_to_bytes(entry_hash, bytes, HASH_SIZE);
+            fwrite(bytes, sizeof(char), HASH_SIZE, buffer);
+        }
+        free(names[name_n]);
+    }
+    free(names);
+
+    if (fclose(buffer) != 0) {
+        perror("Error");
+        exit(1);
+    }
+    *hash = Block_Hash_One(
+        (unsigned char *) data, size, rbuoy_options.block_hash
+    );
+    free(data);
+
+    return true;
+}
+
+// Function to get the names of the files and directories in a directory,
+// sorted byte by byte as the walk does. Returns how many there are.
+size_t merkle_list_dir(char *pathname, char ***names) {
+    *names = NULL;
+    DIR *dir = opendir(pathname);
+    if (dir == NULL) return 0;
+
+    size_t num_names = 0;
+    size_t capacity = 0;
+    for (struct dirent *dirent = readdir(dir); dirent != NULL; dirent = readdir(dir)) {
+        if (!merkle_entry_wanted(dir, dirent)) continue;
+
+        if (num_names == capacity) {
+            capacity = (capacity == 0) ? 16 : capacity * 2;
+            *names = realloc(*names, sizeof(char *) * capacity);
+            if (*names == NULL) {
+                perror("Error");
+                exit(1);
+            }
+        }
+        (*names)[num_names] = strdup(dirent->d_name);
+        if ((*names)[num_names] == NULL) {
+            perror("Error");
+            exit(1);
+        }
+        num_names++;
+    }
+    closedir(dir);
+
+    if (num_names > 0) {
+        qsort(*names, num_names, sizeof(char *), merkle_name_compare);
+    }
+
+    return num_names;
+}
+
+// Function to decide whether a directory entry is part of its node: the
+// same files and directories the walk would find, less the index
+bool merkle_entry_wanted(DIR *dir, struct dirent *dirent) {
+    char *name = dirent->d_name;
+    if (strcmp(name, ".") == 0 || strcmp(name, "..") == 0) return false;
+
+    unsigned char type = dirent->d_type;
+    bool is_skip = merkle_skip_ino != 0 && dirent->d_ino == merkle_skip_ino;
+    if (type == DT_UNKNOWN || is_skip) {
+        struct stat stat;
+        if (fstatat(dirfd(dir), name, &stat, AT_SYMLINK_NOFOLLOW) != 0) {
+            return false;
+        }
+        if (stat.st_dev == merkle_skip_dev && stat.st_ino == merkle_skip_ino) {
+            return false;
+        }
+
+        type = S_ISDIR(stat.st_mode) ? DT_DIR :
+            S_ISREG(stat.st_mode) ? DT_REG : DT_UNKNOWN;
+    }
+
+    return type == DT_DIR || type == DT_REG;
+}
+
+// Function to order names byte by byte, for qsort
+int merkle_name_compare(const void *a, const void *b) {
+    return strcmp(*(char * const *) a, *(char * const *) b);
+}
+
+// Function to get the path of an entry of a directory. What's in the
+// current directory has no "./" in front, as in the walk.
+void merkle_join(char *dir_path, char *name, char path[PATH_MAX]) {
+    int length = (strcmp(dir_path, ".") == 0) ?
+        snprintf(path, PATH_MAX, "%s", name) :
+        snprintf(path, PATH_MAX, "%s/%s", dir_path, name);
+    if (length >= PATH_MAX) {
+        fprintf(stderr, "Error: pathname too long\n");
+        exit(1);
+    }
+}
+
+// Function to open a regular file to hash its tree. Returns false if it
+// isn't one, or can't be opened.
+bool merkle_open(char *pathname, struct Merkle_File *file) {
+    file->f = File_Open(pathname, "r", NOT_HANDLED);
+    if (file->f == NULL) return false;
+
+    struct stat stat;
+    if (fstat(fileno(file->f), &stat) != 0 || !S_ISREG(stat.st_mode)) {
+        fclose(file->f);
+        return false;
+    }
+
+    file->size = stat.st_size;
+    file->num_local_blocks = number_of_blocks_in_file(stat.st_size);
+    file->num_blocks = file->num_local_blocks;
+    return true;
+}
+
+// Function to hash node `index` of a level of a file's tree, from the
+// leaves under it up. Returns false if the file doesn't have all of
+// those leaves.
+bool merkle_node(
+    struct Merkle_File *file, unsigned level, size_t index, uint64_t *hash
+) {
+    size_t span = 1;
+    for (unsigned level_n = 0; level_n < level; level_n++) {
+        span *= MERKLE_FANOUT;
+    }
+
+    size_t first = index * span;
+    size_t last = (file->num_blocks - first < span) ?
+        file->num_blocks : first + span;
+    if (last > file->num_local_blocks) return false;
+
+    struct Merkle_Fold fold = { .level = level };
+    merkle_hash_leaves(file, first, last, &fold);
+    *hash = merkle_fold_finish(&fold);
+
+    return true;
+}
+
+// Function to hash leaves [first, last) of a file into a fold. A whole
+// file small enough to hash in one go is hashed as stage 1 does, so the
+// cache is used if there is one.
+void merkle_hash_leaves(
+    struct Merkle_File *file, size_t first, size_t last,
+    struct Merkle_Fold *fold
+) {
+    size_t block_size = rbuoy_options.block_size;
+    size_t num_leaves = last - first;
+
+    if (first == 0 && last == file->num_local_blocks &&
+        num_leaves <= Hash_Window_Blocks()) {
+        uint64_t *hashes = malloc(sizeof(uint64_t) * num_leaves);
+        if (hashes == NULL) {
+            perror("Error");
+            exit(1);
+        }
+        file_get_hashes(file->f, hashes, NULL, num_leaves);
+        for (size_t leaf_n = 0; leaf_n < num_leaves; leaf_n++) {
+            merkle_fold_push(fold, 0, hashes[leaf_n]);
+        }
+        free(hashes);
+        return;
+    }
+
+    size_t read_blocks = MERKLE_READ_SIZE / block_size;
+    if (read_blocks > num_leaves) read_blocks = num_leaves;
+    unsigned char *buffer = malloc(read_blocks * block_size);
+    uint64_t *hashes = malloc(sizeof(uint64_t) * read_blocks);
+    if (buffer == NULL || hashes == NULL) {
+        perror("Error");
+        exit(1);
+    }
+
+    for (size_t leaf = first; leaf < last; leaf += read_blocks) {
+        size_t count = (last - leaf < read_blocks) ? last - leaf : read_blocks;
+        uint64_t offset = (uint64_t) leaf * block_size;
+        size_t length = count * block_size;
+        if (length > file->size - offset) length = file->size - offset;
+
+        size_t done = 0;
+        while (done < length) {
+            ssize_t n = pread(
+                fileno(file->f), buffer + done, length - done, offset + done
+            );
+            if (n < 0 && errno == EINTR) continue;
+            if (n <= 0) {
+                fprintf(stderr, "Error: file changed size while being hashed\n");
+                exit(1);
+            }
+            done += n;
+        }
+
+        Hash_Buffer_Blocks(buffer, length, hashes, NULL);
+        for (size_t leaf_n = 0; leaf_n < count; leaf_n++) {
+            merkle_fold_push(fold, 0, hashes[leaf_n]);
+        }
+    }
+
+    free(buffer);
+    free(hashes);
+}
+
+// Function to add a node to a fold, hashing its level into the one above
+// whenever it fills up
+void merkle_fold_push(struct Merkle_Fold *fold, unsigned level, uint64_t hash) {
+    fold->children[level][fold->num_children[level]++] = hash;
+
+    if (fold->num_children[level] == MERKLE_FANOUT && level < fold->level) {
+        uint64_t parent = merkle_combine(
+            fold->children[level], MERKLE_FANOUT
+        );
+        fold->num_children[level] = 0;
+        merkle_fold_push(fold, level + 1, parent);
+    }
+}
+
+// Function to hash what's left at each level of a fold into the one
+// above, leaving the one node at the top
+uint64_t merkle_fold_finish(struct Merkle_Fold *fold) {
+    for (unsigned level = 0; level < fold->level; level++) {
+        if (fold->num_children[level] == 0) continue;
+
+        uint64_t parent = merkle_combine(
+            fold->children[level], fold->num_children[level]
+        );
+        fold->num_children[level] = 0;
+        merkle_fold_push(fold, level + 1, parent);
+    }
+
+    return fold->children[fold->level][0];
+}
+
+// Function to hash the children of a node into it
+uint64_t merkle_combine(uint64_t children[], size_t num_children) {
+    uint8_t bytes[MERKLE_FANOUT * HASH_SIZE];
+    Codec_Encode_Hashes(bytes, children, NULL, num_children);
+
+    return Block_Hash_One(
+        bytes, num_children * HASH_SIZE, rbuoy_options.block_hash
+    );
+}
+
+// Function to get the number of nodes in a level of a file's tree
+size_t merkle_level_size(size_t num_blocks, unsigned level) {
+    size_t size = num_blocks;
+    for (unsigned level_n = 0; level_n < level; level_n++) {
+        size = (size + MERKLE_FANOUT - 1) / MERKLE_FANOUT;
+    }
+
+    return size;
+}
+
+// Function to get the level of the root of a file's tree
+unsigned merkle_top_level(size_t num_blocks) {
+    unsigned level = 0;
+    for (size_t size = num_blocks; size > 1; level++) {
+        size = (size + MERKLE_FANOUT - 1) / MERKLE_FANOUT;
+    }
+
+    return level;
+}
+
+// Function to get how many nodes a record's level has
+size_t merkle_node_limit(struct Merkle_Record *record) {
+    if (record->level == MERKLE_LEVEL_FILE || record->level == MERKLE_LEVEL_DIR) {
+        return 1;
+    }
+
+    if (record->level > merkle_top_level(record->num_blocks)) {
+        fprintf(stderr, "Error: invalid level for '%s'\n", record->pathname);
+        exit(1);
+    }
+
+    return merkle_level_size(record->num_blocks, record->level);
+}
+
+// Function to get bit n of some match bytes
+bool match_bytes_get(uint8_t match_bytes[], size_t n) {
+    return (match_bytes[n / MATCH_BYTE_BITS] & (0x80 >> (n % MATCH_BYTE_BITS))) != 0;
+}
@@ -0,0 +1,61 @@
+// Header file for merkle.c written by Connor Li (z5425430)
+// For implementation details go to merkle.c.
+
+#ifndef MERKLE_H_
+#define MERKLE_H_
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stddef.h>
+#include "format.h"
+
+// How many children each node of a file's hash tree has
+#define MERKLE_FANOUT 16
+
+// The level of a record's nodes, in one byte: a level of a file's tree
+// (0 being its blocks), or the node for a whole file or directory
+#define MERKLE_LEVEL_SIZE 1
+#define MERKLE_LEVEL_FILE 0xFE
+#define MERKLE_LEVEL_DIR  0xFF
+
+/// @brief Write the first round of a hash tree TABI: one node for each of
+///        `in_pathnames` (or for the current directory, if there are
+///        none) covering everything in it.
+/// @param f The TABI.
+/// @param in_pathnames The files and directories to send.
+/// @param num_in_pathnames The length of `in_pathnames`.
+/// @param format The format of the TABI, with `merkle` set.
+void Out_Create_Merkle_TABI(
+    FILE *f, char *in_pathnames[], size_t num_in_pathnames,
+    struct Index_Format format
+);
+
+/// @brief Write the next round of a hash tree TABI, going one level down
+///        from every node the receiver didn't match in the last one.
+/// @param tbbi The TBBI answering the last round.
+/// @param tabi The next round's TABI.
+void Out_Refine_Merkle_TABI(FILE *tbbi, FILE *tabi);
+
+/// @brief Answer a round of a hash tree TABI with which of its nodes the
+///        receiver has.
+/// @param tabi The records of the TABI, just after its header.
+/// @param format The format of the TABI.
+/// @param num_records The number of records in the TABI.
+/// @param tbbi The TBBI.
+void Out_Create_Merkle_TBBI(
+    FILE *tabi, struct Index_Format format, uint64_t num_records, FILE *tbbi
+);
+
+/// @brief Read the nodes and match bytes of a record of a hash tree TBBI
+///        that is down to blocks, as the match bytes of every block.
+///        Blocks that aren't listed were matched in an earlier round.
+/// @param tbbi The TBBI, just after the record's number of blocks.
+/// @param format The format of the TBBI.
+/// @param num_blocks The number of blocks in the file.
+/// @param match_bytes Filled in with num_tbbi_match_bytes(num_blocks) bytes.
+void Merkle_Read_Match_Bytes(
+    FILE *tbbi, struct Index_Format format, size_t num_blocks,
+    uint8_t match_bytes[]
+);
+
+#endif
@@ -0,0 +1,320 @@
+// Implementation for 'parallel.h', written by Connor Li (z5425430)
+// Hashing files on a work-stealing pool. A file task opens the file and
+// either hashes it whole, or (for files bigger than a chunk) pushes one
+// task per chunk onto its own deque for idle workers to steal. Every task
+// writes straight into its slice of the job's hash array, so the result
+// is the same as hashing serially. A file split into content-defined
+// chunks is read front to back by its one task, as each cut depends on
+// the one before it.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include "parallel.h"
+#include "hash_io.h"
+#include "cache.h"
+#include "helpers.h"
+#include "rbuoy.h"
+#include "stats.h"
+
+// 16384 blocks is 4 MiB, a multiple of the page size so chunks can be
+// mapped on their own.
+#define CHUNK_BLOCKS 16384
+
+struct Hash_Chunk {
+    struct Hash_Job *job;
+    size_t first_block;
+    size_t num_blocks;
+
+    // Where the chunk's hashes go, and the latch to count down once
+    // they're in
+    uint64_t *hashes;
+    uint32_t *weak_hashes;
+    struct Latch *done;
+};
+
+//////////////////////////////////////////////////////////////////////
+//                        FUNCTION PROTOTYPES
+//////////////////////////////////////////////////////////////////////
+
+void hash_file_task(void *arg);
+
+void hash_local_task(void *arg);
+
+void hash_file(struct Hash_Job *job, int fd, struct stat *stat);
+
+void hash_submit_chunks(
+    struct Hash_Job *job, size_t first, size_t num_blocks, uint64_t hashes[],
+    uint32_t weak_hashes[], struct Latch *done
+);
+
+void hash_chunk_task(void *arg);
+
+void hash_cdc_file(struct Hash_Job *job, int fd, uint64_t size);
+
+//////////////////////////////////////////////////////////////////////
+//                        INTERFACE FUNCTIONS
+//////////////////////////////////////////////////////////////////////
+
+void Hash_Job_Start(struct Pool *pool, struct Hash_Job *job, bool weak) {
+    job->started = Stats_Start();
+    job->pool = pool;
+    job->fd = -1;
+    job->hashes = NULL;
+    job->weak_hashes = NULL;
+    job->cacheable = false;
+    job->windowed = false;
+    job->weak = weak;
+    memset(&job->chunks, 0, sizeof(struct Chunk_List));
+
+    if (job->num_blocks == 0) {
+        Latch_Init(&job->done, 0);
+        return;
+    }
+
+    Latch_Init(&job->done, 1);
+    Pool_Submit(pool, hash_file_task, job);
+}
+
+void Hash_Job_Start_Local(struct Pool *pool, struct Hash_Job *job) {
+    job->started = Stats_Start();
+    job->pool = pool;
+    job->fd = -1;
+    job->num_blocks = 0;
+    job->hashes = NULL;
+    job->weak_hashes = NULL;
+    job->cacheable = false;
+    job->windowed = false;
+    job->weak = false;
+    memset(&job->chunks, 0, sizeof(struct Chunk_List));
+
+    Latch_Init(&job->done, 1);
+    Pool_Submit(pool, hash_local_task, job);
+}
+
+void Hash_Job_Wait(struct Hash_Job *job) {
+    Latch_Wait(&job->done);
+
+    if (job->fd >= 0 && !job->windowed) {
+        // Chunked files are only whole once every chunk is done
+        if (job->cacheable) {
+            Cache_Store(
+                job->fd, &job->cache_key, job->hashes, job->weak_hashes,
+                job->num_blocks
+            );
+        }
+        close(job->fd);
+        job->fd = -1;
+    }
+}
+
+void Hash_Job_Hash_Window(
+    struct Hash_Job *job, size_t first, size_t num_blocks, uint64_t hashes[],
+    uint32_t weak_hashes[]
+) {
+    struct Latch done;
+    Latch_Init(&done, 0);
+    hash_submit_chunks(job, first, num_blocks, hashes, weak_hashes, &done);
+    Latch_Wait(&done);
+    Latch_Destroy(&done);
+}
+
+void Hash_Job_Free(struct Hash_Job *job) {
+    Latch_Destroy(&job->done);
+    if (job->windowed) close(job->fd);
+    job->fd = -1;
+    free(job->hashes);
+    free(job->weak_hashes);
+    job->hashes = NULL;
+    job->weak_hashes = NULL;
+    Chunk_List_Free(&job->chunks);
+}
+
+//////////////////////////////////////////////////////////////////////
+//                           LOCAL HELPERS
+//////////////////////////////////////////////////////////////////////
+
+// Task to hash one file, splitting it into chunk tasks if it is large.
+// One too big to hold every hash of is left for the writer unless it's
+// cached, as the cache holds whole files.
+void hash_file_task(void *arg) {
+    struct Hash_Job *job = arg;
+
+    uint64_t started = Stats_Start();
+    int fd = open(job->pathname, O_RDONLY);
+    Stats_Stop(STATS_TIMER_OPEN, started);
+    Stats_Add(STATS_OPEN_CALLS, 1);
+    if (fd < 0) {
+        perror("Error");
+        exit(1);
+    }
+
+    struct stat stat;
+    if (job->chunked) {
+        hash_cdc_file(job, fd, job->file_size);
+        return;
+    }
+    bool have_stat = fstat(fd, &stat) == 0;
+
+    struct Cache_Key key;
+    if (have_stat && S_ISREG(stat.st_mode) &&
+        job->num_blocks > Hash_Window_Blocks() && !Cache_Key_Get(fd, &key)) {
+        if (number_of_blocks_in_file(stat.st_size) != job->num_blocks) {
+            fprintf(stderr, "Error: file changed size while being hashed\n");
+            exit(1);
+        }
+
+        job->fd = fd;
+        job->file_size = stat.st_size;
+        job->windowed = true;
+        Latch_Count_Down(&job->done);
+        return;
+    }
+
+    job->hashes = malloc(sizeof(uint64_t) * job->num_blocks);
+    if (job->weak) {
+        job->weak_hashes = malloc(sizeof(uint32_t) * job->num_blocks);
+    }
+    if (job->hashes == NULL || (job->weak && job->weak_hashes == NULL)) {
+        perror("Error");
+        exit(1);
+    }
+
+    hash_file(job, fd, have_stat ? &stat : NULL);
+}
+
+// Task to hash the receiver's copy of a file. A missing file has no
+// blocks, and a large one is left for the caller unless it's cached.
+void hash_local_task(void *arg) {
+    struct Hash_Job *job = arg;
+
+    uint64_t started = Stats_Start();
+    int fd = open(job->pathname, O_RDONLY);
+    Stats_Stop(STATS_TIMER_OPEN, started);
+    Stats_Add(STATS_OPEN_CALLS, 1);
+    struct stat stat;
+    if (fd < 0 || fstat(fd, &stat) != 0 || !S_ISREG(stat.st_mode) ||
+        stat.st_size == 0) {
+        if (fd >= 0) close(fd);
+        Latch_Count_Down(&job->done);
+        return;
+    }
+
+    if (job->chunked) {
+        hash_cdc_file(job, fd, stat.st_size);
+        return;
+    }
+    job->num_blocks = number_of_blocks_in_file(stat.st_size);
+
+    struct Cache_Key key;
+    if (job->num_blocks > Hash_Window_Blocks() && !Cache_Key_Get(fd, &key)) {
+        job->fd = fd;
+        job->file_size = stat.st_size;
+        job->windowed = true;
+        Latch_Count_Down(&job->done);
+        return;
+    }
+
+    job->hashes = malloc(sizeof(uint64_t) * job->num_blocks);
+    if (job->hashes == NULL) {
+        perror("Error");
+        exit(1);
+    }
+
+    hash_file(job, fd, &stat);
+}
+
+// Function to hash an open file (`stat` is NULL if it couldn't be
+// stat'd) and count the job down once its hashes are all in
+void hash_file(struct Hash_Job *job, int fd, struct stat *stat) {
+    if (stat != NULL && S_ISREG(stat->st_mode) &&
+        job->num_blocks > CHUNK_BLOCKS) {
+        job->cacheable = Cache_Key_Get(fd, &job->cache_key);
+        if (job->cacheable && Cache_Lookup(
+            &job->cache_key, job->hashes, job->weak_hashes, job->num_blocks
+        )) {
+            job->cacheable = false;
+            close(fd);
+            Latch_Count_Down(&job->done);
+            return;
+        }
+
+        if (number_of_blocks_in_file(stat->st_size) != job->num_blocks) {
+            fprintf(stderr, "Error: file changed size while being hashed\n");
+            exit(1);
+        }
+
+        job->fd = fd;
+        job->file_size = stat->st_size;
+        hash_submit_chunks(
+            job, 0, job->num_blocks, job->hashes, job->weak_hashes, &job->done
+        );
+    } else {
+        FILE *f = fdopen(fd, "rb");
+        if (f == NULL) {
+            perror("Error");
+            exit(1);
+        }
+        file_get_hashes(f, job->hashes, job->weak_hashes, job->num_blocks);
+        fclose(f);
+    }
+
+    Latch_Count_Down(&job->done);
+}
+
+// Function to submit a task for each chunk of the blocks from `first`
+// of a job's open file, which hash them into `hashes` (and `weak_hashes`)
+// and count `done` down
+void hash_submit_chunks(
+    struct Hash_Job *job, size_t first, size_t num_blocks, uint64_t hashes[],
+    uint32_t weak_hashes[], struct Latch *done
+) {
+    size_t num_chunks = (num_blocks + CHUNK_BLOCKS - 1) / CHUNK_BLOCKS;
+    Latch_Add(done, num_chunks);
+
+    for (size_t chunk_n = 0; chunk_n < num_chunks; chunk_n++) {
+        struct Hash_Chunk *chunk = malloc(sizeof(struct Hash_Chunk));
+        if (chunk == NULL) {
+            perror("Error");
+            exit(1);
+        }
+        size_t offset = chunk_n * CHUNK_BLOCKS;
+        chunk->job = job;
+        chunk->first_block = first + offset;
+        chunk->num_blocks = num_blocks - offset;
+        if (chunk->num_blocks > CHUNK_BLOCKS) chunk->num_blocks = CHUNK_BLOCKS;
+        chunk->hashes = hashes + offset;
+        chunk->weak_hashes = (weak_hashes == NULL) ? NULL : weak_hashes + offset;
+        chunk->done = done;
+
+        Pool_Submit(job->pool, hash_chunk_task, chunk);
+    }
+}
+
+// Task to hash one chunk of a large file
+void hash_chunk_task(void *arg) {
+    struct Hash_Chunk *chunk = arg;
+    struct Hash_Job *job = chunk->job;
+    struct Latch *done = chunk->done;
+
+    Hash_File_Range(
+        job->fd, job->file_size, chunk->first_block, chunk->num_blocks,
+        chunk->hashes, chunk->weak_hashes, rbuoy_options.hash_backend
+    );
+
+    free(chunk);
+    Latch_Count_Down(done);
+}
+
+// Function to split an open file into hashed chunks, then close it and
+// count the job down. `num_blocks` becomes the number of chunks.
+void hash_cdc_file(struct Hash_Job *job, int fd, uint64_t size) {
+    Cdc_Chunk_File(fd, size, rbuoy_options.block_size, true, &job->chunks);
+    job->num_blocks = job->chunks.num_chunks;
+    close(fd);
+
+    Latch_Count_Down(&job->done);
+}
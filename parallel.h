@@ -0,0 +1,89 @@
+// Header file for parallel.c written by Connor Li (z5425430)
+// For implementation details go to parallel.c.
+
+#ifndef PARALLEL_H_
+#define PARALLEL_H_
+
+#include <stdint.h>
+#include <stdbool.h>
+#include "pool.h"
+#include "cache.h"
+#include "cdc.h"
+
+/// @brief A file being hashed on a pool. Small files are hashed by one
+///        task, large ones are split into chunks hashed in parallel.
+struct Hash_Job {
+    char *pathname;
+    size_t num_blocks;
+    uint64_t *hashes;
+    uint32_t *weak_hashes;
+
+    struct Pool *pool;
+    struct Latch done;
+    int fd;
+    uint64_t file_size;
+
+    // Key to cache the hashes of a chunked file under, once they're done
+    struct Cache_Key cache_key;
+    bool cacheable;
+
+    // A large file that was left for the caller to hash a window at a
+    // time through `fd`, with Hash_Job_Hash_Window
+    bool windowed;
+
+    // Whether to also compute weak checksums
+    bool weak;
+
+    // Set by the caller to split the file into content-defined chunks
+    // (which are hashed into `chunks`) rather than fixed size blocks
+    bool chunked;
+    struct Chunk_List chunks;
+
+    // When the job was started, for Stats_File
+    uint64_t started;
+};
+
+/// @brief Start hashing a file on a pool.
+/// @param pool The pool to hash on.
+/// @param job The job, with `pathname`, `num_blocks` and `chunked` filled
+///            in. Only whether `num_blocks` is 0 matters to a chunked job.
+/// @param weak Whether to also compute weak checksums.
+///            A file too big to hash in one go (and not cached) is instead
+///            left open as `fd`, with `windowed` set.
+void Hash_Job_Start(struct Pool *pool, struct Hash_Job *job, bool weak);
+
+/// @brief Start hashing the receiver's copy of a file on a pool. It might
+///        not exist, and how many blocks it has isn't known until it is
+///        opened.
+/// @param pool The pool to hash on.
+/// @param job The job, with `pathname` and `chunked` filled in. Once it's done,
+///            `num_blocks` is the number of blocks in the file (0 if it
+///            isn't there or isn't a regular file). A file too big to hash
+///            in one go is instead left open as `fd`, with `file_size`
+///            and `windowed` set.
+void Hash_Job_Start_Local(struct Pool *pool, struct Hash_Job *job);
+
+/// @brief Wait for a job to finish, after which `hashes` (and
+///        `weak_hashes`) hold every block's hash, or `chunks` every
+///        chunk's.
+/// @param job The job to wait for.
+void Hash_Job_Wait(struct Hash_Job *job);
+
+/// @brief Hash a window of a windowed job's file on its pool, and wait
+///        for it.
+/// @param job The finished job, with `windowed` set.
+/// @param first The first block of the window.
+/// @param num_blocks How many blocks are in the window.
+/// @param hashes Where to put the window's hashes.
+/// @param weak_hashes Where to put its weak checksums, or NULL.
+void Hash_Job_Hash_Window(
+    struct Hash_Job *job, size_t first, size_t num_blocks, uint64_t hashes[],
+    uint32_t weak_hashes[]
+);
+
+/// @brief Free the hashes of a finished job, and close the file of a
+///        windowed one.
+/// @param job The job to free.
+void Hash_Job_Free(struct Hash_Job *job);
+
+#endif
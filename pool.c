@@ -0,0 +1,289 @@
+// Implementation for 'pool.h', written by Connor Li (z5425430)
+// A small work-stealing thread pool. Every worker has its own deque: it
+// pushes and pops at the tail (so related work stays on one core), while
+// idle workers steal from the head of the others. Deques are protected by
+// a mutex each, which is plenty for tasks that hash whole files or large
+// chunks of them.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include "pool.h"
+
+#define INITIAL_DEQUE_CAPACITY 64
+
+struct Task {
+    void (*fn)(void *);
+    void *arg;
+};
+
+struct Deque {
+    pthread_mutex_t lock;
+    struct Task *tasks;
+    size_t capacity;
+    size_t head;
+    size_t size;
+};
+
+struct Pool {
+    size_t num_workers;
+    pthread_t *threads;
+    struct Deque *deques;
+
+    // Sleeping workers wait here until something is queued
+    pthread_mutex_t idle_lock;
+    pthread_cond_t idle_cond;
+    size_t queued;
+    bool stopping;
+    size_t next_deque;
+};
+
+struct Worker_Start {
+    struct Pool *pool;
+    size_t worker_n;
+};
+
+// Which pool and deque the current thread works for, if any
+static __thread struct Pool *current_pool = NULL;
+static __thread size_t current_worker = 0;
+
+//////////////////////////////////////////////////////////////////////
+//                        FUNCTION PROTOTYPES
+//////////////////////////////////////////////////////////////////////
+
+void *worker_main(void *arg);
+
+bool worker_find_task(struct Pool *pool, size_t worker_n, struct Task *task);
+
+void deque_push_tail(struct Deque *deque, struct Task task);
+
+bool deque_pop_tail(struct Deque *deque, struct Task *task);
+
+bool deque_pop_head(struct Deque *deque, struct Task *task);
+
+void *alloc_handler(size_t size);
+
+//////////////////////////////////////////////////////////////////////
+//                        INTERFACE FUNCTIONS
+//////////////////////////////////////////////////////////////////////
+
+struct Pool *Pool_Create(size_t num_workers) {
+    if (num_workers == 0) num_workers = 1;
+
+    struct Pool *pool = alloc_handler(sizeof(struct Pool));
+    pool->num_workers = num_workers;
+    pool->threads = alloc_handler(sizeof(pthread_t) * num_workers);
+    pool->deques = alloc_handler(sizeof(struct Deque) * num_workers);
+    pthread_mutex_init(&pool->idle_lock, NULL);
+    pthread_cond_init(&pool->idle_cond, NULL);
+    pool->queued = 0;
+    pool->stopping = false;
+    pool->next_deque = 0;
+
+    for (size_t worker_n = 0; worker_n < num_workers; worker_n++) {
+        struct Deque *deque = &pool->deques[worker_n];
+        pthread_mutex_init(&deque->lock, NULL);
+        deque->tasks = alloc_handler(sizeof(struct Task) * INITIAL_DEQUE_CAPACITY);
+        deque->capacity = INITIAL_DEQUE_CAPACITY;
+        deque->head = 0;
+        deque->size = 0;
+    }
+
+    for (size_t worker_n = 0; worker_n < num_workers; worker_n++) {
+        struct Worker_Start *start = alloc_handler(sizeof(struct Worker_Start));
+        start->pool = pool;
+        start->worker_n = worker_n;
+        if (pthread_create(&pool->threads[worker_n], NULL, worker_main, start) != 0) {
+            fprintf(stderr, "Error: could not start worker thread\n");
+            exit(1);
+        }
+    }
+
+    return pool;
+}
+
+void Pool_Submit(struct Pool *pool, void (*fn)(void *), void *arg) {
+    struct Task task = { .fn = fn, .arg = arg };
+
+    size_t deque_n;
+    if (current_pool == pool) {
+        deque_n = current_worker;
+    } else {
+        pthread_mutex_lock(&pool->idle_lock);
+        deque_n = pool->next_deque;
+        pool->next_deque = (pool->next_deque + 1) % pool->num_workers;
+        pthread_mutex_unlock(&pool->idle_lock);
+    }
+
+    deque_push_tail(&pool->deques[deque_n], task);
+
+    pthread_mutex_lock(&pool->idle_lock);
+    pool->queued++;
+    pthread_cond_signal(&pool->idle_cond);
+    pthread_mutex_unlock(&pool->idle_lock);
+}
+
+void Pool_Destroy(struct Pool *pool) {
+    pthread_mutex_lock(&pool->idle_lock);
+    pool->stopping = true;
+    pthread_cond_broadcast(&pool->idle_cond);
+    pthread_mutex_unlock(&pool->idle_lock);
+
+    for (size_t worker_n = 0; worker_n < pool->num_workers; worker_n++) {
+        pthread_join(pool->threads[worker_n], NULL);
+    }
+
+    for (size_t worker_n = 0; worker_n < pool->num_workers; worker_n++) {
+        pthread_mutex_destroy(&pool->deques[worker_n].lock);
+        free(pool->deques[worker_n].tasks);
+    }
+    pthread_mutex_destroy(&pool->idle_lock);
+    pthread_cond_destroy(&pool->idle_cond);
+    free(pool->deques);
+    free(pool->threads);
+    free(pool);
+}
+
+void Latch_Init(struct Latch *latch, size_t count) {
+    pthread_mutex_init(&latch->lock, NULL);
+    pthread_cond_init(&latch->cond, NULL);
+    latch->remaining = count;
+}
+
+void Latch_Add(struct Latch *latch, size_t count) {
+    pthread_mutex_lock(&latch->lock);
+    latch->remaining += count;
+    pthread_mutex_unlock(&latch->lock);
+}
+
+void Latch_Count_Down(struct Latch *latch) {
+    pthread_mutex_lock(&latch->lock);
+    latch->remaining--;
+    if (latch->remaining == 0) pthread_cond_broadcast(&latch->cond);
+    pthread_mutex_unlock(&latch->lock);
+}
+
+void Latch_Wait(struct Latch *latch) {
+    pthread_mutex_lock(&latch->lock);
+    while (latch->remaining > 0) {
+        pthread_cond_wait(&latch->cond, &latch->lock);
+    }
+    pthread_mutex_unlock(&latch->lock);
+}
+
+void Latch_Destroy(struct Latch *latch) {
+    pthread_mutex_destroy(&latch->lock);
+    pthread_cond_destroy(&latch->cond);
+}
+
+//////////////////////////////////////////////////////////////////////
+//                           LOCAL HELPERS
+//////////////////////////////////////////////////////////////////////
+
+// Function run by each worker: keep taking tasks, and sleep when there
+// are none. Workers only exit once stopping and nothing is queued.
+void *worker_main(void *arg) {
+    struct Worker_Start *start = arg;
+    struct Pool *pool = start->pool;
+    size_t worker_n = start->worker_n;
+    free(start);
+
+    current_pool = pool;
+    current_worker = worker_n;
+
+    for (;;) {
+        struct Task task;
+        if (worker_find_task(pool, worker_n, &task)) {
+            pthread_mutex_lock(&pool->idle_lock);
+            pool->queued--;
+            pthread_mutex_unlock(&pool->idle_lock);
+
+            task.fn(task.arg);
+            continue;
+        }
+
+        pthread_mutex_lock(&pool->idle_lock);
+        while (pool->queued == 0 && !pool->stopping) {
+            pthread_cond_wait(&pool->idle_cond, &pool->idle_lock);
+        }
+        bool done = pool->stopping && pool->queued == 0;
+        pthread_mutex_unlock(&pool->idle_lock);
+
+        if (done) break;
+    }
+
+    return NULL;
+}
+
+// Function to take a task from our own deque, or steal one from another
+bool worker_find_task(struct Pool *pool, size_t worker_n, struct Task *task) {
+    if (deque_pop_tail(&pool->deques[worker_n], task)) return true;
+
+    for (size_t i = 1; i < pool->num_workers; i++) {
+        size_t victim = (worker_n + i) % pool->num_workers;
+        if (deque_pop_head(&pool->deques[victim], task)) return true;
+    }
+
+    return false;
+}
+
+// Function to push a task onto the owner's end, growing the ring if full
+void deque_push_tail(struct Deque *deque, struct Task task) {
+    pthread_mutex_lock(&deque->lock);
+
+    if (deque->size == deque->capacity) {
+        struct Task *tasks = alloc_handler(sizeof(struct Task) * deque->capacity * 2);
+        for (size_t i = 0; i < deque->size; i++) {
+            tasks[i] = deque->tasks[(deque->head + i) % deque->capacity];
+        }
+        free(deque->tasks);
+        deque->tasks = tasks;
+        deque->capacity *= 2;
+        deque->head = 0;
+    }
+
+    deque->tasks[(deque->head + deque->size) % deque->capacity] = task;
+    deque->size++;
+
+    pthread_mutex_unlock(&deque->lock);
+}
+
+// Function to pop the newest task, used by the deque's owner
+bool deque_pop_tail(struct Deque *deque, struct Task *task) {
+    pthread_mutex_lock(&deque->lock);
+
+    bool found = deque->size > 0;
+    if (found) {
+        deque->size--;
+        *task = deque->tasks[(deque->head + deque->size) % deque->capacity];
+    }
+
+    pthread_mutex_unlock(&deque->lock);
+    return found;
+}
+
+// Function to pop the oldest task, used by thieves
+bool deque_pop_head(struct Deque *deque, struct Task *task) {
+    pthread_mutex_lock(&deque->lock);
+
+    bool found = deque->size > 0;
+    if (found) {
+        *task = deque->tasks[deque->head];
+        deque->head = (deque->head + 1) % deque->capacity;
+        deque->size--;
+    }
+
+    pthread_mutex_unlock(&deque->lock);
+    return found;
+}
+
+// Simple function that calls malloc but errors out on fail
+void *alloc_handler(size_t size) {
+    void *ptr = malloc(size);
+    if (ptr == NULL) {
+        perror("Error");
+        exit(1);
+    }
+
+    return ptr;
+}
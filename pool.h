@@ -0,0 +1,40 @@
+// Header file for pool.c written by Connor Li (z5425430)
+// For implementation details go to pool.c.
+
+#ifndef POOL_H_
+#define POOL_H_
+
+#include <stddef.h>
+#include <pthread.h>
+
+struct Pool;
+
+/// @brief Counts down outstanding tasks so another thread can wait on them.
+struct Latch {
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    size_t remaining;
+};
+
+/// @brief Start a work-stealing pool.
+/// @param num_workers The number of worker threads.
+struct Pool *Pool_Create(size_t num_workers);
+
+/// @brief Queue a task. From a worker, the task goes on that worker's own
+///        deque (where it can be stolen), otherwise workers take turns.
+/// @param pool The pool to run the task on.
+/// @param fn The function to run.
+/// @param arg The argument passed to `fn`.
+void Pool_Submit(struct Pool *pool, void (*fn)(void *), void *arg);
+
+/// @brief Wait for every queued task to finish, then stop the workers.
+/// @param pool The pool to destroy.
+void Pool_Destroy(struct Pool *pool);
+
+void Latch_Init(struct Latch *latch, size_t count);
+void Latch_Add(struct Latch *latch, size_t count);
+void Latch_Count_Down(struct Latch *latch);
+void Latch_Wait(struct Latch *latch);
+void Latch_Destroy(struct Latch *latch);
+
+#endif
@@ -25,6 +25,38 @@
 
 #include "rbuoy.h"
 #include "helpers.h"
+#include "format.h"
+#include "apply.h"
+#include "receive.h"
+#include "cache.h"
+#include "merkle.h"
+#include "stats.h"
+
+struct rbuoy_options rbuoy_options = {
+    .rolling = false,
+    .wide = false,
+    .in_place = false,
+    .hash_backend = HASH_BACKEND_AUTO,
+    .jobs = 1,
+    .cache_path = NULL,
+    .block_hash = BLOCK_HASH_FNV1A,
+    .peak_rss = false,
+    .runs = false,
+    .compress = false,
+    .block_size = BLOCK_SIZE,
+    .block_size_auto = false,
+    .cdc = false,
+    .merkle = false,
+    .refine_path = NULL,
+    .io_depth = 0,
+    .io_backend = IO_BACKEND_AUTO,
+    .write_buffer_size = INDEX_WRITER_BUFFER_SIZE,
+    .write_cache = WRITE_CACHE_KEEP,
+    .footer = false,
+    .only_paths = NULL,
+    .num_only_paths = 0,
+    .watch = false,
+};
 
 /// @brief Create a TABI file from an array of pathnames.
 /// @param out_pathname A path to where the new TABI file should be created.
@@ -34,28 +66,132 @@
 ///                         subset 5, when this is zero, you should include
 ///                         everything in the current directory.
 void stage_1(char *out_pathname, char *in_pathnames[], size_t num_in_pathnames) {
-    // Create file with name `out_pathname`
-    FILE *output_file = File_Open(out_pathname, "w", HANDLED);
+    Stats_Set_Stage(1);
+
+    // Later rounds of a hash tree index take everything from the last one
+    if (rbuoy_options.refine_path != NULL) {
+        if (num_in_pathnames > 0) {
+            fprintf(stderr, "Error: --refine takes no pathnames\n");
+            exit(1);
+        }
+
+        FILE *input_file = Index_Open(rbuoy_options.refine_path, "r");
+        FILE *output_file = Index_Open(out_pathname, "w");
+        if (rbuoy_options.cache_path != NULL) Cache_Open(rbuoy_options.cache_path);
+
+        Out_Refine_Merkle_TABI(input_file, output_file);
 
-    Out_Create_TABI(output_file, in_pathnames, num_in_pathnames, TYPE_A_MAGIC);
+        Cache_Close();
+        Index_Close(input_file);
+        Index_Close(output_file);
+        return;
+    }
 
-    fclose(output_file);
+    stage_1_check_options();
+
+    // Create file with name `out_pathname`
+    FILE *output_file = Index_Open(out_pathname, "w");
+    stage_1_write(output_file, in_pathnames, num_in_pathnames);
+    Index_Close(output_file);
 
     return;
 }   
 
 
+/// @brief Error out if the options asked for can't make a TABI together.
+void stage_1_check_options(void) {
+    // A v1 index has nowhere to say which hash it uses
+    if (rbuoy_options.block_hash != BLOCK_HASH_FNV1A && !rbuoy_options.wide) {
+        fprintf(stderr, "Error: --hash needs --wide\n");
+        exit(1);
+    }
+
+    // Nor which block size it uses
+    bool default_blocks = rbuoy_options.block_size == BLOCK_SIZE &&
+        !rbuoy_options.block_size_auto && !rbuoy_options.cdc;
+    if (!default_blocks && !rbuoy_options.wide) {
+        fprintf(stderr, "Error: --block-size and --cdc need --wide\n");
+        exit(1);
+    }
+    if (rbuoy_options.cdc && rbuoy_options.rolling) {
+        fprintf(stderr, "Error: --cdc can't be used with --rolling\n");
+        exit(1);
+    }
+
+    // A hash tree is of fixed size blocks, the size of which is known
+    // before any file is read
+    if (rbuoy_options.merkle && !rbuoy_options.wide) {
+        fprintf(stderr, "Error: --merkle needs --wide\n");
+        exit(1);
+    }
+    if (rbuoy_options.merkle && (
+        rbuoy_options.rolling || rbuoy_options.cdc ||
+        rbuoy_options.block_size_auto
+    )) {
+        fprintf(stderr, "Error: --merkle can't be used with --rolling, --cdc or --block-size auto\n");
+        exit(1);
+    }
+
+    // A footer holds the offsets of records, which a hash tree's rounds
+    // don't keep in one index
+    if (rbuoy_options.footer && !rbuoy_options.wide) {
+        fprintf(stderr, "Error: --footer needs --wide\n");
+        exit(1);
+    }
+    if (rbuoy_options.footer && rbuoy_options.merkle) {
+        fprintf(stderr, "Error: --footer can't be used with --merkle\n");
+        exit(1);
+    }
+}
+
+
+/// @brief Write a TABI (not a later round of a hash tree one) to an open
+///        file, as stage 1 does.
+/// @param output_file Where the TABI is written.
+/// @param in_pathnames The files to put in the TABI, as for stage_1.
+/// @param num_in_pathnames The length of the `in_pathnames` array.
+void stage_1_write(
+    FILE *output_file, char *in_pathnames[], size_t num_in_pathnames
+) {
+    Stats_Set_Stage(1);
+    if (rbuoy_options.cache_path != NULL) Cache_Open(rbuoy_options.cache_path);
+
+    struct Index_Format format = {
+        .type = INDEX_TABI,
+        .wide = rbuoy_options.wide,
+        .rolling = rbuoy_options.rolling,
+        .block_hash = rbuoy_options.block_hash,
+        .block_size = rbuoy_options.block_size,
+        .cdc = rbuoy_options.cdc,
+        .merkle = rbuoy_options.merkle,
+        .footer = rbuoy_options.footer,
+    };
+    if (format.merkle) {
+        Out_Create_Merkle_TABI(
+            output_file, in_pathnames, num_in_pathnames, format
+        );
+    } else {
+        Out_Create_TABI(output_file, in_pathnames, num_in_pathnames, format);
+    }
+
+    Cache_Close();
+}
+
+
 /// @brief Create a TBBI file from a TABI file.
 /// @param out_pathname A path to where the new TBBI file should be created.
 /// @param in_pathname A path to where the existing TABI file is located.
 void stage_2(char *out_pathname, char *in_pathname) {
-    FILE *input_file = File_Open(in_pathname, "r", HANDLED);
-    FILE *output_file = File_Open(out_pathname, "w", HANDLED);
+    Stats_Set_Stage(2);
+    FILE *input_file = Index_Open(in_pathname, "r");
+    FILE *output_file = Index_Open(out_pathname, "w");
+    if (rbuoy_options.cache_path != NULL) Cache_Open(rbuoy_options.cache_path);
 
     Out_Create_TBBI(input_file, output_file);
 
-    fclose(input_file);
-    fclose(output_file);
+    Cache_Close();
+    Index_Close(input_file);
+    Index_Close(output_file);
 }
 
 
@@ -63,18 +199,24 @@ void stage_2(char *out_pathname, char *in_pathname) {
 /// @param out_pathname A path to where the new TCBI file should be created.
 /// @param in_pathname A path to where the existing TBBI file is located.
 void stage_3(char *out_pathname, char *in_pathname) {
-    FILE *input_file = File_Open(in_pathname, "r", HANDLED);
-    FILE *output_file = File_Open(out_pathname, "w", HANDLED);
+    Stats_Set_Stage(3);
+    FILE *input_file = Index_Open(in_pathname, "r");
+    FILE *output_file = Index_Open(out_pathname, "w");
 
     Out_Create_TCBI(input_file, output_file);
 
-    fclose(input_file);
-    fclose(output_file);
+    Index_Close(input_file);
+    Index_Close(output_file);
 }
 
 
 /// @brief Apply a TCBI file to the filesystem.
 /// @param in_pathname A path to where the existing TCBI file is located.
 void stage_4(char *in_pathname) {
-    // Didn't have time to implement
+    Stats_Set_Stage(4);
+    FILE *input_file = Index_Open(in_pathname, "r");
+
+    In_Apply_TCBI(input_file);
+
+    Index_Close(input_file);
 }
\ No newline at end of file
@@ -3,6 +3,12 @@
 
 #include <stdlib.h>
 #include <stdint.h>
+#include <stdbool.h>
+
+#include "hash_io.h"
+#include "block_hash.h"
+#include "io_engine.h"
+#include "index_writer.h"
 
 
 // Sizes (in bytes) of various fields.
@@ -15,6 +21,28 @@
 #define FILE_SIZE_SIZE    4
 #define BLOCK_INDEX_SIZE  3
 #define UPDATE_LEN_SIZE   2
+#define WEAK_HASH_SIZE    4
+#define BLOCK_OFFSET_SIZE 4
+
+// Sizes (in bytes) of the header fields of a wide (v2) index. Every other
+// count, length, size, index and offset in a wide index is a varint.
+#define WIDE_FLAGS_SIZE       1
+#define WIDE_NUM_RECORDS_SIZE 8
+#define VARINT_MAX_SIZE       10
+
+// Bits of the flags byte in a wide index header
+#define WIDE_FLAG_ROLLING 0x01
+#define WIDE_FLAG_XXH64   0x02
+#define WIDE_FLAG_RUNS    0x04
+#define WIDE_FLAG_DEFLATE 0x08
+#define WIDE_FLAG_BLOCK_SIZE 0x10
+#define WIDE_FLAG_CDC     0x20
+#define WIDE_FLAG_MERKLE  0x40
+#define WIDE_FLAG_FOOTER  0x80
+
+// A wide index with WIDE_FLAG_BLOCK_SIZE has one more byte after the
+// number of records: log2 of its block size
+#define WIDE_BLOCK_SHIFT_SIZE 1
 
 #define MATCH_BYTE_BITS   8
 
@@ -24,11 +52,86 @@
 #define TYPE_B_MAGIC "TBBI"
 #define TYPE_C_MAGIC "TCBI"
 
-// The maximum size of a block (the trailing block of a file might be smaller).
+// Rolling variants of the indexes, which can match a block at any offset
+// of the receiver's file rather than only at its own offset.
+#define TYPE_A_ROLLING_MAGIC "TARI"
+#define TYPE_B_ROLLING_MAGIC "TBRI"
+#define TYPE_C_ROLLING_MAGIC "TCRI"
+
+// Wide (v2) variants of the indexes, with no limits on the number of
+// records, blocks or the size of a file. Options such as rolling are
+// flags in the header rather than separate magic numbers.
+#define TYPE_A_WIDE_MAGIC "TAB2"
+#define TYPE_B_WIDE_MAGIC "TBB2"
+#define TYPE_C_WIDE_MAGIC "TCB2"
+
+// The size of a block in a v1 index, and by default in a wide one (the
+// trailing block of a file might be smaller).
 #define BLOCK_SIZE 256
 
+// A wide index can have any power of two block size in this range, which
+// every stage takes from its header. With content-defined chunking it is
+// the average chunk size instead.
+#define BLOCK_SIZE_MIN 64
+#define BLOCK_SIZE_MAX (128 * 1024)
+
+// The largest content-defined chunk, which is 4 times the average
+#define CHUNK_SIZE_MAX (4 * BLOCK_SIZE_MAX)
+
+// Options that change how the stages behave, set from the command line.
+struct rbuoy_options {
+    bool rolling;
+    bool wide;
+    bool in_place;
+    enum Hash_Backend hash_backend;
+    size_t jobs;
+    char *cache_path;
+    enum Block_Hash block_hash;
+    bool peak_rss;
+    bool runs;
+    bool compress;
+
+    // The block size of the index being worked on. Stage 1 takes it from
+    // --block-size (or picks it, with `block_size_auto`), the other
+    // stages from the header of their input.
+    size_t block_size;
+    bool block_size_auto;
+    bool cdc;
+
+    // Stage 1 writes the first round of a hash tree TABI with `merkle`,
+    // or the next round from the TBBI at `refine_path`
+    bool merkle;
+    char *refine_path;
+
+    // With an `io_depth` of more than 0, stage 1 hashes and stage 3 sends
+    // through an I/O engine with that many requests in flight
+    size_t io_depth;
+    enum Io_Backend io_backend;
+
+    // Indexes are written through a buffer this big, and kept out of the
+    // page cache as `write_cache` says
+    size_t write_buffer_size;
+    enum Write_Cache write_cache;
+
+    // Stage 1 ends a wide TABI with a footer of where each record is
+    // with `footer`, which stage 2 uses to look up only `only_paths`
+    bool footer;
+    char **only_paths;
+    size_t num_only_paths;
+
+    // --sync keeps running after its first sync with `watch`, syncing
+    // whatever changes from then on
+    bool watch;
+};
+
 // rbuoy.c
+extern struct rbuoy_options rbuoy_options;
+
 void stage_1(char *out_pathname, char *in_pathnames[], size_t num_in_pathnames);
+void stage_1_check_options(void);
+void stage_1_write(
+    FILE *output_file, char *in_pathnames[], size_t num_in_pathnames
+);
 void stage_2(char *out_pathname, char *in_pathname);
 void stage_3(char *out_pathname, char *in_pathname);
 void stage_4(char *in_pathname);
@@ -14,11 +14,48 @@ SRC = rbuoy.c rbuoy_main.c rbuoy_provided.c
 INCLUDES = rbuoy.h
 
 # if you add extra .c files, add them here
-SRC += helpers.c
+SRC += helpers.c receive.c rolling.c apply.c hash_io.c pool.c parallel.c format.c walk.c cache.c block_hash.c arena.c match.c compress.c cdc.c merkle.c io_engine.c index_writer.c footer.c daemon.c watch.c stats.c
 
 # if you add extra .h files, add them here
-INCLUDES += helpers.h
+INCLUDES += helpers.h receive.h rolling.h apply.h hash_io.h pool.h parallel.h format.h walk.h cache.h block_hash.h arena.h match.h compress.h cdc.h merkle.h io_engine.h codec.h index_writer.h footer.h daemon.h watch.h stats.h
 
+# the worker pool needs threads
+CFLAGS += -pthread
+
+# compressed TCBIs are deflated with zlib
+LDLIBS += -lz
+
+# --stats and --trace can be compiled out of the hot paths entirely by
+# adding -DRBUOY_NO_STATS to CFLAGS, e.g.
+#       make -f rbuoy.mk CFLAGS="-Wall -pthread -DRBUOY_NO_STATS"
 
 rbuoy:	$(SRC) $(INCLUDES)
-	$(CC) $(CFLAGS) $(SRC) -o $@
+	$(CC) $(CFLAGS) $(SRC) $(LDLIBS) -o $@
+
+# Benchmarks, built with `make bench`. The microbenchmarks link everything
+# but main; bench_stages runs the rbuoy binary on a corpus from gen_corpus,
+# e.g.
+#       ./gen_corpus --files 1000 corpus && ./bench_stages corpus
+BENCH_SRC = $(filter-out rbuoy_main.c, $(SRC))
+BENCH_CFLAGS = $(CFLAGS) -O2
+BENCHES = bench_hash_io bench_hash_block bench_match gen_corpus bench_stages
+
+CLEAN_FILES += rbuoy $(BENCHES)
+
+.PHONY: bench
+bench: $(BENCHES)
+
+bench_hash_io: bench/bench_hash_io.c $(BENCH_SRC) $(INCLUDES)
+	$(CC) $(BENCH_CFLAGS) bench/bench_hash_io.c $(BENCH_SRC) $(LDLIBS) -o $@
+
+bench_hash_block: bench/bench_hash_block.c $(BENCH_SRC) $(INCLUDES)
+	$(CC) $(BENCH_CFLAGS) bench/bench_hash_block.c $(BENCH_SRC) $(LDLIBS) -o $@
+
+bench_match: bench/bench_match.c $(BENCH_SRC) $(INCLUDES)
+	$(CC) $(BENCH_CFLAGS) bench/bench_match.c $(BENCH_SRC) $(LDLIBS) -o $@
+
+gen_corpus: bench/gen_corpus.c
+	$(CC) $(BENCH_CFLAGS) bench/gen_corpus.c -lm -o $@
+
+bench_stages: bench/bench_stages.c rbuoy
+	$(CC) $(BENCH_CFLAGS) bench/bench_stages.c -o $@
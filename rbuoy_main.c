@@ -3,21 +3,52 @@
 #include <stdbool.h>
 #include <unistd.h>
 #include <getopt.h>
+#include <string.h>
+#include <sys/resource.h>
 
 #include "rbuoy.h"
+#include "daemon.h"
+#include "stats.h"
 
 int main(int argc, char **argv) {
     int stage = 0;
+    char *socket_path = NULL;
+    char *trace_path = NULL;
     for (;;) {
         int option_index;
         int opt = getopt_long(
             argc, argv,
-            ":1234",
+            ":1234j:",
             (struct option[]) {
                 {"stage-1", no_argument, NULL, 1},
                 {"stage-2", no_argument, NULL, 2},
                 {"stage-3", no_argument, NULL, 3},
                 {"stage-4", no_argument, NULL, 4},
+                {"rolling", no_argument, NULL, 'r'},
+                {"wide", no_argument, NULL, 'w'},
+                {"in-place", no_argument, NULL, 'i'},
+                {"hash-io", required_argument, NULL, 'h'},
+                {"jobs", required_argument, NULL, 'j'},
+                {"cache", required_argument, NULL, 'c'},
+                {"hash", required_argument, NULL, 'a'},
+                {"peak-rss", no_argument, NULL, 'p'},
+                {"runs", no_argument, NULL, 'u'},
+                {"compress", no_argument, NULL, 'z'},
+                {"block-size", required_argument, NULL, 'b'},
+                {"cdc", no_argument, NULL, 'd'},
+                {"merkle", no_argument, NULL, 'm'},
+                {"refine", required_argument, NULL, 'f'},
+                {"io-depth", required_argument, NULL, 'q'},
+                {"io-engine", required_argument, NULL, 'e'},
+                {"write-buffer", required_argument, NULL, 'o'},
+                {"write-cache", required_argument, NULL, 'k'},
+                {"footer", no_argument, NULL, 'x'},
+                {"only", required_argument, NULL, 'y'},
+                {"daemon", required_argument, NULL, 'g'},
+                {"sync", required_argument, NULL, 's'},
+                {"watch", no_argument, NULL, 'l'},
+                {"stats", required_argument, NULL, 't'},
+                {"trace", required_argument, NULL, 'v'},
                 {0,         0,           0,    '?'},
             },
             &option_index
@@ -35,19 +66,205 @@ int main(int argc, char **argv) {
                 stage = opt;
                 break;
             }
+            case 'r': {
+                rbuoy_options.rolling = true;
+                break;
+            }
+            case 'w': {
+                rbuoy_options.wide = true;
+                break;
+            }
+            case 'i': {
+                rbuoy_options.in_place = true;
+                break;
+            }
+            case 'h': {
+                if (strcmp(optarg, "mmap") == 0) {
+                    rbuoy_options.hash_backend = HASH_BACKEND_MMAP;
+                } else if (strcmp(optarg, "stream") == 0) {
+                    rbuoy_options.hash_backend = HASH_BACKEND_STREAM;
+                } else if (strcmp(optarg, "stdio") == 0) {
+                    rbuoy_options.hash_backend = HASH_BACKEND_STDIO;
+                } else {
+                    fprintf(stderr, "Usage: %s --hash-io=[mmap|stream|stdio]\n", argv[0]);
+                    return EXIT_FAILURE;
+                }
+                break;
+            }
+            case 'j': {
+                char *end;
+                long jobs = strtol(optarg, &end, 10);
+                if (*end != '\0' || jobs < 1) {
+                    fprintf(stderr, "Usage: %s --jobs <N> (N >= 1)\n", argv[0]);
+                    return EXIT_FAILURE;
+                }
+                rbuoy_options.jobs = jobs;
+                break;
+            }
+            case 'c': {
+                rbuoy_options.cache_path = optarg;
+                break;
+            }
+            case 'a': {
+                if (strcmp(optarg, "fnv1a") == 0) {
+                    rbuoy_options.block_hash = BLOCK_HASH_FNV1A;
+                } else if (strcmp(optarg, "xxh64") == 0) {
+                    rbuoy_options.block_hash = BLOCK_HASH_XXH64;
+                } else {
+                    fprintf(stderr, "Usage: %s --hash=[fnv1a|xxh64]\n", argv[0]);
+                    return EXIT_FAILURE;
+                }
+                break;
+            }
+            case 'p': {
+                rbuoy_options.peak_rss = true;
+                break;
+            }
+            case 'u': {
+                rbuoy_options.runs = true;
+                break;
+            }
+            case 'z': {
+                rbuoy_options.compress = true;
+                break;
+            }
+            case 'b': {
+                if (strcmp(optarg, "auto") == 0) {
+                    rbuoy_options.block_size_auto = true;
+                    break;
+                }
+
+                char *end;
+                long block_size = strtol(optarg, &end, 10);
+                if (*end != '\0' || block_size < BLOCK_SIZE_MIN ||
+                    block_size > BLOCK_SIZE_MAX ||
+                    (block_size & (block_size - 1)) != 0) {
+                    fprintf(stderr, "Usage: %s --block-size <N|auto> (N a power of 2, %d to %d)\n", argv[0], BLOCK_SIZE_MIN, BLOCK_SIZE_MAX);
+                    return EXIT_FAILURE;
+                }
+                rbuoy_options.block_size = block_size;
+                rbuoy_options.block_size_auto = false;
+                break;
+            }
+            case 'd': {
+                rbuoy_options.cdc = true;
+                break;
+            }
+            case 'm': {
+                rbuoy_options.merkle = true;
+                break;
+            }
+            case 'f': {
+                rbuoy_options.refine_path = optarg;
+                break;
+            }
+            case 'q': {
+                char *end;
+                long depth = strtol(optarg, &end, 10);
+                if (*end != '\0' || depth < 0 || depth > IO_DEPTH_MAX) {
+                    fprintf(stderr, "Usage: %s --io-depth <N> (0 to %d)\n", argv[0], IO_DEPTH_MAX);
+                    return EXIT_FAILURE;
+                }
+                rbuoy_options.io_depth = depth;
+                break;
+            }
+            case 'e': {
+                if (strcmp(optarg, "auto") == 0) {
+                    rbuoy_options.io_backend = IO_BACKEND_AUTO;
+                } else if (strcmp(optarg, "uring") == 0) {
+                    rbuoy_options.io_backend = IO_BACKEND_URING;
+                } else if (strcmp(optarg, "threads") == 0) {
+                    rbuoy_options.io_backend = IO_BACKEND_THREADS;
+                } else {
+                    fprintf(stderr, "Usage: %s --io-engine=[auto|uring|threads]\n", argv[0]);
+                    return EXIT_FAILURE;
+                }
+                break;
+            }
+            case 'o': {
+                char *end;
+                long size = strtol(optarg, &end, 10);
+                if (*end != '\0' || size < INDEX_WRITER_ALIGN) {
+                    fprintf(stderr, "Usage: %s --write-buffer <N> (N >= %d bytes)\n", argv[0], INDEX_WRITER_ALIGN);
+                    return EXIT_FAILURE;
+                }
+                rbuoy_options.write_buffer_size = size;
+                break;
+            }
+            case 'k': {
+                if (strcmp(optarg, "keep") == 0) {
+                    rbuoy_options.write_cache = WRITE_CACHE_KEEP;
+                } else if (strcmp(optarg, "dontneed") == 0) {
+                    rbuoy_options.write_cache = WRITE_CACHE_DONTNEED;
+                } else if (strcmp(optarg, "direct") == 0) {
+                    rbuoy_options.write_cache = WRITE_CACHE_DIRECT;
+                } else {
+                    fprintf(stderr, "Usage: %s --write-cache=[keep|dontneed|direct]\n", argv[0]);
+                    return EXIT_FAILURE;
+                }
+                break;
+            }
+            case 'g':
+            case 's': {
+                stage = opt;
+                socket_path = optarg;
+                break;
+            }
+            case 'l': {
+                rbuoy_options.watch = true;
+                break;
+            }
+            case 't': {
+                if (strcmp(optarg, "json") != 0) {
+                    fprintf(stderr, "Usage: %s --stats=json\n", argv[0]);
+                    return EXIT_FAILURE;
+                }
+                Stats_Enable();
+                break;
+            }
+            case 'v': {
+                trace_path = optarg;
+                break;
+            }
+            case 'x': {
+                rbuoy_options.footer = true;
+                break;
+            }
+            case 'y': {
+                rbuoy_options.only_paths = realloc(
+                    rbuoy_options.only_paths,
+                    sizeof(char *) * (rbuoy_options.num_only_paths + 1)
+                );
+                if (rbuoy_options.only_paths == NULL) {
+                    perror("Error");
+                    return EXIT_FAILURE;
+                }
+                rbuoy_options.only_paths[rbuoy_options.num_only_paths++] = optarg;
+                break;
+            }
             case ':':
             case '?':
             default: {
-                fprintf(stderr, "Usage: %s [--stage-1|--stage-2|--stage-3|--stage-4]\n", argv[0]);
+                fprintf(stderr, "Usage: %s [--stage-1|--stage-2|--stage-3|--stage-4|--daemon <socket>|--sync <socket>] [--stats=json] [--trace PATH]\n", argv[0]);
                 return EXIT_FAILURE;
             }
         }
     }
 
+    if (trace_path != NULL) {
+        // Every session of a daemon is a process of its own, which would
+        // all end the same trace
+        if (stage == 'g') {
+            fprintf(stderr, "Error: --trace can't be used with --daemon\n");
+            return EXIT_FAILURE;
+        }
+        Stats_Trace_Open(trace_path);
+    }
+
     switch (stage) {
         case 1: {
             if (argc - optind < 1) {
-                fprintf(stderr, "Usage: %s --stage-1 <outfile> [<file> ...]\n", argv[0]);
+                fprintf(stderr, "Usage: %s --stage-1 [--rolling] [--wide] [--hash fnv1a|xxh64] [--block-size N|auto] [--cdc] [--merkle] [--refine TBBI] [--footer] [--jobs N] [--io-depth N] [--cache PATH] <outfile> [<file> ...]\n", argv[0]);
                 return EXIT_FAILURE;
             }
             char *outfile = argv[optind];
@@ -58,7 +275,7 @@ int main(int argc, char **argv) {
         }
         case 2: {
             if (argc - optind != 2) {
-                fprintf(stderr, "Usage: %s --stage-2 <outfile> <infile>\n", argv[0]);
+                fprintf(stderr, "Usage: %s --stage-2 [--cache PATH] [--only PATH ...] <outfile> <infile>\n", argv[0]);
                 return EXIT_FAILURE;
             }
             char *outfile = argv[optind];
@@ -68,7 +285,7 @@ int main(int argc, char **argv) {
         }
         case 3: {
             if (argc - optind != 2) {
-                fprintf(stderr, "Usage: %s --stage-3 <outfile> <infile>\n", argv[0]);
+                fprintf(stderr, "Usage: %s --stage-3 [--runs] [--compress] [--jobs N] [--io-depth N] <outfile> <infile>\n", argv[0]);
                 return EXIT_FAILURE;
             }
             char *outfile = argv[optind];
@@ -78,18 +295,39 @@ int main(int argc, char **argv) {
         }
         case 4: {
             if (argc - optind != 1) {
-                fprintf(stderr, "Usage: %s --stage-4 <infile>\n", argv[0]);
+                fprintf(stderr, "Usage: %s --stage-4 [--in-place] <infile>\n", argv[0]);
                 return EXIT_FAILURE;
             }
             char *infile = argv[optind];
             stage_4(infile);
             break;
         }
+        case 'g': {
+            if (argc - optind != 0) {
+                fprintf(stderr, "Usage: %s --daemon <socket> [--jobs N] [--cache PATH] [--in-place]\n", argv[0]);
+                return EXIT_FAILURE;
+            }
+            Daemon_Serve(socket_path);
+            break;
+        }
+        case 's': {
+            char **files = argv + optind;
+            size_t num_files = argc - optind;
+            Daemon_Sync(socket_path, files, num_files);
+            break;
+        }
         case 0: {
-            fprintf(stderr, "Usage: %s [--stage-1|--stage-2|--stage-3|--stage-4]\n", argv[0]);
+            fprintf(stderr, "Usage: %s [--stage-1|--stage-2|--stage-3|--stage-4|--daemon <socket>|--sync <socket>] [--stats=json] [--trace PATH]\n", argv[0]);
             return EXIT_FAILURE;
         }
     }
 
+    if (rbuoy_options.peak_rss) {
+        struct rusage usage;
+        if (getrusage(RUSAGE_SELF, &usage) == 0) {
+            fprintf(stderr, "peak RSS: %ld KiB\n", usage.ru_maxrss);
+        }
+    }
+
     return EXIT_SUCCESS;
 }
@@ -11,11 +11,12 @@
 /// you may want to make a wrapper around this function.
 ///
 /// @param block      The array of bytes to be hashed.
-/// @param block_size The length of that array. Must be at most 256.
+/// @param block_size The length of that array. Must be at most
+///                   CHUNK_SIZE_MAX.
 ///
 /// @return The hash of the block.
 uint64_t hash_block(char block[], size_t block_size) {
-    assert(block_size <= BLOCK_SIZE);
+    assert(block_size <= CHUNK_SIZE_MAX);
 
     uint64_t hash = 0xcbf29ce484222325ull;
     for (size_t i = 0; i < block_size; ++i) {
@@ -32,8 +33,9 @@ uint64_t hash_block(char block[], size_t block_size) {
 /// @return The nunber of blocks that are needed for that file.
 size_t number_of_blocks_in_file(size_t num_bytes) {
     // This is equal to
-    //   ceil(num_bytes / BLOCK_SIZE)
-    return (num_bytes + BLOCK_SIZE - 1) / BLOCK_SIZE;
+    //   ceil(num_bytes / block_size)
+    size_t block_size = rbuoy_options.block_size;
+    return (num_bytes + block_size - 1) / block_size;
 }
 
 
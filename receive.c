@@ -0,0 +1,633 @@
+// Implementation for 'receive.h', written by Connor Li (z5425430)
+// There is 1 'interface' function:
+//      - Out_Create_TBBI()
+//
+// The receiver's side of stage 2. Reading a TABI field by field costs a
+// syscall or more per field, which dominates on trees of many small
+// files, so instead:
+//      1. the whole TABI is mapped (or read, if it's a pipe) and parsed
+//         where it is, without copying any hashes out of it,
+//      2. the receiver's copy of each file is opened and hashed on a pool
+//         while the records before it are still being matched,
+//      3. records are built up in memory and written out in large writes.
+//
+// A TABI with a footer can also be answered for only some of its files
+// (--only), each of whose records is looked up in the footer rather than
+// found by parsing every record before it.
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+#include <limits.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "receive.h"
+#include "helpers.h"
+#include "format.h"
+#include "parallel.h"
+#include "rolling.h"
+#include "arena.h"
+#include "match.h"
+#include "merkle.h"
+#include "rbuoy.h"
+#include "codec.h"
+#include "footer.h"
+#include "stats.h"
+
+// How many files are opened and hashed ahead of the record being written,
+// per worker. Opening a small file takes about as long as hashing it, so
+// it pays to have plenty waiting.
+#define FILES_IN_FLIGHT_PER_JOB 8
+
+// Records are built up in memory and written out once this much is ready
+#define OUTPUT_FLUSH_SIZE (16 * 1024 * 1024)
+
+#define READ_BUFFER_SIZE (64 * 1024)
+
+// A whole TABI in memory, either mapped or read into a buffer
+struct Loaded_Index {
+    uint8_t *data;
+    size_t size;
+    bool mapped;
+};
+
+// One record of the TABI, pointing into the loaded index
+struct Receive_Record {
+    // Pathname length, pathname and number of blocks, as in the TABI.
+    // They are the same in the TBBI, so are copied out as they are.
+    const uint8_t *head;
+    size_t head_size;
+
+    char *pathname;
+    size_t num_blocks;
+    uint64_t sender_size;
+    const uint8_t *hashes;
+
+    // The varint length of each chunk, if the record is chunked
+    const uint8_t *lengths;
+
+    struct Hash_Job job;
+    bool hashing;
+};
+
+// The TBBI being built up in memory. `written` is how much of it has
+// already gone out, so where a record starts is known for the footer.
+struct Receive_Out {
+    FILE *tbbi;
+    FILE *buffer;
+    char *data;
+    size_t size;
+    uint64_t written;
+};
+
+//////////////////////////////////////////////////////////////////////
+//                        FUNCTION PROTOTYPES
+//////////////////////////////////////////////////////////////////////
+
+void index_load(FILE *f, struct Loaded_Index *index);
+
+void index_unload(struct Loaded_Index *index);
+
+void record_parse(
+    struct Format_Cursor *cursor, struct Index_Format format,
+    struct Receive_Record *record
+);
+
+void record_write(
+    struct Receive_Out *out, struct Receive_Record *record,
+    struct Index_Format format, struct Arena *arena
+);
+
+void record_append_matches(
+    FILE *dest, struct Receive_Record *record, struct Arena *arena
+);
+
+void record_append_rolling_matches(
+    FILE *dest, struct Receive_Record *record, struct Index_Format format,
+    struct Arena *arena
+);
+
+void record_append_chunk_matches(
+    FILE *dest, struct Receive_Record *record, struct Index_Format format,
+    struct Arena *arena
+);
+
+void record_count_matches(const uint8_t match_bytes[], size_t num_blocks);
+
+const uint8_t **receive_find_only(
+    struct Loaded_Index *index, const struct Footer *footer,
+    const uint8_t *records_start
+);
+
+uint64_t out_tell(struct Receive_Out *out);
+
+void out_open(struct Receive_Out *out, FILE *tbbi);
+
+void out_flush(struct Receive_Out *out);
+
+void out_close(struct Receive_Out *out);
+
+//////////////////////////////////////////////////////////////////////
+//                        INTERFACE FUNCTIONS
+//////////////////////////////////////////////////////////////////////
+
+// Records are parsed and their files started on the pool a window ahead
+// of the one being written, and are written strictly in order.
+void Out_Create_TBBI(FILE *tabi, FILE *tbbi) {
+    struct Loaded_Index index;
+    index_load(tabi, &index);
+
+    struct Format_Cursor cursor = {
+        .pos = index.data,
+        .end = index.data + index.size,
+    };
+    uint64_t num_records;
+    struct Index_Format format = Format_Parse_Header(
+        &cursor, INDEX_TABI, &num_records
+    );
+    struct Index_Format tbbi_format = Format_As_Type(format, INDEX_TBBI);
+
+    // Hash (or chunk) the receiver's blocks the same way the sender did
+    rbuoy_options.block_hash = format.block_hash;
+    rbuoy_options.block_size = format.block_size;
+
+    // The records end where the footer starts. Only some of them are
+    // answered with --only, each found through the footer.
+    struct Footer footer;
+    const uint8_t **only = NULL;
+    if (format.footer) {
+        Footer_Locate(index.data, index.size, &footer);
+        if (index.data + footer.start < cursor.pos) {
+            fprintf(stderr, "Error: index footer is corrupt\n");
+            exit(1);
+        }
+        cursor.end = index.data + footer.start;
+    }
+    if (rbuoy_options.num_only_paths > 0) {
+        if (!format.footer) {
+            fprintf(stderr, "Error: --only needs a TABI with a footer (--footer)\n");
+            exit(1);
+        }
+        only = receive_find_only(&index, &footer, cursor.pos);
+        num_records = rbuoy_options.num_only_paths;
+    }
+
+    // The TBBI has a footer too, unless it's going down a pipe
+    tbbi_format.footer = format.footer && ftell(tbbi) >= 0;
+    struct Footer_Builder tbbi_footer;
+    Footer_Builder_Init(&tbbi_footer);
+
+    // A round of a hash tree index is small, and read as a stream
+    if (format.merkle) {
+        FILE *records = fmemopen(
+            (void *) cursor.pos, cursor.end - cursor.pos, "r"
+        );
+        if (records == NULL) {
+            perror("Error");
+            exit(1);
+        }
+        Out_Create_Merkle_TBBI(records, format, num_records, tbbi);
+        fclose(records);
+        index_unload(&index);
+        return;
+    }
+
+    struct Pool *pool = Pool_Create(rbuoy_options.jobs);
+    size_t window = rbuoy_options.jobs * FILES_IN_FLIGHT_PER_JOB;
+    struct Receive_Record *records = calloc(
+        window, sizeof(struct Receive_Record)
+    );
+    if (records == NULL) {
+        perror("Error");
+        exit(1);
+    }
+
+    struct Arena arena;
+    Arena_Init(&arena);
+
+    struct Receive_Out out = { .written = 0 };
+    out_open(&out, tbbi);
+    Format_Write_Header(out.buffer, tbbi_format, num_records);
+
+    uint64_t num_started = 0;
+    for (uint64_t record_n = 0; record_n < num_records; record_n++) {
+        while (num_started < num_records && num_started - record_n < window) {
+            struct Receive_Record *record = &records[num_started % window];
+            if (only != NULL) cursor.pos = only[num_started];
+            record_parse(&cursor, format, record);
+
+            // Rolling records can't be hashed until the sender's blocks
+            // are known, so are matched as they are written
+            record->hashing = !format.rolling && record->num_blocks > 0;
+            if (record->hashing) {
+                record->job.pathname = record->pathname;
+                record->job.chunked = format.cdc;
+                Hash_Job_Start_Local(pool, &record->job);
+            }
+            num_started++;
+        }
+
+        struct Receive_Record *record = &records[record_n % window];
+        if (tbbi_format.footer) {
+            Footer_Builder_Add(&tbbi_footer, record->pathname, out_tell(&out));
+        }
+        record_write(&out, record, format, &arena);
+        Arena_Reset(&arena);
+    }
+
+    if (only == NULL && cursor.pos != cursor.end) {
+        fprintf(stderr, "Error: visited all records but not EOF");
+        exit(1);
+    }
+
+    if (tbbi_format.footer) {
+        Footer_Write(out.buffer, &tbbi_footer, out_tell(&out));
+    }
+    out_close(&out);
+    Arena_Free(&arena);
+    Pool_Destroy(pool);
+    free(records);
+    free(only);
+    index_unload(&index);
+}
+
+//////////////////////////////////////////////////////////////////////
+//                           LOCAL HELPERS
+//////////////////////////////////////////////////////////////////////
+
+// Function to get a whole index into memory. A regular file is mapped,
+// anything else (e.g. a pipe) is read to the end.
+void index_load(FILE *f, struct Loaded_Index *index) {
+    struct stat stat;
+    if (fstat(fileno(f), &stat) == 0 && S_ISREG(stat.st_mode) &&
+        stat.st_size > 0) {
+        index->data = mmap(
+            NULL, stat.st_size, PROT_READ, MAP_PRIVATE, fileno(f), 0
+        );
+        if (index->data != MAP_FAILED) {
+            madvise(index->data, stat.st_size, MADV_SEQUENTIAL);
+            index->size = stat.st_size;
+            index->mapped = true;
+            return;
+        }
+    }
+
+    size_t capacity = READ_BUFFER_SIZE;
+    index->data = malloc(capacity);
+    index->size = 0;
+    index->mapped = false;
+    for (;;) {
+        if (index->data == NULL) {
+            perror("Error");
+            exit(1);
+        }
+
+        index->size += fread(
+            index->data + index->size, sizeof(uint8_t),
+            capacity - index->size, f
+        );
+        if (index->size < capacity) break;
+
+        capacity *= 2;
+        index->data = realloc(index->data, capacity);
+    }
+
+    if (ferror(f)) {
+        perror("Read Failed");
+        exit(1);
+    }
+}
+
+// Function to let go of an index from index_load
+void index_unload(struct Loaded_Index *index) {
+    if (index->mapped) {
+        munmap(index->data, index->size);
+    } else {
+        free(index->data);
+    }
+    index->data = NULL;
+}
+
+// Function to parse the next record of a TABI, leaving its hashes where
+// they are
+void record_parse(
+    struct Format_Cursor *cursor, struct Index_Format format,
+    struct Receive_Record *record
+) {
+    record->head = cursor->pos;
+
+    size_t pathname_length = Format_Parse_Uint(
+        cursor, format, PATHNAME_LEN_SIZE
+    );
+    if (pathname_length >= PATH_MAX) {
+        fprintf(stderr, "Error: pathname too long\n");
+        exit(1);
+    }
+    record->pathname = strndup(
+        (const char *) Format_Parse_Bytes(cursor, pathname_length),
+        pathname_length
+    );
+    if (record->pathname == NULL) {
+        perror("Error");
+        exit(1);
+    }
+
+    record->num_blocks = Format_Parse_Uint(cursor, format, NUM_BLOCKS_SIZE);
+    record->head_size = cursor->pos - record->head;
+
+    record->sender_size = 0;
+    if (format.rolling) {
+        record->sender_size = Format_Parse_Uint(cursor, format, FILE_SIZE_SIZE);
+
+        // The rolling matcher takes the blocks' hashes to cover the size
+        size_t num_blocks = (
+            record->sender_size > UINT64_MAX - rbuoy_options.block_size
+        ) ? SIZE_MAX : number_of_blocks_in_file(record->sender_size);
+        if (num_blocks != record->num_blocks) {
+            fprintf(
+                stderr, "Error: invalid file size for '%s'\n", record->pathname
+            );
+            exit(1);
+        }
+    }
+
+    // Chunked records have the length of each chunk before the hashes
+    record->lengths = NULL;
+    if (format.cdc) {
+        record->lengths = cursor->pos;
+        for (size_t chunk_n = 0; chunk_n < record->num_blocks; chunk_n++) {
+            Format_Parse_Uint(cursor, format, UPDATE_LEN_SIZE);
+        }
+    }
+
+    size_t hash_size = format.rolling ? WEAK_HASH_SIZE + HASH_SIZE : HASH_SIZE;
+    if (record->num_blocks > SIZE_MAX / hash_size) {
+        fprintf(stderr, "Error: file '%s' too large\n", record->pathname);
+        exit(1);
+    }
+    record->hashes = Format_Parse_Bytes(
+        cursor, record->num_blocks * hash_size
+    );
+}
+
+// Function to write the TBBI record answering a TABI record, then free it
+void record_write(
+    struct Receive_Out *out, struct Receive_Record *record,
+    struct Index_Format format, struct Arena *arena
+) {
+    uint64_t started = Stats_Start();
+    fwrite(record->head, sizeof(uint8_t), record->head_size, out->buffer);
+
+    if (format.rolling) {
+        record_append_rolling_matches(out->buffer, record, format, arena);
+    } else if (format.cdc) {
+        if (record->hashing) {
+            record_append_chunk_matches(out->buffer, record, format, arena);
+        }
+    } else if (record->hashing) {
+        record_append_matches(out->buffer, record, arena);
+    }
+    Stats_Stop(STATS_TIMER_FIND_MATCHES, started);
+    Stats_File(record->pathname, started);
+
+    free(record->pathname);
+    record->pathname = NULL;
+
+    if (ftell(out->buffer) >= OUTPUT_FLUSH_SIZE) out_flush(out);
+}
+
+// Function to wait for the receiver's copy of a file to be hashed, and
+// append which of the sender's blocks it has at the same offset. A large
+// file is hashed and matched a window at a time, like in stage 1.
+void record_append_matches(
+    FILE *dest, struct Receive_Record *record, struct Arena *arena
+) {
+    struct Hash_Job *job = &record->job;
+    Hash_Job_Wait(job);
+
+    size_t num_blocks = record->num_blocks;
+    size_t max_blocks = (num_blocks > job->num_blocks) ?
+        job->num_blocks : num_blocks;
+
+    size_t window = Hash_Window_Blocks();
+    uint64_t *window_hashes = job->windowed ?
+        Arena_Alloc_Array(arena, window, sizeof(uint64_t)) : NULL;
+    uint8_t *match_bytes = Arena_Alloc(arena, num_tbbi_match_bytes(window));
+
+    for (size_t first = 0; first < num_blocks; first += window) {
+        size_t count = (num_blocks - first < window) ?
+            num_blocks - first : window;
+        size_t local_count = 0;
+        uint64_t *hashes = window_hashes;
+
+        if (first < max_blocks) {
+            local_count = (max_blocks - first < count) ?
+                max_blocks - first : count;
+
+            if (job->windowed) {
+                Hash_Job_Hash_Window(
+                    job, first, local_count, window_hashes, NULL
+                );
+            } else {
+                hashes = job->hashes + first;
+            }
+        }
+
+        // The sender's hashes are compared straight out of the TABI
+        Match_Pack(
+            record->hashes + first * HASH_SIZE, hashes, count, local_count,
+            match_bytes, MATCH_KERNEL_AUTO
+        );
+        fwrite(match_bytes, sizeof(char), num_tbbi_match_bytes(count), dest);
+        record_count_matches(match_bytes, count);
+    }
+
+    Hash_Job_Free(job);
+}
+
+// Function to find the sender's blocks anywhere in the local file for a
+// rolling record. The match bytes are followed by the local offset of each
+// matched block, in block order.
+void record_append_rolling_matches(
+    FILE *dest, struct Receive_Record *record, struct Index_Format format,
+    struct Arena *arena
+) {
+    size_t num_blocks = record->num_blocks;
+    if (num_blocks == 0) return;
+
+    // Blocks can match anywhere, so every hash is needed at once
+    uint32_t *weak_hashes = Arena_Alloc_Array(
+        arena, num_blocks, sizeof(uint32_t)
+    );
+    uint64_t *hashes = Arena_Alloc_Array(arena, num_blocks, sizeof(uint64_t));
+    uint64_t *offsets = Arena_Alloc_Array(arena, num_blocks, sizeof(uint64_t));
+    bool *matched = Arena_Alloc_Array(arena, num_blocks, sizeof(bool));
+    memset(matched, 0, sizeof(bool) * num_blocks);
+
+    Codec_Decode_Hashes(record->hashes, hashes, weak_hashes, num_blocks);
+
+    FILE *local_file = File_Open(record->pathname, "r", NOT_HANDLED);
+    if (local_file != NULL) {
+        struct stat stat;
+        if (fstat(fileno(local_file), &stat) == 0 && S_ISREG(stat.st_mode)) {
+            struct Block_Table table;
+            Block_Table_Build(
+                &table, weak_hashes, hashes, num_blocks, record->sender_size
+            );
+            Rolling_Find_Matches(
+                local_file, stat.st_size, &table, matched, offsets
+            );
+            Block_Table_Free(&table);
+        }
+        fclose(local_file);
+    }
+
+    size_t num_match_bytes = num_tbbi_match_bytes(num_blocks);
+    uint8_t *match_bytes = Arena_Alloc(arena, num_match_bytes);
+    memset(match_bytes, 0, num_match_bytes);
+    for (size_t block_n = 0; block_n < num_blocks; block_n++) {
+        if (matched[block_n]) {
+            match_bytes[block_n / MATCH_BYTE_BITS] |= 0x80 >>
+                (block_n % MATCH_BYTE_BITS);
+        }
+    }
+    fwrite(match_bytes, sizeof(char), num_match_bytes, dest);
+    record_count_matches(match_bytes, num_blocks);
+
+    for (size_t block_n = 0; block_n < num_blocks; block_n++) {
+        if (!matched[block_n]) continue;
+
+        Format_Write_Uint(dest, format, offsets[block_n], BLOCK_OFFSET_SIZE);
+    }
+}
+
+// Function to wait for the receiver's copy of a file to be chunked, and
+// find each of the sender's chunks among its chunks, by hash and length.
+// As for rolling records, the match bytes are followed by the local
+// offset of each matched chunk.
+void record_append_chunk_matches(
+    FILE *dest, struct Receive_Record *record, struct Index_Format format,
+    struct Arena *arena
+) {
+    struct Hash_Job *job = &record->job;
+    Hash_Job_Wait(job);
+
+    size_t num_blocks = record->num_blocks;
+    uint64_t *offsets = Arena_Alloc_Array(arena, num_blocks, sizeof(uint64_t));
+    size_t num_match_bytes = num_tbbi_match_bytes(num_blocks);
+    uint8_t *match_bytes = Arena_Alloc(arena, num_match_bytes);
+    memset(match_bytes, 0, num_match_bytes);
+
+    struct Chunk_Table table;
+    Chunk_Table_Build(&table, &job->chunks);
+
+    struct Format_Cursor lengths = {
+        .pos = record->lengths,
+        .end = record->hashes,
+    };
+    for (size_t block_n = 0; block_n < num_blocks; block_n++) {
+        uint64_t length = Format_Parse_Uint(&lengths, format, UPDATE_LEN_SIZE);
+        uint64_t hash = Codec_Load_U64(record->hashes + block_n * HASH_SIZE);
+
+        size_t local_n = Chunk_Table_Find(&table, hash, length);
+        if (local_n == SIZE_MAX) continue;
+
+        offsets[block_n] = Block_Offset(&job->chunks, local_n);
+        match_bytes[block_n / MATCH_BYTE_BITS] |= 0x80 >>
+            (block_n % MATCH_BYTE_BITS);
+    }
+    Chunk_Table_Free(&table);
+
+    fwrite(match_bytes, sizeof(char), num_match_bytes, dest);
+    record_count_matches(match_bytes, num_blocks);
+    for (size_t block_n = 0; block_n < num_blocks; block_n++) {
+        if (!(match_bytes[block_n / MATCH_BYTE_BITS] &
+            (0x80 >> (block_n % MATCH_BYTE_BITS)))) {
+            continue;
+        }
+
+        Format_Write_Uint(dest, format, offsets[block_n], BLOCK_OFFSET_SIZE);
+    }
+
+    Hash_Job_Free(job);
+}
+
+// Function to count how many of a record's blocks matched, and how many
+// didn't, when stats are being kept
+void record_count_matches(const uint8_t match_bytes[], size_t num_blocks) {
+    if (!Stats_Enabled()) return;
+
+    size_t num_matched = Match_Count(match_bytes, num_blocks, true);
+    Stats_Add(STATS_BLOCKS_MATCHED, num_matched);
+    Stats_Add(STATS_BLOCKS_UNMATCHED, num_blocks - num_matched);
+}
+
+// Function to look up where the record of each --only pathname starts,
+// in the order they were given
+const uint8_t **receive_find_only(
+    struct Loaded_Index *index, const struct Footer *footer,
+    const uint8_t *records_start
+) {
+    size_t num_paths = rbuoy_options.num_only_paths;
+    const uint8_t **only = malloc(sizeof(uint8_t *) * num_paths);
+    if (only == NULL) {
+        perror("Error");
+        exit(1);
+    }
+
+    for (size_t path_n = 0; path_n < num_paths; path_n++) {
+        char *pathname = rbuoy_options.only_paths[path_n];
+        uint64_t offset = Footer_Find(footer, pathname);
+        if (offset == UINT64_MAX) {
+            fprintf(stderr, "Error: '%s' isn't in the TABI\n", pathname);
+            exit(1);
+        }
+
+        if (offset < (uint64_t) (records_start - index->data) ||
+            offset >= footer->start) {
+            fprintf(stderr, "Error: index footer is corrupt\n");
+            exit(1);
+        }
+        only[path_n] = index->data + offset;
+    }
+
+    return only;
+}
+
+// Function to get where the TBBI is up to, counting what's still in memory
+uint64_t out_tell(struct Receive_Out *out) {
+    return out->written + ftell(out->buffer);
+}
+
+// Function to start building up a TBBI in memory
+void out_open(struct Receive_Out *out, FILE *tbbi) {
+    out->tbbi = tbbi;
+    out->buffer = open_memstream(&out->data, &out->size);
+    if (out->buffer == NULL) {
+        perror("Error");
+        exit(1);
+    }
+}
+
+// Function to write out everything built up so far in one go
+void out_flush(struct Receive_Out *out) {
+    out_close(out);
+    out_open(out, out->tbbi);
+}
+
+// Function to write out everything built up so far, and stop
+void out_close(struct Receive_Out *out) {
+    if (fclose(out->buffer) != 0) {
+        perror("Error");
+        exit(1);
+    }
+
+    fwrite(out->data, sizeof(char), out->size, out->tbbi);
+    out->written += out->size;
+    free(out->data);
+    out->buffer = NULL;
+}
@@ -0,0 +1,15 @@
+// Header file for receive.c written by Connor Li (z5425430)
+// For implementation details go to receive.c.
+
+#ifndef RECEIVE_H_
+#define RECEIVE_H_
+
+#include <stdio.h>
+
+/// @brief Create a TBBI file from a TABI file, matching the sender's
+///        hashes against the files below the current directory.
+/// @param tabi The sender's TABI, at its start.
+/// @param tbbi Where the TBBI is written.
+void Out_Create_TBBI(FILE *tabi, FILE *tbbi);
+
+#endif
@@ -0,0 +1,312 @@
+// Implementation for 'rolling.h', written by Connor Li (z5425430)
+// rsync-style block matching. The receiver slides a window of one block
+// over its file one byte at a time, keeping a cheap weak checksum
+// that can be updated in O(1) per byte. Only when the weak checksum hits
+// one of the sender's blocks is the (expensive) hash_block computed to
+// confirm the match.
+//
+// There are 3 'interface' functions:
+//      - Block_Table_Build()
+//      - Block_Table_Free()
+//      - Rolling_Find_Matches()
+
+#include <stdlib.h>
+#include <string.h>
+#include "rolling.h"
+#include "rbuoy.h"
+
+#define WEAK_MODULO_MASK 0xFFFF
+// At least twice BLOCK_SIZE_MAX, so a window always fits after a refill
+#define ROLL_BUFFER_SIZE (256 * 1024)
+
+//////////////////////////////////////////////////////////////////////
+//                        FUNCTION PROTOTYPES
+//////////////////////////////////////////////////////////////////////
+
+bool block_table_match(
+    struct Block_Table *t, uint32_t weak, unsigned char window[],
+    uint64_t pos, bool matched[], uint64_t offsets[]
+);
+
+void window_fill(
+    FILE *local, unsigned char buffer[], uint64_t *buffer_start,
+    size_t *buffer_len, uint64_t pos, size_t need, uint64_t local_size
+);
+
+void trailing_find_match(
+    FILE *local, uint64_t local_size, struct Block_Table *t,
+    bool matched[], uint64_t offsets[]
+);
+
+bool trailing_matches_at(
+    FILE *local, uint64_t offset, size_t length, uint64_t hash
+);
+
+//////////////////////////////////////////////////////////////////////
+//                           WEAK CHECKSUM
+//////////////////////////////////////////////////////////////////////
+
+// The weak checksum is the one used by rsync: `a` is the sum of the bytes
+// and `b` is the sum of the running values of `a`, both mod 2^16.
+uint32_t weak_hash_block(const unsigned char block[], size_t block_size) {
+    struct Weak_Hash w;
+    weak_hash_start(&w, block, block_size);
+
+    return weak_hash_digest(&w);
+}
+
+void weak_hash_start(
+    struct Weak_Hash *w, const unsigned char block[], size_t block_size
+) {
+    w->a = 0;
+    w->b = 0;
+    w->length = block_size;
+
+    for (size_t i = 0; i < block_size; i++) {
+        w->a += block[i];
+        w->b += (block_size - i) * block[i];
+    }
+}
+
+void weak_hash_roll(struct Weak_Hash *w, unsigned char out, unsigned char in) {
+    w->a = w->a - out + in;
+    w->b = w->b - w->length * out + w->a;
+}
+
+uint32_t weak_hash_digest(const struct Weak_Hash *w) {
+    return (w->a & WEAK_MODULO_MASK) | ((w->b & WEAK_MODULO_MASK) << 16);
+}
+
+//////////////////////////////////////////////////////////////////////
+//                        INTERFACE FUNCTIONS
+//////////////////////////////////////////////////////////////////////
+
+// Bucket every full sized sender block by the low bits of its weak
+// checksum (a counting sort), so a lookup only has to look at the handful
+// of blocks sharing a bucket. The trailing block is left out of the table
+// since it can be shorter than the rolling window.
+void Block_Table_Build(
+    struct Block_Table *t, uint32_t weak[], uint64_t strong[],
+    size_t num_blocks, uint64_t file_size
+) {
+    t->weak = weak;
+    t->strong = strong;
+    t->num_blocks = num_blocks;
+    t->file_size = file_size;
+    t->num_full_blocks = file_size / rbuoy_options.block_size;
+    if (t->num_full_blocks > num_blocks) t->num_full_blocks = num_blocks;
+
+    size_t num_buckets = 1;
+    while (num_buckets < t->num_full_blocks && num_buckets < (1u << 24)) {
+        num_buckets <<= 1;
+    }
+    t->mask = num_buckets - 1;
+
+    t->order = malloc(sizeof(size_t) * (t->num_full_blocks + 1));
+    t->bucket_start = calloc(num_buckets + 1, sizeof(size_t));
+    if (t->order == NULL || t->bucket_start == NULL) {
+        perror("Error");
+        exit(1);
+    }
+
+    for (size_t block_n = 0; block_n < t->num_full_blocks; block_n++) {
+        t->bucket_start[(weak[block_n] & t->mask) + 1]++;
+    }
+    for (size_t bucket = 0; bucket < num_buckets; bucket++) {
+        t->bucket_start[bucket + 1] += t->bucket_start[bucket];
+    }
+
+    // Fill each bucket, using bucket_start as a cursor and then shifting
+    // it back so it marks the start again.
+    for (size_t block_n = 0; block_n < t->num_full_blocks; block_n++) {
+        t->order[t->bucket_start[weak[block_n] & t->mask]++] = block_n;
+    }
+    for (size_t bucket = num_buckets; bucket > 0; bucket--) {
+        t->bucket_start[bucket] = t->bucket_start[bucket - 1];
+    }
+    t->bucket_start[0] = 0;
+}
+
+void Block_Table_Free(struct Block_Table *t) {
+    free(t->order);
+    free(t->bucket_start);
+    t->order = NULL;
+    t->bucket_start = NULL;
+}
+
+// Walk the local file with a window of one block. On a confirmed match the
+// window jumps a whole block ahead, otherwise it rolls one byte along.
+void Rolling_Find_Matches(
+    FILE *local, uint64_t local_size, struct Block_Table *t,
+    bool matched[], uint64_t offsets[]
+) {
+    if (local == NULL || local_size == 0) return;
+
+    if (fseek(local, 0, SEEK_SET) != 0) {
+        perror("Seek Failed");
+        exit(1);
+    }
+
+    unsigned char *buffer = malloc(ROLL_BUFFER_SIZE);
+    if (buffer == NULL) {
+        perror("Error");
+        exit(1);
+    }
+    uint64_t buffer_start = 0;
+    size_t buffer_len = 0;
+
+    size_t block_size = rbuoy_options.block_size;
+    struct Weak_Hash w;
+    bool fresh = true;
+    uint64_t pos = 0;
+
+    while (t->num_full_blocks > 0 && pos + block_size <= local_size) {
+        // Need the window plus the byte that rolls in after it
+        window_fill(
+            local, buffer, &buffer_start, &buffer_len,
+            pos, block_size + 1, local_size
+        );
+        unsigned char *window = buffer + (pos - buffer_start);
+
+        if (fresh) {
+            weak_hash_start(&w, window, block_size);
+            fresh = false;
+        }
+
+        if (block_table_match(
+            t, weak_hash_digest(&w), window, pos, matched, offsets
+        )) {
+            pos += block_size;
+            fresh = true;
+            continue;
+        }
+
+        if (pos + block_size == local_size) break;
+
+        weak_hash_roll(&w, window[0], window[block_size]);
+        pos++;
+    }
+
+    free(buffer);
+
+    trailing_find_match(local, local_size, t, matched, offsets);
+}
+
+//////////////////////////////////////////////////////////////////////
+//                           LOCAL HELPERS
+//////////////////////////////////////////////////////////////////////
+
+// Function to check every sender block sharing the window's weak checksum.
+// The strong hash is only computed once there is a weak hit. A block that
+// is found again at its own offset prefers that offset, so unmoved blocks
+// never need to be relocated.
+bool block_table_match(
+    struct Block_Table *t, uint32_t weak, unsigned char window[],
+    uint64_t pos, bool matched[], uint64_t offsets[]
+) {
+    size_t bucket = weak & t->mask;
+    bool have_strong = false;
+    uint64_t strong = 0;
+    bool found = false;
+
+    for (
+        size_t i = t->bucket_start[bucket]; i < t->bucket_start[bucket + 1]; i++
+    ) {
+        size_t block_n = t->order[i];
+        if (t->weak[block_n] != weak) continue;
+
+        if (!have_strong) {
+            strong = Block_Hash_One(
+                window, rbuoy_options.block_size, rbuoy_options.block_hash
+            );
+            have_strong = true;
+        }
+        if (t->strong[block_n] != strong) continue;
+
+        uint64_t natural = (uint64_t) block_n * rbuoy_options.block_size;
+        if (!matched[block_n] || pos == natural) {
+            matched[block_n] = true;
+            offsets[block_n] = pos;
+        }
+        found = true;
+    }
+
+    return found;
+}
+
+// Function to make sure `need` bytes from `pos` (or up to the end of the
+// file) are sitting in the buffer. Reads are strictly sequential, so the
+// file is never seeked during the scan.
+void window_fill(
+    FILE *local, unsigned char buffer[], uint64_t *buffer_start,
+    size_t *buffer_len, uint64_t pos, size_t need, uint64_t local_size
+) {
+    uint64_t buffer_end = *buffer_start + *buffer_len;
+    uint64_t want_end = (pos + need > local_size) ? local_size : pos + need;
+    if (want_end <= buffer_end) return;
+
+    size_t keep = buffer_end - pos;
+    memmove(buffer, buffer + (pos - *buffer_start), keep);
+    *buffer_start = pos;
+    *buffer_len = keep;
+
+    uint64_t remaining = local_size - buffer_end;
+    size_t to_read = ROLL_BUFFER_SIZE - keep;
+    if (to_read > remaining) to_read = remaining;
+
+    if (fread(buffer + keep, 1, to_read, local) != to_read) {
+        perror("Read Failed");
+        exit(1);
+    }
+    *buffer_len += to_read;
+}
+
+// Function to look for a short trailing block, which only makes sense at
+// its own offset or at the very end of the local file.
+void trailing_find_match(
+    FILE *local, uint64_t local_size, struct Block_Table *t,
+    bool matched[], uint64_t offsets[]
+) {
+    size_t trailing_size = t->file_size % rbuoy_options.block_size;
+    if (trailing_size == 0 || t->num_blocks == 0) return;
+
+    size_t block_n = t->num_blocks - 1;
+    uint64_t natural = (uint64_t) block_n * rbuoy_options.block_size;
+
+    if (natural + trailing_size <= local_size && trailing_matches_at(
+        local, natural, trailing_size, t->strong[block_n]
+    )) {
+        matched[block_n] = true;
+        offsets[block_n] = natural;
+    } else if (local_size >= trailing_size && trailing_matches_at(
+        local, local_size - trailing_size, trailing_size, t->strong[block_n]
+    )) {
+        matched[block_n] = true;
+        offsets[block_n] = local_size - trailing_size;
+    }
+}
+
+// Function to hash `length` bytes at `offset` and compare with `hash`
+bool trailing_matches_at(
+    FILE *local, uint64_t offset, size_t length, uint64_t hash
+) {
+    unsigned char *block = malloc(length);
+    if (block == NULL) {
+        perror("Error");
+        exit(1);
+    }
+    if (
+        fseek(local, offset, SEEK_SET) != 0 ||
+        fread(block, 1, length, local) != length
+    ) {
+        perror("Read Failed");
+        exit(1);
+    }
+
+    bool matches = Block_Hash_One(
+        block, length, rbuoy_options.block_hash
+    ) == hash;
+    free(block);
+
+    return matches;
+}
@@ -0,0 +1,81 @@
+// Header file for rolling.c written by Connor Li (z5425430)
+// For implementation details go to rolling.c.
+
+#ifndef ROLLING_H_
+#define ROLLING_H_
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdbool.h>
+
+/// @brief Running state of the weak checksum over a window of bytes.
+struct Weak_Hash {
+    uint32_t a;
+    uint32_t b;
+    size_t length;
+};
+
+/// @brief The sender's blocks, bucketed by weak checksum for fast lookup.
+struct Block_Table {
+    uint32_t *weak;
+    uint64_t *strong;
+    size_t num_blocks;
+    uint64_t file_size;
+    size_t num_full_blocks;
+    size_t *order;
+    size_t *bucket_start;
+    uint32_t mask;
+};
+
+/// @brief Compute the weak checksum of a block in one go.
+/// @param block The bytes to be checksummed.
+/// @param block_size The number of bytes in `block`.
+uint32_t weak_hash_block(const unsigned char block[], size_t block_size);
+
+/// @brief Start a rolling checksum over the first window of a file.
+/// @param w The checksum state to initialise.
+/// @param block The bytes in the window.
+/// @param block_size The length of the window.
+void weak_hash_start(
+    struct Weak_Hash *w, const unsigned char block[], size_t block_size
+);
+
+/// @brief Slide the window one byte forward.
+/// @param w The checksum state.
+/// @param out The byte leaving the front of the window.
+/// @param in The byte entering the back of the window.
+void weak_hash_roll(struct Weak_Hash *w, unsigned char out, unsigned char in);
+
+/// @brief Get the checksum value of the current window.
+/// @param w The checksum state.
+uint32_t weak_hash_digest(const struct Weak_Hash *w);
+
+/// @brief Build a lookup table over the sender's blocks. The table keeps
+///        pointers to `weak` and `strong`, so they must outlive it.
+/// @param t The table to build.
+/// @param weak The weak checksum of each sender block.
+/// @param strong The strong (hash_block) hash of each sender block.
+/// @param num_blocks The number of sender blocks.
+/// @param file_size The size of the sender's file in bytes.
+void Block_Table_Build(
+    struct Block_Table *t, uint32_t weak[], uint64_t strong[],
+    size_t num_blocks, uint64_t file_size
+);
+
+/// @brief Free everything allocated by Block_Table_Build.
+/// @param t The table to free.
+void Block_Table_Free(struct Block_Table *t);
+
+/// @brief Slide over a local file one byte at a time, looking for the
+///        sender's blocks at any offset.
+/// @param local The local (receiver's) file, read from the start.
+/// @param local_size The size of the local file in bytes.
+/// @param t The sender's blocks.
+/// @param matched Set to true for every sender block found locally.
+/// @param offsets The local offset of every matched sender block.
+void Rolling_Find_Matches(
+    FILE *local, uint64_t local_size, struct Block_Table *t,
+    bool matched[], uint64_t offsets[]
+);
+
+#endif
@@ -0,0 +1,343 @@
+// Implementation for 'stats.h', written by Connor Li (z5425430)
+// Counts and times what each stage spends its time on, so a slow run can
+// be put down to reading (open, stat, hashing), matching, or writing, or
+// to an unusually large delta (many unmatched blocks).
+//
+// Every counter and timer is kept separately for each stage, and updated
+// with relaxed atomics since the pool's workers update them too. A timer
+// is a histogram of latencies in power of two buckets, along with their
+// count, total and maximum. All of it is printed as one JSON object when
+// the program exits, along with the CPU time used, which against the
+// wall time says whether the run was waiting on I/O.
+//
+// A trace has one event for each record of each stage, from when work on
+// it started to when its record was written. Files are worked on many at
+// once (e.g. with --jobs), so their events overlap rather than nest, and
+// are written as async events, which each get a row of their own. It is
+// in Chrome's trace event format:
+//      [{"name": "hash", "ph": "b", "id": 1, "ts": <us>, ...},
+//       {"name": "hash", "ph": "e", "id": 1, "ts": <us>, ...},
+//       ...]
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <sys/resource.h>
+#include "stats.h"
+
+#ifndef RBUOY_NO_STATS
+
+struct Stats_Histogram {
+    uint64_t count;
+    uint64_t total_ns;
+    uint64_t max_ns;
+    uint64_t buckets[STATS_NUM_BUCKETS];
+};
+
+bool stats_enabled = false;
+bool stats_tracing = false;
+int stats_stage = 0;
+
+static uint64_t counters[STATS_NUM_STAGES][STATS_NUM_COUNTERS];
+static struct Stats_Histogram timers[STATS_NUM_STAGES][STATS_NUM_TIMERS];
+static uint64_t started_ns;
+
+static FILE *trace_file = NULL;
+static pthread_mutex_t trace_lock = PTHREAD_MUTEX_INITIALIZER;
+static uint64_t trace_started_ns;
+static bool trace_first = true;
+static uint64_t trace_num_events = 0;
+
+static const char *counter_names[STATS_NUM_COUNTERS] = {
+    [STATS_FILES] = "files",
+    [STATS_BYTES_HASHED] = "bytes_hashed",
+    [STATS_BLOCKS_HASHED] = "blocks_hashed",
+    [STATS_BLOCKS_MATCHED] = "blocks_matched",
+    [STATS_BLOCKS_UNMATCHED] = "blocks_unmatched",
+    [STATS_BYTES_WRITTEN] = "bytes_written",
+    [STATS_OPEN_CALLS] = "open_calls",
+    [STATS_STAT_CALLS] = "stat_calls",
+    [STATS_WRITE_CALLS] = "write_calls",
+};
+
+static const char *timer_names[STATS_NUM_TIMERS] = {
+    [STATS_TIMER_FILE] = "file",
+    [STATS_TIMER_GET_HASHES] = "file_get_hashes",
+    [STATS_TIMER_FIND_MATCHES] = "find_matches",
+    [STATS_TIMER_APPEND_UPDATES] = "file_append_updates",
+    [STATS_TIMER_OPEN] = "open",
+    [STATS_TIMER_STAT] = "stat",
+    [STATS_TIMER_WRITE] = "write",
+};
+
+// What each stage does to a record, to name its events in a trace
+static const char *stage_names[STATS_NUM_STAGES] = {
+    "other", "hash", "match", "send", "apply",
+};
+
+#endif
+
+//////////////////////////////////////////////////////////////////////
+//                        FUNCTION PROTOTYPES
+//////////////////////////////////////////////////////////////////////
+
+void stats_print(void);
+
+void stats_print_counters(FILE *f, int stage);
+
+void stats_print_timers(FILE *f, int stage);
+
+bool stats_stage_used(int stage);
+
+void stats_trace_finish(void);
+
+void stats_print_string(FILE *f, const char *string);
+
+uint64_t stats_rusage_ns(struct timeval time);
+
+//////////////////////////////////////////////////////////////////////
+//                        INTERFACE FUNCTIONS
+//////////////////////////////////////////////////////////////////////
+
+#ifndef RBUOY_NO_STATS
+
+void Stats_Enable(void) {
+    if (stats_enabled) return;
+
+    started_ns = stats_now_ns();
+    stats_enabled = true;
+    if (atexit(stats_print) != 0) {
+        perror("Error");
+        exit(1);
+    }
+}
+
+void Stats_Trace_Open(char *pathname) {
+    if (stats_tracing) return;
+
+    trace_file = fopen(pathname, "w");
+    if (trace_file == NULL) {
+        perror("Error");
+        exit(1);
+    }
+    fputs("[\n", trace_file);
+
+    trace_started_ns = stats_now_ns();
+    stats_tracing = true;
+    if (atexit(stats_trace_finish) != 0) {
+        perror("Error");
+        exit(1);
+    }
+}
+
+void stats_add(enum Stats_Counter counter, uint64_t n) {
+    __atomic_fetch_add(
+        &counters[stats_stage][counter], n, __ATOMIC_RELAXED
+    );
+}
+
+uint64_t stats_now_ns(void) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+
+    return (uint64_t) now.tv_sec * 1000000000 + now.tv_nsec;
+}
+
+void stats_stop(enum Stats_Timer timer, uint64_t start) {
+    uint64_t elapsed = stats_now_ns() - start;
+    struct Stats_Histogram *histogram = &timers[stats_stage][timer];
+
+    int bucket = 63 - __builtin_clzll(elapsed | 1);
+    if (bucket >= STATS_NUM_BUCKETS) bucket = STATS_NUM_BUCKETS - 1;
+
+    __atomic_fetch_add(&histogram->count, 1, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&histogram->total_ns, elapsed, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&histogram->buckets[bucket], 1, __ATOMIC_RELAXED);
+
+    uint64_t max = __atomic_load_n(&histogram->max_ns, __ATOMIC_RELAXED);
+    while (elapsed > max && !__atomic_compare_exchange_n(
+        &histogram->max_ns, &max, elapsed, true,
+        __ATOMIC_RELAXED, __ATOMIC_RELAXED
+    ));
+}
+
+void stats_trace(const char *pathname, uint64_t start) {
+    uint64_t end = stats_now_ns();
+    if (start < trace_started_ns) start = trace_started_ns;
+
+    pthread_mutex_lock(&trace_lock);
+    fputs(trace_first ? "" : ",\n", trace_file);
+    trace_first = false;
+    trace_num_events++;
+
+    for (int end_n = 0; end_n < 2; end_n++) {
+        fprintf(
+            trace_file, "{\"name\": \"%s\", \"cat\": \"stage-%d\", "
+            "\"ph\": \"%c\", \"id\": %lu, \"ts\": %.3f, \"pid\": %d, "
+            "\"tid\": %d", stage_names[stats_stage], stats_stage,
+            (end_n == 0) ? 'b' : 'e', trace_num_events,
+            (((end_n == 0) ? start : end) - trace_started_ns) / 1000.0,
+            (int) getpid(), (int) gettid()
+        );
+        if (end_n == 0) {
+            fputs(", \"args\": {\"path\": ", trace_file);
+            stats_print_string(trace_file, pathname);
+            fputs("}},\n", trace_file);
+        } else {
+            fputs("}", trace_file);
+        }
+    }
+    pthread_mutex_unlock(&trace_lock);
+}
+
+#else
+
+void Stats_Enable(void) {
+    fprintf(stderr, "Error: rbuoy was built without stats\n");
+    exit(1);
+}
+
+void Stats_Trace_Open(char *pathname) {
+    Stats_Enable();
+}
+
+#endif
+
+//////////////////////////////////////////////////////////////////////
+//                           LOCAL HELPERS
+//////////////////////////////////////////////////////////////////////
+
+#ifndef RBUOY_NO_STATS
+
+// Function to print everything counted as JSON to stderr, at exit
+void stats_print(void) {
+    FILE *f = stderr;
+    uint64_t wall_ns = stats_now_ns() - started_ns;
+
+    struct rusage usage;
+    memset(&usage, 0, sizeof(struct rusage));
+    getrusage(RUSAGE_SELF, &usage);
+
+    fprintf(f, "{\n  \"wall_ns\": %lu,\n", wall_ns);
+    fprintf(f, "  \"user_ns\": %lu,\n", stats_rusage_ns(usage.ru_utime));
+    fprintf(f, "  \"system_ns\": %lu,\n", stats_rusage_ns(usage.ru_stime));
+    fprintf(f, "  \"peak_rss_kib\": %ld,\n", usage.ru_maxrss);
+    fprintf(f, "  \"stages\": [");
+
+    bool first = true;
+    for (int stage = 0; stage < STATS_NUM_STAGES; stage++) {
+        if (!stats_stage_used(stage)) continue;
+
+        fprintf(f, "%s\n    {\n      \"stage\": %d,\n", first ? "" : ",", stage);
+        stats_print_counters(f, stage);
+        stats_print_timers(f, stage);
+        fprintf(f, "    }");
+        first = false;
+    }
+
+    fprintf(f, "\n  ]\n}\n");
+}
+
+// Function to print the counters of a stage, and how many system calls
+// (of those counted) they add up to
+void stats_print_counters(FILE *f, int stage) {
+    for (int counter = 0; counter < STATS_NUM_COUNTERS; counter++) {
+        fprintf(
+            f, "      \"%s\": %lu,\n", counter_names[counter],
+            counters[stage][counter]
+        );
+    }
+
+    fprintf(
+        f, "      \"syscalls\": %lu,\n", counters[stage][STATS_OPEN_CALLS] +
+        counters[stage][STATS_STAT_CALLS] + counters[stage][STATS_WRITE_CALLS]
+    );
+}
+
+// Function to print the timers of a stage that were ever started. Each
+// bucket is printed as [at least this many ns, how many].
+void stats_print_timers(FILE *f, int stage) {
+    fprintf(f, "      \"timers\": {");
+
+    bool first = true;
+    for (int timer = 0; timer < STATS_NUM_TIMERS; timer++) {
+        struct Stats_Histogram *histogram = &timers[stage][timer];
+        if (histogram->count == 0) continue;
+
+        fprintf(
+            f, "%s\n        \"%s\": {\"count\": %lu, \"total_ns\": %lu, "
+            "\"max_ns\": %lu, \"histogram\": [", first ? "" : ",",
+            timer_names[timer], histogram->count, histogram->total_ns,
+            histogram->max_ns
+        );
+
+        bool first_bucket = true;
+        for (int bucket = 0; bucket < STATS_NUM_BUCKETS; bucket++) {
+            if (histogram->buckets[bucket] == 0) continue;
+
+            fprintf(
+                f, "%s[%lu, %lu]", first_bucket ? "" : ", ",
+                (bucket == 0) ? 0 : (uint64_t) 1 << bucket,
+                histogram->buckets[bucket]
+            );
+            first_bucket = false;
+        }
+        fprintf(f, "]}");
+        first = false;
+    }
+
+    fprintf(f, "%s}\n", first ? "" : "\n      ");
+}
+
+// Function to check whether anything was counted or timed in a stage
+bool stats_stage_used(int stage) {
+    for (int counter = 0; counter < STATS_NUM_COUNTERS; counter++) {
+        if (counters[stage][counter] != 0) return true;
+    }
+    for (int timer = 0; timer < STATS_NUM_TIMERS; timer++) {
+        if (timers[stage][timer].count != 0) return true;
+    }
+
+    return false;
+}
+
+// Function to end the trace's array and close it, at exit
+void stats_trace_finish(void) {
+    pthread_mutex_lock(&trace_lock);
+    fputs("\n]\n", trace_file);
+    if (fclose(trace_file) != 0) perror("Error");
+    trace_file = NULL;
+    stats_tracing = false;
+    pthread_mutex_unlock(&trace_lock);
+}
+
+// Function to print a string as a JSON string. Pathnames are bytes, not
+// necessarily UTF-8, and anything that isn't printable ASCII is escaped
+// as the code point of the same number.
+void stats_print_string(FILE *f, const char *string) {
+    fputc('"', f);
+    for (const unsigned char *c = (const unsigned char *) string; *c; c++) {
+        if (*c == '"' || *c == '\\') {
+            fprintf(f, "\\%c", *c);
+        } else if (*c < 0x20 || *c >= 0x7F) {
+            fprintf(f, "\\u%04x", *c);
+        } else {
+            fputc(*c, f);
+        }
+    }
+    fputc('"', f);
+}
+
+// Function to turn a time from getrusage into nanoseconds
+uint64_t stats_rusage_ns(struct timeval time) {
+    return (uint64_t) time.tv_sec * 1000000000 + (uint64_t) time.tv_usec * 1000;
+}
+
+#endif
@@ -0,0 +1,117 @@
+// Header file for stats.c written by Connor Li (z5425430)
+// For implementation details go to stats.c.
+//
+// The hooks called from the hot paths are inline, so with stats off each
+// one is a single test of a flag. Built with -DRBUOY_NO_STATS they are
+// empty and compile away entirely.
+
+#ifndef STATS_H_
+#define STATS_H_
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+
+// Stages 1 to 4, and 0 for anything not in a stage (e.g. the daemon
+// between syncs)
+#define STATS_NUM_STAGES 5
+
+// Latencies are kept in buckets of powers of two nanoseconds
+#define STATS_NUM_BUCKETS 40
+
+/// @brief What is counted, separately for each stage.
+enum Stats_Counter {
+    STATS_FILES,            // Records handled
+    STATS_BYTES_HASHED,     // Bytes through the strong block hash
+    STATS_BLOCKS_HASHED,
+    STATS_BLOCKS_MATCHED,   // Blocks the receiver already has
+    STATS_BLOCKS_UNMATCHED, // Blocks that have to be sent
+    STATS_BYTES_WRITTEN,    // Bytes written to an index or applied file
+    STATS_OPEN_CALLS,
+    STATS_STAT_CALLS,
+    STATS_WRITE_CALLS,
+    STATS_NUM_COUNTERS,
+};
+
+/// @brief What is timed, separately for each stage.
+enum Stats_Timer {
+    STATS_TIMER_FILE,           // A whole record, from start to written
+    STATS_TIMER_GET_HASHES,     // file_get_hashes
+    STATS_TIMER_FIND_MATCHES,   // Matching one record against local hashes
+    STATS_TIMER_APPEND_UPDATES, // file_append_updates
+    STATS_TIMER_OPEN,
+    STATS_TIMER_STAT,
+    STATS_TIMER_WRITE,
+    STATS_NUM_TIMERS,
+};
+
+#ifndef RBUOY_NO_STATS
+
+// Set by Stats_Enable and Stats_Trace_Open, and never changed after
+extern bool stats_enabled;
+extern bool stats_tracing;
+extern int stats_stage;
+
+void stats_add(enum Stats_Counter counter, uint64_t n);
+uint64_t stats_now_ns(void);
+void stats_stop(enum Stats_Timer timer, uint64_t start);
+void stats_trace(const char *pathname, uint64_t start);
+
+/// @brief Add to a counter of the current stage.
+static inline void Stats_Add(enum Stats_Counter counter, uint64_t n) {
+    if (stats_enabled) stats_add(counter, n);
+}
+
+/// @brief Get the time something starts, for Stats_Stop or Stats_File.
+static inline uint64_t Stats_Start(void) {
+    return (stats_enabled || stats_tracing) ? stats_now_ns() : 0;
+}
+
+/// @brief Add the time since `start` to a timer of the current stage.
+static inline void Stats_Stop(enum Stats_Timer timer, uint64_t start) {
+    if (stats_enabled) stats_stop(timer, start);
+}
+
+/// @brief Count a record of the current stage done, which started at
+///        `start`, and add it to the trace as an event of its own.
+static inline void Stats_File(const char *pathname, uint64_t start) {
+    if (stats_enabled) {
+        stats_add(STATS_FILES, 1);
+        stats_stop(STATS_TIMER_FILE, start);
+    }
+    if (stats_tracing) stats_trace(pathname, start);
+}
+
+/// @brief Whether anything is being counted, for callers that have work
+///        to do only to count something.
+static inline bool Stats_Enabled(void) {
+    return stats_enabled;
+}
+
+/// @brief Say which stage everything from now on is counted under.
+static inline void Stats_Set_Stage(int stage) {
+    stats_stage = stage;
+}
+
+#else
+
+static inline void Stats_Add(enum Stats_Counter counter, uint64_t n) {}
+static inline uint64_t Stats_Start(void) { return 0; }
+static inline void Stats_Stop(enum Stats_Timer timer, uint64_t start) {}
+static inline void Stats_File(const char *pathname, uint64_t start) {}
+static inline bool Stats_Enabled(void) { return false; }
+static inline void Stats_Set_Stage(int stage) {}
+
+#endif
+
+/// @brief Start counting, and print everything counted as JSON to stderr
+///        when the program exits. Errors out if built without stats.
+void Stats_Enable(void);
+
+/// @brief Start writing a Chrome trace (chrome://tracing, or Perfetto) of
+///        every record of every stage, finished when the program exits.
+///        Errors out if built without stats.
+/// @param pathname Where to write the trace.
+void Stats_Trace_Open(char *pathname);
+
+#endif
@@ -0,0 +1,471 @@
+// Implementation for 'walk.h', written by Connor Li (z5425430)
+// A recursive walk of the current directory for stage 1, so a whole tree
+// can be indexed without passing every file on the command line.
+//
+// Directories are read with getdents64 on descriptors from openat (all
+// relative to the root, so nothing depends on the cwd staying put). While
+// the caller works through one directory, a few threads read the ones it
+// will need next. At most WALK_READ_AHEAD directories are held read but
+// not yet walked, so memory stays bounded however big the tree is. If the
+// caller gets to a directory nobody has started on, it reads it itself,
+// which is also how the walk runs with no threads at all.
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <dirent.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include "walk.h"
+
+#define DENTS_BUFFER_SIZE (32 * 1024)
+#define WALK_READ_AHEAD 64
+#define INITIAL_ENTRIES 16
+#define INITIAL_STACK 16
+
+// What getdents64 fills its buffer with
+struct Dirent64 {
+    uint64_t d_ino;
+    int64_t d_off;
+    unsigned short d_reclen;
+    unsigned char d_type;
+    char d_name[];
+};
+
+enum Dir_State { DIR_PENDING, DIR_READING, DIR_READ };
+
+struct Walk_Entry {
+    char *path;
+    struct Walk_Dir *dir;   // Not NULL for a directory not yet walked
+};
+
+struct Walk_Dir {
+    char *path;
+    enum Dir_State state;
+    struct Walk_Entry *entries;
+    size_t num_entries;
+
+    // Links in the list of directories waiting to be read
+    struct Walk_Dir *prev;
+    struct Walk_Dir *next;
+};
+
+struct Walk_Frame {
+    struct Walk_Dir *dir;
+    size_t next_entry;
+};
+
+struct Walker {
+    int root_fd;
+    dev_t skip_dev;
+    ino_t skip_ino;
+
+    pthread_mutex_t lock;
+    pthread_cond_t work_cond;
+    pthread_cond_t read_cond;
+    struct Walk_Dir *pending;
+    size_t read_ahead;
+    bool stopping;
+
+    pthread_t *threads;
+    size_t num_threads;
+
+    // Directories the caller is part way through, innermost last
+    struct Walk_Frame *stack;
+    size_t stack_size;
+    size_t stack_capacity;
+};
+
+//////////////////////////////////////////////////////////////////////
+//                        FUNCTION PROTOTYPES
+//////////////////////////////////////////////////////////////////////
+
+void *walker_thread(void *arg);
+
+void walker_wait_read(struct Walker *walker, struct Walk_Dir *dir);
+
+void walker_claim(struct Walker *walker, struct Walk_Dir *dir);
+
+void walker_read_done(struct Walker *walker, struct Walk_Dir *dir);
+
+void walker_push(struct Walker *walker, struct Walk_Dir *dir);
+
+struct Walk_Dir *walk_dir_create(char *path);
+
+void walk_dir_read(struct Walker *walker, struct Walk_Dir *dir);
+
+bool walk_entry_wanted(
+    struct Walker *walker, int dir_fd, struct Dirent64 *dirent, bool *is_dir
+);
+
+void walk_dir_free(struct Walk_Dir *dir);
+
+char *walk_join(char *dir_path, char *name);
+
+int walk_entry_compare(const void *a, const void *b);
+
+//////////////////////////////////////////////////////////////////////
+//                        INTERFACE FUNCTIONS
+//////////////////////////////////////////////////////////////////////
+
+struct Walker *Walker_Start(size_t num_threads, dev_t skip_dev, ino_t skip_ino) {
+    struct Walker *walker = calloc(1, sizeof(struct Walker));
+    if (walker == NULL) {
+        perror("Error");
+        exit(1);
+    }
+
+    walker->root_fd = open(".", O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (walker->root_fd < 0) {
+        perror("Error");
+        exit(1);
+    }
+    walker->skip_dev = skip_dev;
+    walker->skip_ino = skip_ino;
+
+    pthread_mutex_init(&walker->lock, NULL);
+    pthread_cond_init(&walker->work_cond, NULL);
+    pthread_cond_init(&walker->read_cond, NULL);
+
+    struct Walk_Dir *root = walk_dir_create(strdup(""));
+    walker->pending = root;
+    walker_push(walker, root);
+
+    walker->num_threads = num_threads;
+    walker->threads = malloc(sizeof(pthread_t) * (num_threads + 1));
+    if (walker->threads == NULL) {
+        perror("Error");
+        exit(1);
+    }
+    for (size_t thread_n = 0; thread_n < num_threads; thread_n++) {
+        if (pthread_create(
+            &walker->threads[thread_n], NULL, walker_thread, walker
+        ) != 0) {
+            fprintf(stderr, "Error: could not start walker thread\n");
+            exit(1);
+        }
+    }
+
+    return walker;
+}
+
+char *Walker_Next(struct Walker *walker) {
+    while (walker->stack_size > 0) {
+        struct Walk_Frame *frame = &walker->stack[walker->stack_size - 1];
+        struct Walk_Dir *dir = frame->dir;
+        walker_wait_read(walker, dir);
+
+        if (frame->next_entry == dir->num_entries) {
+            walker->stack_size--;
+
+            pthread_mutex_lock(&walker->lock);
+            walker->read_ahead--;
+            pthread_cond_signal(&walker->work_cond);
+            pthread_mutex_unlock(&walker->lock);
+
+            walk_dir_free(dir);
+            continue;
+        }
+
+        struct Walk_Entry *entry = &dir->entries[frame->next_entry++];
+        char *path = entry->path;
+        entry->path = NULL;
+
+        // A directory comes straight before everything inside it
+        if (entry->dir != NULL) {
+            walker_push(walker, entry->dir);
+            entry->dir = NULL;
+        }
+
+        return path;
+    }
+
+    return NULL;
+}
+
+void Walker_Finish(struct Walker *walker) {
+    pthread_mutex_lock(&walker->lock);
+    walker->stopping = true;
+    pthread_cond_broadcast(&walker->work_cond);
+    pthread_mutex_unlock(&walker->lock);
+
+    for (size_t thread_n = 0; thread_n < walker->num_threads; thread_n++) {
+        pthread_join(walker->threads[thread_n], NULL);
+    }
+
+    // Anything left over (if the walk was cut short) hangs off the stack
+    for (size_t frame_n = 0; frame_n < walker->stack_size; frame_n++) {
+        walk_dir_free(walker->stack[frame_n].dir);
+    }
+
+    pthread_mutex_destroy(&walker->lock);
+    pthread_cond_destroy(&walker->work_cond);
+    pthread_cond_destroy(&walker->read_cond);
+    close(walker->root_fd);
+    free(walker->stack);
+    free(walker->threads);
+    free(walker);
+}
+
+//////////////////////////////////////////////////////////////////////
+//                           LOCAL HELPERS
+//////////////////////////////////////////////////////////////////////
+
+// Function run by each walker thread: read waiting directories, as long
+// as the caller isn't too far behind.
+void *walker_thread(void *arg) {
+    struct Walker *walker = arg;
+
+    pthread_mutex_lock(&walker->lock);
+    for (;;) {
+        while (
+            !walker->stopping &&
+            (walker->pending == NULL || walker->read_ahead >= WALK_READ_AHEAD)
+        ) {
+            pthread_cond_wait(&walker->work_cond, &walker->lock);
+        }
+        if (walker->stopping) break;
+
+        struct Walk_Dir *dir = walker->pending;
+        walker_claim(walker, dir);
+        pthread_mutex_unlock(&walker->lock);
+
+        walk_dir_read(walker, dir);
+
+        pthread_mutex_lock(&walker->lock);
+        walker_read_done(walker, dir);
+    }
+    pthread_mutex_unlock(&walker->lock);
+
+    return NULL;
+}
+
+// Function for the caller to wait until a directory has been read,
+// reading it itself if no thread has got to it yet.
+void walker_wait_read(struct Walker *walker, struct Walk_Dir *dir) {
+    pthread_mutex_lock(&walker->lock);
+
+    if (dir->state == DIR_PENDING) {
+        walker_claim(walker, dir);
+        pthread_mutex_unlock(&walker->lock);
+
+        walk_dir_read(walker, dir);
+
+        pthread_mutex_lock(&walker->lock);
+        walker_read_done(walker, dir);
+    }
+
+    while (dir->state != DIR_READ) {
+        pthread_cond_wait(&walker->read_cond, &walker->lock);
+    }
+
+    pthread_mutex_unlock(&walker->lock);
+}
+
+// Function to take a directory off the pending list to read it. Must be
+// called with the lock held.
+void walker_claim(struct Walker *walker, struct Walk_Dir *dir) {
+    if (dir->prev != NULL) dir->prev->next = dir->next;
+    else walker->pending = dir->next;
+    if (dir->next != NULL) dir->next->prev = dir->prev;
+
+    dir->prev = NULL;
+    dir->next = NULL;
+    dir->state = DIR_READING;
+    walker->read_ahead++;
+}
+
+// Function to mark a directory as read, and put its subdirectories at
+// the front of the pending list in order, since the caller walks depth
+// first and will want them next. Must be called with the lock held.
+void walker_read_done(struct Walker *walker, struct Walk_Dir *dir) {
+    for (size_t entry_n = dir->num_entries; entry_n-- > 0;) {
+        struct Walk_Dir *subdir = dir->entries[entry_n].dir;
+        if (subdir == NULL) continue;
+
+        subdir->next = walker->pending;
+        if (walker->pending != NULL) walker->pending->prev = subdir;
+        walker->pending = subdir;
+    }
+
+    dir->state = DIR_READ;
+    pthread_cond_broadcast(&walker->read_cond);
+    pthread_cond_broadcast(&walker->work_cond);
+}
+
+// Function to start walking a directory's entries
+void walker_push(struct Walker *walker, struct Walk_Dir *dir) {
+    if (walker->stack_size == walker->stack_capacity) {
+        walker->stack_capacity = walker->stack_capacity == 0 ?
+            INITIAL_STACK : walker->stack_capacity * 2;
+        walker->stack = realloc(
+            walker->stack, sizeof(struct Walk_Frame) * walker->stack_capacity
+        );
+        if (walker->stack == NULL) {
+            perror("Error");
+            exit(1);
+        }
+    }
+
+    walker->stack[walker->stack_size].dir = dir;
+    walker->stack[walker->stack_size].next_entry = 0;
+    walker->stack_size++;
+}
+
+// Function to create a directory that hasn't been read yet
+struct Walk_Dir *walk_dir_create(char *path) {
+    struct Walk_Dir *dir = calloc(1, sizeof(struct Walk_Dir));
+    if (dir == NULL || path == NULL) {
+        perror("Error");
+        exit(1);
+    }
+
+    dir->path = path;
+    dir->state = DIR_PENDING;
+
+    return dir;
+}
+
+// Function to read every entry of a directory and sort them by name.
+// Only regular files and directories are kept; symlinks aren't followed.
+void walk_dir_read(struct Walker *walker, struct Walk_Dir *dir) {
+    int fd = openat(
+        walker->root_fd, dir->path[0] == '\0' ? "." : dir->path,
+        O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC
+    );
+    if (fd < 0) {
+        fprintf(stderr, "Error: could not open directory '%s': ", dir->path);
+        perror("");
+        exit(1);
+    }
+
+    char *buffer = malloc(DENTS_BUFFER_SIZE);
+    if (buffer == NULL) {
+        perror("Error");
+        exit(1);
+    }
+
+    size_t capacity = 0;
+    for (;;) {
+        long num_bytes = syscall(SYS_getdents64, fd, buffer, DENTS_BUFFER_SIZE);
+        if (num_bytes < 0) {
+            perror("Error");
+            exit(1);
+        }
+        if (num_bytes == 0) break;
+
+        for (long pos = 0; pos < num_bytes;) {
+            struct Dirent64 *dirent = (struct Dirent64 *) (buffer + pos);
+            pos += dirent->d_reclen;
+
+            bool is_dir;
+            if (!walk_entry_wanted(walker, fd, dirent, &is_dir)) continue;
+
+            if (dir->num_entries == capacity) {
+                capacity = capacity == 0 ? INITIAL_ENTRIES : capacity * 2;
+                dir->entries = realloc(
+                    dir->entries, sizeof(struct Walk_Entry) * capacity
+                );
+                if (dir->entries == NULL) {
+                    perror("Error");
+                    exit(1);
+                }
+            }
+
+            struct Walk_Entry *entry = &dir->entries[dir->num_entries++];
+            entry->path = walk_join(dir->path, dirent->d_name);
+            entry->dir = is_dir ? walk_dir_create(strdup(entry->path)) : NULL;
+        }
+    }
+
+    free(buffer);
+    close(fd);
+
+    // Entries share the directory's prefix, so this sorts them by name
+    if (dir->num_entries < 2) return;
+    qsort(
+        dir->entries, dir->num_entries, sizeof(struct Walk_Entry),
+        walk_entry_compare
+    );
+}
+
+// Function to decide whether a directory entry goes in the walk
+bool walk_entry_wanted(
+    struct Walker *walker, int dir_fd, struct Dirent64 *dirent, bool *is_dir
+) {
+    char *name = dirent->d_name;
+    if (strcmp(name, ".") == 0 || strcmp(name, "..") == 0) return false;
+
+    unsigned char type = dirent->d_type;
+    bool is_skip = walker->skip_ino != 0 && dirent->d_ino == walker->skip_ino;
+
+    // Some filesystems don't fill in d_type, and the file to skip has to
+    // be checked against its device too
+    if (type == DT_UNKNOWN || is_skip) {
+        struct stat stat;
+        if (fstatat(dir_fd, name, &stat, AT_SYMLINK_NOFOLLOW) != 0) {
+            return false;
+        }
+        if (stat.st_dev == walker->skip_dev && stat.st_ino == walker->skip_ino) {
+            return false;
+        }
+
+        type = S_ISDIR(stat.st_mode) ? DT_DIR :
+            S_ISREG(stat.st_mode) ? DT_REG : DT_UNKNOWN;
+    }
+
+    *is_dir = (type == DT_DIR);
+    return type == DT_DIR || type == DT_REG;
+}
+
+// Function to free a directory, along with any of its subdirectories that
+// haven't been walked
+void walk_dir_free(struct Walk_Dir *dir) {
+    for (size_t entry_n = 0; entry_n < dir->num_entries; entry_n++) {
+        free(dir->entries[entry_n].path);
+        if (dir->entries[entry_n].dir != NULL) {
+            walk_dir_free(dir->entries[entry_n].dir);
+        }
+    }
+
+    free(dir->entries);
+    free(dir->path);
+    free(dir);
+}
+
+// Function to get the path of an entry from its directory's path
+char *walk_join(char *dir_path, char *name) {
+    size_t dir_length = strlen(dir_path);
+    size_t name_length = strlen(name);
+
+    char *path = malloc(dir_length + name_length + 2);
+    if (path == NULL) {
+        perror("Error");
+        exit(1);
+    }
+
+    if (dir_length == 0) {
+        memcpy(path, name, name_length + 1);
+    } else {
+        memcpy(path, dir_path, dir_length);
+        path[dir_length] = '/';
+        memcpy(path + dir_length + 1, name, name_length + 1);
+    }
+
+    return path;
+}
+
+// Function to order entries by path, byte by byte, so the order doesn't
+// depend on the locale
+int walk_entry_compare(const void *a, const void *b) {
+    const struct Walk_Entry *entry_a = a;
+    const struct Walk_Entry *entry_b = b;
+
+    return strcmp(entry_a->path, entry_b->path);
+}
@@ -0,0 +1,32 @@
+// Header file for walk.c written by Connor Li (z5425430)
+// For implementation details go to walk.c.
+
+#ifndef WALK_H_
+#define WALK_H_
+
+#include <stddef.h>
+#include <stdbool.h>
+#include <sys/types.h>
+
+struct Walker;
+
+/// @brief Start walking everything below the current directory.
+/// @param num_threads The number of threads reading directories ahead of
+///                    the caller. Zero reads every directory on demand.
+/// @param skip_dev The device of a file to leave out of the walk (e.g. the
+///                 index being written).
+/// @param skip_ino The inode of the file to leave out, or 0 for none.
+struct Walker *Walker_Start(size_t num_threads, dev_t skip_dev, ino_t skip_ino);
+
+/// @brief Get the next path of the walk. Paths are relative to the current
+///        directory and come in a fixed order: every directory's entries
+///        sorted by name, with a directory straight before its contents.
+/// @param walker The walker.
+/// @return A malloc'd path that the caller frees, or NULL once done.
+char *Walker_Next(struct Walker *walker);
+
+/// @brief Stop the walk's threads and free the walker.
+/// @param walker The walker.
+void Walker_Finish(struct Walker *walker);
+
+#endif
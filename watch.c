@@ -0,0 +1,368 @@
+// Implementation for 'watch.h', written by Connor Li (z5425430)
+// Keeps track of what changes below the current directory with inotify,
+// so a sync only has to index the files that changed rather than stat
+// and hash the whole tree.
+//
+// inotify watches single directories, so every directory in the tree
+// gets a watch of its own, and each watch descriptor maps back to the
+// path of its directory. A directory that appears (made, or moved in)
+// is watched and scanned straight away, since anything made in it before
+// its watch was added would otherwise be missed. A directory moved within
+// the tree keeps its watch descriptors, which are pointed at the new
+// paths as it is scanned.
+//
+// Changes are gathered into a dirty set until they settle. inotify says
+// which file changed but not which bytes, so each one is hashed again in
+// full (cheaply, for anything in the hash cache that hasn't changed).
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <poll.h>
+#include <dirent.h>
+#include <unistd.h>
+#include <sys/inotify.h>
+#include <sys/stat.h>
+#include "watch.h"
+#include "walk.h"
+
+// Everything that can change what stage 1 would say about a file
+#define WATCH_MASK (IN_CLOSE_WRITE | IN_MODIFY | IN_ATTRIB | IN_CREATE | \
+    IN_MOVED_TO | IN_ONLYDIR | IN_DONT_FOLLOW | IN_EXCL_UNLINK)
+
+#define WATCH_EVENT_BUFFER_SIZE (64 * 1024)
+#define WATCH_MIN_CAPACITY 64
+
+struct Watch {
+    int fd;
+
+    // The path of the directory behind each watch descriptor, "" for the
+    // current directory, or NULL if the descriptor isn't in use
+    char **dirs;
+    size_t num_dirs;
+
+    char *skip_path;
+
+    // Every path changed since the last batch, maybe more than once
+    char **dirty;
+    size_t num_dirty;
+    size_t capacity;
+    bool rescan;
+};
+
+//////////////////////////////////////////////////////////////////////
+//                        FUNCTION PROTOTYPES
+//////////////////////////////////////////////////////////////////////
+
+bool watch_add_dir(struct Watch *watch, char *path);
+
+void watch_add_tree(struct Watch *watch, char *path);
+
+void watch_read_events(struct Watch *watch);
+
+void watch_handle(struct Watch *watch, const struct inotify_event *event);
+
+void watch_mark(struct Watch *watch, char *path);
+
+void watch_take_batch(struct Watch *watch, struct Watch_Batch *batch);
+
+char *watch_join(const char *dir, const char *name);
+
+int watch_compare(const void *a, const void *b);
+
+int64_t watch_now_ms(void);
+
+//////////////////////////////////////////////////////////////////////
+//                        INTERFACE FUNCTIONS
+//////////////////////////////////////////////////////////////////////
+
+struct Watch *Watch_Start(char *skip_path) {
+    struct Watch *watch = calloc(1, sizeof(struct Watch));
+    if (watch == NULL) {
+        perror("Error");
+        exit(1);
+    }
+    watch->skip_path = skip_path;
+
+    watch->fd = inotify_init1(IN_CLOEXEC);
+    if (watch->fd < 0) {
+        perror("Error");
+        exit(1);
+    }
+
+    // Every directory the walk finds gets a watch
+    watch_add_dir(watch, "");
+    struct Walker *walker = Walker_Start(0, 0, 0);
+    for (
+        char *path = Walker_Next(walker); path != NULL;
+        path = Walker_Next(walker)
+    ) {
+        struct stat path_stat;
+        if (lstat(path, &path_stat) == 0 && S_ISDIR(path_stat.st_mode)) {
+            watch_add_dir(watch, path);
+        }
+        free(path);
+    }
+    Walker_Finish(walker);
+
+    return watch;
+}
+
+void Watch_Wait(struct Watch *watch, struct Watch_Batch *batch) {
+    do {
+        // Wait as long as it takes for the first change, then until
+        // changes stop coming or the batch is old enough
+        int64_t first = -1;
+        for (;;) {
+            int timeout = -1;
+            if (first >= 0) {
+                int64_t left = first + WATCH_MAX_DELAY_MS - watch_now_ms();
+                if (left <= 0) break;
+                timeout = (left < WATCH_QUIET_MS) ? left : WATCH_QUIET_MS;
+            }
+
+            struct pollfd poll_fd = { .fd = watch->fd, .events = POLLIN };
+            int ready = poll(&poll_fd, 1, timeout);
+            if (ready < 0 && errno == EINTR) continue;
+            if (ready < 0) {
+                perror("Error");
+                exit(1);
+            }
+            if (ready == 0) break;
+
+            watch_read_events(watch);
+            if (first < 0 && (watch->num_dirty > 0 || watch->rescan)) {
+                first = watch_now_ms();
+            }
+        }
+
+        watch_take_batch(watch, batch);
+    } while (batch->num_pathnames == 0 && !batch->rescan);
+}
+
+void Watch_Batch_Free(struct Watch_Batch *batch) {
+    for (size_t path_n = 0; path_n < batch->num_pathnames; path_n++) {
+        free(batch->pathnames[path_n]);
+    }
+    free(batch->pathnames);
+    batch->pathnames = NULL;
+    batch->num_pathnames = 0;
+}
+
+void Watch_Finish(struct Watch *watch) {
+    close(watch->fd);
+    for (size_t dir_n = 0; dir_n < watch->num_dirs; dir_n++) {
+        free(watch->dirs[dir_n]);
+    }
+    for (size_t path_n = 0; path_n < watch->num_dirty; path_n++) {
+        free(watch->dirty[path_n]);
+    }
+    free(watch->dirs);
+    free(watch->dirty);
+    free(watch);
+}
+
+//////////////////////////////////////////////////////////////////////
+//                           LOCAL HELPERS
+//////////////////////////////////////////////////////////////////////
+
+// Function to watch one directory, returning false if it has gone.
+// Watching a directory that already is just moves it to its new path.
+bool watch_add_dir(struct Watch *watch, char *path) {
+    int wd = inotify_add_watch(
+        watch->fd, (path[0] == '\0') ? "." : path, WATCH_MASK
+    );
+    if (wd < 0 && errno == ENOSPC) {
+        fprintf(stderr, "Error: out of inotify watches (see fs.inotify.max_user_watches)\n");
+        exit(1);
+    }
+    if (wd < 0) return false;
+
+    if ((size_t) wd >= watch->num_dirs) {
+        size_t num_dirs = (watch->num_dirs == 0) ?
+            WATCH_MIN_CAPACITY : watch->num_dirs;
+        while (num_dirs <= (size_t) wd) num_dirs *= 2;
+
+        watch->dirs = realloc(watch->dirs, sizeof(char *) * num_dirs);
+        if (watch->dirs == NULL) {
+            perror("Error");
+            exit(1);
+        }
+        memset(
+            watch->dirs + watch->num_dirs, 0,
+            sizeof(char *) * (num_dirs - watch->num_dirs)
+        );
+        watch->num_dirs = num_dirs;
+    }
+
+    free(watch->dirs[wd]);
+    watch->dirs[wd] = strdup(path);
+    if (watch->dirs[wd] == NULL) {
+        perror("Error");
+        exit(1);
+    }
+
+    return true;
+}
+
+// Function to watch a directory that has just appeared, and everything
+// below it, marking all of it changed
+void watch_add_tree(struct Watch *watch, char *path) {
+    if (!watch_add_dir(watch, path)) return;
+    watch_mark(watch, watch_join("", path));
+
+    DIR *dir = opendir(path);
+    if (dir == NULL) return;
+
+    for (struct dirent *entry = readdir(dir); entry != NULL; entry = readdir(dir)) {
+        if (strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0) {
+            continue;
+        }
+
+        char *child = watch_join(path, entry->d_name);
+        struct stat path_stat;
+        if (lstat(child, &path_stat) == 0 && S_ISDIR(path_stat.st_mode)) {
+            watch_add_tree(watch, child);
+            free(child);
+        } else {
+            watch_mark(watch, child);
+        }
+    }
+
+    closedir(dir);
+}
+
+// Function to read and handle every event waiting
+void watch_read_events(struct Watch *watch) {
+    uint8_t buffer[WATCH_EVENT_BUFFER_SIZE]
+        __attribute__((aligned(__alignof__(struct inotify_event))));
+
+    ssize_t size = read(watch->fd, buffer, sizeof(buffer));
+    if (size < 0 && errno == EINTR) return;
+    if (size <= 0) {
+        perror("Error");
+        exit(1);
+    }
+
+    for (ssize_t pos = 0; pos < size; ) {
+        const struct inotify_event *event =
+            (const struct inotify_event *) (buffer + pos);
+        watch_handle(watch, event);
+        pos += sizeof(struct inotify_event) + event->len;
+    }
+}
+
+// Function to add what an event says changed to the dirty set
+void watch_handle(struct Watch *watch, const struct inotify_event *event) {
+    if (event->mask & IN_Q_OVERFLOW) {
+        watch->rescan = true;
+        return;
+    }
+
+    bool known = event->wd >= 0 && (size_t) event->wd < watch->num_dirs &&
+        watch->dirs[event->wd] != NULL;
+    if (!known) return;
+
+    // The directory itself has gone
+    if (event->mask & IN_IGNORED) {
+        free(watch->dirs[event->wd]);
+        watch->dirs[event->wd] = NULL;
+        return;
+    }
+
+    // Only changes to something in a directory have a name
+    if (event->len == 0) return;
+
+    char *path = watch_join(watch->dirs[event->wd], event->name);
+    if ((event->mask & IN_ISDIR) && (event->mask & (IN_CREATE | IN_MOVED_TO))) {
+        watch_add_tree(watch, path);
+        free(path);
+        return;
+    }
+
+    watch_mark(watch, path);
+}
+
+// Function to add a path (which the dirty set then owns) to the dirty set
+void watch_mark(struct Watch *watch, char *path) {
+    if (watch->num_dirty == watch->capacity) {
+        watch->capacity = (watch->capacity == 0) ?
+            WATCH_MIN_CAPACITY : watch->capacity * 2;
+        watch->dirty = realloc(watch->dirty, sizeof(char *) * watch->capacity);
+        if (watch->dirty == NULL) {
+            perror("Error");
+            exit(1);
+        }
+    }
+
+    watch->dirty[watch->num_dirty++] = path;
+}
+
+// Function to turn the dirty set into a batch: sorted, each path once,
+// and only regular files and directories that are still there
+void watch_take_batch(struct Watch *watch, struct Watch_Batch *batch) {
+    qsort(watch->dirty, watch->num_dirty, sizeof(char *), watch_compare);
+
+    struct stat skip_stat;
+    bool skip = watch->skip_path != NULL &&
+        lstat(watch->skip_path, &skip_stat) == 0;
+
+    size_t num_kept = 0;
+    for (size_t path_n = 0; path_n < watch->num_dirty; path_n++) {
+        char *path = watch->dirty[path_n];
+        struct stat path_stat;
+        bool wanted = (num_kept == 0 ||
+            strcmp(watch->dirty[num_kept - 1], path) != 0) &&
+            lstat(path, &path_stat) == 0 &&
+            (S_ISREG(path_stat.st_mode) || S_ISDIR(path_stat.st_mode)) &&
+            !(skip && path_stat.st_dev == skip_stat.st_dev &&
+              path_stat.st_ino == skip_stat.st_ino);
+
+        if (wanted) {
+            watch->dirty[num_kept++] = path;
+        } else {
+            free(path);
+        }
+    }
+
+    batch->pathnames = watch->dirty;
+    batch->num_pathnames = num_kept;
+    batch->rescan = watch->rescan;
+
+    watch->dirty = NULL;
+    watch->num_dirty = 0;
+    watch->capacity = 0;
+    watch->rescan = false;
+}
+
+// Function to get the path of something in a directory, malloc'd
+char *watch_join(const char *dir, const char *name) {
+    char *path;
+    int length = (dir[0] == '\0') ?
+        asprintf(&path, "%s", name) : asprintf(&path, "%s/%s", dir, name);
+    if (length < 0) {
+        perror("Error");
+        exit(1);
+    }
+
+    return path;
+}
+
+// Function to order paths as strcmp does, for qsort
+int watch_compare(const void *a, const void *b) {
+    return strcmp(*(char * const *) a, *(char * const *) b);
+}
+
+// Function to get the time in milliseconds, from a clock that never jumps
+int64_t watch_now_ms(void) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+
+    return (int64_t) now.tv_sec * 1000 + now.tv_nsec / 1000000;
+}
@@ -0,0 +1,45 @@
+// Header file for watch.c written by Connor Li (z5425430)
+// For implementation details go to watch.c.
+
+#ifndef WATCH_H_
+#define WATCH_H_
+
+#include <stddef.h>
+#include <stdbool.h>
+
+// A batch of changes is returned once nothing has changed for this long,
+// or once it is this old, whichever comes first
+#define WATCH_QUIET_MS 200
+#define WATCH_MAX_DELAY_MS 2000
+
+struct Watch;
+
+/// @brief The paths changed since the last batch, in the order stage 1
+///        takes them: sorted, so a directory comes before its contents.
+struct Watch_Batch {
+    char **pathnames;
+    size_t num_pathnames;
+
+    // Changes were lost (the kernel's queue overflowed), so everything
+    // has to be looked at again
+    bool rescan;
+};
+
+/// @brief Start watching everything below the current directory.
+/// @param skip_path A file whose changes are never reported (e.g. a hash
+///                  cache kept in the tree), or NULL.
+struct Watch *Watch_Start(char *skip_path);
+
+/// @brief Wait for something to change, then for the changes to settle.
+///        Only regular files and directories that still exist are
+///        reported. Deletions aren't, as stage 1 has nothing to say
+///        about them.
+/// @param watch The watch.
+/// @param batch Filled in with what changed. Free it with Watch_Batch_Free.
+void Watch_Wait(struct Watch *watch, struct Watch_Batch *batch);
+
+void Watch_Batch_Free(struct Watch_Batch *batch);
+
+void Watch_Finish(struct Watch *watch);
+
+#endif